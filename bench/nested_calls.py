@@ -0,0 +1,59 @@
+"""Nested call latency: Lua -> Python -> Lua -> ... at increasing depths."""
+
+import argparse
+import time
+
+import pylua
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("-n", "--iterations", type=int, default=20000)
+    parser.add_argument("-d", "--max-depth", type=int, default=32)
+    args = parser.parse_args()
+
+    state = pylua.LuaState()
+    g = state.get_globals()
+
+    nest = state.load_string("""
+        local n = ...
+        if n == 0 then
+            return 0
+        end
+        return down(n - 1) + 1
+    """, "nest")
+
+    def down(n):
+        return nest(n)[0]
+
+    g["down"] = state.new_function(down)
+
+    depths = [0]
+    depth = 1
+    while depth <= args.max_depth:
+        depths.append(depth)
+        depth *= 2
+
+    print("%6s %14s %14s" % ("depth", "us/call", "us/level"))
+    base = None
+    for depth in depths:
+        # warm up the stack and the chunk before timing
+        for _ in range(100):
+            nest(depth)
+
+        start = time.perf_counter()
+        for _ in range(args.iterations):
+            nest(depth)
+        elapsed = (time.perf_counter() - start) / args.iterations * 1e6
+
+        if base is None:
+            base = elapsed
+            print("%6d %14.3f %14s" % (depth, elapsed, "-"))
+        else:
+            print("%6d %14.3f %14.3f" % (depth, elapsed, (elapsed - base) / depth))
+
+    state.close()
+
+
+if __name__ == "__main__":
+    main()
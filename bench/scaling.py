@@ -0,0 +1,62 @@
+"""Throughput of independent LuaStates running in 1 to N Python threads."""
+
+import argparse
+import os
+import threading
+import time
+
+import pylua
+
+SCRIPT = """
+    local n = ...
+    local s = 0
+    for i = 1, n do
+        s = s + i % 7
+    end
+    return s
+"""
+
+
+def worker(loops, calls, barrier):
+    state = pylua.LuaState()
+    func = state.load_string(SCRIPT, "loop")
+    barrier.wait()
+    for _ in range(calls):
+        func(loops)
+    state.close()
+
+
+def run(threads, loops, calls):
+    # one extra party so the clock starts once every state is ready
+    barrier = threading.Barrier(threads + 1)
+    workers = [threading.Thread(target=worker, args=(loops, calls, barrier)) for _ in range(threads)]
+    for thread in workers:
+        thread.start()
+
+    barrier.wait()
+    start = time.perf_counter()
+    for thread in workers:
+        thread.join()
+    return time.perf_counter() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("-j", "--max-threads", type=int, default=os.cpu_count() or 1)
+    parser.add_argument("-l", "--loops", type=int, default=1000000)
+    parser.add_argument("-c", "--calls", type=int, default=20)
+    args = parser.parse_args()
+
+    print("%8s %12s %14s %10s %12s" % ("threads", "seconds", "calls/s", "speedup", "efficiency"))
+    single = None
+    for threads in range(1, args.max_threads + 1):
+        elapsed = run(threads, args.loops, args.calls)
+        rate = threads * args.calls / elapsed
+        if single is None:
+            single = rate
+        speedup = rate / single
+        print("%8d %12.3f %14.1f %10.2f %11.0f%%" % (threads, elapsed, rate, speedup, speedup / threads * 100))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,77 @@
+"""Allocation-heavy scripts and state teardown, slab allocator against libc."""
+
+import argparse
+import time
+
+import pylua
+
+# short-lived small tables, strings and closures: the sizes the slab serves
+CHURN = """
+    local n = ...
+    local keep = {}
+    for i = 1, n do
+        local t = {i, i + 1, x = i}
+        local s = "k" .. i
+        local f = function() return t, s end
+        keep[i % 64 + 1] = f
+    end
+    return #keep
+"""
+
+# a large live heap left behind for close() to free
+BUILD = """
+    local n = ...
+    heap = {}
+    for i = 1, n do
+        heap[i] = {tostring(i), {i}, function() return i end}
+    end
+    return #heap
+"""
+
+
+def churn(slab, count, repeat):
+    state = pylua.LuaState(slab=slab)
+    func = state.load_string(CHURN, "churn")
+    func(1000)
+
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        func(count)
+        elapsed = time.perf_counter() - start
+        if best is None or elapsed < best:
+            best = elapsed
+
+    state.close()
+    return best
+
+
+def teardown(slab, count, repeat):
+    best = None
+    for _ in range(repeat):
+        state = pylua.LuaState(slab=slab)
+        state.load_string(BUILD, "build")(count)
+
+        start = time.perf_counter()
+        state.close()
+        elapsed = time.perf_counter() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("-n", "--count", type=int, default=500000)
+    parser.add_argument("-r", "--repeat", type=int, default=5)
+    args = parser.parse_args()
+
+    print("%10s %12s %12s %10s" % ("", "libc (s)", "slab (s)", "ratio"))
+    for name, bench in (("churn", churn), ("teardown", teardown)):
+        libc = bench(False, args.count, args.repeat)
+        slab = bench(True, args.count, args.repeat)
+        print("%10s %12.4f %12.4f %9.2fx" % (name, libc, slab, libc / slab))
+
+
+if __name__ == "__main__":
+    main()
@@ -40,16 +40,36 @@ lua_files = [
 
 files = [
     'pylua.c',
+    'pylua_async.c',
+    'pylua_buffer.c',
+    'pylua_channel.c',
+    'pylua_checkpoint.c',
+    'pylua_chunk.c',
+    'pylua_codec.c',
+    'pylua_collect.c',
+    'pylua_coverage.c',
+    'pylua_cycles.c',
     'pylua_exceptions.c',
+    'pylua_executor.c',
     'pylua_function.c',
     'pylua_hooks.c',
+    'pylua_image.c',
+    'pylua_json.c',
+    'pylua_lib.c',
+    'pylua_lock.c',
+    'pylua_memstats.c',
     'pylua_object.c',
+    'pylua_pool.c',
+    'pylua_profiler.c',
     'pylua_protect.c',
     'pylua_python.c',
+    'pylua_slab.c',
     'pylua_state.c',
     'pylua_stateinfo.c',
     'pylua_table.c',
     'pylua_thread.c',
+    'pylua_tracemalloc.c',
+    'pylua_tracer.c',
     'pylua_userdata.c'
 ]
 
@@ -1,68 +1,85 @@
 #include "pylua.h"
+#include "pylua_async.h"
+#include "pylua_channel.h"
+#include "pylua_chunk.h"
 #include "pylua_exceptions.h"
+#include "pylua_executor.h"
 #include "pylua_function.h"
+#include "pylua_module.h"
 #include "pylua_object.h"
+#include "pylua_pool.h"
 #include "pylua_state.h"
 #include "pylua_table.h"
 #include "pylua_thread.h"
 #include "pylua_userdata.h"
 
 
-static PyModuleDef module = {
-    PyModuleDef_HEAD_INIT,
+/**
+ * Returns the module state of the interpreter owning a type (or a subtype) ;
+ * if it can't be found, returns NULL and sets a python exception
+ */
+PyLuaModuleState* pylua_get_module_state(PyTypeObject* type) {
+    PyObject* mod = PyType_GetModuleByDef(type, &pylua_module);
+    if (!mod)
+        return NULL;
     
-    .m_name = "pylua",
-    .m_doc = "Implements a lua environment for use with Python.",
-    .m_size = -1,
-};
+    return (PyLuaModuleState*)PyModule_GetState(mod);
+}
 
-PyMODINIT_FUNC PyInit_pylua(void) {
-    // init exceptions
-    if (pylua_init_exceptions() < 0)
+/**
+ * Creates a type from its spec, then adds it to the module
+ */
+static PyTypeObject* pylua_add_type(PyObject* mod, PyType_Spec* spec, PyTypeObject* base) {
+    PyTypeObject* type = (PyTypeObject*)PyType_FromModuleAndSpec(mod, spec, (PyObject*)base);
+    if (!type)
         return NULL;
     
-    // init types
-    if (PyType_Ready(&LuaStateType) < 0)
-        return NULL;
-    if (PyType_Ready(&LuaObjectType) < 0)
-        return NULL;
-    if (PyType_Ready(&LuaFunctionType) < 0)
-        return NULL;
-    if (PyType_Ready(&LuaTableType) < 0)
-        return NULL;
-    if (PyType_Ready(&LuaThreadType) < 0)
-        return NULL;
-    if (PyType_Ready(&LuaUserDataType) < 0)
+    if (PyModule_AddType(mod, type) < 0) {
+        Py_DECREF(type);
         return NULL;
+    }
+    return type;
+}
+
+/**
+ * Initializes the module, once per interpreter
+ */
+static int pylua_exec(PyObject* mod) {
+    PyLuaModuleState* state = (PyLuaModuleState*)PyModule_GetState(mod);
     
-    // create module
-    PyObject* mod = PyModule_Create(&module);
-    if (!mod)
-        return NULL;
+    // init exceptions
+    if (pylua_init_exceptions(state) < 0)
+        return -1;
     
-    // those might not be necessary, as NewException returns a new reference
-    /*Py_INCREF(LuaError);
-    Py_INCREF(LuaCompileError);
-    Py_INCREF(LuaRuntimeError);
-    Py_INCREF(LuaFatalError);*/
-    PyModule_AddObject(mod, "LuaError", LuaError);
-    PyModule_AddObject(mod, "LuaCompileError", LuaCompileError);
-    PyModule_AddObject(mod, "LuaRuntimeError", LuaRuntimeError);
-    PyModule_AddObject(mod, "LuaFatalError", LuaFatalError);
+    if (PyModule_AddObjectRef(mod, "LuaError", state->LuaError) < 0 ||
+        PyModule_AddObjectRef(mod, "LuaCompileError", state->LuaCompileError) < 0 ||
+        PyModule_AddObjectRef(mod, "LuaRuntimeError", state->LuaRuntimeError) < 0 ||
+        PyModule_AddObjectRef(mod, "LuaFatalError", state->LuaFatalError) < 0)
+        return -1;
     
-    // those might not be necessary either
-    /*Py_INCREF(&LuaObjectType);
-    Py_INCREF(&LuaStateType);
-    Py_INCREF(&LuaTableType);
-    Py_INCREF(&LuaFunctionType);
-    Py_INCREF(&LuaUserDataType);
-    Py_INCREF(&LuaThreadType);*/
-    PyModule_AddObject(mod, "LuaObject", (PyObject *) &LuaObjectType);
-    PyModule_AddObject(mod, "LuaState", (PyObject *) &LuaStateType);
-    PyModule_AddObject(mod, "LuaTable", (PyObject *) &LuaTableType);
-    PyModule_AddObject(mod, "LuaFunction", (PyObject *) &LuaFunctionType);
-    PyModule_AddObject(mod, "LuaUserData", (PyObject *) &LuaUserDataType);
-    PyModule_AddObject(mod, "LuaThread", (PyObject *) &LuaThreadType);
+    // init types
+    if (!(state->LuaStateType = pylua_add_type(mod, &LuaStateTypeSpec, NULL)))
+        return -1;
+    if (!(state->LuaObjectType = pylua_add_type(mod, &LuaObjectTypeSpec, NULL)))
+        return -1;
+    if (!(state->LuaFunctionType = pylua_add_type(mod, &LuaFunctionTypeSpec, state->LuaObjectType)))
+        return -1;
+    if (!(state->LuaTableType = pylua_add_type(mod, &LuaTableTypeSpec, state->LuaObjectType)))
+        return -1;
+    if (!(state->LuaThreadType = pylua_add_type(mod, &LuaThreadTypeSpec, state->LuaObjectType)))
+        return -1;
+    if (!(state->LuaUserDataType = pylua_add_type(mod, &LuaUserDataTypeSpec, state->LuaObjectType)))
+        return -1;
+    if (!(state->LuaAwaitableType = pylua_add_type(mod, &LuaAwaitableTypeSpec, NULL)))
+        return -1;
+    if (!(state->LuaExecutorType = pylua_add_type(mod, &LuaExecutorTypeSpec, NULL)))
+        return -1;
+    if (!(state->LuaChannelType = pylua_add_type(mod, &LuaChannelTypeSpec, NULL)))
+        return -1;
+    if (!(state->LuaChunkCacheType = pylua_add_type(mod, &LuaChunkCacheTypeSpec, NULL)))
+        return -1;
+    if (!(state->LuaStatePoolType = pylua_add_type(mod, &LuaStatePoolTypeSpec, NULL)))
+        return -1;
     
     // also some useful consts
     PyModule_AddIntConstant(mod, "LUA_HOOKCALL", LUA_HOOKCALL);
@@ -75,5 +92,81 @@ PyMODINIT_FUNC PyInit_pylua(void) {
     PyModule_AddIntConstant(mod, "LUA_MASKRET", LUA_MASKRET);
     PyModule_AddIntConstant(mod, "LUA_MASKLINE", LUA_MASKLINE);
     PyModule_AddIntConstant(mod, "LUA_MASKCOUNT", LUA_MASKCOUNT);
-    return mod;
+    return 0;
+}
+
+static int pylua_traverse(PyObject* mod, visitproc visit, void* arg) {
+    PyLuaModuleState* state = (PyLuaModuleState*)PyModule_GetState(mod);
+    Py_VISIT(state->LuaError);
+    Py_VISIT(state->LuaCompileError);
+    Py_VISIT(state->LuaRuntimeError);
+    Py_VISIT(state->LuaFatalError);
+    Py_VISIT(state->LuaStateType);
+    Py_VISIT(state->LuaObjectType);
+    Py_VISIT(state->LuaFunctionType);
+    Py_VISIT(state->LuaTableType);
+    Py_VISIT(state->LuaThreadType);
+    Py_VISIT(state->LuaUserDataType);
+    Py_VISIT(state->LuaAwaitableType);
+    Py_VISIT(state->LuaExecutorType);
+    Py_VISIT(state->LuaChannelType);
+    Py_VISIT(state->LuaChunkCacheType);
+    Py_VISIT(state->LuaStatePoolType);
+    Py_VISIT(state->Future);
+    return 0;
+}
+
+static int pylua_clear(PyObject* mod) {
+    PyLuaModuleState* state = (PyLuaModuleState*)PyModule_GetState(mod);
+    Py_CLEAR(state->LuaError);
+    Py_CLEAR(state->LuaCompileError);
+    Py_CLEAR(state->LuaRuntimeError);
+    Py_CLEAR(state->LuaFatalError);
+    Py_CLEAR(state->LuaStateType);
+    Py_CLEAR(state->LuaObjectType);
+    Py_CLEAR(state->LuaFunctionType);
+    Py_CLEAR(state->LuaTableType);
+    Py_CLEAR(state->LuaThreadType);
+    Py_CLEAR(state->LuaUserDataType);
+    Py_CLEAR(state->LuaAwaitableType);
+    Py_CLEAR(state->LuaExecutorType);
+    Py_CLEAR(state->LuaChannelType);
+    Py_CLEAR(state->LuaChunkCacheType);
+    Py_CLEAR(state->LuaStatePoolType);
+    Py_CLEAR(state->Future);
+    return 0;
+}
+
+static void pylua_free(void* mod) {
+    pylua_clear((PyObject*)mod);
+}
+
+
+static PyModuleDef_Slot pylua_slots[] = {
+    {Py_mod_exec, pylua_exec},
+#ifdef Py_mod_multiple_interpreters
+    // each interpreter gets its own exceptions and types
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    // every state is protected by its own lock (see pylua_lock.c)
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
+PyModuleDef pylua_module = {
+    PyModuleDef_HEAD_INIT,
+    
+    .m_name = "pylua",
+    .m_doc = "Implements a lua environment for use with Python.",
+    .m_size = sizeof(PyLuaModuleState),
+    .m_slots = pylua_slots,
+    .m_traverse = pylua_traverse,
+    .m_clear = pylua_clear,
+    .m_free = pylua_free
+};
+
+PyMODINIT_FUNC PyInit_pylua(void) {
+    return PyModuleDef_Init(&pylua_module);
 }
\ No newline at end of file
@@ -8,4 +8,11 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
+// Objects shared between threads are protected by critical sections
+// on free-threaded builds ; with the GIL, there's nothing more to do
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#   define Py_BEGIN_CRITICAL_SECTION(op) {
+#   define Py_END_CRITICAL_SECTION() }
+#endif
+
 #endif
\ No newline at end of file
@@ -1,10 +1,12 @@
-from typing import Any, Callable
+import os
+from concurrent.futures import Future
+from typing import Any, Awaitable, Callable, Generator
 from typing_extensions import Protocol
 
-_LuaObj = LuaObject | str | int | float | None
+_LuaObj = LuaObject | Channel | str | int | float | None
 
 class _LuaCallable(Protocol):
-    def __call__(self, *args: _LuaObj) -> _LuaObj | tuple[_LuaObj, ...]:
+    def __call__(self, *args: _LuaObj) -> _LuaObj | tuple[_LuaObj, ...] | Awaitable[_LuaObj | tuple[_LuaObj, ...]]:
         ...
 
 class LuaError(Exception):
@@ -26,6 +28,12 @@ class LuaUserData(LuaObject):
     ...
 
 class LuaThread(LuaObject):
+    mem_budget: int
+
+    @property
+    def mem_usage(self) -> int:
+        ...
+
     def call(self, func: LuaObject, *args: _LuaObj) -> tuple[_LuaObj, ...]:
         ...
     
@@ -33,7 +41,26 @@ class LuaThread(LuaObject):
         ...
 
 class LuaFunction(LuaObject):
-    def __call__(self, *args: _LuaObj) -> tuple[_LuaObj, ...]:
+    def __call__(self, *args: _LuaObj, mem_budget: int | None = None) -> tuple[_LuaObj, ...]:
+        ...
+
+    def call_async(self, *args: _LuaObj) -> LuaAwaitable:
+        ...
+
+    def dump(self, /, strip: bool = True) -> bytes:
+        ...
+
+class LuaAwaitable:
+    def __await__(self) -> Generator[Any, Any, tuple[_LuaObj, ...]]:
+        ...
+
+    def send(self, value: Any) -> Any:
+        ...
+
+    def throw(self, typ: Any, val: Any = None, tb: Any = None) -> Any:
+        ...
+
+    def close(self) -> None:
         ...
 
 class LuaTable(LuaObject):
@@ -49,18 +76,47 @@ class LuaTable(LuaObject):
     def __setitem__(self, key: _LuaObj, value: _LuaObj) -> None:
         ...
 
+    def encode_json(self, /, empty_array: bool = False, null: _LuaObj = None) -> str:
+        ...
+
+
+class ChunkCache:
+    def __init__(self, /, maxsize: int = 64 * 1024 * 1024, directory: str | None = None) -> None:
+        ...
+
+    @property
+    def maxsize(self) -> int:
+        ...
+
+    @property
+    def directory(self) -> str | None:
+        ...
+
+    def stats(self) -> dict[str, int]:
+        ...
+
+    def clear(self) -> None:
+        ...
+
+    def __len__(self) -> int:
+        ...
 
 class LuaState:
     mem_limit: int
+    soft_mem_limit: int
     time_limit: int
+    chunk_cache: ChunkCache | None
 
-    def __init__(self, /, openlibs: int = 1) -> None:
+    def __init__(self, /, openlibs: int = 1, cache: ChunkCache | None = None, slab: bool = False, track_mem: bool = False, tracemalloc: bool = False) -> None:
         ...
 
     @property
     def mem_usage(self) -> int:
         ...
 
+    @property
+    def tracemalloc_domain(self) -> int | None:
+        ...
     def get_globals(self) -> LuaTable:
         ...
 
@@ -70,6 +126,30 @@ class LuaState:
     def load_file(self, /, filename: str, mode: str = None) -> LuaFunction:
         ...
 
+    def load_stream(self, /, source: Any, name: str = None, mode: str = None) -> LuaFunction:
+        ...
+
+    def load_bytecode(self, /, buffer: bytes | bytearray | memoryview | Any, name: str = None) -> LuaFunction:
+        ...
+
+    def pack(self, /, value: _LuaObj, refs: bool = False) -> bytes:
+        ...
+
+    def unpack(self, /, buffer: bytes | bytearray | memoryview | Any) -> _LuaObj:
+        ...
+
+    def gc(self, op: str = "collect", *args: int) -> int | bool | str | None:
+        ...
+
+    def collect_cycles(self) -> int:
+        ...
+
+    def mem_stats(self, /, reset: bool = False) -> dict[str, Any]:
+        ...
+
+    def decode_json(self, /, buffer: bytes | bytearray | memoryview | Any, null: _LuaObj = None, mark_arrays: bool = False) -> _LuaObj:
+        ...
+
     def new_table(self) -> LuaTable:
         ...
 
@@ -79,5 +159,105 @@ class LuaState:
     def new_function(self, /, func: _LuaCallable) -> LuaFunction:
         ...
 
+    def set_hook(self, /, hook: Callable[..., None] | None, mask: int = 0, count: int = 0, batch: int = 0) -> None:
+        ...
+
+    def start_profiler(self, /, interval_instructions: int = 0, interval_us: int = 1000, max_samples: int = 10000) -> None:
+        ...
+
+    def stop_profiler(self) -> None:
+        ...
+
+    def collapsed_stacks(self, /, clear: bool = False) -> str:
+        ...
+
+    def start_tracer(self) -> None:
+        ...
+
+    def stop_tracer(self) -> None:
+        ...
+
+    def tracer_stats(self, /, clear: bool = False) -> dict[tuple[str, int, str], tuple[int, int, float, float, dict[tuple[str, int, str], tuple[int, int, float, float]]]]:
+        ...
+
+    def dump_stats(self, /, filename: str | os.PathLike[str]) -> None:
+        ...
+
+    def start_coverage(self, /, functions: bool = False) -> None:
+        ...
+
+    def stop_coverage(self) -> dict[str, set[int]]:
+        ...
+
+    def coverage_lcov(self, /, test_name: str = "") -> str:
+        ...
+
+    def checkpoint(self) -> None:
+        ...
+
+    def reset(self) -> None:
+        ...
+
+    def save_image(self, /, persist: Callable[[Any], bytes] = None, permanents: dict[str, _LuaObj] = None) -> bytes:
+        ...
+
+    def load_image(self, /, image: bytes | bytearray | memoryview | Any, unpersist: Callable[[bytes], Any] = None, permanents: dict[str, _LuaObj] = None) -> None:
+        ...
+
     def close(self) -> bool:
+        ...
+
+class StatePool:
+    def __init__(self, /, factory: Callable[[], LuaState], size: int = 4) -> None:
+        ...
+
+    @property
+    def size(self) -> int:
+        ...
+
+    def acquire(self) -> LuaState:
+        ...
+
+    def release(self, state: LuaState, /) -> None:
+        ...
+
+    def __len__(self) -> int:
+        ...
+
+class Channel:
+    def __init__(self, /, capacity: int) -> None:
+        ...
+
+    @property
+    def capacity(self) -> int:
+        ...
+
+    @property
+    def closed(self) -> bool:
+        ...
+
+    def close(self) -> None:
+        ...
+
+    def __len__(self) -> int:
+        ...
+
+class LuaExecutor:
+    def __init__(self, /, workers: int = 0, init: Callable[[LuaState], Any] = None, setup: str = None, openlibs: int = 1, batch: int = 16) -> None:
+        ...
+
+    @property
+    def workers(self) -> int:
+        ...
+
+    def submit(self, name: str, /, *args: _LuaObj) -> Future[tuple[_LuaObj, ...]]:
+        ...
+
+    def shutdown(self, /, wait: bool = True, *, cancel_futures: bool = False) -> None:
+        ...
+
+    def __enter__(self) -> LuaExecutor:
+        ...
+
+    def __exit__(self, *args: Any) -> bool:
         ...
\ No newline at end of file
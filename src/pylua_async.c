@@ -0,0 +1,537 @@
+#include "pylua_async.h"
+#include "pylua_exceptions.h"
+#include "pylua_lock.h"
+#include "pylua_protect.h"
+#include "pylua_python.h"
+
+#include <setjmp.h>
+
+
+/**
+ * Checks if a python object can be awaited
+ */
+int pylua_is_awaitable(PyObject* obj) {
+    PyAsyncMethods* am = Py_TYPE(obj)->tp_as_async;
+    return am != NULL && am->am_await != NULL;
+}
+
+/**
+ * Forget about the saved python exception
+ */
+static void pylua_async_clear_exception(LuaAwaitableObject* self) {
+    Py_CLEAR(self->exc_type);
+    Py_CLEAR(self->exc_value);
+    Py_CLEAR(self->exc_tb);
+}
+
+/**
+ * Push the outcome of the awaited object on the lua thread stack:
+ * true followed by the results, or false followed by an error message.
+ * If `value` is NULL, the current python exception is saved, and will be
+ * raised again if the lua code does not handle the error.
+ *
+ * The state lock must be held.
+ * Returns -1 if a fatal error occured ; else, returns the number of pushed values
+ */
+static int pylua_async_feed(LuaAwaitableObject* self, PyObject* value) {
+    if (!self->sobj->info.state) {
+        PyErr_SetString(self->sobj->module->LuaFatalError, "lua state is dead");
+        return -1;
+    }
+    
+    lua_State* L = self->info->state;
+    PYLUA_PROTECT(self->info, -1);
+
+    if (value) {
+        Py_ssize_t size = PyTuple_CheckExact(value) ? PyTuple_GET_SIZE(value) : 1;
+        if (size >= INT_MAX || !lua_checkstack(L, (int)size + 1)) {
+            PyErr_SetString(self->sobj->module->LuaError, "too many values to return to lua");
+            value = NULL;
+        }
+    }
+
+    if (value) {
+        lua_pushboolean(L, 1);
+
+        // same arg handling as pylua_call_python
+        int err = 0;
+        int argc = 1;
+        if (PyTuple_CheckExact(value)) {
+            argc = pylua_push_tuple(L, value, 0);
+            if (argc < 0)
+                err = argc;
+        } else {
+            err = pylua_push_pyobj(L, value);
+        }
+
+        if (!err) {
+            PYLUA_UNPROTECT(self->info);
+            return argc + 1;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    pylua_async_clear_exception(self);
+    PyErr_Fetch(&self->exc_type, &self->exc_value, &self->exc_tb);
+
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "python error on await");
+
+    PYLUA_UNPROTECT(self->info);
+    return 2;
+}
+
+/**
+ * Resumes the lua thread with `nargs` values on top of its stack.
+ * The state lock must be held.
+ *
+ * Returns 1 if the thread is now waiting for a python awaitable,
+ *         0 if the call returned, and sets `result`,
+ *        -1 if an error occured, and sets a python exception
+ */
+static int pylua_async_resume(LuaAwaitableObject* self, int nargs, PyObject** result) {
+    if (!self->sobj->info.state) {
+        PyErr_SetString(self->sobj->module->LuaFatalError, "lua state is dead");
+        self->done = 1;
+        return -1;
+    }
+    
+    struct LuaStateInfo* info = self->info;
+    lua_State* L = info->state;
+    int status;
+    int nres = 0;
+
+    info->thstate = PyEval_SaveThread();
+
+    // same protection as pylua_call, as we stole the python GIL
+    struct PanicHandler* panic = pylua_push_panichandler(info);
+    int fatal = setjmp(panic->buf);
+    if (!fatal) {
+        pylua_enter_call(info);
+#if LUA_VERSION_NUM >= 504
+        status = lua_resume(L, NULL, nargs, &nres);
+#else
+        status = lua_resume(L, NULL, nargs);
+        nres = lua_gettop(L);
+#endif
+    }
+
+    pylua_pop_panichandler(info);
+
+    // restore the thread
+    PyEval_RestoreThread(info->thstate);
+    info->thstate = NULL;
+    pylua_leave_call(info);
+
+    if (fatal) {
+        self->done = 1;
+        return -1;
+    }
+
+    PYLUA_PROTECT(info, -1);
+
+    if (status == LUA_YIELD) {
+        lua_pop(L, nres);
+
+        // pylua_call_python left us the awaitable
+        PyObject* awaitable = info->awaiting;
+        info->awaiting = NULL;
+
+        if (!awaitable) {
+            PyErr_SetString(self->sobj->module->LuaRuntimeError, "attempt to yield across a python call");
+            self->done = 1;
+            PYLUA_UNPROTECT(info);
+            return -1;
+        }
+
+        pylua_async_clear_exception(self);
+
+        // if this fails, the error is given back to lua
+        self->awaiting = Py_TYPE(awaitable)->tp_as_async->am_await(awaitable);
+        Py_DECREF(awaitable);
+
+        PYLUA_UNPROTECT(info);
+        return 1;
+    }
+
+    // the lua thread is dead either way
+    self->done = 1;
+
+    if (status == LUA_OK) {
+        pylua_async_clear_exception(self);
+        *result = pylua_to_tuple(info, nres);
+
+        PYLUA_UNPROTECT(info);
+        return *result ? 0 : -1;
+    }
+
+    // error handling
+    if (!PyErr_Occurred()) {
+        if (self->exc_type) {
+            // the awaited object failed, and lua did not handle it
+            PyErr_Restore(self->exc_type, self->exc_value, self->exc_tb);
+            self->exc_type = self->exc_value = self->exc_tb = NULL;
+
+        } else {
+            PyObject* err = pylua_get_as_unicode(L, -1);
+            PyErr_SetObject(self->sobj->module->LuaRuntimeError, err);
+            Py_DECREF(err);
+        }
+    }
+    pylua_async_clear_exception(self);
+
+    // remove the error from the stack
+    lua_pop(L, 1);
+
+    PYLUA_UNPROTECT(info);
+    return -1;
+}
+
+/**
+ * Runs the lua thread with `nargs` values on its stack, and keeps
+ * feeding it the awaited results until something has to be yielded
+ * to the event loop.
+ *
+ * Returns the value to yield, or NULL when the call is over (StopIteration)
+ * or if an error occured.
+ */
+static PyObject* pylua_async_run(LuaAwaitableObject* self, int nargs) {
+    for (;;) {
+        PyObject* result;
+        
+        pylua_lock(self->sobj);
+        int status = pylua_async_resume(self, nargs, &result);
+        pylua_unlock(self->sobj);
+        
+        if (status < 0)
+            return NULL;
+
+        if (status == 0) {
+            // we're done, the results are carried by StopIteration
+            PyObject* exc = PyObject_CallOneArg(PyExc_StopIteration, result);
+            Py_DECREF(result);
+            if (exc) {
+                PyErr_SetObject(PyExc_StopIteration, exc);
+                Py_DECREF(exc);
+            }
+            return NULL;
+        }
+
+        // start the new awaitable
+        PyObject* value = NULL;
+        if (self->awaiting) {
+            if (PyIter_Send(self->awaiting, Py_None, &value) == PYGEN_NEXT)
+                return value;
+
+            Py_CLEAR(self->awaiting);
+        }
+
+        // it completed right away
+        pylua_lock(self->sobj);
+        nargs = pylua_async_feed(self, value);
+        pylua_unlock(self->sobj);
+        Py_XDECREF(value);
+
+        if (nargs < 0) {
+            self->done = 1;
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Resumes the lua thread once the awaited object completed with `value`,
+ * or failed if `value` is NULL. Steals the reference to `value`.
+ */
+static PyObject* pylua_async_continue(LuaAwaitableObject* self, PyObject* value) {
+    Py_CLEAR(self->awaiting);
+
+    pylua_lock(self->sobj);
+    int nargs = pylua_async_feed(self, value);
+    pylua_unlock(self->sobj);
+    Py_XDECREF(value);
+
+    if (nargs < 0) {
+        self->done = 1;
+        return NULL;
+    }
+
+    return pylua_async_run(self, nargs);
+}
+
+/**
+ * Sets the python exception described by the arguments of throw()
+ */
+static void pylua_async_set_exception(PyObject* type, PyObject* value) {
+    if (PyExceptionInstance_Check(type)) {
+        PyErr_SetObject((PyObject*)Py_TYPE(type), type);
+
+    } else if (PyExceptionClass_Check(type)) {
+        PyErr_SetObject(type, value);
+
+    } else {
+        PyErr_SetString(PyExc_TypeError, "exceptions must derive from BaseException");
+    }
+}
+
+/**
+ * Creates the awaitable returned by LuaFunction.call_async.
+ * Every call runs in its own lua thread, so it can be suspended
+ * whenever a python callback returns an awaitable.
+ */
+PyObject* pylua_new_awaitable(LuaObject* func, PyObject* args) {
+#if LUA_VERSION_NUM < 503
+    PyErr_SetString(func->sobj->module->LuaError, LUA_VERSION " does not support async calls");
+    return NULL;
+#else
+    PYLUA_ENTER(L, &func->sobj->info, NULL);
+
+    PyTypeObject* type = func->sobj->module->LuaAwaitableType;
+    LuaAwaitableObject* self = (LuaAwaitableObject*)type->tp_alloc(type, 0);
+    if (!self) {
+        PYLUA_LEAVE(&func->sobj->info);
+        return NULL;
+    }
+
+    self->sobj = func->sobj;
+    self->ref = LUA_NOREF;
+    self->info = NULL;
+    self->nargs = 0;
+    self->awaiting = NULL;
+    self->exc_type = self->exc_value = self->exc_tb = NULL;
+    self->started = 0;
+    self->done = 0;
+    Py_INCREF(self->sobj);
+
+    // create the thread
+    PYLUA_PROTECT_LEAVE(&func->sobj->info, NULL);
+
+    lua_State* thread = lua_newthread(L);
+    self->info = pylua_alloc_stateinfo(thread);
+    self->info->root = func->sobj;
+    self->info->async = 1;
+    self->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    PYLUA_UNPROTECT(&func->sobj->info);
+
+    // push the function and its args
+    PYLUA_PROTECT_LEAVE(self->info, NULL);
+
+    int nargs = -1;
+    if (!lua_checkstack(thread, (int)PyTuple_GET_SIZE(args) + 1)) {
+        PyErr_SetString(func->sobj->module->LuaError, "too many arguments");
+
+    } else {
+        lua_rawgeti(thread, LUA_REGISTRYINDEX, func->ref);
+        nargs = pylua_push_tuple(thread, args, 0);
+    }
+
+    PYLUA_UNPROTECT(self->info);
+
+    if (nargs < 0) {
+        Py_DECREF(self);
+        PYLUA_LEAVE(&func->sobj->info);
+        return NULL;
+    }
+
+    self->nargs = nargs;
+    PYLUA_LEAVE(&func->sobj->info);
+    return (PyObject*)self;
+#endif
+}
+
+
+/**
+ * Implements LuaAwaitable.send, which resumes the call
+ * by sending a value to the awaited object
+ */
+static PyObject* LuaAwaitable_send(LuaAwaitableObject* self, PyObject* value) {
+    if (self->done) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot reuse already awaited lua call");
+        return NULL;
+    }
+
+    if (!self->started) {
+        if (value != Py_None) {
+            PyErr_SetString(PyExc_TypeError, "can't send non-None value to a just-started lua call");
+            return NULL;
+        }
+
+        self->started = 1;
+        return pylua_async_run(self, self->nargs);
+    }
+
+    PyObject* res;
+    if (PyIter_Send(self->awaiting, value, &res) == PYGEN_NEXT)
+        return res;
+
+    return pylua_async_continue(self, res);
+}
+
+/**
+ * Implements LuaAwaitable.throw, which raises an exception
+ * into the awaited object
+ */
+static PyObject* LuaAwaitable_throw(LuaAwaitableObject* self, PyObject* args) {
+    PyObject* type;
+    PyObject* value = Py_None;
+    PyObject* tb = Py_None;
+
+    if (!PyArg_ParseTuple(args, "O|OO", &type, &value, &tb))
+        return NULL;
+
+    if (self->done || !self->started || !self->sobj->info.state) {
+        // there's nothing to throw it into
+        self->done = 1;
+        pylua_async_set_exception(type, value);
+        return NULL;
+    }
+
+    PyObject* throw = PyObject_GetAttrString(self->awaiting, "throw");
+    if (!throw) {
+        // the lua code gets the exception instead
+        PyErr_Clear();
+        pylua_async_set_exception(type, value);
+        return pylua_async_continue(self, NULL);
+    }
+
+    PyObject* res = PyObject_CallObject(throw, args);
+    Py_DECREF(throw);
+
+    if (res)
+        return res;
+
+    if (PyErr_ExceptionMatches(PyExc_StopIteration)) {
+        // the awaited object returned a value
+        PyObject *exc_type, *exc_value, *exc_tb;
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        PyErr_NormalizeException(&exc_type, &exc_value, &exc_tb);
+
+        res = exc_value ? PyObject_GetAttrString(exc_value, "value") : NULL;
+        if (!res && !PyErr_Occurred()) {
+            res = Py_None;
+            Py_INCREF(res);
+        }
+
+        Py_XDECREF(exc_type);
+        Py_XDECREF(exc_value);
+        Py_XDECREF(exc_tb);
+    }
+
+    return pylua_async_continue(self, res);
+}
+
+/**
+ * Implements LuaAwaitable.close, which gives up on the call
+ */
+static PyObject* LuaAwaitable_close(LuaAwaitableObject* self, PyObject* unused) {
+    self->done = 1;
+
+    if (self->awaiting) {
+        PyObject* close = PyObject_GetAttrString(self->awaiting, "close");
+        Py_CLEAR(self->awaiting);
+
+        if (!close) {
+            PyErr_Clear();
+
+        } else {
+            PyObject* res = PyObject_CallNoArgs(close);
+            Py_DECREF(close);
+            if (!res)
+                return NULL;
+            Py_DECREF(res);
+        }
+    }
+
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements __await__, the awaitable is its own iterator
+ */
+static PyObject* LuaAwaitable_await(LuaAwaitableObject* self) {
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+/**
+ * Implements __next__
+ */
+static PyObject* LuaAwaitable_iternext(LuaAwaitableObject* self) {
+    return LuaAwaitable_send(self, Py_None);
+}
+
+/**
+ * Handle deallocation of LuaAwaitable
+ */
+static void LuaAwaitable_dealloc(LuaAwaitableObject* self) {
+    PyObject_GC_UnTrack(self);
+    Py_CLEAR(self->awaiting);
+    pylua_async_clear_exception(self);
+
+    // release the lua thread (with its state info)
+    pylua_lock(self->sobj);
+    lua_State* L = self->sobj->info.state;
+    if (L && self->info) {
+        pylua_free_stateinfo(L, self->info->state);
+        luaL_unref(L, LUA_REGISTRYINDEX, self->ref);
+    }
+    pylua_unlock(self->sobj);
+
+    Py_DECREF(self->sobj);
+    
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+/**
+ * Implement tp_traverse for LuaAwaitable
+ */
+static int LuaAwaitable_traverse(LuaAwaitableObject* self, visitproc visit, void* arg) {
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->sobj);
+    Py_VISIT(self->awaiting);
+    Py_VISIT(self->exc_type);
+    Py_VISIT(self->exc_value);
+    Py_VISIT(self->exc_tb);
+    return 0;
+}
+
+/**
+ * Implement tp_clear for LuaAwaitable: the state is kept,
+ * as the lua thread is released with it on dealloc
+ */
+static int LuaAwaitable_clear(LuaAwaitableObject* self) {
+    Py_CLEAR(self->awaiting);
+    pylua_async_clear_exception(self);
+    return 0;
+}
+
+
+static PyMethodDef LuaAwaitable_methods[] = {
+    {"send", (PyCFunction)LuaAwaitable_send, METH_O, "send a value into the awaited object"},
+    {"throw", (PyCFunction)LuaAwaitable_throw, METH_VARARGS, "raise an exception into the awaited object"},
+    {"close", (PyCFunction)LuaAwaitable_close, METH_NOARGS, "give up on the lua call"},
+    {NULL}
+};
+
+static PyType_Slot LuaAwaitableSlots[] = {
+    {Py_tp_doc, "Lua asynchronous call"},
+    {Py_tp_dealloc, LuaAwaitable_dealloc},
+    {Py_tp_traverse, LuaAwaitable_traverse},
+    {Py_tp_clear, LuaAwaitable_clear},
+    {Py_am_await, LuaAwaitable_await},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, LuaAwaitable_iternext},
+    {Py_tp_methods, LuaAwaitable_methods},
+    {0, NULL}
+};
+
+PyType_Spec LuaAwaitableTypeSpec = {
+    .name = "pylua.LuaAwaitable",
+    .basicsize = sizeof(LuaAwaitableObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_HAVE_GC,
+    .slots = LuaAwaitableSlots
+};
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef PYLUA_ASYNC_H
+#define PYLUA_ASYNC_H
+
+#include "pylua.h"
+#include "pylua_object.h"
+#include "pylua_state.h"
+#include "pylua_stateinfo.h"
+
+typedef struct {
+    PyObject_HEAD
+    
+    // The parent state
+    LuaStateObject* sobj;
+    
+    // Reference number of the lua thread running the call
+    int ref;
+    
+    // State info of that thread
+    struct LuaStateInfo* info;
+    
+    // Argument count for the first resume
+    int nargs;
+    
+    // Iterator of the awaitable we are waiting for
+    PyObject* awaiting;
+    
+    // Python exception raised while awaiting, if any
+    PyObject* exc_type;
+    PyObject* exc_value;
+    PyObject* exc_tb;
+    
+    // Call progress
+    int started;
+    int done;
+    
+} LuaAwaitableObject;
+
+extern PyType_Spec LuaAwaitableTypeSpec;
+
+PyObject* pylua_new_awaitable(LuaObject* func, PyObject* args);
+int pylua_is_awaitable(PyObject* obj);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,74 @@
+#include "pylua_buffer.h"
+
+#include <string.h>
+
+/**
+ * Initialize an empty buffer
+ */
+void pylua_buffer_init(struct Buffer* buf) {
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+/**
+ * Frees the content of a buffer, which can be used again
+ */
+void pylua_buffer_free(struct Buffer* buf) {
+    free(buf->data);
+    pylua_buffer_init(buf);
+}
+
+/**
+ * Makes room for `size` more bytes
+ * Returns -1 if there is not enough memory
+ */
+int pylua_buffer_reserve(struct Buffer* buf, size_t size) {
+    if (buf->capacity - buf->size >= size)
+        return 0;
+    
+    if (size > SIZE_MAX - buf->size)
+        return -1;
+    
+    size_t capacity = buf->capacity ? buf->capacity : 64;
+    while (capacity - buf->size < size) {
+        if (capacity > SIZE_MAX / 2) {
+            capacity = buf->size + size;
+            break;
+        }
+        capacity *= 2;
+    }
+    
+    char* data = realloc(buf->data, capacity);
+    if (!data)
+        return -1;
+    
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Appends `size` bytes to the buffer
+ * Returns -1 if there is not enough memory
+ */
+int pylua_buffer_write(struct Buffer* buf, const void* data, size_t size) {
+    if (pylua_buffer_reserve(buf, size) < 0)
+        return -1;
+    
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    return 0;
+}
+
+/**
+ * Appends a single byte to the buffer
+ * Returns -1 if there is not enough memory
+ */
+int pylua_buffer_putc(struct Buffer* buf, unsigned char c) {
+    if (buf->size == buf->capacity && pylua_buffer_reserve(buf, 1) < 0)
+        return -1;
+    
+    buf->data[buf->size++] = (char)c;
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,19 @@
+#ifndef PYLUA_BUFFER_H
+#define PYLUA_BUFFER_H
+
+#include "pylua.h"
+
+// Growable byte buffer, which can be used without the GIL
+struct Buffer {
+    char* data;
+    size_t size;
+    size_t capacity;
+};
+
+void pylua_buffer_init(struct Buffer* buf);
+void pylua_buffer_free(struct Buffer* buf);
+int pylua_buffer_reserve(struct Buffer* buf, size_t size);
+int pylua_buffer_write(struct Buffer* buf, const void* data, size_t size);
+int pylua_buffer_putc(struct Buffer* buf, unsigned char c);
+
+#endif
\ No newline at end of file
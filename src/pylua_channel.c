@@ -0,0 +1,543 @@
+#include "pylua_channel.h"
+#include "pylua_buffer.h"
+#include "pylua_codec.h"
+#include "pylua_module.h"
+#include "pylua_profiler.h"
+
+
+// Blocked receivers and senders check the channel at least that often (in microseconds)
+#define PYLUA_CHANNEL_SLICE 10000
+
+#define PYLUA_CHANNEL_META "pylua.Channel"
+
+
+/**
+ * Allocates a channel, with room for at least `capacity` values
+ * Returns NULL if there is not enough memory
+ */
+static struct Channel* pylua_channel_new(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+    
+    struct Channel* chan = calloc(1, sizeof *chan);
+    if (!chan)
+        return NULL;
+    
+    chan->slots = calloc(size, sizeof *chan->slots);
+    chan->readable = PyThread_allocate_lock();
+    chan->writable = PyThread_allocate_lock();
+    
+    if (!chan->slots || !chan->readable || !chan->writable) {
+        if (chan->readable)
+            PyThread_free_lock(chan->readable);
+        if (chan->writable)
+            PyThread_free_lock(chan->writable);
+        free(chan->slots);
+        free(chan);
+        return NULL;
+    }
+    
+    // nobody is signaled yet
+    PyThread_acquire_lock(chan->readable, WAIT_LOCK);
+    PyThread_acquire_lock(chan->writable, WAIT_LOCK);
+    
+    chan->mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&chan->slots[i].seq, i);
+    
+    atomic_init(&chan->refs, 1);
+    atomic_init(&chan->closed, 0);
+    atomic_init(&chan->enqueue, 0);
+    atomic_init(&chan->dequeue, 0);
+    atomic_init(&chan->readsignal, 0);
+    atomic_init(&chan->writesignal, 0);
+    atomic_init(&chan->readers, 0);
+    atomic_init(&chan->writers, 0);
+    return chan;
+}
+
+/**
+ * Releases a reference to a channel, and frees it (with the values left in it)
+ * if it was the last one. This does not need the GIL.
+ */
+static void pylua_channel_release(struct Channel* chan) {
+    if (atomic_fetch_sub(&chan->refs, 1) != 1)
+        return;
+    
+    size_t end = atomic_load(&chan->enqueue);
+    for (size_t pos = atomic_load(&chan->dequeue); pos != end; pos++)
+        free(chan->slots[pos & chan->mask].data);
+    
+    PyThread_free_lock(chan->readable);
+    PyThread_free_lock(chan->writable);
+    free(chan->slots);
+    free(chan);
+}
+
+/**
+ * Attempts to enqueue a value, without waiting.
+ * Returns 0 if the channel is full
+ */
+static int pylua_channel_push(struct Channel* chan, char* data, size_t size) {
+    struct ChannelSlot* slot;
+    size_t pos = atomic_load_explicit(&chan->enqueue, memory_order_relaxed);
+    
+    for (;;) {
+        slot = &chan->slots[pos & chan->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&chan->enqueue, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&chan->enqueue, memory_order_relaxed);
+        }
+    }
+    
+    slot->data = data;
+    slot->size = size;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+/**
+ * Attempts to dequeue a value, without waiting.
+ * Returns 0 if the channel is empty
+ */
+static int pylua_channel_pop(struct Channel* chan, char** data, size_t* size) {
+    struct ChannelSlot* slot;
+    size_t pos = atomic_load_explicit(&chan->dequeue, memory_order_relaxed);
+    
+    for (;;) {
+        slot = &chan->slots[pos & chan->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&chan->dequeue, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&chan->dequeue, memory_order_relaxed);
+        }
+    }
+    
+    *data = slot->data;
+    *size = slot->size;
+    atomic_store_explicit(&slot->seq, pos + chan->mask + 1, memory_order_release);
+    return 1;
+}
+
+/**
+ * Returns the number of values in the channel (which may be outdated already)
+ */
+static size_t pylua_channel_count(struct Channel* chan) {
+    size_t dequeue = atomic_load(&chan->dequeue);
+    size_t enqueue = atomic_load(&chan->enqueue);
+    return enqueue - dequeue;
+}
+
+/**
+ * Wakes up one of the threads waiting on `lock`, if any
+ */
+static void pylua_channel_signal(PyThread_type_lock lock, atomic_int* signaled, atomic_int* waiters) {
+    int expected = 0;
+    if (atomic_load(waiters) > 0 && atomic_compare_exchange_strong(signaled, &expected, 1))
+        PyThread_release_lock(lock);
+}
+
+/**
+ * Waits until `lock` is signaled, or for `us` microseconds
+ */
+static void pylua_channel_wait(PyThread_type_lock lock, atomic_int* signaled, long long us) {
+    if (PyThread_acquire_lock_timed(lock, us, 0) == PY_LOCK_ACQUIRED)
+        atomic_store(signaled, 0);
+}
+
+/**
+ * Returns the number of microseconds left before `timeout` seconds elapsed since `start`
+ * (from pylua_clock_ns, which clock jumps don't affect),
+ * but no more than a slice, so we don't miss a close. Negative timeouts never expire.
+ */
+static long long pylua_channel_remaining(long long start, double timeout) {
+    if (timeout < 0)
+        return PYLUA_CHANNEL_SLICE;
+    
+    long long elapsed = (pylua_clock_ns() - start) / 1000;
+    long long remaining = (long long)(timeout * 1000000) - elapsed;
+    return remaining < PYLUA_CHANNEL_SLICE ? remaining : PYLUA_CHANNEL_SLICE;
+}
+
+/**
+ * Enqueues a value, waiting up to `timeout` seconds for room (forever if negative).
+ * The channel owns `data` if successful.
+ *
+ * Returns 1 if successful, 0 on timeout, -1 if the channel is closed
+ */
+static int pylua_channel_send(struct Channel* chan, char* data, size_t size, double timeout) {
+    long long start = pylua_clock_ns();
+    
+    for (;;) {
+        if (atomic_load(&chan->closed))
+            return -1;
+        
+        if (pylua_channel_push(chan, data, size)) {
+            pylua_channel_signal(chan->readable, &chan->readsignal, &chan->readers);
+            return 1;
+        }
+        
+        long long remaining = pylua_channel_remaining(start, timeout);
+        if (remaining <= 0)
+            return 0;
+        
+        // someone may have made room before we registered
+        atomic_fetch_add(&chan->writers, 1);
+        if (pylua_channel_count(chan) > chan->mask)
+            pylua_channel_wait(chan->writable, &chan->writesignal, remaining);
+        atomic_fetch_sub(&chan->writers, 1);
+    }
+}
+
+/**
+ * Dequeues a value, waiting up to `timeout` seconds for one (forever if negative).
+ * The caller owns `data` if successful.
+ *
+ * Returns 1 if successful, 0 on timeout, -1 if the channel is closed and empty
+ */
+static int pylua_channel_recv(struct Channel* chan, char** data, size_t* size, double timeout) {
+    long long start = pylua_clock_ns();
+    
+    for (;;) {
+        if (pylua_channel_pop(chan, data, size)) {
+            pylua_channel_signal(chan->writable, &chan->writesignal, &chan->writers);
+            
+            // pass it on to the next receiver
+            if (pylua_channel_count(chan))
+                pylua_channel_signal(chan->readable, &chan->readsignal, &chan->readers);
+            return 1;
+        }
+        
+        if (atomic_load(&chan->closed))
+            return -1;
+        
+        long long remaining = pylua_channel_remaining(start, timeout);
+        if (remaining <= 0)
+            return 0;
+        
+        // someone may have sent a value before we registered
+        atomic_fetch_add(&chan->readers, 1);
+        if (!pylua_channel_count(chan))
+            pylua_channel_wait(chan->readable, &chan->readsignal, remaining);
+        atomic_fetch_sub(&chan->readers, 1);
+    }
+}
+
+/**
+ * Closes a channel: sending fails, and receiving fails once it is empty
+ */
+static void pylua_channel_close(struct Channel* chan) {
+    atomic_store(&chan->closed, 1);
+    pylua_channel_signal(chan->readable, &chan->readsignal, &chan->readers);
+    pylua_channel_signal(chan->writable, &chan->writesignal, &chan->writers);
+}
+
+
+/**
+ * Returns the channel of the userdata at index 1, or raises a lua error
+ */
+static struct Channel* pylua_check_channel(lua_State* L) {
+    struct Channel** ud = (struct Channel**)luaL_checkudata(L, 1, PYLUA_CHANNEL_META);
+    if (!*ud)
+        luaL_error(L, "invalid channel");
+    return *ud;
+}
+
+/**
+ * Returns the optional timeout at index `idx`, -1 if none
+ */
+static double pylua_check_timeout(lua_State* L, int idx) {
+    if (lua_isnoneornil(L, idx))
+        return -1;
+    
+    double timeout = (double)luaL_checknumber(L, idx);
+    return timeout < 0 ? 0 : timeout;
+}
+
+/**
+ * Shared by channel:send and channel:try_send
+ */
+static int pylua_channel_lua_send(lua_State* L, double timeout) {
+    struct Channel* chan = pylua_check_channel(L);
+    luaL_checkany(L, 2);
+    
+    struct Buffer buf;
+    pylua_buffer_init(&buf);
+    
+    const char* err = pylua_encode(L, 2, &buf, 0);
+    if (err) {
+        pylua_buffer_free(&buf);
+        return luaL_error(L, "cannot send value: %s", err);
+    }
+    
+    int res = pylua_channel_send(chan, buf.data, buf.size, timeout);
+    if (res <= 0)
+        pylua_buffer_free(&buf);
+    
+    lua_pushboolean(L, res > 0);
+    if (res > 0)
+        return 1;
+    
+    lua_pushstring(L, res ? "closed" : (timeout ? "timeout" : "full"));
+    return 2;
+}
+
+/**
+ * channel:send(value [, timeout]) -> true | false, "timeout" | "closed"
+ */
+static int pylua_channel_lua_send_blocking(lua_State* L) {
+    return pylua_channel_lua_send(L, pylua_check_timeout(L, 3));
+}
+
+/**
+ * channel:try_send(value) -> true | false, "full" | "closed"
+ */
+static int pylua_channel_lua_try_send(lua_State* L) {
+    return pylua_channel_lua_send(L, 0);
+}
+
+/**
+ * Shared by channel:recv and channel:try_recv
+ * The holder userdata (upvalue 1) owns the value until it is decoded,
+ * so it is not lost if lua runs out of memory.
+ */
+static int pylua_channel_lua_recv(lua_State* L, double timeout) {
+    struct Channel* chan = pylua_check_channel(L);
+    char** holder = (char**)lua_touserdata(L, lua_upvalueindex(1));
+    
+    // left over by a memory error
+    free(*holder);
+    *holder = NULL;
+    
+    size_t size;
+    int res = pylua_channel_recv(chan, holder, &size, timeout);
+    if (res <= 0) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, res ? "closed" : (timeout ? "timeout" : "empty"));
+        return 2;
+    }
+    
+    lua_pushboolean(L, 1);
+    
+    size_t pos = 0;
+    const char* err = pylua_decode(L, *holder, size, &pos);
+    
+    free(*holder);
+    *holder = NULL;
+    
+    if (err)
+        return luaL_error(L, "cannot receive value: %s", err);
+    return 2;
+}
+
+/**
+ * channel:recv([timeout]) -> true, value | false, "timeout" | "closed"
+ */
+static int pylua_channel_lua_recv_blocking(lua_State* L) {
+    return pylua_channel_lua_recv(L, pylua_check_timeout(L, 2));
+}
+
+/**
+ * channel:try_recv() -> true, value | false, "empty" | "closed"
+ */
+static int pylua_channel_lua_try_recv(lua_State* L) {
+    return pylua_channel_lua_recv(L, 0);
+}
+
+/**
+ * channel:close()
+ */
+static int pylua_channel_lua_close(lua_State* L) {
+    pylua_channel_close(pylua_check_channel(L));
+    return 0;
+}
+
+/**
+ * #channel
+ */
+static int pylua_channel_lua_len(lua_State* L) {
+    lua_pushinteger(L, (lua_Integer)pylua_channel_count(pylua_check_channel(L)));
+    return 1;
+}
+
+/**
+ * __gc of the channel userdata
+ */
+static int pylua_channel_lua_gc(lua_State* L) {
+    struct Channel** ud = (struct Channel**)lua_touserdata(L, 1);
+    if (*ud)
+        pylua_channel_release(*ud);
+    *ud = NULL;
+    return 0;
+}
+
+/**
+ * __gc of the holder used by recv
+ */
+static int pylua_channel_lua_gc_holder(lua_State* L) {
+    char** holder = (char**)lua_touserdata(L, 1);
+    free(*holder);
+    *holder = NULL;
+    return 0;
+}
+
+/**
+ * Pushes a userdata for a channel, which lua code can use
+ * through its send, try_send, recv, try_recv and close methods.
+ *
+ * This may raise memory errors, so it must be called from protected code.
+ */
+int pylua_push_channel(lua_State* L, struct Channel* chan) {
+    luaL_checkstack(L, 4, NULL);
+    
+    struct Channel** ud = (struct Channel**)lua_newuserdata(L, sizeof *ud);
+    *ud = NULL;
+    
+    // the metatable is created once per lua state
+    if (luaL_newmetatable(L, PYLUA_CHANNEL_META)) {
+        lua_pushcfunction(L, &pylua_channel_lua_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushcfunction(L, &pylua_channel_lua_len);
+        lua_setfield(L, -2, "__len");
+        
+        lua_newtable(L);
+        lua_pushcfunction(L, &pylua_channel_lua_send_blocking);
+        lua_setfield(L, -2, "send");
+        lua_pushcfunction(L, &pylua_channel_lua_try_send);
+        lua_setfield(L, -2, "try_send");
+        lua_pushcfunction(L, &pylua_channel_lua_close);
+        lua_setfield(L, -2, "close");
+        
+        // recv and try_recv share their holder
+        char** holder = (char**)lua_newuserdata(L, sizeof *holder);
+        *holder = NULL;
+        lua_newtable(L);
+        lua_pushcfunction(L, &pylua_channel_lua_gc_holder);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        
+        lua_pushvalue(L, -1);
+        lua_pushcclosure(L, &pylua_channel_lua_recv_blocking, 1);
+        lua_setfield(L, -3, "recv");
+        lua_pushcclosure(L, &pylua_channel_lua_try_recv, 1);
+        lua_setfield(L, -2, "try_recv");
+        
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    
+    atomic_fetch_add(&chan->refs, 1);
+    *ud = chan;
+    return 0;
+}
+
+
+/**
+ * Implement tp_new for our Channel type
+ */
+static PyObject* LuaChannel_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"capacity", NULL};
+    Py_ssize_t capacity;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n", keywords, &capacity))
+        return NULL;
+    
+    if (capacity < 1 || (size_t)capacity > SIZE_MAX / 2 / sizeof(struct ChannelSlot)) {
+        PyErr_SetString(PyExc_ValueError, "invalid capacity");
+        return NULL;
+    }
+    
+    LuaChannelObject* self = (LuaChannelObject*)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->chan = pylua_channel_new((size_t)capacity);
+        if (!self->chan) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+    return (PyObject*)self;
+}
+
+/**
+ * Implements Channel.close, which wakes up everyone waiting on the channel
+ */
+static PyObject* LuaChannel_close(LuaChannelObject* self, PyObject* unused) {
+    pylua_channel_close(self->chan);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements `len` for a Channel
+ */
+static Py_ssize_t LuaChannel_length(LuaChannelObject* self) {
+    return (Py_ssize_t)pylua_channel_count(self->chan);
+}
+
+/**
+ * Getter for Channel.capacity
+ */
+static PyObject* LuaChannel_get_capacity(LuaChannelObject* self, void* unused) {
+    return PyLong_FromSize_t(self->chan->mask + 1);
+}
+
+/**
+ * Getter for Channel.closed
+ */
+static PyObject* LuaChannel_get_closed(LuaChannelObject* self, void* unused) {
+    return PyBool_FromLong(atomic_load(&self->chan->closed));
+}
+
+/**
+ * Handle deallocation of Channel ; lua states may still use it
+ */
+static void LuaChannel_dealloc(LuaChannelObject* self) {
+    if (self->chan)
+        pylua_channel_release(self->chan);
+    
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+
+static PyMethodDef LuaChannel_methods[] = {
+    {"close", (PyCFunction)LuaChannel_close, METH_NOARGS, "close the channel"},
+    {NULL}
+};
+
+static PyGetSetDef LuaChannel_getset[] = {
+    {"capacity", (getter)LuaChannel_get_capacity, NULL, "number of values the channel can hold", NULL},
+    {"closed", (getter)LuaChannel_get_closed, NULL, "whether the channel is closed", NULL},
+    {NULL}
+};
+
+static PyType_Slot LuaChannelSlots[] = {
+    {Py_tp_doc, "Bounded queue of lua values, shared by lua states"},
+    {Py_tp_new, LuaChannel_new},
+    {Py_tp_dealloc, LuaChannel_dealloc},
+    {Py_tp_methods, LuaChannel_methods},
+    {Py_tp_getset, LuaChannel_getset},
+    {Py_mp_length, LuaChannel_length},
+    {0, NULL}
+};
+
+PyType_Spec LuaChannelTypeSpec = {
+    .name = "pylua.Channel",
+    .basicsize = sizeof(LuaChannelObject),
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = LuaChannelSlots
+};
\ No newline at end of file
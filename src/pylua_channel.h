@@ -0,0 +1,51 @@
+#ifndef PYLUA_CHANNEL_H
+#define PYLUA_CHANNEL_H
+
+#include "pylua.h"
+
+#include <pythread.h>
+#include <stdatomic.h>
+
+struct ChannelSlot {
+    atomic_size_t seq;
+    char* data;
+    size_t size;
+};
+
+// Bounded lock-free MPMC queue of encoded lua values (see pylua_codec.c),
+// shared by the python object and every lua state it was given to
+struct Channel {
+    atomic_int refs;
+    atomic_int closed;
+    
+    struct ChannelSlot* slots;
+    size_t mask;
+    
+    // Enqueue and dequeue positions, kept on separate cache lines
+    char pad0[64];
+    atomic_size_t enqueue;
+    char pad1[64];
+    atomic_size_t dequeue;
+    char pad2[64];
+    
+    // Wake up blocked receivers and senders
+    PyThread_type_lock readable;
+    PyThread_type_lock writable;
+    atomic_int readsignal;
+    atomic_int writesignal;
+    atomic_int readers;
+    atomic_int writers;
+};
+
+typedef struct {
+    PyObject_HEAD
+    
+    struct Channel* chan;
+    
+} LuaChannelObject;
+
+extern PyType_Spec LuaChannelTypeSpec;
+
+int pylua_push_channel(lua_State* L, struct Channel* chan);
+
+#endif
\ No newline at end of file
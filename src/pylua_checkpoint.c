@@ -0,0 +1,300 @@
+#include "pylua_checkpoint.h"
+
+/*
+    A checkpoint is a copy of every table reachable from the globals,
+    the registry and the metatables of the basic types, along with their metatables,
+    and of the upvalues (and environments, in 5.1) of the lua closures found on the way.
+    Resetting refills those tables and upvalues in place, so everything created since
+    becomes garbage, and the memory is reused by lua.
+    
+    Userdata contents, and the upvalues of C functions, are not saved.
+    In the registry, references (integer keys) and thread infos (light userdata keys)
+    are left alone, as python objects are still using them.
+*/
+
+// Address used as the registry key of the checkpoint
+static char pylua_checkpoint_key;
+
+// Types sharing a metatable, which can only be set from C or the debug library
+static const int pylua_basic_types[] = {
+    LUA_TNIL, LUA_TBOOLEAN, LUA_TLIGHTUSERDATA, LUA_TNUMBER, LUA_TSTRING, LUA_TFUNCTION, LUA_TTHREAD
+};
+
+#define PYLUA_BASIC_TYPES ((int)(sizeof pylua_basic_types / sizeof pylua_basic_types[0]))
+
+/**
+ * Only used as a value of type function
+ */
+static int pylua_checkpoint_nop(lua_State* L) {
+    return 0;
+}
+
+/**
+ * Pushes a value of a basic type
+ */
+static void pylua_push_basic(lua_State* L, int type) {
+    switch (type) {
+        case LUA_TBOOLEAN:
+            lua_pushboolean(L, 0);
+            break;
+        case LUA_TLIGHTUSERDATA:
+            lua_pushlightuserdata(L, NULL);
+            break;
+        case LUA_TNUMBER:
+            lua_pushinteger(L, 0);
+            break;
+        case LUA_TSTRING:
+            lua_pushliteral(L, "");
+            break;
+        case LUA_TFUNCTION:
+            lua_pushcfunction(L, &pylua_checkpoint_nop);
+            break;
+        case LUA_TTHREAD:
+            lua_pushthread(L);
+            break;
+        default:
+            lua_pushnil(L);
+            break;
+    }
+}
+
+/**
+ * Returns whether the registry key at `idx` is saved and restored
+ */
+static int pylua_restorable(lua_State* L, int idx) {
+    int type = lua_type(L, idx);
+    return type != LUA_TNUMBER && type != LUA_TLIGHTUSERDATA;
+}
+
+/**
+ * Queues the value at `idx` to be saved, if it is a table or a lua closure
+ * we have not seen yet.
+ * `tables` and `queue` are absolute indices, `n` is the length of the queue.
+ */
+static void pylua_checkpoint_visit(lua_State* L, int idx, int tables, int queue, int* n) {
+    int type = lua_type(L, idx);
+    if (type != LUA_TTABLE && (type != LUA_TFUNCTION || lua_iscfunction(L, idx)))
+        return;
+    
+    lua_pushvalue(L, idx);
+    lua_rawget(L, tables);
+    int seen = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (seen)
+        return;
+    
+    // placeholder, until it is saved
+    lua_pushvalue(L, idx);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, tables);
+    
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, queue, ++*n);
+}
+
+/**
+ * Saves the current state, replacing any previous checkpoint.
+ * This is a lua_CFunction, so that memory errors can be caught.
+ */
+int pylua_checkpoint(lua_State* L) {
+    luaL_checkstack(L, 16, NULL);
+    
+    int base = lua_gettop(L);
+    lua_newtable(L); // the checkpoint
+    lua_newtable(L); // table -> copy
+    lua_newtable(L); // table -> metatable
+    lua_newtable(L); // basic type -> metatable
+    lua_newtable(L); // tables to save
+    
+    int tables = base + 2;
+    int metas = base + 3;
+    int types = base + 4;
+    int queue = base + 5;
+    int n = 0;
+    
+    // globals
+#if LUA_VERSION_NUM >= 502
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#else
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+    pylua_checkpoint_visit(L, -1, tables, queue, &n);
+    lua_pop(L, 1);
+    
+    // registry, along with the loaded packages
+    lua_pushvalue(L, LUA_REGISTRYINDEX);
+    pylua_checkpoint_visit(L, -1, tables, queue, &n);
+    lua_pop(L, 1);
+    
+    // metatables of the basic types
+    for (int i = 0; i < PYLUA_BASIC_TYPES; i++) {
+        pylua_push_basic(L, pylua_basic_types[i]);
+        if (lua_getmetatable(L, -1)) {
+            pylua_checkpoint_visit(L, -1, tables, queue, &n);
+            lua_rawseti(L, types, i + 1);
+        }
+        lua_pop(L, 1);
+    }
+    
+    while (n > 0) {
+        lua_rawgeti(L, queue, n);
+        lua_pushnil(L);
+        lua_rawseti(L, queue, n--);
+        
+        int t = lua_gettop(L);
+        lua_pushvalue(L, LUA_REGISTRYINDEX);
+        int registry = lua_rawequal(L, t, -1);
+        lua_pop(L, 1);
+        
+        lua_newtable(L);
+        int copy = t + 1;
+        
+        // the copy of a closure holds its upvalues, and their count
+        if (lua_type(L, t) == LUA_TFUNCTION) {
+            int i = 1;
+            while (lua_getupvalue(L, t, i)) {
+                pylua_checkpoint_visit(L, -1, tables, queue, &n);
+                lua_rawseti(L, copy, i++);
+            }
+            lua_pushinteger(L, i - 1);
+            lua_setfield(L, copy, "n");
+            
+#if LUA_VERSION_NUM <= 501
+            lua_getfenv(L, t);
+            pylua_checkpoint_visit(L, -1, tables, queue, &n);
+            lua_setfield(L, copy, "env");
+#endif
+            
+            lua_pushvalue(L, t);
+            lua_pushvalue(L, copy);
+            lua_rawset(L, tables);
+            lua_settop(L, t - 1);
+            continue;
+        }
+        
+        lua_pushnil(L);
+        while (lua_next(L, t)) {
+            if (!registry || pylua_restorable(L, -2)) {
+                pylua_checkpoint_visit(L, -2, tables, queue, &n);
+                pylua_checkpoint_visit(L, -1, tables, queue, &n);
+                
+                lua_pushvalue(L, -2);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, copy);
+            }
+            lua_pop(L, 1);
+        }
+        
+        if (lua_getmetatable(L, t)) {
+            pylua_checkpoint_visit(L, -1, tables, queue, &n);
+            lua_pushvalue(L, t);
+            lua_insert(L, -2);
+            lua_rawset(L, metas);
+        }
+        
+        lua_pushvalue(L, t);
+        lua_pushvalue(L, copy);
+        lua_rawset(L, tables);
+        lua_settop(L, t - 1);
+    }
+    
+    lua_pop(L, 1); // queue
+    lua_setfield(L, base + 1, "types");
+    lua_setfield(L, base + 1, "metas");
+    lua_setfield(L, base + 1, "tables");
+    
+    lua_pushlightuserdata(L, &pylua_checkpoint_key);
+    lua_insert(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    return 0;
+}
+
+/**
+ * Restores the state saved by pylua_checkpoint, then collects the garbage.
+ * This is a lua_CFunction, so that memory errors can be caught.
+ */
+int pylua_reset(lua_State* L) {
+    luaL_checkstack(L, 16, NULL);
+    
+    lua_pushlightuserdata(L, &pylua_checkpoint_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1))
+        return luaL_error(L, "no checkpoint");
+    
+    int cp = lua_gettop(L);
+    lua_getfield(L, cp, "tables");
+    lua_getfield(L, cp, "metas");
+    lua_getfield(L, cp, "types");
+    
+    int tables = cp + 1;
+    int metas = cp + 2;
+    int types = cp + 3;
+    
+    lua_pushnil(L);
+    while (lua_next(L, tables)) {
+        int t = lua_gettop(L) - 1;
+        int copy = t + 1;
+        
+        if (lua_type(L, t) == LUA_TFUNCTION) {
+            lua_getfield(L, copy, "n");
+            int nups = (int)lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            
+            for (int i = 1; i <= nups; i++) {
+                lua_rawgeti(L, copy, i);
+                if (!lua_setupvalue(L, t, i))
+                    lua_pop(L, 1);
+            }
+            
+#if LUA_VERSION_NUM <= 501
+            lua_getfield(L, copy, "env");
+            lua_setfenv(L, t);
+#endif
+            
+            lua_pop(L, 1); // copy
+            continue;
+        }
+        
+        lua_pushvalue(L, LUA_REGISTRYINDEX);
+        int registry = lua_rawequal(L, t, -1);
+        lua_pop(L, 1);
+        
+        // clearing existing fields is allowed while traversing
+        lua_pushnil(L);
+        while (lua_next(L, t)) {
+            lua_pop(L, 1);
+            if (!registry || pylua_restorable(L, -1)) {
+                lua_pushvalue(L, -1);
+                lua_pushnil(L);
+                lua_rawset(L, t);
+            }
+        }
+        
+        lua_pushnil(L);
+        while (lua_next(L, copy)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, t);
+        }
+        
+        // nil removes the metatable
+        lua_pushvalue(L, t);
+        lua_rawget(L, metas);
+        lua_setmetatable(L, t);
+        
+        lua_pop(L, 1); // copy
+    }
+    
+    for (int i = 0; i < PYLUA_BASIC_TYPES; i++) {
+        pylua_push_basic(L, pylua_basic_types[i]);
+        lua_rawgeti(L, types, i + 1);
+        lua_setmetatable(L, -2);
+        lua_pop(L, 1);
+    }
+    
+    lua_settop(L, cp - 1);
+    
+    // everything created since the checkpoint can go now
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef PYLUA_CHECKPOINT_H
+#define PYLUA_CHECKPOINT_H
+
+#include "pylua.h"
+
+int pylua_checkpoint(lua_State* L);
+int pylua_reset(lua_State* L);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,572 @@
+#include "pylua_chunk.h"
+#include "pylua_module.h"
+
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#   include <process.h>
+#   define pylua_getpid _getpid
+#else
+#   include <unistd.h>
+#   define pylua_getpid getpid
+#endif
+
+// Default size limit of the in-memory cache
+#define PYLUA_CHUNK_MAXSIZE (64 * 1024 * 1024)
+
+// Size of the digests used as keys
+#define PYLUA_CHUNK_DIGEST 20
+
+
+/**
+ * lua_Writer appending to a struct Buffer
+ */
+static int pylua_dump_writer(lua_State* L, const void* p, size_t size, void* ud) {
+    return pylua_buffer_write((struct Buffer*)ud, p, size) < 0;
+}
+
+/**
+ * Dumps the lua function on the top of the stack as a binary chunk.
+ * Debug info is left out if `strip` is set (ignored before lua 5.3).
+ * Returns non-zero if it is not a lua function, or there is not enough memory
+ */
+int pylua_dump(lua_State* L, struct Buffer* buf, int strip) {
+#if LUA_VERSION_NUM >= 503
+    return lua_dump(L, &pylua_dump_writer, buf, strip);
+#else
+    (void)strip;
+    return lua_dump(L, &pylua_dump_writer, buf);
+#endif
+}
+
+/**
+ * Reads a whole file to a buffer, which doesn't need the GIL.
+ * Returns -1 if it can't be read
+ */
+int pylua_read_file(const char* filename, struct Buffer* buf) {
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return -1;
+    
+    for (;;) {
+        if (pylua_buffer_reserve(buf, 4096) < 0)
+            break;
+        
+        size_t n = fread(buf->data + buf->size, 1, buf->capacity - buf->size, f);
+        buf->size += n;
+        if (n == 0) {
+            if (ferror(f))
+                break;
+            
+            fclose(f);
+            return 0;
+        }
+    }
+    
+    fclose(f);
+    pylua_buffer_free(buf);
+    return -1;
+}
+
+/**
+ * Checks the header of a binary chunk against our lua version.
+ * Returns NULL if it is compatible, or an error message
+ * (sizes and number formats are checked by lua_load)
+ */
+const char* pylua_check_bytecode(const char* data, size_t size) {
+    size_t siglen = sizeof(LUA_SIGNATURE) - 1;
+    if (size < siglen + 2 || memcmp(data, LUA_SIGNATURE, siglen) != 0)
+        return "not a lua binary chunk";
+    
+    // major and minor version, in a byte
+    unsigned char version = (unsigned char)data[siglen];
+    if (version != (LUA_VERSION_NUM / 100) * 16 + LUA_VERSION_NUM % 100)
+        return "binary chunk was compiled for another version of lua (" LUA_VERSION " is required)";
+    
+    // only the official format is supported
+    if (data[siglen + 1] != 0)
+        return "binary chunk has an unsupported format";
+    
+    return NULL;
+}
+
+/**
+ * Loads a binary chunk, never source code.
+ * Returns the same as lua_load
+ */
+int pylua_load_binary(lua_State* L, const char* data, size_t size, const char* name) {
+#if LUA_VERSION_NUM >= 502
+    return luaL_loadbufferx(L, data, size, name, "b");
+#else
+    if (!size || data[0] != LUA_SIGNATURE[0]) {
+        lua_pushliteral(L, "not a binary chunk");
+        return LUA_ERRSYNTAX;
+    }
+    return luaL_loadbuffer(L, data, size, name);
+#endif
+}
+
+/**
+ * Returns the length of what luaL_loadfile skips at the start of a file:
+ * a UTF-8 BOM (since 5.2), and a first line starting with '#',
+ * but not its newline, so that line numbers are kept
+ */
+size_t pylua_skip_header(const char* data, size_t size) {
+    size_t pos = 0;
+    
+#if LUA_VERSION_NUM >= 502
+    if (size >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0)
+        pos = 3;
+#endif
+    
+    if (pos < size && data[pos] == '#') {
+        while (pos < size && data[pos] != '\n')
+            pos++;
+    }
+    return pos;
+}
+
+/**
+ * Returns whether a chunk should go through the cache:
+ * only source code is worth caching, and only if the mode allows it
+ */
+int pylua_chunk_cacheable(const char* source, size_t len, const char* mode) {
+    if (mode && !strchr(mode, 't'))
+        return 0;
+    
+    return !len || source[0] != LUA_SIGNATURE[0];
+}
+
+/**
+ * Returns the key of a chunk (a str), from its source, name, and the lua version
+ */
+PyObject* pylua_chunk_key(LuaChunkCacheObject* cache, const char* source, size_t len, const char* name) {
+    // the length of the source comes first, so that the name can't be mistaken for source code
+    PyObject* header = PyBytes_FromFormat("%s:%zu:", LUA_RELEASE, len);
+    if (!header)
+        return NULL;
+    
+    PyObject* args = PyTuple_Pack(1, header);
+    Py_DECREF(header);
+    if (!args)
+        return NULL;
+    
+    PyObject* kwargs = Py_BuildValue("{s:i}", "digest_size", PYLUA_CHUNK_DIGEST);
+    if (!kwargs) {
+        Py_DECREF(args);
+        return NULL;
+    }
+    
+    PyObject* hash = PyObject_Call(cache->hash, args, kwargs);
+    Py_DECREF(args);
+    Py_DECREF(kwargs);
+    if (!hash)
+        return NULL;
+    
+    // no need to copy the source
+    PyObject* view = PyMemoryView_FromMemory((char*)source, (Py_ssize_t)len, PyBUF_READ);
+    PyObject* res = view ? PyObject_CallMethod(hash, "update", "O", view) : NULL;
+    Py_XDECREF(view);
+    
+    if (res) {
+        Py_DECREF(res);
+        res = PyObject_CallMethod(hash, "update", "y", name);
+    }
+    if (res) {
+        Py_DECREF(res);
+        res = PyObject_CallMethod(hash, "hexdigest", NULL);
+    }
+    
+    Py_DECREF(hash);
+    return res;
+}
+
+/**
+ * Adds a chunk to the in-memory cache (as the most recently used one),
+ * then evicts the least recently used chunks until it fits.
+ * Returns -1 if a python exception occured
+ */
+static int pylua_chunk_insert(LuaChunkCacheObject* cache, PyObject* key, PyObject* data) {
+    size_t size = (size_t)PyBytes_GET_SIZE(data);
+    int res = 0;
+    
+    Py_BEGIN_CRITICAL_SECTION(cache->entries);
+    
+    if (size <= cache->maxsize) {
+        // dicts keep the insertion order, so it has to be removed first
+        PyObject* old = PyDict_GetItemWithError(cache->entries, key);
+        if (old) {
+            cache->size -= (size_t)PyBytes_GET_SIZE(old);
+            res = PyDict_DelItem(cache->entries, key);
+            
+        } else if (PyErr_Occurred()) {
+            res = -1;
+        }
+        
+        if (!res)
+            res = PyDict_SetItem(cache->entries, key, data);
+        
+        if (!res) {
+            cache->size += size;
+            
+            while (cache->size > cache->maxsize) {
+                Py_ssize_t pos = 0;
+                PyObject* k;
+                PyObject* v;
+                if (!PyDict_Next(cache->entries, &pos, &k, &v))
+                    break;
+                
+                cache->size -= (size_t)PyBytes_GET_SIZE(v);
+                cache->evictions++;
+                
+                Py_INCREF(k);
+                res = PyDict_DelItem(cache->entries, k);
+                Py_DECREF(k);
+                if (res)
+                    break;
+            }
+        }
+    }
+    
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+/**
+ * Returns the path of a chunk in the cache directory, as bytes
+ */
+static PyObject* pylua_chunk_path(LuaChunkCacheObject* cache, PyObject* key) {
+    const char* name = PyUnicode_AsUTF8(key);
+    if (!name)
+        return NULL;
+    
+    return PyBytes_FromFormat("%s/%s.luac", PyBytes_AS_STRING(cache->directory), name);
+}
+
+/**
+ * Writes a chunk to the cache directory.
+ * Other processes may be reading it, so it is written to a temporary file first.
+ * Errors are ignored: it will be compiled again next time.
+ */
+static void pylua_chunk_write(LuaChunkCacheObject* cache, PyObject* key, struct Buffer* buf) {
+    PyObject* path = pylua_chunk_path(cache, key);
+    if (!path) {
+        PyErr_Clear();
+        return;
+    }
+    
+    PyObject* tmp = PyBytes_FromFormat("%s.%d.%lu.tmp", PyBytes_AS_STRING(path), (int)pylua_getpid(), PyThread_get_thread_ident());
+    if (!tmp) {
+        PyErr_Clear();
+        Py_DECREF(path);
+        return;
+    }
+    
+    FILE* f = fopen(PyBytes_AS_STRING(tmp), "wb");
+    if (f) {
+        int ok = fwrite(buf->data, 1, buf->size, f) == buf->size;
+        ok = fclose(f) == 0 && ok;
+        
+        if (ok && rename(PyBytes_AS_STRING(tmp), PyBytes_AS_STRING(path)) != 0) {
+            // windows does not replace existing files
+            remove(PyBytes_AS_STRING(path));
+            ok = rename(PyBytes_AS_STRING(tmp), PyBytes_AS_STRING(path)) == 0;
+        }
+        
+        if (!ok)
+            remove(PyBytes_AS_STRING(tmp));
+    }
+    
+    Py_DECREF(tmp);
+    Py_DECREF(path);
+}
+
+/**
+ * Looks up a chunk in memory, then in the cache directory,
+ * and pushes the compiled function if it was found.
+ *
+ * Returns 1 if the function was pushed,
+ *         0 if it was not found (or could not be loaded anymore),
+ *        -1 if a python exception occured
+ */
+int pylua_chunk_load(LuaChunkCacheObject* cache, lua_State* L, PyObject* key, const char* name) {
+    PyObject* data;
+    
+    Py_BEGIN_CRITICAL_SECTION(cache->entries);
+    data = PyDict_GetItemWithError(cache->entries, key);
+    Py_XINCREF(data);
+    Py_END_CRITICAL_SECTION();
+    
+    if (!data && PyErr_Occurred())
+        return -1;
+    
+    if (data) {
+        int err = pylua_load_binary(L, PyBytes_AS_STRING(data), (size_t)PyBytes_GET_SIZE(data), name);
+        if (!err) {
+            Py_BEGIN_CRITICAL_SECTION(cache->entries);
+            cache->hits++;
+            Py_END_CRITICAL_SECTION();
+            
+            int res = pylua_chunk_insert(cache, key, data);
+            Py_DECREF(data);
+            if (res < 0) {
+                lua_pop(L, 1);
+                return -1;
+            }
+            return 1;
+        }
+        
+        // it will be replaced once compiled
+        lua_pop(L, 1);
+        Py_DECREF(data);
+    }
+    
+    if (!data && cache->directory) {
+        PyObject* path = pylua_chunk_path(cache, key);
+        if (!path)
+            return -1;
+        
+        struct Buffer buf;
+        pylua_buffer_init(&buf);
+        
+        int found = pylua_read_file(PyBytes_AS_STRING(path), &buf) == 0;
+        Py_DECREF(path);
+        
+        if (found && !pylua_load_binary(L, buf.data, buf.size, name)) {
+            data = PyBytes_FromStringAndSize(buf.data, (Py_ssize_t)buf.size);
+            pylua_buffer_free(&buf);
+            
+            if (data) {
+                Py_BEGIN_CRITICAL_SECTION(cache->entries);
+                cache->diskhits++;
+                Py_END_CRITICAL_SECTION();
+            }
+            
+            if (!data || pylua_chunk_insert(cache, key, data) < 0) {
+                Py_XDECREF(data);
+                lua_pop(L, 1);
+                return -1;
+            }
+            
+            Py_DECREF(data);
+            return 1;
+        }
+        
+        if (found)
+            lua_pop(L, 1);
+        pylua_buffer_free(&buf);
+    }
+    
+    Py_BEGIN_CRITICAL_SECTION(cache->entries);
+    cache->misses++;
+    Py_END_CRITICAL_SECTION();
+    return 0;
+}
+
+/**
+ * Stores the function on the top of the stack, freshly compiled, in the cache.
+ * Returns -1 if a python exception occured
+ */
+int pylua_chunk_store(LuaChunkCacheObject* cache, lua_State* L, PyObject* key) {
+    struct Buffer buf;
+    pylua_buffer_init(&buf);
+    
+    // keep the debug info, for the tracebacks
+    if (pylua_dump(L, &buf, 0)) {
+        pylua_buffer_free(&buf);
+        return 0;
+    }
+    
+    PyObject* data = PyBytes_FromStringAndSize(buf.data, (Py_ssize_t)buf.size);
+    if (data && cache->directory)
+        pylua_chunk_write(cache, key, &buf);
+    
+    pylua_buffer_free(&buf);
+    if (!data)
+        return -1;
+    
+    int res = pylua_chunk_insert(cache, key, data);
+    Py_DECREF(data);
+    return res;
+}
+
+
+/**
+ * Implement tp_new for our ChunkCache type
+ */
+static PyObject* LuaChunkCache_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"maxsize", "directory", NULL};
+    Py_ssize_t maxsize = PYLUA_CHUNK_MAXSIZE;
+    PyObject* directory = Py_None;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nO", keywords, &maxsize, &directory))
+        return NULL;
+    
+    if (maxsize < 0) {
+        PyErr_SetString(PyExc_ValueError, "maxsize must be positive");
+        return NULL;
+    }
+    
+    LuaChunkCacheObject* self = (LuaChunkCacheObject*)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    
+    self->maxsize = (size_t)maxsize;
+    self->size = 0;
+    self->hits = 0;
+    self->diskhits = 0;
+    self->misses = 0;
+    self->evictions = 0;
+    
+    self->entries = PyDict_New();
+    if (!self->entries) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    
+    PyObject* hashlib = PyImport_ImportModule("hashlib");
+    if (!hashlib) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    
+    self->hash = PyObject_GetAttrString(hashlib, "blake2b");
+    Py_DECREF(hashlib);
+    if (!self->hash) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    
+    if (directory != Py_None) {
+        if (!PyUnicode_FSConverter(directory, &self->directory)) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        
+        // create it now, so that writing a chunk is just a matter of writing a file
+        PyObject* os = PyImport_ImportModule("os");
+        PyObject* res = os ? PyObject_CallMethod(os, "makedirs", "OO", directory, Py_True) : NULL;
+        Py_XDECREF(os);
+        if (!res) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        Py_DECREF(res);
+    }
+    
+    return (PyObject*)self;
+}
+
+/**
+ * Implements ChunkCache.clear, which empties the in-memory cache.
+ * The cache directory is left untouched.
+ */
+static PyObject* LuaChunkCache_clear(LuaChunkCacheObject* self, PyObject* unused) {
+    Py_BEGIN_CRITICAL_SECTION(self->entries);
+    PyDict_Clear(self->entries);
+    self->size = 0;
+    Py_END_CRITICAL_SECTION();
+    
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements ChunkCache.stats, which returns a dict of counters
+ */
+static PyObject* LuaChunkCache_stats(LuaChunkCacheObject* self, PyObject* unused) {
+    PyObject* res;
+    
+    Py_BEGIN_CRITICAL_SECTION(self->entries);
+    res = Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n}",
+        "hits", self->hits,
+        "disk_hits", self->diskhits,
+        "misses", self->misses,
+        "evictions", self->evictions,
+        "entries", PyDict_GET_SIZE(self->entries),
+        "size", (Py_ssize_t)self->size,
+        "maxsize", (Py_ssize_t)self->maxsize);
+    Py_END_CRITICAL_SECTION();
+    
+    return res;
+}
+
+/**
+ * Implements `len` for a ChunkCache
+ */
+static Py_ssize_t LuaChunkCache_length(LuaChunkCacheObject* self) {
+    return PyDict_GET_SIZE(self->entries);
+}
+
+/**
+ * Getter for ChunkCache.maxsize
+ */
+static PyObject* LuaChunkCache_get_maxsize(LuaChunkCacheObject* self, void* unused) {
+    return PyLong_FromSize_t(self->maxsize);
+}
+
+/**
+ * Getter for ChunkCache.directory
+ */
+static PyObject* LuaChunkCache_get_directory(LuaChunkCacheObject* self, void* unused) {
+    if (!self->directory)
+        Py_RETURN_NONE;
+    
+    return PyUnicode_DecodeFSDefaultAndSize(PyBytes_AS_STRING(self->directory), PyBytes_GET_SIZE(self->directory));
+}
+
+/**
+ * Implement tp_traverse for ChunkCache ;
+ * it only holds its own bytes and the hash constructor, so it can't
+ * take part in a cycle and has no tp_clear, but the type is visited
+ */
+static int LuaChunkCache_traverse(LuaChunkCacheObject* self, visitproc visit, void* arg) {
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->entries);
+    Py_VISIT(self->hash);
+    return 0;
+}
+
+/**
+ * Handle deallocation of ChunkCache
+ */
+static void LuaChunkCache_dealloc(LuaChunkCacheObject* self) {
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->entries);
+    Py_XDECREF(self->directory);
+    Py_XDECREF(self->hash);
+    
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+
+static PyMethodDef LuaChunkCache_methods[] = {
+    {"clear", (PyCFunction)LuaChunkCache_clear, METH_NOARGS, "remove every chunk from memory"},
+    {"stats", (PyCFunction)LuaChunkCache_stats, METH_NOARGS, "return the cache counters"},
+    {NULL}
+};
+
+static PyGetSetDef LuaChunkCache_getset[] = {
+    {"maxsize", (getter)LuaChunkCache_get_maxsize, NULL, "size limit of the in-memory cache", NULL},
+    {"directory", (getter)LuaChunkCache_get_directory, NULL, "cache directory, if any", NULL},
+    {NULL}
+};
+
+static PyType_Slot LuaChunkCacheSlots[] = {
+    {Py_tp_doc, "Cache of compiled lua chunks, which can be given to LuaState"},
+    {Py_tp_new, LuaChunkCache_new},
+    {Py_tp_dealloc, LuaChunkCache_dealloc},
+    {Py_tp_traverse, LuaChunkCache_traverse},
+    {Py_tp_methods, LuaChunkCache_methods},
+    {Py_tp_getset, LuaChunkCache_getset},
+    {Py_mp_length, LuaChunkCache_length},
+    {0, NULL}
+};
+
+PyType_Spec LuaChunkCacheTypeSpec = {
+    .name = "pylua.ChunkCache",
+    .basicsize = sizeof(LuaChunkCacheObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .slots = LuaChunkCacheSlots
+};
\ No newline at end of file
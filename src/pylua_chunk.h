@@ -0,0 +1,42 @@
+#ifndef PYLUA_CHUNK_H
+#define PYLUA_CHUNK_H
+
+#include "pylua.h"
+#include "pylua_buffer.h"
+
+typedef struct {
+    PyObject_HEAD
+    
+    // Compiled chunks (bytes) by key, least recently used first
+    PyObject* entries;
+    size_t size;
+    size_t maxsize;
+    
+    // Cache directory (encoded with the filesystem encoding), or NULL
+    PyObject* directory;
+    
+    // hashlib.blake2b, used for the keys
+    PyObject* hash;
+    
+    // Stats
+    Py_ssize_t hits;
+    Py_ssize_t diskhits;
+    Py_ssize_t misses;
+    Py_ssize_t evictions;
+    
+} LuaChunkCacheObject;
+
+extern PyType_Spec LuaChunkCacheTypeSpec;
+
+int pylua_dump(lua_State* L, struct Buffer* buf, int strip);
+int pylua_read_file(const char* filename, struct Buffer* buf);
+const char* pylua_check_bytecode(const char* data, size_t size);
+int pylua_load_binary(lua_State* L, const char* data, size_t size, const char* name);
+size_t pylua_skip_header(const char* data, size_t size);
+
+int pylua_chunk_cacheable(const char* source, size_t len, const char* mode);
+PyObject* pylua_chunk_key(LuaChunkCacheObject* cache, const char* source, size_t len, const char* name);
+int pylua_chunk_load(LuaChunkCacheObject* cache, lua_State* L, PyObject* key, const char* name);
+int pylua_chunk_store(LuaChunkCacheObject* cache, lua_State* L, PyObject* key);
+
+#endif
\ No newline at end of file
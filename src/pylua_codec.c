@@ -0,0 +1,615 @@
+#include "pylua_codec.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+    Native encoding of lua values, compatible with msgpack:
+    nil, booleans, numbers and strings are encoded as themselves,
+    sequences as arrays, and other tables as maps.
+    
+    Optionally, tables seen before are encoded as a reference:
+    an ext value (fixext 4, type PYLUA_CODEC_REF) holding the index of the table,
+    in order of appearance. This keeps shared tables and cycles.
+    
+    None of this needs the GIL, nor creates any python object.
+*/
+
+// Tables nested deeper than this are refused (they are likely cyclic)
+#define PYLUA_CODEC_DEPTH 128
+
+// msgpack ext type of references
+#define PYLUA_CODEC_REF 1
+
+#define PYLUA_ENOMEM "not enough memory"
+
+// Metatable of the buffers owned by lua, freed if an error occurs
+#define PYLUA_BUFFER_META "pylua.Buffer"
+
+// State of the encoder
+struct Writer {
+    struct Buffer* buf;
+    
+    // Table -> index, if references are enabled (else 0), and the number of tables so far
+    int seen;
+    lua_Integer ntables;
+};
+
+
+/**
+ * Appends a tag followed by a big-endian value of `size` bytes
+ */
+static int pylua_put_tagged(struct Buffer* buf, unsigned char tag, uint64_t value, int size) {
+    unsigned char bytes[9];
+    bytes[0] = tag;
+    for (int i = 0; i < size; i++)
+        bytes[size - i] = (unsigned char)(value >> (8 * i));
+    
+    return pylua_buffer_write(buf, bytes, size + 1);
+}
+
+/**
+ * Appends an integer, with the shortest encoding
+ */
+static int pylua_encode_integer(struct Buffer* buf, int64_t value) {
+    if (value >= 0) {
+        if (value <= 0x7f)
+            return pylua_buffer_putc(buf, (unsigned char)value);
+        if (value <= UINT8_MAX)
+            return pylua_put_tagged(buf, 0xcc, (uint64_t)value, 1);
+        if (value <= UINT16_MAX)
+            return pylua_put_tagged(buf, 0xcd, (uint64_t)value, 2);
+        if (value <= UINT32_MAX)
+            return pylua_put_tagged(buf, 0xce, (uint64_t)value, 4);
+        return pylua_put_tagged(buf, 0xcf, (uint64_t)value, 8);
+    }
+    
+    if (value >= -32)
+        return pylua_buffer_putc(buf, (unsigned char)(int8_t)value);
+    if (value >= INT8_MIN)
+        return pylua_put_tagged(buf, 0xd0, (uint64_t)value, 1);
+    if (value >= INT16_MIN)
+        return pylua_put_tagged(buf, 0xd1, (uint64_t)value, 2);
+    if (value >= INT32_MIN)
+        return pylua_put_tagged(buf, 0xd2, (uint64_t)value, 4);
+    return pylua_put_tagged(buf, 0xd3, (uint64_t)value, 8);
+}
+
+/**
+ * Appends a float64
+ */
+static int pylua_encode_double(struct Buffer* buf, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof bits);
+    return pylua_put_tagged(buf, 0xcb, bits, 8);
+}
+
+/**
+ * Appends the header of a string, an array or a map of `count` elements
+ */
+static int pylua_encode_header(struct Buffer* buf, unsigned char fix, size_t fixmax, unsigned char tag8, unsigned char tag16, size_t count) {
+    if (count <= fixmax)
+        return pylua_buffer_putc(buf, (unsigned char)(fix | count));
+    if (tag8 && count <= UINT8_MAX)
+        return pylua_put_tagged(buf, tag8, count, 1);
+    if (count <= UINT16_MAX)
+        return pylua_put_tagged(buf, tag16, count, 2);
+    if (count <= UINT32_MAX)
+        return pylua_put_tagged(buf, tag16 + 1, count, 4);
+    return -1;
+}
+
+static const char* pylua_encode_value(lua_State* L, int idx, struct Writer* w, int depth);
+
+/**
+ * Appends a table, as an array if it is a sequence, as a map otherwise
+ */
+static const char* pylua_encode_table(lua_State* L, int idx, struct Writer* w, int depth) {
+    struct Buffer* buf = w->buf;
+    
+    if (depth > PYLUA_CODEC_DEPTH)
+        return w->seen ? "table is nested too deeply" : "table is nested too deeply (or is cyclic)";
+    
+    if (!lua_checkstack(L, 3))
+        return "stack overflow";
+    
+    int top = lua_gettop(L);
+    
+    if (w->seen) {
+        lua_pushvalue(L, idx);
+        lua_rawget(L, w->seen);
+        
+        // seen before, only its index is needed
+        if (!lua_isnil(L, -1)) {
+            uint64_t index = (uint64_t)lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            
+            if (pylua_buffer_putc(buf, 0xd6) < 0 || pylua_put_tagged(buf, PYLUA_CODEC_REF, index, 4) < 0)
+                return PYLUA_ENOMEM;
+            return NULL;
+        }
+        lua_pop(L, 1);
+        
+        if (w->ntables > UINT32_MAX)
+            return "too many tables";
+        
+        // this may raise a memory error
+        lua_pushvalue(L, idx);
+        lua_pushinteger(L, w->ntables++);
+        lua_rawset(L, w->seen);
+    }
+    
+    // count the pairs, and check if they form a sequence
+#if LUA_VERSION_NUM >= 502
+    size_t len = lua_rawlen(L, idx);
+#else
+    size_t len = lua_objlen(L, idx);
+#endif
+    size_t count = 0;
+    
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        count++;
+        lua_pop(L, 1);
+    }
+    
+    int sequence = count == len && len <= INT_MAX;
+    for (size_t i = 1; sequence && i <= len; i++) {
+        lua_rawgeti(L, idx, (int)i);
+        sequence = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+    }
+    
+    const char* err = NULL;
+    if (sequence) {
+        if (pylua_encode_header(buf, 0x90, 15, 0, 0xdc, len) < 0)
+            return "table is too large";
+        
+        for (size_t i = 1; !err && i <= len; i++) {
+            lua_rawgeti(L, idx, (int)i);
+            err = pylua_encode_value(L, -1, w, depth + 1);
+            lua_pop(L, 1);
+        }
+        
+    } else {
+        if (pylua_encode_header(buf, 0x80, 15, 0, 0xde, count) < 0)
+            return "table is too large";
+        
+        lua_pushnil(L);
+        while (!err && lua_next(L, idx)) {
+            err = pylua_encode_value(L, -2, w, depth + 1);
+            if (!err)
+                err = pylua_encode_value(L, -1, w, depth + 1);
+            lua_pop(L, 1);
+        }
+    }
+    
+    lua_settop(L, top);
+    return err;
+}
+
+/**
+ * Appends the value at index `idx`
+ */
+static const char* pylua_encode_value(lua_State* L, int idx, struct Writer* w, int depth) {
+    struct Buffer* buf = w->buf;
+    
+    // absolute index, as we push values while encoding tables
+    if (idx < 0)
+        idx = lua_gettop(L) + idx + 1;
+    
+    int err = 0;
+    switch (lua_type(L, idx)) {
+        case LUA_TNIL:
+            err = pylua_buffer_putc(buf, 0xc0);
+            break;
+        
+        case LUA_TBOOLEAN:
+            err = pylua_buffer_putc(buf, lua_toboolean(L, idx) ? 0xc3 : 0xc2);
+            break;
+        
+        case LUA_TNUMBER: ;
+#if LUA_VERSION_NUM >= 503
+            if (lua_isinteger(L, idx)) {
+                err = pylua_encode_integer(buf, (int64_t)lua_tointeger(L, idx));
+                break;
+            }
+#endif
+            double value = (double)lua_tonumber(L, idx);
+#if LUA_VERSION_NUM < 503
+            // there are no integers, but integral values are more compact this way
+            if (value == floor(value) && value >= -9223372036854775808.0 && value < 9223372036854775808.0) {
+                err = pylua_encode_integer(buf, (int64_t)value);
+                break;
+            }
+#endif
+            err = pylua_encode_double(buf, value);
+            break;
+        
+        case LUA_TSTRING: ;
+            size_t len;
+            const char* str = lua_tolstring(L, idx, &len);
+            err = pylua_encode_header(buf, 0xa0, 31, 0xd9, 0xda, len);
+            if (!err)
+                err = pylua_buffer_write(buf, str, len);
+            break;
+        
+        case LUA_TTABLE:
+            return pylua_encode_table(L, idx, w, depth);
+        
+        default:
+            return "cannot encode this type of value";
+    }
+    
+    return err ? PYLUA_ENOMEM : NULL;
+}
+
+/**
+ * Encodes the value at index `idx` (and everything it contains) to `buf`
+ * Returns NULL if successful, or an error message
+ *
+ * With `refs`, shared tables and cycles are encoded as references ;
+ * this may raise memory errors, so it must be called from protected code.
+ */
+const char* pylua_encode(lua_State* L, int idx, struct Buffer* buf, int refs) {
+    struct Writer w = {buf, 0, 0};
+    
+    if (idx < 0)
+        idx = lua_gettop(L) + idx + 1;
+    
+    if (!refs)
+        return pylua_encode_value(L, idx, &w, 0);
+    
+    if (!lua_checkstack(L, 1))
+        return "stack overflow";
+    
+    lua_newtable(L);
+    w.seen = lua_gettop(L);
+    
+    const char* err = pylua_encode_value(L, idx, &w, 0);
+    lua_pop(L, 1);
+    return err;
+}
+
+
+// Position in the data being decoded
+struct Reader {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+    
+    // Index -> table, for references
+    int tables;
+    lua_Integer ntables;
+};
+
+/**
+ * Reads a big-endian value of `size` bytes
+ * Returns -1 if there is not enough data
+ */
+static int pylua_read_be(struct Reader* r, int size, uint64_t* value) {
+    if (r->size - r->pos < (size_t)size)
+        return -1;
+    
+    *value = 0;
+    for (int i = 0; i < size; i++)
+        *value = (*value << 8) | r->data[r->pos++];
+    return 0;
+}
+
+/**
+ * Pushes a 64 bits integer, as a float if lua does not have integers
+ */
+static void pylua_push_int64(lua_State* L, int64_t value) {
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, (lua_Integer)value);
+#else
+    lua_pushnumber(L, (lua_Number)value);
+#endif
+}
+
+static const char* pylua_decode_value(lua_State* L, struct Reader* r, int depth);
+
+/**
+ * Pushes a table from an array (or a map) of `count` elements
+ */
+static const char* pylua_decode_table(lua_State* L, struct Reader* r, int depth, size_t count, int map) {
+    if (depth > PYLUA_CODEC_DEPTH)
+        return "data is nested too deeply";
+    
+    if (!lua_checkstack(L, 3))
+        return "stack overflow";
+    
+    // every element takes at least a byte, don't trust the count
+    if (count > (r->size - r->pos) / (map ? 2 : 1))
+        return "truncated data";
+    
+    int hint = count > INT_MAX ? INT_MAX : (int)count;
+    lua_createtable(L, map ? 0 : hint, map ? hint : 0);
+    
+    // before its content, which may refer to it
+    if (r->ntables < INT_MAX) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, r->tables, (int)r->ntables++);
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        const char* err = pylua_decode_value(L, r, depth + 1);
+        if (err)
+            return err;
+        
+        if (!map) {
+            lua_rawseti(L, -2, (int)(i + 1));
+            continue;
+        }
+        
+        err = pylua_decode_value(L, r, depth + 1);
+        if (err)
+            return err;
+        
+        if (lua_isnil(L, -2) || (lua_type(L, -2) == LUA_TNUMBER && lua_tonumber(L, -2) != lua_tonumber(L, -2)))
+            return "invalid table key";
+        
+        lua_rawset(L, -3);
+    }
+    
+    return NULL;
+}
+
+/**
+ * Pushes a string of `size` bytes
+ */
+static const char* pylua_decode_string(lua_State* L, struct Reader* r, size_t size) {
+    if (r->size - r->pos < size)
+        return "truncated data";
+    
+    lua_pushlstring(L, (const char*)r->data + r->pos, size);
+    r->pos += size;
+    return NULL;
+}
+
+/**
+ * Pushes the next value
+ */
+static const char* pylua_decode_value(lua_State* L, struct Reader* r, int depth) {
+    if (r->pos >= r->size)
+        return "truncated data";
+    
+    unsigned char tag = r->data[r->pos++];
+    uint64_t value;
+    
+    // fixed size types
+    if (tag <= 0x7f) {
+        lua_pushinteger(L, tag);
+        return NULL;
+    }
+    if (tag >= 0xe0) {
+        lua_pushinteger(L, (int8_t)tag);
+        return NULL;
+    }
+    if (tag <= 0x8f)
+        return pylua_decode_table(L, r, depth, tag & 0x0f, 1);
+    if (tag <= 0x9f)
+        return pylua_decode_table(L, r, depth, tag & 0x0f, 0);
+    if (tag <= 0xbf)
+        return pylua_decode_string(L, r, tag & 0x1f);
+    
+    switch (tag) {
+        case 0xc0:
+            lua_pushnil(L);
+            return NULL;
+        
+        case 0xc2:
+        case 0xc3:
+            lua_pushboolean(L, tag == 0xc3);
+            return NULL;
+        
+        // bin 8, 16, 32 and str 8, 16, 32
+        case 0xc4:
+        case 0xc5:
+        case 0xc6:
+        case 0xd9:
+        case 0xda:
+        case 0xdb: ;
+            int size = tag <= 0xc6 ? 1 << (tag - 0xc4) : 1 << (tag - 0xd9);
+            if (pylua_read_be(r, size, &value) < 0)
+                return "truncated data";
+            return pylua_decode_string(L, r, (size_t)value);
+        
+        // float 32
+        case 0xca: ;
+            if (pylua_read_be(r, 4, &value) < 0)
+                return "truncated data";
+            
+            uint32_t bits32 = (uint32_t)value;
+            float f;
+            memcpy(&f, &bits32, sizeof f);
+            lua_pushnumber(L, (lua_Number)f);
+            return NULL;
+        
+        // float 64
+        case 0xcb: ;
+            if (pylua_read_be(r, 8, &value) < 0)
+                return "truncated data";
+            
+            double d;
+            memcpy(&d, &value, sizeof d);
+            lua_pushnumber(L, (lua_Number)d);
+            return NULL;
+        
+        // uint 8, 16, 32, 64
+        case 0xcc:
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+            if (pylua_read_be(r, 1 << (tag - 0xcc), &value) < 0)
+                return "truncated data";
+            
+            if (value > INT64_MAX)
+                lua_pushnumber(L, (lua_Number)value);
+            else
+                pylua_push_int64(L, (int64_t)value);
+            return NULL;
+        
+        // int 8, 16, 32, 64
+        case 0xd0:
+        case 0xd1:
+        case 0xd2:
+        case 0xd3: ;
+            int bytes = 1 << (tag - 0xd0);
+            if (pylua_read_be(r, bytes, &value) < 0)
+                return "truncated data";
+            
+            // sign extend
+            if (bytes < 8 && (value >> (bytes * 8 - 1)) & 1)
+                value |= UINT64_MAX << (bytes * 8);
+            
+            pylua_push_int64(L, (int64_t)value);
+            return NULL;
+        
+        // fixext 4, for references
+        case 0xd6:
+            if (r->size - r->pos < 5)
+                return "truncated data";
+            if (r->data[r->pos++] != PYLUA_CODEC_REF)
+                return "unsupported msgpack ext type";
+            
+            pylua_read_be(r, 4, &value);
+            if (value >= (uint64_t)r->ntables)
+                return "invalid reference";
+            
+            lua_rawgeti(L, r->tables, (int)value);
+            return NULL;
+        
+        // array 16, 32 and map 16, 32
+        case 0xdc:
+        case 0xdd:
+        case 0xde:
+        case 0xdf:
+            if (pylua_read_be(r, (tag & 1) ? 4 : 2, &value) < 0)
+                return "truncated data";
+            return pylua_decode_table(L, r, depth, (size_t)value, tag >= 0xde);
+        
+        default:
+            return "unsupported msgpack type";
+    }
+}
+
+/**
+ * Decodes the value at `*pos`, pushes it, and moves `pos` after it.
+ * Returns NULL if successful, or an error message (and the stack is untouched)
+ *
+ * This may raise memory errors, so it must be called from protected code.
+ */
+const char* pylua_decode(lua_State* L, const char* data, size_t size, size_t* pos) {
+    struct Reader r = {(const unsigned char*)data, size, *pos, 0, 0};
+    
+    int top = lua_gettop(L);
+    if (!lua_checkstack(L, 2))
+        return "stack overflow";
+    
+    // references can be anywhere, so every table is kept
+    lua_newtable(L);
+    r.tables = lua_gettop(L);
+    
+    const char* err = pylua_decode_value(L, &r, 0);
+    if (err) {
+        lua_settop(L, top);
+        return err;
+    }
+    
+    lua_remove(L, r.tables);
+    *pos = r.pos;
+    return NULL;
+}
+
+
+/**
+ * __gc of the buffers owned by lua
+ */
+static int pylua_codec_buffer_gc(lua_State* L) {
+    pylua_buffer_free((struct Buffer*)lua_touserdata(L, 1));
+    return 0;
+}
+
+/**
+ * Pushes an empty buffer owned by lua, so that it is freed
+ * even if an error occurs before we are done with it
+ */
+static struct Buffer* pylua_codec_push_buffer(lua_State* L) {
+    struct Buffer* buf = (struct Buffer*)lua_newuserdata(L, sizeof *buf);
+    pylua_buffer_init(buf);
+    
+    if (luaL_newmetatable(L, PYLUA_BUFFER_META)) {
+        lua_pushcfunction(L, &pylua_codec_buffer_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    return buf;
+}
+
+/**
+ * pylua.pack(value [, refs]) -> string
+ * With refs, shared tables and cycles are kept.
+ */
+int pylua_lua_pack(lua_State* L) {
+    luaL_checkany(L, 1);
+    int refs = lua_toboolean(L, 2);
+    
+    struct Buffer* buf = pylua_codec_push_buffer(L);
+    const char* err = pylua_encode(L, 1, buf, refs);
+    if (err)
+        return luaL_error(L, "cannot pack value: %s", err);
+    
+    lua_pushlstring(L, buf->data, buf->size);
+    pylua_buffer_free(buf);
+    return 1;
+}
+
+/**
+ * pylua.unpack(string [, pos]) -> value, next pos
+ */
+int pylua_lua_unpack(lua_State* L) {
+    size_t size;
+    const char* data = luaL_checklstring(L, 1, &size);
+    lua_Integer init = luaL_optinteger(L, 2, 1);
+    luaL_argcheck(L, init >= 1 && (size_t)init <= size + 1, 2, "out of range");
+    
+    size_t pos = (size_t)init - 1;
+    const char* err = pylua_decode(L, data, size, &pos);
+    if (err)
+        return luaL_error(L, "cannot unpack value: %s", err);
+    
+    lua_pushinteger(L, (lua_Integer)(pos + 1));
+    return 2;
+}
+
+/**
+ * Same as pylua.pack, to a struct Buffer given as a light userdata (argument 3),
+ * owned by the caller
+ */
+int pylua_pack_buffer(lua_State* L) {
+    struct Buffer* buf = (struct Buffer*)lua_touserdata(L, 3);
+    const char* err = pylua_encode(L, 1, buf, lua_toboolean(L, 2));
+    if (err)
+        return luaL_error(L, "cannot pack value: %s", err);
+    return 0;
+}
+
+/**
+ * Same as pylua.unpack, from memory given as a light userdata and a size,
+ * which must be decoded entirely
+ */
+int pylua_unpack_buffer(lua_State* L) {
+    const char* data = (const char*)lua_touserdata(L, 1);
+    size_t size = (size_t)lua_tointeger(L, 2);
+    
+    size_t pos = 0;
+    const char* err = pylua_decode(L, data, size, &pos);
+    if (err)
+        return luaL_error(L, "cannot unpack value: %s", err);
+    if (pos != size)
+        return luaL_error(L, "cannot unpack value: trailing data");
+    return 1;
+}
\ No newline at end of file
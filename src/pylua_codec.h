@@ -0,0 +1,15 @@
+#ifndef PYLUA_CODEC_H
+#define PYLUA_CODEC_H
+
+#include "pylua.h"
+#include "pylua_buffer.h"
+
+const char* pylua_encode(lua_State* L, int idx, struct Buffer* buf, int refs);
+const char* pylua_decode(lua_State* L, const char* data, size_t size, size_t* pos);
+
+int pylua_lua_pack(lua_State* L);
+int pylua_lua_unpack(lua_State* L);
+int pylua_pack_buffer(lua_State* L);
+int pylua_unpack_buffer(lua_State* L);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,41 @@
+#include "pylua_collect.h"
+
+/**
+ * Runs the struct GcCall given as a light userdata, as a lua_CFunction:
+ * finalizers may raise errors (before Lua 5.4)
+ */
+int pylua_collect_call(lua_State* L) {
+    struct GcCall* call = (struct GcCall*)lua_touserdata(L, 1);
+    
+#if LUA_VERSION_NUM >= 504
+    call->res = lua_gc(L, call->what, call->args[0], call->args[1], call->args[2]);
+#else
+    call->res = lua_gc(L, call->what, call->args[0]);
+#endif
+    return 0;
+}
+
+/**
+ * Runs a struct GcCall from C, leaving the error message on the stack if it fails
+ */
+int pylua_collect_protected(lua_State* L, struct GcCall* call) {
+    lua_pushcfunction(L, &pylua_collect_call);
+    lua_pushlightuserdata(L, call);
+    return lua_pcall(L, 1, 0, 0);
+}
+
+/**
+ * Runs the full collection asked by the soft memory limit, if any:
+ * before a call from python, and from the builtin count hook.
+ * `L` must be able to run code ; errors of finalizers are dropped.
+ */
+void pylua_collect_pending(lua_State* L, LuaStateObject* self) {
+    if (!self->gcpending)
+        return;
+    
+    self->gcpending = 0;
+    
+    struct GcCall call = {LUA_GCCOLLECT, {0, 0, 0}, 0};
+    if (pylua_collect_protected(L, &call))
+        lua_pop(L, 1);
+}
\ No newline at end of file
@@ -0,0 +1,18 @@
+#ifndef PYLUA_COLLECT_H
+#define PYLUA_COLLECT_H
+
+#include "pylua.h"
+#include "pylua_state.h"
+
+// A lua_gc call, run protected by pylua_collect_call
+struct GcCall {
+    int what;
+    int args[3];
+    int res;
+};
+
+int pylua_collect_call(lua_State* L);
+int pylua_collect_protected(lua_State* L, struct GcCall* call);
+void pylua_collect_pending(lua_State* L, LuaStateObject* self);
+
+#endif
\ No newline at end of file
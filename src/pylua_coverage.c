@@ -0,0 +1,353 @@
+#include "pylua_coverage.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Allocates a coverage collector, also collecting the lines of
+ * the functions called if `functions` is set. Returns NULL if out of memory.
+ */
+struct Coverage* pylua_coverage_new(int functions) {
+    struct Coverage* cov = calloc(1, sizeof *cov);
+    if (!cov)
+        return NULL;
+    
+    cov->running = 1;
+    cov->functions = functions;
+    return cov;
+}
+
+/**
+ * Frees a coverage collector
+ */
+void pylua_coverage_free(struct Coverage* cov) {
+    if (!cov)
+        return;
+    
+    for (uint32_t i = 0; i < cov->nchunks; i++) {
+        free(cov->chunks[i].name);
+        free(cov->chunks[i].hit);
+        free(cov->chunks[i].lines);
+        free(cov->chunks[i].functions);
+    }
+    
+    free(cov->chunks);
+    free(cov->index);
+    free(cov);
+}
+
+/**
+ * Hash of the name of a chunk (FNV-1a), up to PYLUA_COVERAGE_NAME bytes
+ */
+static uint32_t pylua_coverage_hash(const char* source) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < PYLUA_COVERAGE_NAME && source[i]; i++) {
+        hash = (hash ^ (unsigned char)source[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Grows the index of the chunks to `size` slots, a power of two
+ */
+static int pylua_coverage_reindex(struct Coverage* cov, uint32_t size) {
+    uint32_t* index = calloc(size, sizeof *index);
+    if (!index)
+        return -1;
+    
+    for (uint32_t i = 0; i < cov->nchunks; i++) {
+        uint32_t j = cov->chunks[i].hash & (size - 1);
+        while (index[j])
+            j = (j + 1) & (size - 1);
+        index[j] = i + 1;
+    }
+    
+    free(cov->index);
+    cov->index = index;
+    cov->indexcap = size;
+    return 0;
+}
+
+/**
+ * Returns the chunk of a source, adding it if it is new,
+ * or NULL if out of memory
+ */
+static struct CoverageChunk* pylua_coverage_chunk(struct Coverage* cov, const char* source) {
+    uint32_t hash = pylua_coverage_hash(source);
+    
+    if (cov->indexcap) {
+        uint32_t j = hash & (cov->indexcap - 1);
+        while (cov->index[j]) {
+            struct CoverageChunk* chunk = &cov->chunks[cov->index[j] - 1];
+            if (chunk->hash == hash && strncmp(chunk->name, source, PYLUA_COVERAGE_NAME) == 0)
+                return chunk;
+            j = (j + 1) & (cov->indexcap - 1);
+        }
+    }
+    
+    // kept at most half full
+    if ((cov->nchunks + 1) * 2 > cov->indexcap) {
+        if (pylua_coverage_reindex(cov, cov->indexcap ? cov->indexcap * 2 : 32) < 0)
+            return NULL;
+    }
+    
+    if (cov->nchunks == cov->chunkcap) {
+        uint32_t cap = cov->chunkcap ? cov->chunkcap * 2 : 16;
+        struct CoverageChunk* chunks = realloc(cov->chunks, cap * sizeof *chunks);
+        if (!chunks)
+            return NULL;
+        cov->chunks = chunks;
+        cov->chunkcap = cap;
+    }
+    
+    size_t len = strlen(source);
+    if (len > PYLUA_COVERAGE_NAME)
+        len = PYLUA_COVERAGE_NAME;
+    
+    char* name = malloc(len + 1);
+    if (!name)
+        return NULL;
+    memcpy(name, source, len);
+    name[len] = '\0';
+    
+    struct CoverageChunk* chunk = &cov->chunks[cov->nchunks];
+    memset(chunk, 0, sizeof *chunk);
+    chunk->hash = hash;
+    chunk->name = name;
+    
+    uint32_t j = hash & (cov->indexcap - 1);
+    while (cov->index[j])
+        j = (j + 1) & (cov->indexcap - 1);
+    cov->index[j] = ++cov->nchunks;
+    return chunk;
+}
+
+/**
+ * Makes room in the bitmaps of a chunk for a line
+ */
+static int pylua_coverage_grow(struct CoverageChunk* chunk, int line) {
+    if (line < chunk->size)
+        return 0;
+    
+    int size = chunk->size ? chunk->size : 256;
+    while (size <= line)
+        size = size > INT_MAX / 2 ? INT_MAX : size * 2;
+    
+    size_t old = ((size_t)chunk->size + 7) / 8;
+    size_t bytes = ((size_t)size + 7) / 8;
+    
+    unsigned char* hit = realloc(chunk->hit, bytes);
+    if (!hit)
+        return -1;
+    chunk->hit = hit;
+    
+    unsigned char* lines = realloc(chunk->lines, bytes);
+    if (!lines)
+        return -1;
+    chunk->lines = lines;
+    
+    memset(hit + old, 0, bytes - old);
+    memset(lines + old, 0, bytes - old);
+    chunk->size = size;
+    return 0;
+}
+
+/**
+ * Called by the builtin hook on new lines
+ */
+void pylua_coverage_line(struct Coverage* cov, lua_State* L, lua_Debug* ar) {
+    int line = ar->currentline;
+    if (line < 0 || !lua_getinfo(L, "S", ar))
+        return;
+    
+    struct CoverageChunk* chunk = pylua_coverage_chunk(cov, ar->source);
+    if (!chunk || pylua_coverage_grow(chunk, line) < 0) {
+        cov->lost++;
+        return;
+    }
+    
+    chunk->hit[line >> 3] |= (unsigned char)(1 << (line & 7));
+}
+
+/**
+ * Adds a function to the ones whose lines are known, by its line defined.
+ * Returns 1 if it was known, 0 if it was added, -1 if out of memory.
+ */
+static int pylua_coverage_function(struct CoverageChunk* chunk, int linedefined) {
+    int key = linedefined + 1;
+    
+    if (chunk->funccap) {
+        int j = (int)(((unsigned int)key * 2654435761u) & (unsigned int)(chunk->funccap - 1));
+        while (chunk->functions[j]) {
+            if (chunk->functions[j] == key)
+                return 1;
+            j = (j + 1) & (chunk->funccap - 1);
+        }
+    }
+    
+    // kept at most half full
+    if ((chunk->nfunctions + 1) * 2 > chunk->funccap) {
+        int cap = chunk->funccap ? chunk->funccap * 2 : 16;
+        int* functions = calloc((size_t)cap, sizeof *functions);
+        if (!functions)
+            return -1;
+        
+        for (int i = 0; i < chunk->funccap; i++) {
+            if (!chunk->functions[i])
+                continue;
+            int j = (int)(((unsigned int)chunk->functions[i] * 2654435761u) & (unsigned int)(cap - 1));
+            while (functions[j])
+                j = (j + 1) & (cap - 1);
+            functions[j] = chunk->functions[i];
+        }
+        
+        free(chunk->functions);
+        chunk->functions = functions;
+        chunk->funccap = cap;
+    }
+    
+    int j = (int)(((unsigned int)key * 2654435761u) & (unsigned int)(chunk->funccap - 1));
+    while (chunk->functions[j])
+        j = (j + 1) & (chunk->funccap - 1);
+    chunk->functions[j] = key;
+    chunk->nfunctions++;
+    return 0;
+}
+
+/**
+ * Called by the builtin hook on calls, to add the lines
+ * of the lua functions called for the first time
+ */
+void pylua_coverage_call(struct Coverage* cov, lua_State* L, lua_Debug* ar) {
+#if LUA_VERSION_NUM >= 502
+    if (ar->event != LUA_HOOKCALL && ar->event != LUA_HOOKTAILCALL)
+        return;
+#else
+    if (ar->event != LUA_HOOKCALL)
+        return;
+#endif
+    
+    if (!lua_getinfo(L, "S", ar) || ar->what[0] == 'C')
+        return;
+    
+    struct CoverageChunk* chunk = pylua_coverage_chunk(cov, ar->source);
+    int known = chunk ? pylua_coverage_function(chunk, ar->linedefined) : -1;
+    if (known)  {
+        if (known < 0)
+            cov->lost++;
+        return;
+    }
+    
+    // a table with its lines as keys
+    lua_getinfo(L, "L", ar);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        int line = (int)lua_tointeger(L, -1);
+        if (line < 0)
+            continue;
+        
+        if (pylua_coverage_grow(chunk, line) < 0) {
+            cov->lost++;
+            continue;
+        }
+        chunk->lines[line >> 3] |= (unsigned char)(1 << (line & 7));
+    }
+    lua_pop(L, 1);
+}
+
+/**
+ * Name of a chunk, as given to python: its file, or its name
+ */
+static const char* pylua_coverage_name(struct CoverageChunk* chunk) {
+    return chunk->name[0] == '@' || chunk->name[0] == '=' ? chunk->name + 1 : chunk->name;
+}
+
+/**
+ * Returns the lines run, as a dict of sets by chunk
+ */
+PyObject* pylua_coverage_lines(struct Coverage* cov) {
+    PyObject* res = PyDict_New();
+    if (!res)
+        return NULL;
+    
+    for (uint32_t i = 0; i < cov->nchunks; i++) {
+        struct CoverageChunk* chunk = &cov->chunks[i];
+        PyObject* lines = PySet_New(NULL);
+        if (!lines)
+            goto error;
+        
+        for (int line = 0; line < chunk->size; line++) {
+            if (!(chunk->hit[line >> 3] & (1 << (line & 7))))
+                continue;
+            
+            PyObject* num = PyLong_FromLong(line);
+            if (!num || PySet_Add(lines, num) < 0) {
+                Py_XDECREF(num);
+                Py_DECREF(lines);
+                goto error;
+            }
+            Py_DECREF(num);
+        }
+        
+        int err = PyDict_SetItemString(res, pylua_coverage_name(chunk), lines);
+        Py_DECREF(lines);
+        if (err < 0)
+            goto error;
+    }
+    return res;
+    
+error:
+    Py_DECREF(res);
+    return NULL;
+}
+
+/**
+ * Writes the coverage as an lcov tracefile, one record per chunk.
+ * Lines known but not run are only there for the functions called
+ * (see pylua_coverage_call). Returns -1 if out of memory.
+ */
+int pylua_coverage_lcov(struct Coverage* cov, const char* test, struct Buffer* out) {
+    char line[64];
+    int len;
+    
+    for (uint32_t i = 0; i < cov->nchunks; i++) {
+        struct CoverageChunk* chunk = &cov->chunks[i];
+        const char* name = pylua_coverage_name(chunk);
+        
+        if (pylua_buffer_write(out, "TN:", 3) < 0
+                || pylua_buffer_write(out, test, strlen(test)) < 0
+                || pylua_buffer_write(out, "\nSF:", 4) < 0
+                || pylua_buffer_write(out, name, strlen(name)) < 0
+                || pylua_buffer_putc(out, '\n') < 0)
+            return -1;
+        
+        int found = 0;
+        int hits = 0;
+        for (int l = 0; l < chunk->size; l++) {
+            int bit = 1 << (l & 7);
+            int hit = (chunk->hit[l >> 3] & bit) != 0;
+            if (!hit && !(chunk->lines[l >> 3] & bit))
+                continue;
+            
+            found++;
+            hits += hit;
+            len = snprintf(line, sizeof line, "DA:%d,%d\n", l, hit);
+            if (pylua_buffer_write(out, line, (size_t)len) < 0)
+                return -1;
+        }
+        
+        len = snprintf(line, sizeof line, "LF:%d\nLH:%d\nend_of_record\n", found, hits);
+        if (pylua_buffer_write(out, line, (size_t)len) < 0)
+            return -1;
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,54 @@
+#ifndef PYLUA_COVERAGE_H
+#define PYLUA_COVERAGE_H
+
+#include "pylua.h"
+#include "pylua_buffer.h"
+
+#include <stdint.h>
+
+// Chunks are told apart by this much of their name
+#define PYLUA_COVERAGE_NAME 256
+
+// Lines of a chunk, as bitmaps
+struct CoverageChunk {
+    uint32_t hash;
+    char* name;
+    
+    // Lines run, and lines the functions seen could run
+    unsigned char* hit;
+    unsigned char* lines;
+    int size;
+    
+    // Functions whose lines were added, by line defined (offset by one)
+    int* functions;
+    int nfunctions;
+    int funccap;
+};
+
+// Line coverage collector, run by the builtin hook without the GIL
+struct Coverage {
+    // Whether it collects, or is only kept for its data
+    int running;
+    
+    // Whether the lines of functions are collected on calls
+    int functions;
+    
+    // Chunks seen so far, and their index by hash (offset by one)
+    struct CoverageChunk* chunks;
+    uint32_t nchunks;
+    uint32_t chunkcap;
+    uint32_t* index;
+    uint32_t indexcap;
+    
+    // Events dropped for lack of memory
+    size_t lost;
+};
+
+struct Coverage* pylua_coverage_new(int functions);
+void pylua_coverage_free(struct Coverage* cov);
+void pylua_coverage_line(struct Coverage* cov, lua_State* L, lua_Debug* ar);
+void pylua_coverage_call(struct Coverage* cov, lua_State* L, lua_Debug* ar);
+PyObject* pylua_coverage_lines(struct Coverage* cov);
+int pylua_coverage_lcov(struct Coverage* cov, const char* test, struct Buffer* out);
+
+#endif
\ No newline at end of file
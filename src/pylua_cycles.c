@@ -0,0 +1,283 @@
+#include "pylua_cycles.h"
+#include "pylua_python.h"
+
+// Stack slots of pylua_cycles_mark
+#define PYLUA_CYCLES_SELF 1
+#define PYLUA_CYCLES_HELD 2
+#define PYLUA_CYCLES_SEEN 3
+#define PYLUA_CYCLES_TODO 4
+#define PYLUA_CYCLES_SHARED 5
+
+/**
+ * Links a PyRef in the state, once lua is the one to release it
+ */
+void pylua_link_pyref(LuaStateObject* self, struct PyRef* ref) {
+    ref->owner = NULL;
+    ref->prev = NULL;
+    ref->next = self->pyrefs;
+    if (self->pyrefs)
+        self->pyrefs->prev = ref;
+    self->pyrefs = ref;
+}
+
+/**
+ * Unlinks a PyRef from the state, if it was linked
+ */
+void pylua_unlink_pyref(LuaStateObject* self, struct PyRef* ref) {
+    if (ref->prev) {
+        ref->prev->next = ref->next;
+    } else if (self->pyrefs == ref) {
+        self->pyrefs = ref->next;
+    } else {
+        return;
+    }
+    
+    if (ref->next)
+        ref->next->prev = ref->prev;
+    ref->prev = NULL;
+    ref->next = NULL;
+}
+
+/**
+ * Links a LuaObject in the state
+ */
+void pylua_link_object(LuaStateObject* self, LuaObject* obj) {
+    obj->prev = NULL;
+    obj->next = self->objects;
+    if (self->objects)
+        self->objects->prev = obj;
+    self->objects = obj;
+}
+
+/**
+ * Unlinks a LuaObject from the state
+ */
+void pylua_unlink_object(LuaStateObject* self, LuaObject* obj) {
+    if (obj->prev) {
+        obj->prev->next = obj->next;
+    } else if (self->objects == obj) {
+        self->objects = obj->next;
+    }
+    
+    if (obj->next)
+        obj->next->prev = obj->prev;
+    obj->prev = NULL;
+    obj->next = NULL;
+}
+
+/**
+ * Attributes a PyRef reached by `owner`: a LuaObject, or the state when
+ * the value is reachable from the roots or from more than one LuaObject
+ */
+static void pylua_cycles_reach(LuaStateObject* self, void* owner, struct PyRef* ref) {
+    if (owner == self || !ref->owner) {
+        ref->owner = owner;
+    } else if (ref->owner != owner) {
+        ref->owner = self;
+    }
+}
+
+/**
+ * Walks the values of the `todo` stack (of size `n`) and all they reference,
+ * on behalf of `owner`. The SEEN table tells who walked a value first ;
+ * a LuaObject stops at values walked by someone else, and pushes them on
+ * the SHARED stack (of size `*nshared`), to be walked again by the state.
+ * The state walks again what only a LuaObject walked so far.
+ */
+static void pylua_cycles_walk(lua_State* L, LuaStateObject* self, void* owner, int todo, int n, int* nshared) {
+    while (n > 0) {
+        luaL_checkstack(L, 4, "cannot walk the lua heap");
+        lua_rawgeti(L, todo, n);
+        lua_pushnil(L);
+        lua_rawseti(L, todo, n--);
+        
+        int v = lua_gettop(L);
+        int type = lua_type(L, v);
+        if (type != LUA_TTABLE && type != LUA_TFUNCTION && type != LUA_TUSERDATA && type != LUA_TTHREAD) {
+            lua_pop(L, 1);
+            continue;
+        }
+        
+        lua_pushvalue(L, v);
+        lua_rawget(L, PYLUA_CYCLES_SEEN);
+        void* seen = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        
+        if (seen == owner || seen == self) {
+            lua_pop(L, 1);
+            continue;
+        }
+        
+        if (seen && owner != self) {
+            // another LuaObject walked it first
+            lua_rawseti(L, PYLUA_CYCLES_SHARED, ++*nshared);
+            continue;
+        }
+        
+        lua_pushvalue(L, v);
+        lua_pushlightuserdata(L, owner);
+        lua_rawset(L, PYLUA_CYCLES_SEEN);
+        
+        if (lua_getmetatable(L, v))
+            lua_rawseti(L, todo, ++n);
+        
+        switch (type) {
+            case LUA_TTABLE:
+                lua_pushnil(L);
+                while (lua_next(L, v)) {
+                    lua_rawseti(L, todo, ++n);
+                    lua_pushvalue(L, -1);
+                    lua_rawseti(L, todo, ++n);
+                }
+                break;
+            
+            case LUA_TFUNCTION:
+                for (int i = 1; lua_getupvalue(L, v, i); i++) {
+                    lua_rawseti(L, todo, ++n);
+                }
+#if LUA_VERSION_NUM < 502
+                lua_getfenv(L, v);
+                lua_rawseti(L, todo, ++n);
+#endif
+                break;
+            
+            case LUA_TUSERDATA:
+#if LUA_VERSION_NUM >= 504
+                for (int i = 1; lua_getiuservalue(L, v, i) != LUA_TNONE; i++) {
+                    lua_rawseti(L, todo, ++n);
+                }
+                lua_pop(L, 1);
+#elif LUA_VERSION_NUM >= 502
+                lua_getuservalue(L, v);
+                lua_rawseti(L, todo, ++n);
+#else
+                lua_getfenv(L, v);
+                lua_rawseti(L, todo, ++n);
+#endif
+                if (pylua_to_pyuserdata(L, v))
+                    pylua_cycles_reach(self, owner, (struct PyRef*)lua_touserdata(L, v));
+                break;
+            
+            case LUA_TTHREAD: {
+                lua_State* co = lua_tothread(L, v);
+#if LUA_VERSION_NUM < 502
+                lua_getfenv(L, v);
+                lua_rawseti(L, todo, ++n);
+#endif
+                // the stack running the walk holds nothing of interest
+                if (co == L)
+                    break;
+                
+                if (!lua_checkstack(co, 2))
+                    luaL_error(L, "cannot walk a lua thread");
+                
+                int top = lua_gettop(co);
+                for (int i = 1; i <= top; i++) {
+                    lua_pushvalue(co, i);
+                    lua_xmove(co, L, 1);
+                    lua_rawseti(L, todo, ++n);
+                }
+                
+                // and the suspended frames below
+                lua_Debug ar;
+                for (int level = 0; lua_getstack(co, level, &ar); level++) {
+                    lua_getinfo(co, "f", &ar);
+                    lua_xmove(co, L, 1);
+                    lua_rawseti(L, todo, ++n);
+                    
+                    for (int i = 1; lua_getlocal(co, &ar, i); i++) {
+                        lua_xmove(co, L, 1);
+                        lua_rawseti(L, todo, ++n);
+                    }
+                }
+                break;
+            }
+        }
+        
+        lua_settop(L, v - 1);
+    }
+}
+
+/**
+ * Finds which LuaObjects alone can reach the python objects held by lua,
+ * given the LuaStateObject as a light userdata. Must run protected, with
+ * no lua code running. The collector is stopped, so the heap stays as walked
+ * until the caller restarts it.
+ *
+ * The roots are the registry, without the references held by LuaObjects.
+ * A PyRef is owned by the state if it is reachable from the roots,
+ * or from more than one LuaObject ; otherwise, by the LuaObject reaching it.
+ */
+int pylua_cycles_mark(lua_State* L) {
+    LuaStateObject* self = (LuaStateObject*)lua_touserdata(L, 1);
+    lua_settop(L, 1);
+    
+    // what lua can tell is garbage is gone first
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    lua_gc(L, LUA_GCSTOP, 0);
+    
+    lua_newtable(L);
+    for (LuaObject* obj = self->objects; obj; obj = obj->next) {
+        lua_pushboolean(L, 1);
+        lua_rawseti(L, PYLUA_CYCLES_HELD, obj->ref);
+    }
+    
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_newtable(L);
+    
+    int n = 0;
+    int nshared = 0;
+    
+    // walked here, as it has the references of LuaObjects
+    lua_pushvalue(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, self);
+    lua_rawset(L, PYLUA_CYCLES_SEEN);
+    
+    lua_pushnil(L);
+    while (lua_next(L, LUA_REGISTRYINDEX)) {
+        int held = 0;
+        if (lua_type(L, -2) == LUA_TNUMBER) {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, PYLUA_CYCLES_HELD);
+            held = !lua_isnil(L, -1);
+            lua_pop(L, 1);
+        }
+        
+        if (held) {
+            lua_pop(L, 1);
+        } else {
+            lua_rawseti(L, PYLUA_CYCLES_TODO, ++n);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, PYLUA_CYCLES_TODO, ++n);
+        }
+    }
+    
+#if LUA_VERSION_NUM < 502
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    lua_rawseti(L, PYLUA_CYCLES_TODO, ++n);
+#endif
+    
+    pylua_cycles_walk(L, self, self, PYLUA_CYCLES_TODO, n, &nshared);
+    
+    for (LuaObject* obj = self->objects; obj; obj = obj->next) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, obj->ref);
+        lua_rawseti(L, PYLUA_CYCLES_TODO, 1);
+        pylua_cycles_walk(L, self, obj, PYLUA_CYCLES_TODO, 1, &nshared);
+        
+        // what it shares with the others is the state's
+        pylua_cycles_walk(L, self, self, PYLUA_CYCLES_SHARED, nshared, &nshared);
+        nshared = 0;
+    }
+    
+    return 0;
+}
+
+/**
+ * Forgets who owns the PyRefs, once the cycle collection is done
+ */
+void pylua_cycles_reset(LuaStateObject* self) {
+    for (struct PyRef* ref = self->pyrefs; ref; ref = ref->next) {
+        ref->owner = NULL;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef PYLUA_CYCLES_H
+#define PYLUA_CYCLES_H
+
+#include "pylua.h"
+#include "pylua_state.h"
+#include "pylua_object.h"
+
+// Userdata made by pylua_push_pyuserdata, linked in the state pyrefs
+struct PyRef {
+    // The python object, first so that the userdata is also a PyObject**
+    PyObject* obj;
+    
+    struct PyRef* prev;
+    struct PyRef* next;
+    
+    // During a cycle collection, the LuaObject reaching it alone,
+    // or the state if it is reachable from elsewhere (see pylua_cycles_mark)
+    void* owner;
+};
+
+void pylua_link_pyref(LuaStateObject* self, struct PyRef* ref);
+void pylua_unlink_pyref(LuaStateObject* self, struct PyRef* ref);
+void pylua_link_object(LuaStateObject* self, LuaObject* obj);
+void pylua_unlink_object(LuaStateObject* self, LuaObject* obj);
+
+int pylua_cycles_mark(lua_State* L);
+void pylua_cycles_reset(LuaStateObject* self);
+
+#endif
\ No newline at end of file
@@ -1,16 +1,16 @@
 #include "pylua_exceptions.h"
 
-int pylua_init_exceptions() {
+int pylua_init_exceptions(PyLuaModuleState* state) {
     // create the exceptions
-    LuaError = PyErr_NewException("pylua.LuaError", NULL, NULL);
-    LuaCompileError = PyErr_NewException("pylua.LuaCompileError", LuaError, NULL);
-    LuaRuntimeError = PyErr_NewException("pylua.LuaRuntimeError", LuaError, NULL);
-    LuaFatalError = PyErr_NewException("pylua.LuaFatalError", LuaError, NULL);
-    if (!LuaError || !LuaCompileError || !LuaRuntimeError || !LuaFatalError) {
-        Py_XDECREF(LuaError);
-        Py_XDECREF(LuaCompileError);
-        Py_XDECREF(LuaRuntimeError);
-        Py_XDECREF(LuaFatalError);
+    state->LuaError = PyErr_NewException("pylua.LuaError", NULL, NULL);
+    if (!state->LuaError)
+        return -1;
+    
+    state->LuaCompileError = PyErr_NewException("pylua.LuaCompileError", state->LuaError, NULL);
+    state->LuaRuntimeError = PyErr_NewException("pylua.LuaRuntimeError", state->LuaError, NULL);
+    state->LuaFatalError = PyErr_NewException("pylua.LuaFatalError", state->LuaError, NULL);
+    if (!state->LuaCompileError || !state->LuaRuntimeError || !state->LuaFatalError) {
+        // the module clears the others
         return -1;
     }
     return 0;
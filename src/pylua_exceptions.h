@@ -2,12 +2,8 @@
 #define PYLUA_EXCEPTIONS_H
 
 #include "pylua.h"
+#include "pylua_module.h"
 
-PyObject* LuaError;
-PyObject* LuaCompileError;
-PyObject* LuaFatalError;
-PyObject* LuaRuntimeError;
-
-int pylua_init_exceptions();
+int pylua_init_exceptions(PyLuaModuleState* state);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1134 @@
+#include "pylua_executor.h"
+#include "pylua_exceptions.h"
+#include "pylua_hooks.h"
+#include "pylua_lock.h"
+#include "pylua_protect.h"
+#include "pylua_python.h"
+
+#include <setjmp.h>
+#include <structmember.h>
+
+// How long an idle worker waits before checking for work again (in microseconds)
+#define PYLUA_EXECUTOR_IDLE 50000
+
+// Task status, once taken by a worker
+#define PYLUA_TASK_PENDING  0   // to be run
+#define PYLUA_TASK_RAN      1   // results (or error message) are on the stack
+#define PYLUA_TASK_DONE     2   // result is set
+#define PYLUA_TASK_FAILED   3   // exception is set
+#define PYLUA_TASK_SKIPPED  4   // future was cancelled
+
+
+/**
+ * Appends a task to a deque.
+ * The deque lock must be held.
+ * Returns -1 if there is not enough memory
+ */
+static int pylua_deque_push(struct ExecutorDeque* d, struct ExecutorTask* task) {
+    if (d->size == d->capacity) {
+        Py_ssize_t capacity = d->capacity ? d->capacity * 2 : 16;
+        struct ExecutorTask* tasks = PyMem_Malloc(capacity * sizeof *tasks);
+        if (!tasks)
+            return -1;
+        
+        // unwrap the ring
+        for (Py_ssize_t i = 0; i < d->size; i++)
+            tasks[i] = d->tasks[(d->head + i) % d->capacity];
+        
+        PyMem_Free(d->tasks);
+        d->tasks = tasks;
+        d->head = 0;
+        d->capacity = capacity;
+    }
+    
+    d->tasks[(d->head + d->size) % d->capacity] = *task;
+    d->size++;
+    return 0;
+}
+
+/**
+ * Takes up to `max` tasks from the front of a deque, in submission order.
+ * The deque lock must be held.
+ * Returns the number of tasks taken
+ */
+static int pylua_deque_pop(struct ExecutorDeque* d, struct ExecutorTask* tasks, int max) {
+    int count = d->size < max ? (int)d->size : max;
+    for (int i = 0; i < count; i++)
+        tasks[i] = d->tasks[(d->head + i) % d->capacity];
+    
+    if (count) {
+        d->head = (d->head + count) % d->capacity;
+        d->size -= count;
+    }
+    return count;
+}
+
+/**
+ * Takes half of the tasks (up to `max`) from the back of a deque,
+ * so the owner keeps the oldest ones.
+ * The deque lock must be held.
+ * Returns the number of tasks taken
+ */
+static int pylua_deque_steal(struct ExecutorDeque* d, struct ExecutorTask* tasks, int max) {
+    Py_ssize_t half = (d->size + 1) / 2;
+    int count = half < max ? (int)half : max;
+    Py_ssize_t start = d->head + d->size - count;
+    
+    for (int i = 0; i < count; i++)
+        tasks[i] = d->tasks[(start + i) % d->capacity];
+    
+    d->size -= count;
+    return count;
+}
+
+
+/**
+ * Wakes up an idle worker, if any
+ */
+static void pylua_executor_signal(struct Executor* ex) {
+    PyThread_acquire_lock(ex->mutex, WAIT_LOCK);
+    if (!ex->signaled) {
+        ex->signaled = 1;
+        PyThread_release_lock(ex->wakeup);
+    }
+    PyThread_release_lock(ex->mutex);
+}
+
+/**
+ * Checks if every deque is empty.
+ * The executor mutex must be held.
+ */
+static int pylua_executor_empty(struct Executor* ex) {
+    for (int i = 0; i < ex->nworkers; i++) {
+        struct ExecutorDeque* d = &ex->workers[i].deque;
+        PyThread_acquire_lock(d->lock, WAIT_LOCK);
+        Py_ssize_t size = d->size;
+        PyThread_release_lock(d->lock);
+        
+        if (size)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Returns the worker running on the current thread, or NULL
+ */
+static struct ExecutorWorker* pylua_executor_current(struct Executor* ex) {
+    unsigned long ident = PyThread_get_thread_ident();
+    for (int i = 0; i < ex->nworkers; i++) {
+        if (ex->workers[i].ident == ident)
+            return &ex->workers[i];
+    }
+    return NULL;
+}
+
+/**
+ * Frees the executor, which may be partially initialized
+ */
+static void pylua_executor_free(struct Executor* ex) {
+    for (int i = 0; ex->workers && i < ex->nworkers; i++) {
+        struct ExecutorWorker* w = &ex->workers[i];
+        
+        // workers only exit once their deque is empty, but the setup may have failed
+        struct ExecutorTask task;
+        while (w->deque.tasks && pylua_deque_pop(&w->deque, &task, 1)) {
+            Py_DECREF(task.name);
+            Py_DECREF(task.args);
+            Py_DECREF(task.future);
+        }
+        
+        PyMem_Free(w->deque.tasks);
+        PyMem_Free(w->batch);
+        Py_XDECREF(w->exc_type);
+        Py_XDECREF(w->exc_value);
+        Py_XDECREF(w->exc_tb);
+        
+        if (w->deque.lock)
+            PyThread_free_lock(w->deque.lock);
+        if (w->started)
+            PyThread_free_lock(w->started);
+        if (w->exited)
+            PyThread_free_lock(w->exited);
+    }
+    
+    Py_XDECREF(ex->setup);
+    Py_XDECREF(ex->init);
+    
+    if (ex->mutex)
+        PyThread_free_lock(ex->mutex);
+    if (ex->wakeup)
+        PyThread_free_lock(ex->wakeup);
+    
+    PyMem_Free(ex->workers);
+    PyMem_Free(ex);
+}
+
+/**
+ * Releases a reference to the executor, and frees it if it was the last one.
+ * Must be called with the GIL.
+ */
+static void pylua_executor_release(struct Executor* ex) {
+    PyThread_acquire_lock(ex->mutex, WAIT_LOCK);
+    int refs = --ex->refs;
+    PyThread_release_lock(ex->mutex);
+    
+    if (!refs)
+        pylua_executor_free(ex);
+}
+
+/**
+ * Stops accepting new tasks, and optionally cancels the pending ones.
+ * Workers exit once every deque is empty.
+ */
+static void pylua_executor_close(struct Executor* ex, int cancel) {
+    struct ExecutorTask* cancelled = NULL;
+    Py_ssize_t count = 0;
+    
+    PyThread_acquire_lock(ex->mutex, WAIT_LOCK);
+    ex->closing = 1;
+    
+    if (cancel) {
+        Py_ssize_t size = 0;
+        for (int i = 0; i < ex->nworkers; i++)
+            size += ex->workers[i].deque.size;
+        
+        if (size)
+            cancelled = PyMem_Malloc(size * sizeof *cancelled);
+        
+        for (int i = 0; cancelled && i < ex->nworkers; i++) {
+            struct ExecutorDeque* d = &ex->workers[i].deque;
+            PyThread_acquire_lock(d->lock, WAIT_LOCK);
+            count += pylua_deque_pop(d, cancelled + count, (int)(size - count));
+            PyThread_release_lock(d->lock);
+        }
+    }
+    
+    PyThread_release_lock(ex->mutex);
+    pylua_executor_signal(ex);
+    
+    // the futures may run any code, so do that without the mutex
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject* res = PyObject_CallMethod(cancelled[i].future, "cancel", NULL);
+        if (res)
+            Py_DECREF(res);
+        else
+            PyErr_WriteUnraisable(cancelled[i].future);
+        
+        Py_DECREF(cancelled[i].name);
+        Py_DECREF(cancelled[i].args);
+        Py_DECREF(cancelled[i].future);
+    }
+    
+    PyMem_Free(cancelled);
+}
+
+/**
+ * Waits for the workers to exit, except the current one
+ */
+static void pylua_executor_join(struct Executor* ex) {
+    unsigned long ident = PyThread_get_thread_ident();
+    
+    for (int i = 0; i < ex->nworkers; i++) {
+        struct ExecutorWorker* w = &ex->workers[i];
+        if (!w->running || w->ident == ident)
+            continue;
+        
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(w->exited, WAIT_LOCK);
+        PyThread_release_lock(w->exited);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+
+/**
+ * Marks a task as failed with a new exception
+ */
+static void pylua_task_fail(struct ExecutorTask* task, PyObject* type, const char* msg) {
+    PyErr_SetString(type, msg);
+    PyErr_Fetch(&task->exc_type, &task->exc_value, &task->exc_tb);
+    task->status = PYLUA_TASK_FAILED;
+}
+
+/**
+ * Marks a task as failed with the current python exception
+ */
+static void pylua_task_fetch(struct ExecutorTask* task) {
+    PyErr_Fetch(&task->exc_type, &task->exc_value, &task->exc_tb);
+    task->status = PYLUA_TASK_FAILED;
+}
+
+/**
+ * Completes the future of a task, then releases the task
+ */
+static void pylua_task_finish(struct ExecutorTask* task) {
+    PyObject* res = NULL;
+    
+    if (task->status == PYLUA_TASK_DONE) {
+        res = PyObject_CallMethod(task->future, "set_result", "O", task->result);
+        
+    } else if (task->status == PYLUA_TASK_FAILED) {
+        PyErr_NormalizeException(&task->exc_type, &task->exc_value, &task->exc_tb);
+        if (task->exc_tb)
+            PyException_SetTraceback(task->exc_value, task->exc_tb);
+        
+        res = PyObject_CallMethod(task->future, "set_exception", "O", task->exc_value);
+        
+    } else {
+        Py_INCREF(Py_None);
+        res = Py_None;
+    }
+    
+    if (res)
+        Py_DECREF(res);
+    else
+        PyErr_WriteUnraisable(task->future);
+    
+    Py_DECREF(task->name);
+    Py_DECREF(task->args);
+    Py_DECREF(task->future);
+    Py_XDECREF(task->result);
+    Py_XDECREF(task->exc_type);
+    Py_XDECREF(task->exc_value);
+    Py_XDECREF(task->exc_tb);
+}
+
+/**
+ * Pushes the function of a task, followed by its arguments.
+ * Returns -1 if an error occured, and sets a python exception ;
+ * else, returns the number of arguments
+ */
+static int pylua_task_push(struct LuaStateInfo* info, struct ExecutorTask* task) {
+    lua_State* L = info->state;
+    
+    const char* name = PyUnicode_AsUTF8(task->name);
+    if (!name)
+        return -1;
+    
+    PYLUA_PROTECT(info, -1);
+    
+    // each worker has its own state, pylua_push_pyobj refuses values from the others
+    Py_ssize_t size = PyTuple_GET_SIZE(task->args);
+    if (size >= INT_MAX || !lua_checkstack(L, (int)size + 1)) {
+        PyErr_SetString(info->root->module->LuaError, "too many arguments");
+        PYLUA_UNPROTECT(info);
+        return -1;
+    }
+    
+    lua_getglobal(L, name);
+    
+    int argc = pylua_push_tuple(L, task->args, 0);
+    if (argc < 0)
+        lua_pop(L, 1);
+    
+    PYLUA_UNPROTECT(info);
+    return argc;
+}
+
+/**
+ * Converts the results left on the stack (above `top`) by the calls which ran
+ * Returns -1 if a fatal error occured
+ */
+static int pylua_task_collect(struct LuaStateInfo* info, struct ExecutorTask* tasks, int count, int top) {
+    lua_State* L = info->state;
+    PYLUA_PROTECT(info, -1);
+    
+    int idx = top + 1;
+    for (int i = 0; i < count; i++) {
+        struct ExecutorTask* task = &tasks[i];
+        if (task->status != PYLUA_TASK_RAN)
+            continue;
+        
+        if (task->err) {
+            // the python exception raised by a callback, or the lua error
+            if (!task->exc_type) {
+                PyObject* err = pylua_get_as_unicode(L, idx);
+                PyErr_SetObject(info->root->module->LuaRuntimeError, err);
+                Py_XDECREF(err);
+                PyErr_Fetch(&task->exc_type, &task->exc_value, &task->exc_tb);
+            }
+            task->status = PYLUA_TASK_FAILED;
+            
+        } else {
+            task->result = PyTuple_New(task->nres);
+            for (int j = 0; task->result && j < task->nres; j++) {
+                PyObject* value = pylua_get_as_pyobj(info, idx + j);
+                if (!value)
+                    Py_CLEAR(task->result);
+                else
+                    PyTuple_SET_ITEM(task->result, j, value);
+            }
+            
+            if (task->result)
+                task->status = PYLUA_TASK_DONE;
+            else
+                pylua_task_fetch(task);
+        }
+        
+        idx += task->nres;
+    }
+    
+    lua_settop(L, top);
+    PYLUA_UNPROTECT(info);
+    return 0;
+}
+
+
+/**
+ * Runs a batch of tasks on the worker state.
+ *
+ * The GIL is only taken twice: once to push every call, and once to
+ * convert every result. The calls themselves run without it.
+ */
+static void pylua_executor_run(struct ExecutorWorker* w, struct ExecutorTask* tasks, int count) {
+    PyEval_RestoreThread(w->tstate);
+    
+    for (int i = 0; i < count; i++) {
+        struct ExecutorTask* task = &tasks[i];
+        task->status = PYLUA_TASK_PENDING;
+        task->nargs = 0;
+        task->nres = 0;
+        task->err = 0;
+        task->result = NULL;
+        task->exc_type = NULL;
+        task->exc_value = NULL;
+        task->exc_tb = NULL;
+        
+        PyObject* res = PyObject_CallMethod(task->future, "set_running_or_notify_cancel", NULL);
+        if (!res) {
+            PyErr_WriteUnraisable(task->future);
+            task->status = PYLUA_TASK_SKIPPED;
+        } else {
+            if (res != Py_True)
+                task->status = PYLUA_TASK_SKIPPED;
+            Py_DECREF(res);
+        }
+    }
+    
+    LuaStateObject* sobj = w->state;
+    struct LuaStateInfo* info = &sobj->info;
+    pylua_lock(sobj);
+    
+    int top = info->state ? lua_gettop(info->state) : 0;
+    
+    // push the calls in reverse order, so the first one ends up on top
+    for (int i = count - 1; i >= 0 && info->state; i--) {
+        struct ExecutorTask* task = &tasks[i];
+        if (task->status != PYLUA_TASK_PENDING)
+            continue;
+        
+        task->nargs = pylua_task_push(info, task);
+        if (task->nargs < 0)
+            pylua_task_fetch(task);
+    }
+    
+    // a fatal error discarded everything we pushed
+    if (!info->state) {
+        for (int i = 0; i < count; i++) {
+            if (tasks[i].status == PYLUA_TASK_PENDING)
+                pylua_task_fail(&tasks[i], sobj->module->LuaFatalError, "lua state is dead");
+        }
+    }
+    
+    lua_State* L = info->state;
+    volatile int current = 0;
+    volatile int base = top;
+    int fatal = 0;
+    
+    if (L) {
+        PyThreadState* outer = info->thstate;
+        info->thstate = PyEval_SaveThread();
+        
+        // same protection as pylua_call
+        struct PanicHandler* panic = pylua_push_panichandler(info);
+        fatal = setjmp(panic->buf);
+        if (!fatal) {
+            for (; current < count; current++) {
+                struct ExecutorTask* task = &tasks[current];
+                if (task->status != PYLUA_TASK_PENDING)
+                    continue;
+                
+                int below = lua_gettop(L) - task->nargs - 1;
+                
+                pylua_enter_call(info);
+                task->err = lua_pcall(L, task->nargs, LUA_MULTRET, 0);
+                pylua_leave_call(info);
+                
+                task->nres = lua_gettop(L) - below;
+                task->status = PYLUA_TASK_RAN;
+                
+                // move the results below the calls left to run
+                for (int i = 0; i < task->nres; i++)
+                    lua_insert(L, base + 1);
+                base += task->nres;
+                
+                // keep the python exception raised by a callback, if any
+                if (task->err) {
+                    PyEval_RestoreThread(info->thstate);
+                    if (PyErr_Occurred())
+                        PyErr_Fetch(&task->exc_type, &task->exc_value, &task->exc_tb);
+                    info->thstate = PyEval_SaveThread();
+                }
+            }
+        }
+        
+        pylua_pop_panichandler(info);
+        
+        PyEval_RestoreThread(info->thstate);
+        info->thstate = outer;
+        
+        // the calls left events to a batched hook, if set by the setup
+        pylua_flush_hook(info->root);
+    }
+    
+    if (fatal) {
+        pylua_leave_call(info);
+        
+        // the results of the calls which ran are lost as well
+        for (int i = 0; i < count; i++) {
+            struct ExecutorTask* task = &tasks[i];
+            if (task->status != PYLUA_TASK_PENDING && task->status != PYLUA_TASK_RAN)
+                continue;
+            
+            if (i == current && PyErr_Occurred())
+                pylua_task_fetch(task);
+            else
+                pylua_task_fail(task, sobj->module->LuaFatalError, "lua state is dead");
+        }
+        
+    } else if (L && pylua_task_collect(info, tasks, count, top) < 0) {
+        for (int i = 0; i < count; i++) {
+            if (tasks[i].status == PYLUA_TASK_RAN)
+                pylua_task_fail(&tasks[i], sobj->module->LuaFatalError, "lua state is dead");
+        }
+        PyErr_Clear();
+    }
+    
+    pylua_unlock(sobj);
+    
+    for (int i = 0; i < count; i++)
+        pylua_task_finish(&tasks[i]);
+    
+    w->tstate = PyEval_SaveThread();
+}
+
+/**
+ * Takes a batch of tasks from the worker deque, or steals some from another worker.
+ * Returns the number of tasks taken
+ */
+static int pylua_executor_take(struct ExecutorWorker* w) {
+    struct Executor* ex = w->ex;
+    
+    PyThread_acquire_lock(w->deque.lock, WAIT_LOCK);
+    int count = pylua_deque_pop(&w->deque, w->batch, ex->batch);
+    Py_ssize_t left = w->deque.size;
+    PyThread_release_lock(w->deque.lock);
+    
+    if (count) {
+        // someone idle may take the rest
+        if (left)
+            pylua_executor_signal(ex);
+        return count;
+    }
+    
+    for (int i = 1; i < ex->nworkers; i++) {
+        struct ExecutorWorker* victim = &ex->workers[(w->index + i) % ex->nworkers];
+        
+        PyThread_acquire_lock(victim->deque.lock, WAIT_LOCK);
+        count = pylua_deque_steal(&victim->deque, w->batch, ex->batch);
+        PyThread_release_lock(victim->deque.lock);
+        
+        if (count)
+            return count;
+    }
+    
+    return 0;
+}
+
+/**
+ * Waits for a task to be submitted.
+ * Returns 1 if the worker should exit
+ */
+static int pylua_executor_idle(struct ExecutorWorker* w) {
+    struct Executor* ex = w->ex;
+    
+    PyThread_acquire_lock(ex->mutex, WAIT_LOCK);
+    int done = ex->closing && pylua_executor_empty(ex);
+    PyThread_release_lock(ex->mutex);
+    
+    if (done)
+        return 1;
+    
+    if (PyThread_acquire_lock_timed(ex->wakeup, PYLUA_EXECUTOR_IDLE, 0) == PY_LOCK_ACQUIRED) {
+        PyThread_acquire_lock(ex->mutex, WAIT_LOCK);
+        ex->signaled = 0;
+        PyThread_release_lock(ex->mutex);
+    }
+    return 0;
+}
+
+/**
+ * Creates the lua state of a worker, then runs the setup script and the init callable.
+ * Returns -1 if an error occured, and sets a python exception
+ */
+static int pylua_executor_setup(struct ExecutorWorker* w) {
+    struct Executor* ex = w->ex;
+    
+    w->batch = PyMem_Malloc(ex->batch * sizeof *w->batch);
+    if (!w->batch) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    
+    w->state = (LuaStateObject*)PyObject_CallFunction((PyObject*)ex->module->LuaStateType, "(i)", ex->openlibs);
+    if (!w->state)
+        return -1;
+    
+    if (ex->setup) {
+        PyObject* func = PyObject_CallMethod((PyObject*)w->state, "load_string", "O", ex->setup);
+        if (!func)
+            return -1;
+        
+        PyObject* res = PyObject_CallObject(func, NULL);
+        Py_DECREF(func);
+        if (!res)
+            return -1;
+        Py_DECREF(res);
+    }
+    
+    if (ex->init) {
+        PyObject* res = PyObject_CallFunctionObjArgs(ex->init, (PyObject*)w->state, NULL);
+        if (!res)
+            return -1;
+        Py_DECREF(res);
+    }
+    
+    return 0;
+}
+
+/**
+ * Entry point of the worker threads
+ */
+static void pylua_executor_worker(void* arg) {
+    struct ExecutorWorker* w = (struct ExecutorWorker*)arg;
+    struct Executor* ex = w->ex;
+    
+    w->ident = PyThread_get_thread_ident();
+    
+    // the executor may live in a sub-interpreter
+    PyThreadState* tstate = PyThreadState_New(ex->interp);
+    if (!tstate) {
+        PyThread_release_lock(w->started);
+        PyThread_release_lock(w->exited);
+        
+        // the executor object still holds a reference
+        PyThread_acquire_lock(ex->mutex, WAIT_LOCK);
+        ex->refs--;
+        PyThread_release_lock(ex->mutex);
+        return;
+    }
+    PyEval_RestoreThread(tstate);
+    
+    w->ready = pylua_executor_setup(w) == 0;
+    if (!w->ready)
+        PyErr_Fetch(&w->exc_type, &w->exc_value, &w->exc_tb);
+    
+    PyThread_release_lock(w->started);
+    
+    if (w->ready) {
+        w->tstate = PyEval_SaveThread();
+        
+        for (;;) {
+            int count = pylua_executor_take(w);
+            if (count)
+                pylua_executor_run(w, w->batch, count);
+            else if (pylua_executor_idle(w))
+                break;
+        }
+        
+        PyEval_RestoreThread(w->tstate);
+    }
+    
+    Py_CLEAR(w->state);
+    
+    // let the other idle workers notice too
+    pylua_executor_signal(ex);
+    
+    PyThread_release_lock(w->exited);
+    pylua_executor_release(ex);
+    
+    PyThreadState_Clear(tstate);
+    PyThreadState_DeleteCurrent();
+}
+
+
+/**
+ * Returns os.cpu_count(), or 1 if unknown
+ */
+static int pylua_cpu_count(void) {
+    int count = 1;
+    
+    PyObject* os = PyImport_ImportModule("os");
+    if (!os)
+        return -1;
+    
+    PyObject* res = PyObject_CallMethod(os, "cpu_count", NULL);
+    Py_DECREF(os);
+    if (!res)
+        return -1;
+    
+    if (res != Py_None)
+        count = (int)PyLong_AsLong(res);
+    Py_DECREF(res);
+    
+    if (count == -1 && PyErr_Occurred())
+        return -1;
+    return count > 0 ? count : 1;
+}
+
+static PyObject* pylua_executor_atexit(PyObject* ref, PyObject* unused);
+
+static PyMethodDef pylua_executor_atexit_def = {
+    "shutdown", (PyCFunction)pylua_executor_atexit, METH_NOARGS, "shut down the executor on exit"
+};
+
+/**
+ * Implement tp_new for our LuaExecutor type
+ */
+static PyObject* LuaExecutor_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    LuaExecutorObject* self = (LuaExecutorObject*)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->ex = NULL;
+        self->atexit = NULL;
+        self->weakreflist = NULL;
+    }
+    return (PyObject*)self;
+}
+
+/**
+ * Implement tp_init for our LuaExecutor type ;
+ * Starts the workers, and waits for them to be ready
+ */
+static int LuaExecutor_init(LuaExecutorObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"workers", "init", "setup", "openlibs", "batch", NULL};
+    int workers = 0;
+    PyObject* init = Py_None;
+    PyObject* setup = Py_None;
+    int openlibs = 1;
+    int batch = 16;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iOOpi", keywords, &workers, &init, &setup, &openlibs, &batch))
+        return -1;
+    
+    if (self->ex) {
+        PyErr_SetString(PyExc_RuntimeError, "executor is already started");
+        return -1;
+    }
+    
+    if (init != Py_None && !PyCallable_Check(init)) {
+        PyErr_SetString(PyExc_TypeError, "init must be callable");
+        return -1;
+    }
+    
+    if (setup != Py_None && !PyUnicode_Check(setup)) {
+        PyErr_SetString(PyExc_TypeError, "setup must be a str");
+        return -1;
+    }
+    
+    if (batch < 1) {
+        PyErr_SetString(PyExc_ValueError, "batch must be at least 1");
+        return -1;
+    }
+    
+    if (workers <= 0 && (workers = pylua_cpu_count()) < 0)
+        return -1;
+    
+    PyLuaModuleState* module = pylua_get_module_state(Py_TYPE(self));
+    if (!module)
+        return -1;
+    
+    if (!module->Future) {
+        PyObject* mod = PyImport_ImportModule("concurrent.futures");
+        if (!mod)
+            return -1;
+        
+        module->Future = PyObject_GetAttrString(mod, "Future");
+        Py_DECREF(mod);
+        if (!module->Future)
+            return -1;
+    }
+    
+    struct Executor* ex = PyMem_Calloc(1, sizeof *ex);
+    if (!ex) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    
+    ex->interp = PyInterpreterState_Get();
+    ex->module = module;
+    ex->refs = 1;
+    ex->batch = batch;
+    ex->openlibs = openlibs;
+    ex->nworkers = workers;
+    ex->workers = PyMem_Calloc(workers, sizeof *ex->workers);
+    ex->mutex = PyThread_allocate_lock();
+    ex->wakeup = PyThread_allocate_lock();
+    
+    int failed = !ex->workers || !ex->mutex || !ex->wakeup;
+    for (int i = 0; !failed && i < workers; i++) {
+        struct ExecutorWorker* w = &ex->workers[i];
+        w->ex = ex;
+        w->index = i;
+        w->deque.lock = PyThread_allocate_lock();
+        w->started = PyThread_allocate_lock();
+        w->exited = PyThread_allocate_lock();
+        failed = !w->deque.lock || !w->started || !w->exited;
+    }
+    
+    if (failed) {
+        pylua_executor_free(ex);
+        PyErr_NoMemory();
+        return -1;
+    }
+    
+    self->ex = ex;
+    
+    if (init != Py_None) {
+        Py_INCREF(init);
+        ex->init = init;
+    }
+    if (setup != Py_None) {
+        Py_INCREF(setup);
+        ex->setup = setup;
+    }
+    
+    // nothing to wake up yet
+    PyThread_acquire_lock(ex->wakeup, WAIT_LOCK);
+    
+    for (int i = 0; i < workers; i++) {
+        struct ExecutorWorker* w = &ex->workers[i];
+        PyThread_acquire_lock(w->started, WAIT_LOCK);
+        PyThread_acquire_lock(w->exited, WAIT_LOCK);
+        
+        ex->refs++;
+        if (PyThread_start_new_thread(&pylua_executor_worker, w) == PYTHREAD_INVALID_THREAD_ID) {
+            ex->refs--;
+            PyErr_SetString(PyExc_RuntimeError, "can't start new thread");
+            PyErr_Fetch(&w->exc_type, &w->exc_value, &w->exc_tb);
+            break;
+        }
+        w->running = 1;
+    }
+    
+    // wait for the setup to be done
+    for (int i = 0; i < workers; i++) {
+        struct ExecutorWorker* w = &ex->workers[i];
+        if (!w->running)
+            continue;
+        
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(w->started, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+    
+    for (int i = 0; i < workers; i++) {
+        struct ExecutorWorker* w = &ex->workers[i];
+        if (!w->ready) {
+            pylua_executor_close(ex, 1);
+            pylua_executor_join(ex);
+            
+            if (w->exc_type) {
+                PyErr_Restore(w->exc_type, w->exc_value, w->exc_tb);
+                w->exc_type = w->exc_value = w->exc_tb = NULL;
+            } else {
+                PyErr_SetString(PyExc_RuntimeError, "can't start worker");
+            }
+            return -1;
+        }
+    }
+    
+    // don't leave the workers behind on exit, without keeping the executor alive
+    PyObject* atexit = PyImport_ImportModule("atexit");
+    if (!atexit)
+        return -1;
+    
+    PyObject* ref = PyWeakref_NewRef((PyObject*)self, NULL);
+    if (ref) {
+        self->atexit = PyCFunction_New(&pylua_executor_atexit_def, ref);
+        Py_DECREF(ref);
+    }
+    
+    PyObject* res = self->atexit ? PyObject_CallMethod(atexit, "register", "O", self->atexit) : NULL;
+    Py_DECREF(atexit);
+    if (!res)
+        return -1;
+    Py_DECREF(res);
+    
+    return 0;
+}
+
+/**
+ * Implements LuaExecutor.submit, which schedules a call to a global function
+ * on one of the workers, and returns a concurrent.futures.Future
+ */
+static PyObject* LuaExecutor_submit(LuaExecutorObject* self, PyObject* args) {
+    Py_ssize_t argc = PyTuple_GET_SIZE(args);
+    if (argc < 1) {
+        PyErr_SetString(PyExc_TypeError, "expected at least 1 argument");
+        return NULL;
+    }
+    
+    PyObject* name = PyTuple_GET_ITEM(args, 0);
+    if (!PyUnicode_Check(name)) {
+        PyErr_SetString(PyExc_TypeError, "function name must be a str");
+        return NULL;
+    }
+    
+    struct Executor* ex = self->ex;
+    if (!ex) {
+        PyErr_SetString(PyExc_RuntimeError, "executor is not started");
+        return NULL;
+    }
+    
+    struct ExecutorTask task;
+    task.args = PyTuple_GetSlice(args, 1, argc);
+    if (!task.args)
+        return NULL;
+    
+    task.future = PyObject_CallObject(ex->module->Future, NULL);
+    if (!task.future) {
+        Py_DECREF(task.args);
+        return NULL;
+    }
+    
+    Py_INCREF(name);
+    task.name = name;
+    
+    PyThread_acquire_lock(ex->mutex, WAIT_LOCK);
+    
+    int err = 0;
+    if (ex->closing) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot schedule new futures after shutdown");
+        err = -1;
+        
+    } else {
+        // tasks submitted from a worker (by a python callback) stay on it
+        struct ExecutorWorker* w = pylua_executor_current(ex);
+        if (!w)
+            w = &ex->workers[ex->next++ % ex->nworkers];
+        
+        PyThread_acquire_lock(w->deque.lock, WAIT_LOCK);
+        err = pylua_deque_push(&w->deque, &task);
+        PyThread_release_lock(w->deque.lock);
+        
+        if (err)
+            PyErr_NoMemory();
+    }
+    
+    PyThread_release_lock(ex->mutex);
+    
+    if (err) {
+        Py_DECREF(task.name);
+        Py_DECREF(task.args);
+        Py_DECREF(task.future);
+        return NULL;
+    }
+    
+    pylua_executor_signal(ex);
+    
+    Py_INCREF(task.future);
+    return task.future;
+}
+
+/**
+ * Takes the shutdown trampoline back from atexit
+ */
+static int pylua_executor_unregister(LuaExecutorObject* self) {
+    if (!self->atexit)
+        return 0;
+    
+    PyObject* func = self->atexit;
+    self->atexit = NULL;
+    
+    PyObject* atexit = PyImport_ImportModule("atexit");
+    PyObject* res = atexit ? PyObject_CallMethod(atexit, "unregister", "O", func) : NULL;
+    Py_XDECREF(atexit);
+    Py_DECREF(func);
+    if (!res)
+        return -1;
+    
+    Py_DECREF(res);
+    return 0;
+}
+
+/**
+ * Stops accepting tasks, and waits for the workers to exit if `wait` is set
+ */
+static PyObject* pylua_executor_shutdown(LuaExecutorObject* self, int wait, int cancel) {
+    if (self->ex) {
+        pylua_executor_close(self->ex, cancel);
+        if (wait)
+            pylua_executor_join(self->ex);
+    }
+    
+    if (pylua_executor_unregister(self) < 0)
+        return NULL;
+    
+    Py_RETURN_NONE;
+}
+
+/**
+ * Registered with atexit, with a weakref to the executor as self:
+ * shuts it down if it is still alive
+ */
+static PyObject* pylua_executor_atexit(PyObject* ref, PyObject* unused) {
+#if PY_VERSION_HEX >= 0x030D0000
+    PyObject* self;
+    if (PyWeakref_GetRef(ref, &self) < 0)
+        return NULL;
+    if (!self)
+        Py_RETURN_NONE;
+#else
+    PyObject* self = PyWeakref_GetObject(ref);
+    if (!self)
+        return NULL;
+    if (self == Py_None)
+        Py_RETURN_NONE;
+    Py_INCREF(self);
+#endif
+    
+    PyObject* res = pylua_executor_shutdown((LuaExecutorObject*)self, 1, 0);
+    Py_DECREF(self);
+    return res;
+}
+
+/**
+ * Implements LuaExecutor.shutdown
+ */
+static PyObject* LuaExecutor_shutdown(LuaExecutorObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"wait", "cancel_futures", NULL};
+    int wait = 1;
+    int cancel = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p$p", keywords, &wait, &cancel))
+        return NULL;
+    
+    return pylua_executor_shutdown(self, wait, cancel);
+}
+
+/**
+ * Implements LuaExecutor.__enter__
+ */
+static PyObject* LuaExecutor_enter(LuaExecutorObject* self, PyObject* unused) {
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+/**
+ * Implements LuaExecutor.__exit__, which shuts down the executor
+ */
+static PyObject* LuaExecutor_exit(LuaExecutorObject* self, PyObject* args) {
+    PyObject* res = pylua_executor_shutdown(self, 1, 0);
+    if (!res)
+        return NULL;
+    
+    Py_DECREF(res);
+    Py_RETURN_FALSE;
+}
+
+/**
+ * Getter for LuaExecutor.workers
+ */
+static PyObject* LuaExecutor_get_workers(LuaExecutorObject* self, void* unused) {
+    return PyLong_FromLong(self->ex ? self->ex->nworkers : 0);
+}
+
+/**
+ * Implement tp_traverse for LuaExecutor ;
+ * the init callable is only used while the workers start
+ */
+static int LuaExecutor_traverse(LuaExecutorObject* self, visitproc visit, void* arg) {
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->atexit);
+    if (self->ex)
+        Py_VISIT(self->ex->init);
+    return 0;
+}
+
+/**
+ * Implement tp_clear for LuaExecutor
+ */
+static int LuaExecutor_clear(LuaExecutorObject* self) {
+    if (self->ex)
+        Py_CLEAR(self->ex->init);
+    return 0;
+}
+
+/**
+ * Handle deallocation of LuaExecutor ;
+ * the workers finish the pending tasks, then exit by themselves
+ */
+static void LuaExecutor_dealloc(LuaExecutorObject* self) {
+    PyObject_GC_UnTrack(self);
+    
+    if (self->weakreflist)
+        PyObject_ClearWeakRefs((PyObject*)self);
+    
+    if (self->ex) {
+        pylua_executor_close(self->ex, 0);
+        pylua_executor_release(self->ex);
+        self->ex = NULL;
+    }
+    
+    // the exception being handled, if any, is not ours
+    PyObject *exc_type, *exc_value, *exc_tb;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    if (pylua_executor_unregister(self) < 0)
+        PyErr_Clear();
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+    
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+
+static PyMethodDef LuaExecutor_methods[] = {
+    {"submit", (PyCFunction)LuaExecutor_submit, METH_VARARGS, "schedule a call to a global function"},
+    {"shutdown", (PyCFunction)LuaExecutor_shutdown, METH_VARARGS | METH_KEYWORDS, "stop the workers"},
+    {"__enter__", (PyCFunction)LuaExecutor_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)LuaExecutor_exit, METH_VARARGS, NULL},
+    {NULL}
+};
+
+static PyGetSetDef LuaExecutor_getset[] = {
+    {"workers", (getter)LuaExecutor_get_workers, NULL, "number of workers", NULL},
+    {NULL}
+};
+
+static PyMemberDef LuaExecutor_members[] = {
+    {"__weaklistoffset__", T_PYSSIZET, offsetof(LuaExecutorObject, weakreflist), READONLY},
+    {NULL}
+};
+
+static PyType_Slot LuaExecutorSlots[] = {
+    {Py_tp_doc, "Runs lua functions on a pool of worker threads, each with its own lua state"},
+    {Py_tp_new, LuaExecutor_new},
+    {Py_tp_init, LuaExecutor_init},
+    {Py_tp_dealloc, LuaExecutor_dealloc},
+    {Py_tp_traverse, LuaExecutor_traverse},
+    {Py_tp_clear, LuaExecutor_clear},
+    {Py_tp_methods, LuaExecutor_methods},
+    {Py_tp_getset, LuaExecutor_getset},
+    {Py_tp_members, LuaExecutor_members},
+    {0, NULL}
+};
+
+PyType_Spec LuaExecutorTypeSpec = {
+    .name = "pylua.LuaExecutor",
+    .basicsize = sizeof(LuaExecutorObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .slots = LuaExecutorSlots
+};
\ No newline at end of file
@@ -0,0 +1,108 @@
+#ifndef PYLUA_EXECUTOR_H
+#define PYLUA_EXECUTOR_H
+
+#include "pylua.h"
+#include "pylua_state.h"
+
+#include <pythread.h>
+
+struct Executor;
+
+// A function call scheduled on an executor
+struct ExecutorTask {
+    // Name of the global function, its arguments, and the future to complete
+    PyObject* name;
+    PyObject* args;
+    PyObject* future;
+    
+    // Progress of the call, once taken by a worker
+    int status;
+    int nargs;
+    int nres;
+    int err;
+    
+    // Outcome of the call
+    PyObject* result;
+    PyObject* exc_type;
+    PyObject* exc_value;
+    PyObject* exc_tb;
+};
+
+// Tasks waiting for a worker, in a growable ring buffer
+struct ExecutorDeque {
+    PyThread_type_lock lock;
+    struct ExecutorTask* tasks;
+    Py_ssize_t head;
+    Py_ssize_t size;
+    Py_ssize_t capacity;
+};
+
+struct ExecutorWorker {
+    struct Executor* ex;
+    int index;
+    
+    // Native thread running the worker
+    unsigned long ident;
+    PyThreadState* tstate;
+    
+    // Pending tasks, and the tasks being run
+    struct ExecutorDeque deque;
+    struct ExecutorTask* batch;
+    
+    // The lua state owned by this worker
+    LuaStateObject* state;
+    
+    // Released once the worker is ready, and once it exited
+    PyThread_type_lock started;
+    PyThread_type_lock exited;
+    int running;
+    int ready;
+    
+    // Python exception raised while setting up the worker, if any
+    PyObject* exc_type;
+    PyObject* exc_value;
+    PyObject* exc_tb;
+};
+
+// Shared by the executor object and its workers,
+// freed when the last of them is done with it
+struct Executor {
+    // Interpreter and module state the workers run in
+    PyInterpreterState* interp;
+    PyLuaModuleState* module;
+    
+    struct ExecutorWorker* workers;
+    int nworkers;
+    int batch;
+    
+    // Worker setup
+    PyObject* setup;
+    PyObject* init;
+    int openlibs;
+    
+    // Protects the fields below, and the deques when submitting
+    PyThread_type_lock mutex;
+    unsigned int next;
+    int closing;
+    int refs;
+    
+    // Wakes up an idle worker
+    PyThread_type_lock wakeup;
+    int signaled;
+};
+
+typedef struct {
+    PyObject_HEAD
+    
+    struct Executor* ex;
+    
+    // Shutdown trampoline registered with atexit, holding a weakref to the executor
+    PyObject* atexit;
+    
+    PyObject* weakreflist;
+    
+} LuaExecutorObject;
+
+extern PyType_Spec LuaExecutorTypeSpec;
+
+#endif
\ No newline at end of file
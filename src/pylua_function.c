@@ -1,4 +1,6 @@
 #include "pylua_function.h"
+#include "pylua_async.h"
+#include "pylua_chunk.h"
 #include "pylua_exceptions.h"
 #include "pylua_protect.h"
 #include "pylua_python.h"
@@ -10,23 +12,55 @@
  * and return a python object.
  */
 static PyObject* LuaFunction_call(LuaObject* self, PyObject* args, PyObject* kwargs) {
-    // We do not allow keyword arguments
+    // The only keyword argument is the memory budget of the call,
+    // none if it is None or 0 (as LuaThread.mem_budget)
+    size_t limit = SIZE_MAX;
     if (kwargs && PyDict_Size(kwargs)) {
-        PyErr_SetString(PyExc_TypeError, "unexpected keyword argument");
-        return NULL;
+        PyObject* value = PyDict_GetItemString(kwargs, "mem_budget");
+        if (!value || PyDict_Size(kwargs) > 1) {
+            PyErr_SetString(PyExc_TypeError, "unexpected keyword argument");
+            return NULL;
+        }
+        
+        if (value != Py_None) {
+            limit = PyLong_AsSize_t(value);
+            if (limit == (size_t)-1 && PyErr_Occurred())
+                return NULL;
+            if (!limit)
+                limit = SIZE_MAX;
+        }
     }
     
+    // concurrent calls wait for their turn
+    pylua_lock(self->sobj);
+    
     if (!self->sobj->info.state) {
-        PyErr_SetString(LuaFatalError, "lua state is dead");
+        pylua_unlock(self->sobj);
+        PyErr_SetString(self->sobj->module->LuaFatalError, "lua state is dead");
         return NULL;
     }
     
-    if (self->sobj->info.thstate) {
-        PyErr_SetString(LuaFatalError, "not thread safe");
-        return NULL;
-    }
+    // charged along with the budgets already running
+    struct MemBudget budget = {0, limit, self->sobj->budget};
+    if (limit != SIZE_MAX)
+        self->sobj->budget = &budget;
+    
+    PyObject* res = pylua_call(&self->sobj->info, self->ref, args, 0);
     
-    return pylua_call(&self->sobj->info, self->ref, args, 0);
+    if (limit != SIZE_MAX)
+        self->sobj->budget = budget.outer;
+    
+    pylua_unlock(self->sobj);
+    return res;
+}
+
+/**
+ * Implements LuaFunction.call_async, which returns an awaitable running the
+ * lua function in its own lua thread ; python callbacks returning awaitables
+ * suspend it until they complete.
+ */
+static PyObject* LuaFunction_call_async(LuaObject* self, PyObject* args) {
+    return pylua_new_awaitable(self, args);
 }
 
 /**
@@ -37,10 +71,10 @@ static PyObject* LuaFunction_call(LuaObject* self, PyObject* args, PyObject* kwa
  * For Lua <= 5.1, it just uses getfenv
  */
 static PyObject* LuaFunction_getfenv(LuaObject* self, PyObject* args) {
-    PYLUA_CHECK(L, &self->sobj->info, NULL);
+    PYLUA_ENTER(L, &self->sobj->info, NULL);
 
     // Protect from memory allocation errors
-    PYLUA_PROTECT(&self->sobj->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->sobj->info, NULL);
 
     // Let's push the function first
     lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
@@ -58,6 +92,7 @@ static PyObject* LuaFunction_getfenv(LuaObject* self, PyObject* args) {
 
     // Returns it (error handling is useless for res)
     PYLUA_UNPROTECT(&self->sobj->info);
+    PYLUA_LEAVE(&self->sobj->info);
     return res;
 }
 
@@ -71,21 +106,23 @@ static PyObject* LuaFunction_getfenv(LuaObject* self, PyObject* args) {
 static PyObject* LuaFunction_setfenv(LuaObject* self, PyObject* args) {
     PyObject* env;
 
-    if (!PyArg_ParseTuple(args, "O!", &LuaTableType, &env)) {
+    if (!PyArg_ParseTuple(args, "O!", self->sobj->module->LuaTableType, &env)) {
         return NULL;
     }
 
-    PYLUA_CHECK(L, &self->sobj->info, NULL);
+    PYLUA_ENTER(L, &self->sobj->info, NULL);
 
     // Protect from memory allocation
-    PYLUA_PROTECT(&self->sobj->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->sobj->info, NULL);
 
     // Push the function
     lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
 
     // Push the env
     if (pylua_push_pyobj(L, env)) {
+        lua_pop(L, 1);
         PYLUA_UNPROTECT(&self->sobj->info);
+        PYLUA_LEAVE(&self->sobj->info);
         return NULL;
     }
 
@@ -100,21 +137,76 @@ static PyObject* LuaFunction_setfenv(LuaObject* self, PyObject* args) {
     lua_pop(L, 1);
 
     PYLUA_UNPROTECT(&self->sobj->info);
+    PYLUA_LEAVE(&self->sobj->info);
     Py_RETURN_NONE;
 }
 
+/**
+ * Implements LuaFunction.dump, which returns the function as a binary chunk
+ * that LuaState.load_bytecode can load back. Its upvalues are not saved.
+ *
+ * Debug info is stripped by default ; before Lua 5.3, it is always kept.
+ */
+static PyObject* LuaFunction_dump(LuaObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"strip", NULL};
+    int strip = 1;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", keywords, &strip)) {
+        return NULL;
+    }
+    
+    PYLUA_ENTER(L, &self->sobj->info, NULL);
+    
+    if (!lua_checkstack(L, 1)) {
+        PYLUA_LEAVE(&self->sobj->info);
+        return PyErr_NoMemory();
+    }
+    
+    lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
+    if (lua_iscfunction(L, -1)) {
+        lua_pop(L, 1);
+        PYLUA_LEAVE(&self->sobj->info);
+        PyErr_SetString(self->sobj->module->LuaError, "cannot dump a C function");
+        return NULL;
+    }
+    
+    // lua writes it piece by piece
+    struct Buffer buf;
+    pylua_buffer_init(&buf);
+    int err = pylua_dump(L, &buf, strip);
+    lua_pop(L, 1);
+    
+    PYLUA_LEAVE(&self->sobj->info);
+    
+    if (err) {
+        pylua_buffer_free(&buf);
+        return PyErr_NoMemory();
+    }
+    
+    PyObject* res = PyBytes_FromStringAndSize(buf.data, (Py_ssize_t)buf.size);
+    pylua_buffer_free(&buf);
+    return res;
+}
+
 
 static PyMethodDef LuaFunction_methods[] = {
+    {"call_async", (PyCFunction)LuaFunction_call_async, METH_VARARGS, "call the lua function, returning an awaitable"},
+    {"dump", (PyCFunction)LuaFunction_dump, METH_VARARGS | METH_KEYWORDS, "return the function as a binary chunk"},
     {"getfenv", (PyCFunction)LuaFunction_getfenv, METH_VARARGS, "return a function environment"},
     {"setfenv", (PyCFunction)LuaFunction_setfenv, METH_VARARGS, "define a function environment"},
     {NULL}
 };
 
-PyTypeObject LuaFunctionType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pylua.LuaFunction",
-    .tp_doc = "Lua function",
-    .tp_base = &LuaObjectType,
-    .tp_call = (ternaryfunc)LuaFunction_call,
-    .tp_methods = LuaFunction_methods
+static PyType_Slot LuaFunctionSlots[] = {
+    {Py_tp_doc, "Lua function"},
+    {Py_tp_call, LuaFunction_call},
+    {Py_tp_methods, LuaFunction_methods},
+    {0, NULL}
+};
+
+PyType_Spec LuaFunctionTypeSpec = {
+    .name = "pylua.LuaFunction",
+    .basicsize = sizeof(LuaObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = LuaFunctionSlots
 };
\ No newline at end of file
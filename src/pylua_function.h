@@ -4,6 +4,6 @@
 #include "pylua.h"
 #include "pylua_object.h"
 
-PyTypeObject LuaFunctionType;
+extern PyType_Spec LuaFunctionTypeSpec;
 
 #endif
\ No newline at end of file
@@ -1,8 +1,16 @@
 #include "pylua_hooks.h"
+#include "pylua_async.h"
+#include "pylua_collect.h"
+#include "pylua_coverage.h"
+#include "pylua_cycles.h"
 #include "pylua_exceptions.h"
+#include "pylua_lock.h"
+#include "pylua_profiler.h"
 #include "pylua_protect.h"
 #include "pylua_python.h"
+#include "pylua_slab.h"
 #include "pylua_stateinfo.h"
+#include "pylua_tracer.h"
 
 #include <sys/timeb.h>
 
@@ -52,12 +60,93 @@ static PyObject* pylua_call_pyobject(struct LuaStateInfo* info, PyObject* func,
 
 
 /**
- * Builtin debug hook
+ * Returns the mask under which a hook event is asked for
+ */
+static int pylua_hook_mask(int event) {
+    switch (event) {
+        case LUA_HOOKCALL:
+            return LUA_MASKCALL;
+        case LUA_HOOKRET:
+            return LUA_MASKRET;
+        case LUA_HOOKLINE:
+            return LUA_MASKLINE;
+#if LUA_VERSION_NUM >= 502
+        case LUA_HOOKTAILCALL:
+            return LUA_MASKCALL;
+#else
+        case LUA_HOOKTAILRET:
+            return LUA_MASKRET;
+#endif
+        default:
+            return LUA_MASKCOUNT;
+    }
+}
+
+/**
+ * Gives an event to the debug hook set from python, at once or in a batch
+ */
+static void pylua_hook_user(LuaStateObject* root, lua_State* L, lua_Debug* ar) {
+    if (root->hookbatch) {
+        pylua_hook_batched(L, ar);
+    } else {
+        pylua_hook_python(L, ar);
+    }
+}
+
+/**
+ * Builtin debug hook, dispatching to everything which needs one:
+ * the time limit, the profiler, the tracer, the coverage and the python hook.
+ * Each is only given the events it asked for (see pylua_set_builtin_hook).
  */
 void pylua_hook_builtin(lua_State* L, lua_Debug* ar) {
+    // lines are for the coverage, calls and returns for the tracer (and the coverage)
+    if (ar->event != LUA_HOOKCOUNT) {
+        LuaStateObject* root = pylua_get_root(L);
+        struct Coverage* cov = root->coverage;
+        struct Tracer* tr = root->tracer;
+        
+        if (ar->event == LUA_HOOKLINE) {
+            if (cov && cov->running)
+                pylua_coverage_line(cov, L, ar);
+            
+        } else {
+            if (tr && tr->running)
+                pylua_tracer_hook(tr, L, ar);
+            if (cov && cov->running && cov->functions)
+                pylua_coverage_call(cov, L, ar);
+        }
+        
+        // last, as it may raise
+        if (root->hook && (root->hookmask & pylua_hook_mask(ar->event)))
+            pylua_hook_user(root, L, ar);
+        return;
+    }
+    
+    // coroutines made by lua have no info
     struct LuaStateInfo* info = pylua_get_stateinfo(L, L);
+    LuaStateObject* root = pylua_get_root(L);
+    
+    if (root->profiler && root->profiler->running)
+        pylua_profiler_hook(root->profiler, L);
+    
+    // past the soft memory limit
+    if (root->gcpending)
+        pylua_collect_pending(L, root);
+    
+    // the python hook, once its own interval has run
+    if (root->hook && (root->hookmask & LUA_MASKCOUNT) && root->hookcount) {
+        root->hookelapsed += root->hookstep;
+        if (root->hookelapsed >= root->hookcount) {
+            root->hookelapsed = 0;
+            pylua_hook_user(root, L, ar);
+        }
+    }
+    
+    // should we limit execution time? coroutines made by lua
+    // are limited by the call of the state, if they run in it
+    if (!info)
+        info = &root->info;
     
-    // should we limit execution time?
     if (info->depth && info->timelimit) {
         // get current execution time
         struct timeb time;
@@ -72,14 +161,96 @@ void pylua_hook_builtin(lua_State* L, lua_Debug* ar) {
     }
 }
 
+/**
+ * Sets the builtin hook on the main thread and the threads made from python
+ * (LuaThreads and async calls), with the count needed by
+ * the time limit, the profiler and the python hook, on calls and returns
+ * for the tracer, on lines for the coverage, and on the events of the
+ * python hook, or removes it if none of them is used.
+ * The count is the smallest asked, and each of them keeps its own.
+ *
+ * Threads made afterwards inherit it. Coroutines made by lua can't be found:
+ * they keep the hook they were made with, until they are done.
+ */
+void pylua_set_builtin_hook(LuaStateObject* self) {
+    int count = self->info.timelimit * 250;
+    struct Profiler* prof = self->profiler;
+    
+    if (prof && prof->running) {
+        int needed = prof->instructions ? (int)prof->instructions : PYLUA_PROFILER_CHECK;
+        if (!count || needed < count)
+            count = needed;
+    }
+    
+    int hookmask = self->hook ? self->hookmask : 0;
+    if ((hookmask & LUA_MASKCOUNT) && self->hookcount) {
+        if (!count || self->hookcount < count)
+            count = self->hookcount;
+    }
+    
+    if (prof)
+        prof->hookcount = count;
+    self->hookstep = count;
+    
+    int mask = (count ? LUA_MASKCOUNT : 0) | (hookmask & ~LUA_MASKCOUNT);
+    if (self->tracer && self->tracer->running)
+        mask |= LUA_MASKCALL | LUA_MASKRET;
+    if (self->coverage && self->coverage->running)
+        mask |= self->coverage->functions ? LUA_MASKLINE | LUA_MASKCALL : LUA_MASKLINE;
+    
+    lua_Hook hook = mask ? &pylua_hook_builtin : NULL;
+    if (!mask)
+        count = 0;
+    
+    lua_State* L = self->info.state;
+    lua_sethook(L, hook, mask, count);
+    
+    // the threads made from python are the ones with an info in the registry
+    lua_pushnil(L);
+    while (lua_next(L, LUA_REGISTRYINDEX)) {
+        if (lua_type(L, -2) == LUA_TLIGHTUSERDATA && lua_type(L, -1) == LUA_TUSERDATA) {
+#if LUA_VERSION_NUM >= 502
+            size_t size = lua_rawlen(L, -1);
+#else
+            size_t size = lua_objlen(L, -1);
+#endif
+            struct LuaStateInfo* info = (struct LuaStateInfo*)lua_touserdata(L, -1);
+            if (size == sizeof *info && info->state == lua_touserdata(L, -2))
+                lua_sethook(info->state, hook, mask, count);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+
+/**
+ * Returns the info holding the python thread state, for the python hook.
+ * Coroutines made by lua have none: they run in the call of the state,
+ * if it released the GIL, or else in one of a LuaThread, which can't be
+ * found, and the event is dropped.
+ */
+static struct LuaStateInfo* pylua_hook_info(lua_State* L) {
+    struct LuaStateInfo* info = pylua_get_stateinfo(L, L);
+    if (info)
+        return info;
+    
+    info = &pylua_get_root(L)->info;
+    return info->thstate ? info : NULL;
+}
 
 /**
  * Debug hook for Python functions
  */
 void pylua_hook_python(lua_State* L, lua_Debug* ar) {
-    struct LuaStateInfo* info = pylua_get_stateinfo(L, L);
+    struct LuaStateInfo* info = pylua_hook_info(L);
+    if (!info)
+        return;
+    
     PyEval_RestoreThread(info->thstate);
     
+    // the hook may run lua code again
+    info->thstate = NULL;
+    
     PyObject* evt = PyLong_FromLong(ar->event);
     PyObject* args;
     
@@ -92,9 +263,169 @@ void pylua_hook_python(lua_State* L, lua_Debug* ar) {
     
     
     PyObject* res = pylua_call_pyobject(info, info->root->hook, args);
+    Py_DECREF(res);
+    
+    info->thstate = PyEval_SaveThread();
+}
+
+
+/**
+ * Allocates a batch of `size` hook events, or returns NULL if out of memory
+ */
+struct HookBatch* pylua_hookbatch_new(int size) {
+    struct HookBatch* batch = malloc(sizeof *batch);
+    if (!batch)
+        return NULL;
+    
+    batch->events = malloc((size_t)size * sizeof *batch->events);
+    if (!batch->events) {
+        free(batch);
+        return NULL;
+    }
+    
+    batch->size = size;
+    batch->count = 0;
+    batch->lost = 0;
+    return batch;
+}
+
+/**
+ * Frees a batch of hook events
+ */
+void pylua_hookbatch_free(struct HookBatch* batch) {
+    if (batch) {
+        free(batch->events);
+        free(batch);
+    }
+}
+
+/**
+ * Returns the events of a batch as a list of (event, line, source, name)
+ * tuples, and empties it, even if that fails. Needs the GIL.
+ * Warns about the events dropped since the last time.
+ *
+ * Sources and names may not be valid UTF-8 (or be cut in the middle
+ * of a character), so they are decoded with replacement.
+ */
+static PyObject* pylua_hookbatch_list(struct HookBatch* batch) {
+    int count = batch->count;
+    batch->count = 0;
+    
+    if (batch->lost) {
+        Py_ssize_t lost = batch->lost;
+        batch->lost = 0;
+        if (PyErr_WarnFormat(PyExc_RuntimeWarning, 1, "%zd debug hook events were dropped, as the batch was full", lost) < 0)
+            return NULL;
+    }
+    
+    PyObject* list = PyList_New(count);
+    if (!list)
+        return NULL;
+    
+    for (int i = 0; i < count; i++) {
+        struct HookEvent* evt = &batch->events[i];
+        
+        PyObject* source = PyUnicode_DecodeUTF8(evt->source, (Py_ssize_t)strlen(evt->source), "replace");
+        PyObject* name = Py_None;
+        if (evt->named) {
+            name = PyUnicode_DecodeUTF8(evt->name, (Py_ssize_t)strlen(evt->name), "replace");
+        } else {
+            Py_INCREF(name);
+        }
+        
+        PyObject* item = source && name
+            ? Py_BuildValue("(iiNN)", evt->event, evt->line, source, name)
+            : NULL;
+        
+        if (!item) {
+            if (!source || !name) {
+                Py_XDECREF(source);
+                Py_XDECREF(name);
+            }
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    
+    return list;
+}
+
+/**
+ * Debug hook for Python functions taking events in batches:
+ * an event is only recorded, and the hook is called with the list of them
+ * once the batch is full, or when the call from python returns
+ */
+void pylua_hook_batched(lua_State* L, lua_Debug* ar) {
+    struct HookBatch* batch = pylua_get_root(L)->hookbatch;
+    
+    // in a coroutine made by lua within a LuaThread, the batch can't be
+    // given until the call returns, and the newest events are dropped
+    if (batch->count >= batch->size) {
+        batch->lost++;
+        return;
+    }
+    
+    struct HookEvent* evt = &batch->events[batch->count++];
+    
+    evt->event = ar->event;
+    lua_getinfo(L, "nSl", ar);
+    evt->line = ar->currentline;
+    memcpy(evt->source, ar->short_src, sizeof evt->source);
+    
+    evt->named = ar->name != NULL;
+    if (ar->name) {
+        strncpy(evt->name, ar->name, sizeof evt->name - 1);
+        evt->name[sizeof evt->name - 1] = '\0';
+    }
+    
+    if (batch->count < batch->size)
+        return;
+    
+    struct LuaStateInfo* info = pylua_hook_info(L);
+    if (!info)
+        return;
+    
+    PyEval_RestoreThread(info->thstate);
+    
+    // the hook may run lua code again
+    info->thstate = NULL;
+    
+    PyObject* list = pylua_hookbatch_list(batch);
+    PyObject* args = list ? PyTuple_Pack(1, list) : NULL;
+    Py_XDECREF(list);
+    
+    if (!args) {
+        info->thstate = PyEval_SaveThread();
+        lua_pushstring(L, "failed to convert hook events");
+        lua_error(L);
+    }
+    
+    PyObject* res = pylua_call_pyobject(info, info->root->hook, args);
+    Py_DECREF(res);
+    
     info->thstate = PyEval_SaveThread();
+}
+
+/**
+ * Gives the pending events of a batched hook to it, once lua code
+ * is done running. Needs the GIL ; errors of the hook are unraisable.
+ */
+void pylua_flush_hook(LuaStateObject* self) {
+    if (!self->hook || !self->hookbatch || !self->hookbatch->count)
+        return;
+    
+    PyObject* hook = self->hook;
+    Py_INCREF(hook);
     
-    return NULL;
+    PyObject* list = pylua_hookbatch_list(self->hookbatch);
+    PyObject* res = list ? PyObject_CallOneArg(hook, list) : NULL;
+    Py_XDECREF(list);
+    
+    if (!res)
+        PyErr_WriteUnraisable(hook);
+    Py_XDECREF(res);
+    Py_DECREF(hook);
 }
 
 
@@ -105,15 +436,28 @@ int pylua_panic(lua_State* L) {
     // set the python error    
     struct LuaStateInfo* info = pylua_get_stateinfo(L, L);
     
+    // we may be running lua code without the GIL
+    PyThreadState* detached = NULL;
+    if (!pylua_current_thread()) {
+        detached = info->thstate;
+        PyEval_RestoreThread(detached);
+    }
+    
     if (!PyErr_Occurred()) {
         PyObject* value = pylua_get_as_unicode(L, -1);
-        PyErr_SetObject(LuaFatalError, value);
+        PyErr_SetObject(info->root->module->LuaFatalError, value);
         Py_DECREF(value);
     }
 
     lua_close(L);
     info->state = NULL;
     
+    pylua_slab_free(info->root->slab);
+    info->root->slab = NULL;
+    
+    if (detached)
+        info->thstate = PyEval_SaveThread();
+    
     if (info->panic) {
         longjmp(info->panic->buf, 0);
     } else {
@@ -123,6 +467,50 @@ int pylua_panic(lua_State* L) {
 }
 
 
+/**
+ * Checks if a block can grow from `osize` to `nsize` bytes,
+ * within the memory limit and the budgets of the running code.
+ *
+ * The allocator can't collect: lua may be halfway through building an object.
+ * Lua 5.2 and later collect when it fails, and try again.
+ */
+int pylua_can_alloc(LuaStateObject* self, size_t osize, size_t nsize) {
+    if (nsize <= osize)
+        return 1;
+    
+    size_t delta = nsize - osize;
+    if (self->mem + delta > self->limit)
+        return 0;
+    
+    for (struct MemBudget* budget = self->budget; budget; budget = budget->outer) {
+        if (budget->used + delta > budget->limit)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Accounts for a block going from `osize` to `nsize` bytes,
+ * and asks for a collection when crossing the soft limit,
+ * run later from a safe point (see pylua_collect_pending).
+ *
+ * Frees are charged to the running code as well, whoever allocated the block.
+ */
+void pylua_account(LuaStateObject* self, size_t osize, size_t nsize) {
+    size_t before = self->mem;
+    self->mem += nsize - osize;
+    
+    if (before <= self->softlimit && self->mem > self->softlimit)
+        self->gcpending = 1;
+    
+    for (struct MemBudget* budget = self->budget; budget; budget = budget->outer) {
+        if (nsize >= osize)
+            budget->used += nsize - osize;
+        else
+            budget->used -= osize - nsize < budget->used ? osize - nsize : budget->used;
+    }
+}
+
 /**
  * Custom alloc function for lua
  * Checks if there's enough available memory before allocating
@@ -138,19 +526,19 @@ void* pylua_alloc(LuaStateObject* self, void* ptr, size_t osize, size_t nsize) {
     // lua knows its size, so we're just gonna free and remove the size
     if (nsize == 0) {
         free(ptr);
-        self->mem -= osize;
+        pylua_account(self, osize, 0);
         return NULL;
     }
 
     // we're here for allocating ; but do we have enough memory?
-    if (self->mem + (nsize - osize) > self->limit)
+    if (!pylua_can_alloc(self, osize, nsize))
         return NULL;
 
     // apparently we do have enough memory, so let's realloc
     ptr = realloc(ptr, nsize);
 
     if (ptr)
-        self->mem += (nsize - osize);
+        pylua_account(self, osize, nsize);
 
     return ptr;
 }
@@ -158,11 +546,23 @@ void* pylua_alloc(LuaStateObject* self, void* ptr, size_t osize, size_t nsize) {
 
 /**
  * Handler for garbage collecting of a python object in metatables
+ *
+ * The collector may run while lua code is running without the GIL,
+ * in which case the object is released later (see pylua_unlock).
  */
 int pylua_gc(lua_State* L) {
-    PyObject** obj = (PyObject**)lua_touserdata(L, -1);
-    Py_XDECREF(*obj);
-    *obj = NULL;
+    struct PyRef* ref = (struct PyRef*)lua_touserdata(L, -1);
+    LuaStateObject* root = pylua_get_root(L);
+    pylua_unlink_pyref(root, ref);
+    
+    if (ref->obj) {
+        if (pylua_current_thread()) {
+            Py_DECREF(ref->obj);
+        } else {
+            pylua_defer_decref(root, ref->obj);
+        }
+    }
+    ref->obj = NULL;
     return 0;
 }
 
@@ -177,6 +577,45 @@ int pylua_tostring(lua_State* L) {
 }
 
 
+#if LUA_VERSION_NUM >= 503
+/**
+ * Continuation of pylua_call_python, once the awaited object completed.
+ * The resumer pushed a success flag, followed by the results or an error message.
+ */
+static int pylua_call_python_k(lua_State* L, int status, lua_KContext ctx) {
+    if (!lua_toboolean(L, 1))
+        return lua_error(L);
+    
+    lua_remove(L, 1);
+    return lua_gettop(L);
+}
+#endif
+
+
+/**
+ * Suspends the lua thread until the awaitable returned by
+ * a python callback completes (see pylua_async.c).
+ * Steals the reference to `awaitable`.
+ */
+static int pylua_await_python(lua_State* L, struct LuaStateInfo* info, PyObject* awaitable) {
+#if LUA_VERSION_NUM >= 503
+    if (info->async && lua_isyieldable(L)) {
+        // the resumer picks it up from there
+        info->awaiting = awaitable;
+        info->thstate = PyEval_SaveThread();
+        return lua_yieldk(L, 0, 0, &pylua_call_python_k);
+    }
+#endif
+    
+    Py_DECREF(awaitable);
+    info->thstate = PyEval_SaveThread();
+    
+    lua_pushstring(L, "cannot await python object outside of call_async");
+    lua_error(L);
+    return 0;
+}
+
+
 /**
  * Handler for lua -> python calls
  */
@@ -190,12 +629,17 @@ int pylua_call_python(lua_State* L) {
     // okay, the issue here is that we need the GIL
     PyEval_RestoreThread(info->thstate);
     
+    // the GIL is ours while the callback runs, so it may
+    // call lua code again (see pylua_call)
+    info->thstate = NULL;
+    
     // get argc
     int argc = lua_gettop(L);
     
     // remove args, we don't care anymore about them
     PyObject* args = pylua_to_tuple(info, argc);
     if (!args) {
+        info->thstate = PyEval_SaveThread();
         lua_pushstring(L, "failed to convert to python args");
         lua_error(L);
         return 0;
@@ -203,8 +647,17 @@ int pylua_call_python(lua_State* L) {
     
     PyObject* func = *(PyObject**)lua_touserdata(L, lua_upvalueindex(1));
     
+    // the call is the callback's, for the tracer
+    struct Tracer* tr = info->root->tracer;
+    if (tr && tr->running)
+        pylua_tracer_python(tr, L, func);
+    
     // attempt to call the function
     PyObject* res = pylua_call_pyobject(info, func, args);
+    
+    // async callbacks suspend the lua thread
+    if (pylua_is_awaitable(res))
+        return pylua_await_python(L, info, res);
 
     // arg handling:
     // if it's a tuple, unpack it, otherwise, single arg
@@ -4,9 +4,45 @@
 #include "pylua.h"
 #include "pylua_state.h"
 
+// The python thread state attached to the current thread, NULL if we don't hold the GIL
+#if PY_VERSION_HEX >= 0x030D0000
+#   define pylua_current_thread() PyThreadState_GetUnchecked()
+#else
+#   define pylua_current_thread() _PyThreadState_UncheckedGet()
+#endif
+
+// Size of the function names in batched hook events
+#define PYLUA_HOOK_NAME 48
+
+// A hook event, as recorded for a batch
+struct HookEvent {
+    int event;
+    int line;
+    char source[LUA_IDSIZE];
+    char name[PYLUA_HOOK_NAME];
+    int named;
+};
+
+// Events waiting to be given to the python hook at once
+struct HookBatch {
+    struct HookEvent* events;
+    int size;
+    int count;
+    
+    // Events dropped as the batch was full, with no python thread to give it to
+    Py_ssize_t lost;
+};
+
 void pylua_hook_builtin(lua_State* L, lua_Debug* ar);
 void pylua_hook_python(lua_State* L, lua_Debug* ar);
+void pylua_hook_batched(lua_State* L, lua_Debug* ar);
+struct HookBatch* pylua_hookbatch_new(int size);
+void pylua_hookbatch_free(struct HookBatch* batch);
+void pylua_flush_hook(LuaStateObject* self);
+void pylua_set_builtin_hook(LuaStateObject* self);
 int pylua_panic(lua_State* L);
+int pylua_can_alloc(LuaStateObject* self, size_t osize, size_t nsize);
+void pylua_account(LuaStateObject* self, size_t osize, size_t nsize);
 void* pylua_alloc(LuaStateObject* self, void* ptr, size_t osize, size_t nsize);
 int pylua_gc(lua_State* L);
 int pylua_tostring(lua_State* L);
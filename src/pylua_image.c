@@ -0,0 +1,881 @@
+#include "pylua_image.h"
+#include "pylua_chunk.h"
+#include "pylua_python.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+    An image holds the globals, the loaded packages and the metatables
+    of the basic types of a state, along with everything reachable from them:
+    tables, lua closures (as bytecode, with their upvalues) and python-backed values
+    (saved through a user hook). Objects are numbered as they are saved, so that
+    shared objects and cycles are kept as they are.
+    
+    C functions and other userdata can't be saved: they must be permanents,
+    saved by name. The functions and userdata of the loaded packages are permanents
+    ("string.format", "io.stdout"...), and more can be given by the user.
+    
+    Loading an image replaces the globals and loaded packages of a state.
+    Images are not verified: just like bytecode, they must come from a trusted source.
+*/
+
+#define PYLUA_IMAGE_MAGIC   "PYLUAIMG"
+#define PYLUA_IMAGE_FORMAT  1
+
+// Maximum nesting of tables and functions
+#define PYLUA_IMAGE_DEPTH   200
+
+// Stack indices, in pylua_save_image and pylua_load_image
+#define PYLUA_IMAGE_PERMS       2   // value -> name when saving, name -> value when loading
+#define PYLUA_IMAGE_OBJECTS     3   // object -> id when saving, id -> object when loading
+#define PYLUA_IMAGE_UPVALUES    4   // upvalue id -> function id * 256 + index, when saving
+
+// Value tags
+#define PYLUA_IMAGE_NIL     0
+#define PYLUA_IMAGE_FALSE   1
+#define PYLUA_IMAGE_TRUE    2
+#define PYLUA_IMAGE_INT     3
+#define PYLUA_IMAGE_NUM     4
+#define PYLUA_IMAGE_STRING  5
+#define PYLUA_IMAGE_REF     6
+#define PYLUA_IMAGE_PERM    7
+#define PYLUA_IMAGE_TABLE   8
+#define PYLUA_IMAGE_LFUNC   9
+#define PYLUA_IMAGE_PYFUNC  10
+#define PYLUA_IMAGE_PYUDATA 11
+
+// Types sharing a metatable
+static const int pylua_image_types[] = {
+    LUA_TNIL, LUA_TBOOLEAN, LUA_TLIGHTUSERDATA, LUA_TNUMBER, LUA_TSTRING, LUA_TFUNCTION, LUA_TTHREAD
+};
+
+#define PYLUA_IMAGE_TYPES ((int)(sizeof pylua_image_types / sizeof pylua_image_types[0]))
+
+/**
+ * Only used as a value of type function
+ */
+static int pylua_image_nop(lua_State* L) {
+    return 0;
+}
+
+/**
+ * Pushes a value of a basic type
+ */
+static void pylua_image_push_basic(lua_State* L, int type) {
+    switch (type) {
+        case LUA_TBOOLEAN:
+            lua_pushboolean(L, 0);
+            break;
+        case LUA_TLIGHTUSERDATA:
+            lua_pushlightuserdata(L, NULL);
+            break;
+        case LUA_TNUMBER:
+            lua_pushinteger(L, 0);
+            break;
+        case LUA_TSTRING:
+            lua_pushliteral(L, "");
+            break;
+        case LUA_TFUNCTION:
+            lua_pushcfunction(L, &pylua_image_nop);
+            break;
+        case LUA_TTHREAD:
+            lua_pushthread(L);
+            break;
+        default:
+            lua_pushnil(L);
+            break;
+    }
+}
+
+/**
+ * Images are made with the GIL released (see pylua_state_protected):
+ * it is taken back around python code, and given back before any lua error.
+ * Lua allocates as little as possible in between, its memory errors come
+ * back to pylua_pcall_released with the GIL held.
+ */
+static struct LuaStateInfo* pylua_image_acquire(lua_State* L) {
+    struct LuaStateInfo* info = pylua_get_stateinfo(L, L);
+    PyEval_RestoreThread(info->thstate);
+    info->thstate = NULL;
+    return info;
+}
+
+static void pylua_image_release(struct LuaStateInfo* info) {
+    info->thstate = PyEval_SaveThread();
+}
+
+/**
+ * Raised when a python exception occured, which takes precedence.
+ * Gives the GIL back first.
+ */
+static int pylua_image_pyerror(lua_State* L, struct LuaStateInfo* info) {
+    pylua_image_release(info);
+    return luaL_error(L, "python exception");
+}
+
+/**
+ * Gives the next id to the object at `idx`
+ */
+static void pylua_image_register(lua_State* L, struct Image* img, int idx, int saving) {
+    img->count++;
+    if (saving) {
+        lua_pushvalue(L, idx);
+        lua_pushinteger(L, img->count);
+    } else {
+        lua_pushinteger(L, img->count);
+        lua_pushvalue(L, idx);
+    }
+    lua_rawset(L, PYLUA_IMAGE_OBJECTS);
+}
+
+/**
+ * Pushes the permanents table: the C functions and userdata of the
+ * loaded packages, named after them, then the ones given by the user
+ */
+static void pylua_image_permanents(lua_State* L, struct Image* img, int saving) {
+    lua_newtable(L);
+    
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    int loaded = lua_gettop(L);
+    if (lua_istable(L, loaded)) {
+        lua_pushnil(L);
+        while (lua_next(L, loaded)) {
+            if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1)) {
+                lua_pushnil(L);
+                while (lua_next(L, -2)) {
+                    int type = lua_type(L, -1);
+                    int perm = type == LUA_TUSERDATA || type == LUA_TLIGHTUSERDATA || lua_iscfunction(L, -1);
+                    
+                    if (perm && lua_type(L, -2) == LUA_TSTRING && !pylua_to_pycallable(L, -1) && !pylua_to_pyuserdata(L, -1)) {
+                        lua_pushfstring(L, "%s.%s", lua_tostring(L, -4), lua_tostring(L, -2));
+                        
+                        // the first name wins when saving
+                        if (saving) {
+                            lua_pushvalue(L, -2);
+                            lua_rawget(L, PYLUA_IMAGE_PERMS);
+                            int named = !lua_isnil(L, -1);
+                            lua_pop(L, 1);
+                            
+                            if (!named) {
+                                lua_pushvalue(L, -2);
+                                lua_insert(L, -2);
+                                lua_rawset(L, PYLUA_IMAGE_PERMS);
+                            } else {
+                                lua_pop(L, 1);
+                            }
+                        } else {
+                            lua_pushvalue(L, -2);
+                            lua_rawset(L, PYLUA_IMAGE_PERMS);
+                        }
+                    }
+                    lua_pop(L, 1);
+                }
+            }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+    
+    if (!img->permanents)
+        return;
+    
+    struct LuaStateInfo* info = pylua_image_acquire(L);
+    
+    PyObject* name;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(img->permanents, &pos, &name, &value)) {
+        if (!PyUnicode_Check(name)) {
+            PyErr_SetString(PyExc_TypeError, "permanent names must be str");
+            pylua_image_pyerror(L, info);
+        }
+        
+        if (pylua_push_pyobj(L, name) < 0 || pylua_push_pyobj(L, value) < 0)
+            pylua_image_pyerror(L, info);
+        
+        if (saving)
+            lua_insert(L, -2);
+        lua_rawset(L, PYLUA_IMAGE_PERMS);
+    }
+    
+    pylua_image_release(info);
+}
+
+
+/**
+ * Appends bytes to the image
+ */
+static void pylua_image_put(lua_State* L, struct Image* img, const void* data, size_t size) {
+    if (pylua_buffer_write(&img->buf, data, size) < 0)
+        luaL_error(L, "not enough memory");
+}
+
+/**
+ * Appends a byte to the image
+ */
+static void pylua_image_putc(lua_State* L, struct Image* img, unsigned char c) {
+    if (pylua_buffer_putc(&img->buf, c) < 0)
+        luaL_error(L, "not enough memory");
+}
+
+/**
+ * Appends a size to the image, 7 bits at a time
+ */
+static void pylua_image_putsize(lua_State* L, struct Image* img, size_t n) {
+    while (n >= 0x80) {
+        pylua_image_putc(L, img, (unsigned char)(n | 0x80));
+        n >>= 7;
+    }
+    pylua_image_putc(L, img, (unsigned char)n);
+}
+
+/**
+ * Appends a string to the image, after its length
+ */
+static void pylua_image_putstring(lua_State* L, struct Image* img, int idx) {
+    size_t len;
+    const char* str = lua_tolstring(L, idx, &len);
+    pylua_image_putsize(L, img, len);
+    pylua_image_put(L, img, str, len);
+}
+
+static void pylua_image_write(lua_State* L, struct Image* img, int idx);
+
+/**
+ * Saves the content of a table (which is already known), then its metatable
+ */
+static void pylua_image_write_table(lua_State* L, struct Image* img, int t) {
+    lua_pushnil(L);
+    while (lua_next(L, t)) {
+        pylua_image_write(L, img, -2);
+        pylua_image_write(L, img, -1);
+        lua_pop(L, 1);
+    }
+    
+    // keys are never nil
+    pylua_image_putc(L, img, PYLUA_IMAGE_NIL);
+    
+    if (lua_getmetatable(L, t)) {
+        pylua_image_write(L, img, -1);
+        lua_pop(L, 1);
+    } else {
+        pylua_image_putc(L, img, PYLUA_IMAGE_NIL);
+    }
+}
+
+/**
+ * Saves a lua closure: its bytecode (with debug info), then its upvalues.
+ * Shared upvalues are saved once, then joined.
+ */
+static void pylua_image_write_function(lua_State* L, struct Image* img, int f) {
+    pylua_image_register(L, img, f, 1);
+    lua_Integer id = img->count;
+    
+    pylua_image_putc(L, img, PYLUA_IMAGE_LFUNC);
+    
+    // the size is only known once dumped
+    uint64_t size = 0;
+    size_t start = img->buf.size;
+    pylua_image_put(L, img, &size, sizeof size);
+    
+    lua_pushvalue(L, f);
+    int err = pylua_dump(L, &img->buf, 0);
+    lua_pop(L, 1);
+    if (err)
+        luaL_error(L, "not enough memory");
+    
+    size = (uint64_t)(img->buf.size - start - sizeof size);
+    memcpy(img->buf.data + start, &size, sizeof size);
+    
+    int nups = 0;
+    while (lua_getupvalue(L, f, nups + 1)) {
+        lua_pop(L, 1);
+        nups++;
+    }
+    pylua_image_putsize(L, img, (size_t)nups);
+    
+    for (int i = 1; i <= nups; i++) {
+#if LUA_VERSION_NUM >= 502
+        lua_pushlightuserdata(L, lua_upvalueid(L, f, i));
+        lua_rawget(L, PYLUA_IMAGE_UPVALUES);
+        if (!lua_isnil(L, -1)) {
+            lua_Integer other = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            
+            pylua_image_putc(L, img, 1);
+            pylua_image_putsize(L, img, (size_t)(other / 256));
+            pylua_image_putc(L, img, (unsigned char)(other % 256));
+            continue;
+        }
+        lua_pop(L, 1);
+        
+        lua_pushlightuserdata(L, lua_upvalueid(L, f, i));
+        lua_pushinteger(L, id * 256 + i);
+        lua_rawset(L, PYLUA_IMAGE_UPVALUES);
+        
+        pylua_image_putc(L, img, 0);
+#endif
+        lua_getupvalue(L, f, i);
+        pylua_image_write(L, img, -1);
+        lua_pop(L, 1);
+    }
+    
+#if LUA_VERSION_NUM <= 501
+    lua_getfenv(L, f);
+    pylua_image_write(L, img, -1);
+    lua_pop(L, 1);
+#endif
+}
+
+/**
+ * Saves a python-backed value, through the persist hook
+ */
+static void pylua_image_write_python(lua_State* L, struct Image* img, int tag, PyObject* obj) {
+    if (!img->hook)
+        luaL_error(L, "cannot save a python object without a persist hook");
+    
+    struct LuaStateInfo* info = pylua_image_acquire(L);
+    
+    PyObject* res = PyObject_CallFunctionObjArgs(img->hook, obj, NULL);
+    if (!res)
+        pylua_image_pyerror(L, info);
+    
+    Py_buffer view;
+    if (PyObject_GetBuffer(res, &view, PyBUF_SIMPLE) < 0) {
+        Py_DECREF(res);
+        pylua_image_pyerror(L, info);
+    }
+    
+    // no lua error until it is released
+    int err = pylua_buffer_putc(&img->buf, (unsigned char)tag);
+    size_t n = (size_t)view.len;
+    while (!err && n >= 0x80) {
+        err = pylua_buffer_putc(&img->buf, (unsigned char)(n | 0x80));
+        n >>= 7;
+    }
+    if (!err)
+        err = pylua_buffer_putc(&img->buf, (unsigned char)n);
+    if (!err)
+        err = pylua_buffer_write(&img->buf, view.buf, (size_t)view.len);
+    
+    PyBuffer_Release(&view);
+    Py_DECREF(res);
+    pylua_image_release(info);
+    
+    if (err)
+        luaL_error(L, "not enough memory");
+}
+
+/**
+ * Saves the value at `idx`
+ */
+static void pylua_image_write(lua_State* L, struct Image* img, int idx) {
+    if (idx < 0)
+        idx = lua_gettop(L) + idx + 1;
+    
+    int type = lua_type(L, idx);
+    switch (type) {
+        case LUA_TNIL:
+            pylua_image_putc(L, img, PYLUA_IMAGE_NIL);
+            return;
+        
+        case LUA_TBOOLEAN:
+            pylua_image_putc(L, img, lua_toboolean(L, idx) ? PYLUA_IMAGE_TRUE : PYLUA_IMAGE_FALSE);
+            return;
+        
+        case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+            if (lua_isinteger(L, idx)) {
+                lua_Integer val = lua_tointeger(L, idx);
+                pylua_image_putc(L, img, PYLUA_IMAGE_INT);
+                pylua_image_put(L, img, &val, sizeof val);
+                return;
+            }
+#endif
+            {
+                lua_Number val = lua_tonumber(L, idx);
+                pylua_image_putc(L, img, PYLUA_IMAGE_NUM);
+                pylua_image_put(L, img, &val, sizeof val);
+            }
+            return;
+        
+        case LUA_TSTRING:
+            pylua_image_putc(L, img, PYLUA_IMAGE_STRING);
+            pylua_image_putstring(L, img, idx);
+            return;
+    }
+    
+    luaL_checkstack(L, 8, "image too deep");
+    
+    // permanents are saved by name
+    lua_pushvalue(L, idx);
+    lua_rawget(L, PYLUA_IMAGE_PERMS);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        pylua_image_putc(L, img, PYLUA_IMAGE_PERM);
+        pylua_image_putstring(L, img, -1);
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+    
+    // objects saved before are saved by id
+    lua_pushvalue(L, idx);
+    lua_rawget(L, PYLUA_IMAGE_OBJECTS);
+    if (!lua_isnil(L, -1)) {
+        pylua_image_putc(L, img, PYLUA_IMAGE_REF);
+        pylua_image_putsize(L, img, (size_t)lua_tointeger(L, -1));
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+    
+    if (++img->depth > PYLUA_IMAGE_DEPTH)
+        luaL_error(L, "image too deep");
+    
+    PyObject* obj;
+    switch (type) {
+        case LUA_TTABLE:
+            pylua_image_register(L, img, idx, 1);
+            pylua_image_putc(L, img, PYLUA_IMAGE_TABLE);
+            pylua_image_write_table(L, img, idx);
+            break;
+        
+        case LUA_TFUNCTION:
+            if (!lua_iscfunction(L, idx)) {
+                pylua_image_write_function(L, img, idx);
+                
+            } else if ((obj = pylua_to_pycallable(L, idx))) {
+                pylua_image_register(L, img, idx, 1);
+                pylua_image_write_python(L, img, PYLUA_IMAGE_PYFUNC, obj);
+                
+            } else {
+                luaL_error(L, "cannot save a C function which is not a permanent");
+            }
+            break;
+        
+        case LUA_TUSERDATA:
+            if (!(obj = pylua_to_pyuserdata(L, idx)))
+                luaL_error(L, "cannot save a userdata which is not a permanent");
+            
+            pylua_image_register(L, img, idx, 1);
+            pylua_image_write_python(L, img, PYLUA_IMAGE_PYUDATA, obj);
+            break;
+        
+        default:
+            luaL_error(L, "cannot save a %s", lua_typename(L, type));
+    }
+    
+    img->depth--;
+}
+
+/**
+ * Writes the header of an image: our format and lua build
+ */
+static void pylua_image_write_header(lua_State* L, struct Image* img) {
+    lua_Integer one = 1;
+    
+    pylua_image_put(L, img, PYLUA_IMAGE_MAGIC, sizeof(PYLUA_IMAGE_MAGIC) - 1);
+    pylua_image_putc(L, img, PYLUA_IMAGE_FORMAT);
+    pylua_image_putsize(L, img, LUA_VERSION_NUM);
+    pylua_image_putc(L, img, (unsigned char)sizeof(lua_Number));
+    pylua_image_putc(L, img, (unsigned char)sizeof(lua_Integer));
+    pylua_image_put(L, img, &one, sizeof one);
+}
+
+/**
+ * Saves the state to img->buf.
+ * This is a lua_CFunction, given the struct Image as a light userdata.
+ */
+int pylua_save_image(lua_State* L) {
+    struct Image* img = (struct Image*)lua_touserdata(L, 1);
+    luaL_checkstack(L, 16, NULL);
+    
+    pylua_image_permanents(L, img, 1);
+    lua_newtable(L); // objects
+    lua_newtable(L); // upvalues
+    
+    pylua_image_write_header(L, img);
+    
+    // globals and loaded packages are filled in place when loading
+#if LUA_VERSION_NUM >= 502
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#else
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+    int globals = lua_gettop(L);
+    pylua_image_register(L, img, globals, 1);
+    
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    int loaded = lua_gettop(L);
+    int hasloaded = lua_istable(L, loaded) && !lua_rawequal(L, loaded, globals);
+    if (hasloaded)
+        pylua_image_register(L, img, loaded, 1);
+    pylua_image_putc(L, img, (unsigned char)hasloaded);
+    
+    pylua_image_write_table(L, img, globals);
+    if (hasloaded)
+        pylua_image_write_table(L, img, loaded);
+    
+    for (int i = 0; i < PYLUA_IMAGE_TYPES; i++) {
+        pylua_image_push_basic(L, pylua_image_types[i]);
+        if (lua_getmetatable(L, -1)) {
+            pylua_image_write(L, img, -1);
+            lua_pop(L, 1);
+        } else {
+            pylua_image_putc(L, img, PYLUA_IMAGE_NIL);
+        }
+        lua_pop(L, 1);
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Reads bytes from the image
+ */
+static const char* pylua_image_get(lua_State* L, struct Image* img, size_t size) {
+    if (img->size - img->pos < size)
+        luaL_error(L, "truncated image");
+    
+    const char* res = img->data + img->pos;
+    img->pos += size;
+    return res;
+}
+
+/**
+ * Reads a byte from the image
+ */
+static unsigned char pylua_image_getc(lua_State* L, struct Image* img) {
+    return (unsigned char)*pylua_image_get(L, img, 1);
+}
+
+/**
+ * Reads a size from the image
+ */
+static size_t pylua_image_getsize(lua_State* L, struct Image* img) {
+    size_t n = 0;
+    for (int shift = 0; shift < (int)sizeof(size_t) * 8; shift += 7) {
+        unsigned char c = pylua_image_getc(L, img);
+        n |= (size_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return n;
+    }
+    
+    luaL_error(L, "corrupt image");
+    return 0;
+}
+
+/**
+ * Reads a string from the image, and pushes it
+ */
+static void pylua_image_getstring(lua_State* L, struct Image* img) {
+    size_t len = pylua_image_getsize(L, img);
+    const char* str = pylua_image_get(L, img, len);
+    lua_pushlstring(L, str, len);
+}
+
+static void pylua_image_read(lua_State* L, struct Image* img);
+
+/**
+ * Reads the content of a table, then its metatable
+ */
+static void pylua_image_read_table(lua_State* L, struct Image* img, int t) {
+    for (;;) {
+        if (img->pos < img->size && img->data[img->pos] == PYLUA_IMAGE_NIL) {
+            img->pos++;
+            break;
+        }
+        
+        pylua_image_read(L, img);
+        pylua_image_read(L, img);
+        lua_rawset(L, t);
+    }
+    
+    pylua_image_read(L, img);
+    if (lua_istable(L, -1)) {
+        lua_setmetatable(L, t);
+    } else if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+    } else {
+        luaL_error(L, "corrupt image");
+    }
+}
+
+/**
+ * Returns whether a function has an upvalue at index `n`
+ */
+static int pylua_image_has_upvalue(lua_State* L, int f, int n) {
+    if (!lua_getupvalue(L, f, n))
+        return 0;
+    
+    lua_pop(L, 1);
+    return 1;
+}
+
+/**
+ * Reads a lua closure and pushes it
+ */
+static void pylua_image_read_function(lua_State* L, struct Image* img) {
+    uint64_t size;
+    memcpy(&size, pylua_image_get(L, img, sizeof size), sizeof size);
+    if (size > img->size - img->pos)
+        luaL_error(L, "truncated image");
+    
+    const char* code = pylua_image_get(L, img, (size_t)size);
+    if (pylua_load_binary(L, code, (size_t)size, "=(image)"))
+        lua_error(L);
+    
+    int f = lua_gettop(L);
+    pylua_image_register(L, img, f, 0);
+    
+    size_t nups = pylua_image_getsize(L, img);
+    for (size_t i = 1; i <= nups; i++) {
+        if (i > 255 || !pylua_image_has_upvalue(L, f, (int)i))
+            luaL_error(L, "corrupt image");
+        
+#if LUA_VERSION_NUM >= 502
+        if (pylua_image_getc(L, img)) {
+            size_t other = pylua_image_getsize(L, img);
+            int n = pylua_image_getc(L, img);
+            
+            lua_pushinteger(L, (lua_Integer)other);
+            lua_rawget(L, PYLUA_IMAGE_OBJECTS);
+            if (!lua_isfunction(L, -1) || lua_iscfunction(L, -1) || !pylua_image_has_upvalue(L, -1, n))
+                luaL_error(L, "corrupt image");
+            
+            lua_upvaluejoin(L, f, (int)i, -1, n);
+            lua_pop(L, 1);
+            continue;
+        }
+#endif
+        pylua_image_read(L, img);
+        lua_setupvalue(L, f, (int)i);
+    }
+    
+#if LUA_VERSION_NUM <= 501
+    pylua_image_read(L, img);
+    if (!lua_istable(L, -1))
+        luaL_error(L, "corrupt image");
+    lua_setfenv(L, f);
+#endif
+}
+
+/**
+ * Reads a python-backed value, through the unpersist hook, and pushes it
+ */
+static void pylua_image_read_python(lua_State* L, struct Image* img, int tag) {
+    size_t len = pylua_image_getsize(L, img);
+    const char* data = pylua_image_get(L, img, len);
+    
+    if (!img->hook)
+        luaL_error(L, "cannot load a python object without an unpersist hook");
+    
+    // made first, and without the GIL, so that lua can't fail once the object is ours
+    PyObject** userdata;
+    if (tag == PYLUA_IMAGE_PYFUNC) {
+        pylua_push_pycallable(L, NULL);
+        lua_getupvalue(L, -1, 1);
+        userdata = (PyObject**)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+    } else {
+        pylua_push_pyuserdata(L, NULL);
+        userdata = (PyObject**)lua_touserdata(L, -1);
+    }
+    
+    struct LuaStateInfo* info = pylua_image_acquire(L);
+    
+    PyObject* bytes = PyBytes_FromStringAndSize(data, (Py_ssize_t)len);
+    if (!bytes)
+        pylua_image_pyerror(L, info);
+    
+    PyObject* obj = PyObject_CallFunctionObjArgs(img->hook, bytes, NULL);
+    Py_DECREF(bytes);
+    if (!obj)
+        pylua_image_pyerror(L, info);
+    
+    *userdata = obj;
+    pylua_image_release(info);
+    
+    pylua_image_register(L, img, lua_gettop(L), 0);
+}
+
+/**
+ * Reads a value, and pushes it
+ */
+static void pylua_image_read(lua_State* L, struct Image* img) {
+    luaL_checkstack(L, 8, "image too deep");
+    
+    unsigned char tag = pylua_image_getc(L, img);
+    switch (tag) {
+        case PYLUA_IMAGE_NIL:
+            lua_pushnil(L);
+            break;
+        
+        case PYLUA_IMAGE_FALSE:
+        case PYLUA_IMAGE_TRUE:
+            lua_pushboolean(L, tag == PYLUA_IMAGE_TRUE);
+            break;
+        
+        case PYLUA_IMAGE_INT: {
+            lua_Integer val;
+            memcpy(&val, pylua_image_get(L, img, sizeof val), sizeof val);
+            lua_pushinteger(L, val);
+            break;
+        }
+        
+        case PYLUA_IMAGE_NUM: {
+            lua_Number val;
+            memcpy(&val, pylua_image_get(L, img, sizeof val), sizeof val);
+            lua_pushnumber(L, val);
+            break;
+        }
+        
+        case PYLUA_IMAGE_STRING:
+            pylua_image_getstring(L, img);
+            break;
+        
+        case PYLUA_IMAGE_PERM:
+            pylua_image_getstring(L, img);
+            lua_pushvalue(L, -1);
+            lua_rawget(L, PYLUA_IMAGE_PERMS);
+            if (lua_isnil(L, -1))
+                luaL_error(L, "unknown permanent '%s'", lua_tostring(L, -2));
+            lua_remove(L, -2);
+            break;
+        
+        case PYLUA_IMAGE_REF:
+            lua_pushinteger(L, (lua_Integer)pylua_image_getsize(L, img));
+            lua_rawget(L, PYLUA_IMAGE_OBJECTS);
+            if (lua_isnil(L, -1))
+                luaL_error(L, "corrupt image");
+            break;
+        
+        case PYLUA_IMAGE_TABLE:
+            if (++img->depth > PYLUA_IMAGE_DEPTH)
+                luaL_error(L, "image too deep");
+            
+            lua_newtable(L);
+            pylua_image_register(L, img, lua_gettop(L), 0);
+            pylua_image_read_table(L, img, lua_gettop(L));
+            img->depth--;
+            break;
+        
+        case PYLUA_IMAGE_LFUNC:
+            if (++img->depth > PYLUA_IMAGE_DEPTH)
+                luaL_error(L, "image too deep");
+            
+            pylua_image_read_function(L, img);
+            img->depth--;
+            break;
+        
+        case PYLUA_IMAGE_PYFUNC:
+        case PYLUA_IMAGE_PYUDATA:
+            pylua_image_read_python(L, img, tag);
+            break;
+        
+        default:
+            luaL_error(L, "corrupt image");
+    }
+}
+
+/**
+ * Checks the header of an image against our format and lua build
+ */
+static void pylua_image_read_header(lua_State* L, struct Image* img) {
+    size_t len = sizeof(PYLUA_IMAGE_MAGIC) - 1;
+    if (img->size < len || memcmp(img->data, PYLUA_IMAGE_MAGIC, len) != 0)
+        luaL_error(L, "not a lua state image");
+    img->pos = len;
+    
+    if (pylua_image_getc(L, img) != PYLUA_IMAGE_FORMAT)
+        luaL_error(L, "unsupported image format");
+    
+    if (pylua_image_getsize(L, img) != LUA_VERSION_NUM)
+        luaL_error(L, "image was saved by another version of lua (" LUA_VERSION " is required)");
+    
+    lua_Integer one;
+    int nsize = pylua_image_getc(L, img);
+    int isize = pylua_image_getc(L, img);
+    if (nsize != sizeof(lua_Number) || isize != sizeof(lua_Integer))
+        luaL_error(L, "image was saved by an incompatible lua build");
+    
+    memcpy(&one, pylua_image_get(L, img, sizeof one), sizeof one);
+    if (one != 1)
+        luaL_error(L, "image was saved by an incompatible lua build");
+}
+
+/**
+ * Removes every field of a table
+ */
+static void pylua_image_clear(lua_State* L, int t) {
+    lua_pushnil(L);
+    while (lua_next(L, t)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, t);
+    }
+}
+
+/**
+ * Replaces the state with the image from img->data.
+ * This is a lua_CFunction, given the struct Image as a light userdata.
+ *
+ * If it fails, the state is left half loaded.
+ */
+int pylua_load_image(lua_State* L) {
+    struct Image* img = (struct Image*)lua_touserdata(L, 1);
+    luaL_checkstack(L, 16, NULL);
+    
+    // the permanents are those of the state as it is now
+    pylua_image_permanents(L, img, 0);
+    lua_newtable(L); // objects
+    
+    pylua_image_read_header(L, img);
+    
+#if LUA_VERSION_NUM >= 502
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#else
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+    int globals = lua_gettop(L);
+    pylua_image_register(L, img, globals, 0);
+    
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    }
+    int loaded = lua_gettop(L);
+    
+    int hasloaded = pylua_image_getc(L, img);
+    if (hasloaded)
+        pylua_image_register(L, img, loaded, 0);
+    
+    pylua_image_clear(L, globals);
+    pylua_image_read_table(L, img, globals);
+    
+    if (hasloaded) {
+        pylua_image_clear(L, loaded);
+        pylua_image_read_table(L, img, loaded);
+    }
+    
+    for (int i = 0; i < PYLUA_IMAGE_TYPES; i++) {
+        pylua_image_push_basic(L, pylua_image_types[i]);
+        pylua_image_read(L, img);
+        if (!lua_istable(L, -1) && !lua_isnil(L, -1))
+            luaL_error(L, "corrupt image");
+        
+        lua_setmetatable(L, -2);
+        lua_pop(L, 1);
+    }
+    
+    if (img->pos != img->size)
+        luaL_error(L, "corrupt image");
+    
+    return 0;
+}
\ No newline at end of file
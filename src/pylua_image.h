@@ -0,0 +1,31 @@
+#ifndef PYLUA_IMAGE_H
+#define PYLUA_IMAGE_H
+
+#include "pylua.h"
+#include "pylua_buffer.h"
+
+// Given to pylua_save_image and pylua_load_image
+struct Image {
+    // Python hook for python-backed values (persist or unpersist), or NULL
+    PyObject* hook;
+    
+    // Extra permanents (name -> value), or NULL
+    PyObject* permanents;
+    
+    // Image being written
+    struct Buffer buf;
+    
+    // Image being read
+    const char* data;
+    size_t size;
+    size_t pos;
+    
+    // Number of objects so far, and nesting depth
+    lua_Integer count;
+    int depth;
+};
+
+int pylua_save_image(lua_State* L);
+int pylua_load_image(lua_State* L);
+
+#endif
\ No newline at end of file
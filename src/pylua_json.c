@@ -0,0 +1,684 @@
+#include "pylua_json.h"
+#include "pylua_buffer.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    JSON, parsed directly to lua tables and strings, and encoded from them.
+    
+    Objects become tables with string keys, and arrays become sequences.
+    JSON null is nil (leaving holes in arrays), or a sentinel value if one is given.
+    Decoded arrays can be marked with a metatable, so that empty ones are encoded back as [].
+*/
+
+// Containers nested deeper than this are refused
+#define PYLUA_JSON_DEPTH 256
+
+// Metatable of the arrays marked by the decoder
+#define PYLUA_JSON_ARRAY "pylua.JsonArray"
+
+// Every byte of a word set to 0x01, and to 0x80
+#define PYLUA_ONES 0x0101010101010101ULL
+#define PYLUA_HIGHS 0x8080808080808080ULL
+
+// State of the decoder
+struct JsonReader {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+    
+    // Index of the null sentinel (0 for nil), and of the array metatable (0 if not marking)
+    int null;
+    int arrays;
+};
+
+// State of the encoder
+struct JsonWriter {
+    struct Buffer* buf;
+    
+    // Index of the null sentinel (0 if none), and of the array metatable
+    int null;
+    int arrays;
+    
+    // Whether empty tables are arrays
+    int empty;
+};
+
+
+/**
+ * Returns the length of the run of bytes which need no escaping in a JSON string,
+ * that is until a quote, a backslash or a control character
+ */
+static size_t pylua_json_plain(const unsigned char* p, size_t n) {
+    size_t i = 0;
+    
+    // a word at a time, as long as none of its bytes is special
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        
+        uint64_t quote = word ^ (PYLUA_ONES * '"');
+        uint64_t slash = word ^ (PYLUA_ONES * '\\');
+        uint64_t special = ((quote - PYLUA_ONES) & ~quote)
+                         | ((slash - PYLUA_ONES) & ~slash)
+                         | ((word - PYLUA_ONES * 0x20) & ~word);
+        
+        if (special & PYLUA_HIGHS)
+            break;
+    }
+    
+    while (i < n && p[i] != '"' && p[i] != '\\' && p[i] >= 0x20)
+        i++;
+    
+    return i;
+}
+
+/**
+ * Skips whitespace
+ */
+static void pylua_json_skip(struct JsonReader* r) {
+    while (r->pos < r->size) {
+        unsigned char c = r->data[r->pos];
+        if (c != ' ' && c != '\n' && c != '\r' && c != '\t')
+            break;
+        r->pos++;
+    }
+}
+
+/**
+ * Reads the 4 hex digits of a \u escape
+ */
+static int pylua_json_hex(const unsigned char* p, size_t n, uint32_t* value) {
+    if (n < 4)
+        return -1;
+    
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        unsigned char c = p[i];
+        uint32_t digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return -1;
+        
+        *value = (*value << 4) | digit;
+    }
+    return 0;
+}
+
+/**
+ * Pushes a string, the opening quote being already read
+ */
+static const char* pylua_json_string(lua_State* L, struct JsonReader* r) {
+    const unsigned char* p = r->data + r->pos;
+    size_t n = r->size - r->pos;
+    size_t i = pylua_json_plain(p, n);
+    
+    // most strings have no escapes, and are pushed as they are
+    if (i < n && p[i] == '"') {
+        lua_pushlstring(L, (const char*)p, i);
+        r->pos += i + 1;
+        return NULL;
+    }
+    
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    
+    for (;;) {
+        luaL_addlstring(&b, (const char*)p, i);
+        p += i;
+        n -= i;
+        
+        if (n == 0)
+            return "unterminated string";
+        if (*p == '"')
+            break;
+        if (*p < 0x20)
+            return "control character in string";
+        if (n < 2)
+            return "unterminated string";
+        
+        unsigned char c = p[1];
+        p += 2;
+        n -= 2;
+        
+        switch (c) {
+            case '"': case '\\': case '/':
+                luaL_addchar(&b, (char)c);
+                break;
+            case 'b': luaL_addchar(&b, '\b'); break;
+            case 'f': luaL_addchar(&b, '\f'); break;
+            case 'n': luaL_addchar(&b, '\n'); break;
+            case 'r': luaL_addchar(&b, '\r'); break;
+            case 't': luaL_addchar(&b, '\t'); break;
+            
+            case 'u': ;
+                uint32_t cp, low;
+                if (pylua_json_hex(p, n, &cp) < 0)
+                    return "invalid \\u escape";
+                p += 4;
+                n -= 4;
+                
+                if (cp >= 0xdc00 && cp < 0xe000)
+                    return "invalid surrogate pair";
+                
+                if (cp >= 0xd800 && cp < 0xdc00) {
+                    if (n < 6 || p[0] != '\\' || p[1] != 'u' || pylua_json_hex(p + 2, n - 2, &low) < 0 || low < 0xdc00 || low >= 0xe000)
+                        return "invalid surrogate pair";
+                    
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    p += 6;
+                    n -= 6;
+                }
+                
+                // to utf-8
+                char utf8[4];
+                size_t len;
+                if (cp < 0x80) {
+                    utf8[0] = (char)cp;
+                    len = 1;
+                } else if (cp < 0x800) {
+                    utf8[0] = (char)(0xc0 | (cp >> 6));
+                    utf8[1] = (char)(0x80 | (cp & 0x3f));
+                    len = 2;
+                } else if (cp < 0x10000) {
+                    utf8[0] = (char)(0xe0 | (cp >> 12));
+                    utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+                    utf8[2] = (char)(0x80 | (cp & 0x3f));
+                    len = 3;
+                } else {
+                    utf8[0] = (char)(0xf0 | (cp >> 18));
+                    utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+                    utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+                    utf8[3] = (char)(0x80 | (cp & 0x3f));
+                    len = 4;
+                }
+                luaL_addlstring(&b, utf8, len);
+                break;
+            
+            default:
+                return "invalid escape";
+        }
+        
+        i = pylua_json_plain(p, n);
+    }
+    
+    luaL_pushresult(&b);
+    r->pos = (size_t)(p - r->data) + 1;
+    return NULL;
+}
+
+/**
+ * Pushes a number, as an integer if it is written as one and fits
+ */
+static const char* pylua_json_number(lua_State* L, struct JsonReader* r) {
+    const unsigned char* p = r->data;
+    size_t size = r->size;
+    size_t start = r->pos, i = start;
+    int integral = 1;
+    
+    // validate it first, strtod accepts more than JSON does
+    if (i < size && p[i] == '-')
+        i++;
+    if (i >= size || p[i] < '0' || p[i] > '9')
+        return "invalid value";
+    
+    if (p[i] == '0')
+        i++;
+    else while (i < size && p[i] >= '0' && p[i] <= '9')
+        i++;
+    
+    if (i < size && p[i] == '.') {
+        integral = 0;
+        if (++i >= size || p[i] < '0' || p[i] > '9')
+            return "invalid number";
+        while (i < size && p[i] >= '0' && p[i] <= '9')
+            i++;
+    }
+    
+    if (i < size && (p[i] == 'e' || p[i] == 'E')) {
+        integral = 0;
+        if (++i < size && (p[i] == '+' || p[i] == '-'))
+            i++;
+        if (i >= size || p[i] < '0' || p[i] > '9')
+            return "invalid number";
+        while (i < size && p[i] >= '0' && p[i] <= '9')
+            i++;
+    }
+    
+    // the data is not nul-terminated
+    char small[64];
+    size_t len = i - start;
+    char* tmp = len < sizeof small ? small : (char*)malloc(len + 1);
+    if (!tmp)
+        return "not enough memory";
+    
+    memcpy(tmp, p + start, len);
+    tmp[len] = '\0';
+    
+#if LUA_VERSION_NUM >= 503
+    if (integral) {
+        errno = 0;
+        long long value = strtoll(tmp, NULL, 10);
+        integral = errno != ERANGE;
+        if (integral)
+            lua_pushinteger(L, (lua_Integer)value);
+    }
+    if (!integral)
+#endif
+    lua_pushnumber(L, (lua_Number)strtod(tmp, NULL));
+    
+    if (tmp != small)
+        free(tmp);
+    
+    r->pos = i;
+    return NULL;
+}
+
+/**
+ * Checks a literal (true, false or null)
+ */
+static int pylua_json_literal(struct JsonReader* r, const char* literal, size_t len) {
+    if (r->size - r->pos < len || memcmp(r->data + r->pos, literal, len) != 0)
+        return -1;
+    
+    r->pos += len;
+    return 0;
+}
+
+static const char* pylua_json_value(lua_State* L, struct JsonReader* r, int depth);
+
+/**
+ * Pushes an object or an array
+ */
+static const char* pylua_json_container(lua_State* L, struct JsonReader* r, int depth) {
+    if (depth >= PYLUA_JSON_DEPTH)
+        return "too deeply nested";
+    
+    if (!lua_checkstack(L, 3))
+        return "stack overflow";
+    
+    int array = r->data[r->pos++] == '[';
+    unsigned char close = array ? ']' : '}';
+    
+    lua_newtable(L);
+    if (array && r->arrays) {
+        lua_pushvalue(L, r->arrays);
+        lua_setmetatable(L, -2);
+    }
+    
+    pylua_json_skip(r);
+    if (r->pos < r->size && r->data[r->pos] == close) {
+        r->pos++;
+        return NULL;
+    }
+    
+    const char* err;
+    int index = 1;
+    
+    for (;;) {
+        if (array) {
+            if (index == INT_MAX)
+                return "array is too large";
+            
+            if ((err = pylua_json_value(L, r, depth + 1)))
+                return err;
+            lua_rawseti(L, -2, index++);
+            
+        } else {
+            pylua_json_skip(r);
+            if (r->pos >= r->size || r->data[r->pos] != '"')
+                return "expected a string key";
+            
+            r->pos++;
+            if ((err = pylua_json_string(L, r)))
+                return err;
+            
+            pylua_json_skip(r);
+            if (r->pos >= r->size || r->data[r->pos] != ':')
+                return "expected ':'";
+            
+            r->pos++;
+            if ((err = pylua_json_value(L, r, depth + 1)))
+                return err;
+            lua_rawset(L, -3);
+        }
+        
+        pylua_json_skip(r);
+        if (r->pos >= r->size)
+            return "unexpected end of data";
+        
+        unsigned char c = r->data[r->pos++];
+        if (c == close)
+            return NULL;
+        if (c != ',')
+            return array ? "expected ',' or ']'" : "expected ',' or '}'";
+    }
+}
+
+/**
+ * Pushes any value
+ */
+static const char* pylua_json_value(lua_State* L, struct JsonReader* r, int depth) {
+    pylua_json_skip(r);
+    if (r->pos >= r->size)
+        return "unexpected end of data";
+    
+    switch (r->data[r->pos]) {
+        case '{': case '[':
+            return pylua_json_container(L, r, depth);
+        
+        case '"':
+            r->pos++;
+            return pylua_json_string(L, r);
+        
+        case 't':
+            if (pylua_json_literal(r, "true", 4) < 0)
+                return "invalid value";
+            lua_pushboolean(L, 1);
+            return NULL;
+        
+        case 'f':
+            if (pylua_json_literal(r, "false", 5) < 0)
+                return "invalid value";
+            lua_pushboolean(L, 0);
+            return NULL;
+        
+        case 'n':
+            if (pylua_json_literal(r, "null", 4) < 0)
+                return "invalid value";
+            if (r->null)
+                lua_pushvalue(L, r->null);
+            else
+                lua_pushnil(L);
+            return NULL;
+        
+        default:
+            return pylua_json_number(L, r);
+    }
+}
+
+/**
+ * Decodes JSON given as a light userdata and a size (arguments 1 and 2).
+ * Arrays are marked if argument 3 is true, and null is argument 4 if there is one.
+ */
+int pylua_json_decode_buffer(lua_State* L) {
+    struct JsonReader r;
+    r.data = (const unsigned char*)lua_touserdata(L, 1);
+    r.size = (size_t)lua_tointeger(L, 2);
+    r.pos = 0;
+    r.null = lua_gettop(L) >= 4 ? 4 : 0;
+    r.arrays = 0;
+    
+    if (lua_toboolean(L, 3)) {
+        luaL_newmetatable(L, PYLUA_JSON_ARRAY);
+        r.arrays = lua_gettop(L);
+    }
+    
+    const char* err = pylua_json_value(L, &r, 0);
+    if (!err) {
+        pylua_json_skip(&r);
+        if (r.pos != r.size)
+            err = "trailing data";
+    }
+    
+    if (err)
+        return luaL_error(L, "invalid json: %s (at byte %d)", err, (int)r.pos);
+    return 1;
+}
+
+
+/**
+ * Appends a string, with its quotes
+ */
+static int pylua_json_encode_string(struct Buffer* buf, const char* s, size_t n) {
+    const unsigned char* p = (const unsigned char*)s;
+    
+    if (pylua_buffer_putc(buf, '"') < 0)
+        return -1;
+    
+    for (;;) {
+        size_t i = pylua_json_plain(p, n);
+        if (pylua_buffer_write(buf, p, i) < 0)
+            return -1;
+        
+        p += i;
+        n -= i;
+        if (n == 0)
+            break;
+        
+        char esc[7] = {'\\', 0};
+        size_t len = 2;
+        switch (*p) {
+            case '"': esc[1] = '"'; break;
+            case '\\': esc[1] = '\\'; break;
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
+            default:
+                snprintf(esc, sizeof esc, "\\u%04x", *p);
+                len = 6;
+        }
+        
+        if (pylua_buffer_write(buf, esc, len) < 0)
+            return -1;
+        p++;
+        n--;
+    }
+    
+    return pylua_buffer_putc(buf, '"');
+}
+
+/**
+ * Appends the number at index `idx`
+ */
+static const char* pylua_json_encode_number(lua_State* L, int idx, struct Buffer* buf) {
+    char tmp[32];
+    int len;
+    
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, idx)) {
+        len = snprintf(tmp, sizeof tmp, "%lld", (long long)lua_tointeger(L, idx));
+        return pylua_buffer_write(buf, tmp, (size_t)len) < 0 ? "not enough memory" : NULL;
+    }
+#endif
+    
+    double value = (double)lua_tonumber(L, idx);
+    if (!isfinite(value))
+        return "cannot encode nan or inf";
+    
+    // the shortest of the two which reads back the same
+    len = snprintf(tmp, sizeof tmp, "%.15g", value);
+    if (strtod(tmp, NULL) != value)
+        len = snprintf(tmp, sizeof tmp, "%.17g", value);
+    
+    return pylua_buffer_write(buf, tmp, (size_t)len) < 0 ? "not enough memory" : NULL;
+}
+
+static const char* pylua_json_encode_value(lua_State* L, int idx, struct JsonWriter* w, int depth);
+
+/**
+ * Appends a table, as an array if it is a sequence, as an object otherwise
+ */
+static const char* pylua_json_encode_table(lua_State* L, int idx, struct JsonWriter* w, int depth) {
+    struct Buffer* buf = w->buf;
+    
+    if (depth > PYLUA_JSON_DEPTH)
+        return "table is nested too deeply (or is cyclic)";
+    
+    if (!lua_checkstack(L, 3))
+        return "stack overflow";
+    
+    int top = lua_gettop(L);
+    
+    // count the pairs, and check if they form a sequence
+#if LUA_VERSION_NUM >= 502
+    size_t len = lua_rawlen(L, idx);
+#else
+    size_t len = lua_objlen(L, idx);
+#endif
+    size_t count = 0;
+    
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        count++;
+        lua_pop(L, 1);
+    }
+    
+    int array = count == len && len <= INT_MAX;
+    for (size_t i = 1; array && i <= len; i++) {
+        lua_rawgeti(L, idx, (int)i);
+        array = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+    }
+    
+    if (count == 0) {
+        array = w->empty;
+        if (!array && lua_getmetatable(L, idx)) {
+            array = lua_rawequal(L, -1, w->arrays);
+            lua_pop(L, 1);
+        }
+    }
+    
+    const char* err = NULL;
+    if (array) {
+        if (pylua_buffer_putc(buf, '[') < 0)
+            return "not enough memory";
+        
+        for (size_t i = 1; !err && i <= len; i++) {
+            if (i > 1 && pylua_buffer_putc(buf, ',') < 0)
+                err = "not enough memory";
+            
+            if (!err) {
+                lua_rawgeti(L, idx, (int)i);
+                err = pylua_json_encode_value(L, -1, w, depth + 1);
+                lua_pop(L, 1);
+            }
+        }
+        
+        if (!err && pylua_buffer_putc(buf, ']') < 0)
+            err = "not enough memory";
+        
+    } else {
+        if (pylua_buffer_putc(buf, '{') < 0)
+            return "not enough memory";
+        
+        int first = 1;
+        lua_pushnil(L);
+        while (!err && lua_next(L, idx)) {
+            if (!first && pylua_buffer_putc(buf, ',') < 0) {
+                err = "not enough memory";
+                break;
+            }
+            first = 0;
+            
+            // numbers keys are written as strings, without converting the key itself (which breaks lua_next)
+            if (lua_type(L, -2) == LUA_TSTRING) {
+                size_t n;
+                const char* s = lua_tolstring(L, -2, &n);
+                if (pylua_json_encode_string(buf, s, n) < 0)
+                    err = "not enough memory";
+                
+            } else if (lua_type(L, -2) == LUA_TNUMBER) {
+                if (pylua_buffer_putc(buf, '"') < 0 || (err = pylua_json_encode_number(L, -2, buf)) || pylua_buffer_putc(buf, '"') < 0)
+                    err = err ? err : "not enough memory";
+                
+            } else {
+                err = "table keys must be strings or numbers";
+            }
+            
+            if (!err && pylua_buffer_putc(buf, ':') < 0)
+                err = "not enough memory";
+            
+            if (!err)
+                err = pylua_json_encode_value(L, -1, w, depth + 1);
+            
+            lua_pop(L, 1);
+        }
+        
+        if (!err && pylua_buffer_putc(buf, '}') < 0)
+            err = "not enough memory";
+    }
+    
+    lua_settop(L, top);
+    return err;
+}
+
+/**
+ * Appends the value at index `idx`
+ */
+static const char* pylua_json_encode_value(lua_State* L, int idx, struct JsonWriter* w, int depth) {
+    struct Buffer* buf = w->buf;
+    
+    // absolute index, as we push values while encoding tables
+    if (idx < 0)
+        idx = lua_gettop(L) + idx + 1;
+    
+    if (w->null && lua_rawequal(L, idx, w->null))
+        return pylua_buffer_write(buf, "null", 4) < 0 ? "not enough memory" : NULL;
+    
+    int err = 0;
+    switch (lua_type(L, idx)) {
+        case LUA_TNIL:
+            err = pylua_buffer_write(buf, "null", 4);
+            break;
+        
+        case LUA_TBOOLEAN:
+            err = lua_toboolean(L, idx) ? pylua_buffer_write(buf, "true", 4) : pylua_buffer_write(buf, "false", 5);
+            break;
+        
+        case LUA_TNUMBER:
+            return pylua_json_encode_number(L, idx, buf);
+        
+        case LUA_TSTRING: ;
+            size_t n;
+            const char* s = lua_tolstring(L, idx, &n);
+            err = pylua_json_encode_string(buf, s, n);
+            break;
+        
+        case LUA_TTABLE:
+            return pylua_json_encode_table(L, idx, w, depth);
+        
+        case LUA_TFUNCTION:
+            return "cannot encode a function";
+        
+        case LUA_TTHREAD:
+            return "cannot encode a thread";
+        
+        default:
+            return "cannot encode a userdata";
+    }
+    
+    return err < 0 ? "not enough memory" : NULL;
+}
+
+/**
+ * Encodes the value at argument 1 to a struct Buffer given as a light userdata (argument 2),
+ * owned by the caller. Empty tables are arrays if argument 3 is true,
+ * and values equal to argument 4 (if there is one) are null.
+ */
+int pylua_json_encode_buffer(lua_State* L) {
+    struct JsonWriter w;
+    w.buf = (struct Buffer*)lua_touserdata(L, 2);
+    w.empty = lua_toboolean(L, 3);
+    w.null = lua_gettop(L) >= 4 ? 4 : 0;
+    
+    luaL_newmetatable(L, PYLUA_JSON_ARRAY);
+    w.arrays = lua_gettop(L);
+    
+    const char* err = pylua_json_encode_value(L, 1, &w, 0);
+    if (err)
+        return luaL_error(L, "cannot encode json: %s", err);
+    return 0;
+}
\ No newline at end of file
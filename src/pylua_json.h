@@ -0,0 +1,9 @@
+#ifndef PYLUA_JSON_H
+#define PYLUA_JSON_H
+
+#include "pylua.h"
+
+int pylua_json_decode_buffer(lua_State* L);
+int pylua_json_encode_buffer(lua_State* L);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include "pylua_lib.h"
+#include "pylua_codec.h"
+
+/*
+    The "pylua" library, opened with the standard libraries
+*/
+
+static const luaL_Reg pylua_lib[] = {
+    {"pack", &pylua_lua_pack},
+    {"unpack", &pylua_lua_unpack},
+    {NULL, NULL}
+};
+
+/**
+ * Opens the library, as a regular lua module
+ */
+int luaopen_pylua(lua_State* L) {
+#if LUA_VERSION_NUM >= 502
+    luaL_newlib(L, pylua_lib);
+#else
+    luaL_register(L, "pylua", pylua_lib);
+#endif
+    return 1;
+}
+
+/**
+ * Opens the library as the global "pylua", like luaL_openlibs would
+ */
+void pylua_open_lib(lua_State* L) {
+#if LUA_VERSION_NUM >= 502
+    luaL_requiref(L, "pylua", &luaopen_pylua, 1);
+    lua_pop(L, 1);
+#else
+    lua_pushcfunction(L, &luaopen_pylua);
+    lua_pushstring(L, "pylua");
+    lua_call(L, 1, 0);
+#endif
+}
\ No newline at end of file
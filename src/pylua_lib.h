@@ -0,0 +1,9 @@
+#ifndef PYLUA_LIB_H
+#define PYLUA_LIB_H
+
+#include "pylua.h"
+
+int luaopen_pylua(lua_State* L);
+void pylua_open_lib(lua_State* L);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include "pylua_lock.h"
+#include "pylua_tracemalloc.h"
+
+/**
+ * Allocates the lock of a LuaStateObject
+ * Returns -1 and sets a python exception on failure
+ */
+int pylua_init_lock(LuaStateObject* sobj) {
+    sobj->lock = PyThread_allocate_lock();
+    atomic_init(&sobj->lockowner, 0);
+    sobj->lockcount = 0;
+    sobj->deferred = NULL;
+    sobj->ndeferred = 0;
+    sobj->deferredsize = 0;
+    sobj->deferredlost = 0;
+
+    if (!sobj->lock) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Frees the lock of a LuaStateObject
+ */
+void pylua_free_lock(LuaStateObject* sobj) {
+    if (sobj->lock) {
+        PyThread_free_lock(sobj->lock);
+        sobj->lock = NULL;
+    }
+}
+
+/**
+ * Takes the lock of a LuaStateObject (and all of its lua threads).
+ * The lock is recursive, so python callbacks can use the state again.
+ *
+ * Must be called with the GIL, which is released while waiting,
+ * as the thread holding the lock might need it.
+ */
+void pylua_lock(LuaStateObject* sobj) {
+    unsigned long ident = PyThread_get_thread_ident();
+
+    // only we can set the owner to ourselves
+    if (atomic_load_explicit(&sobj->lockowner, memory_order_acquire) == ident) {
+        sobj->lockcount++;
+        return;
+    }
+
+    if (!PyThread_acquire_lock(sobj->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(sobj->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+
+    atomic_store_explicit(&sobj->lockowner, ident, memory_order_release);
+    sobj->lockcount = 1;
+}
+
+/**
+ * Warns that python objects released by lua were leaked ; as it may
+ * run python code, it must be called with the GIL, once the lock is released
+ */
+static void pylua_deferred_warn(Py_ssize_t leaked) {
+    PyObject *exc_type, *exc_value, *exc_tb;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    
+    if (PyErr_WarnFormat(PyExc_RuntimeWarning, 1, "%zd python objects released by lua were leaked, out of memory", leaked) < 0)
+        PyErr_WriteUnraisable(NULL);
+    
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+/**
+ * Releases the lock of a LuaStateObject, after reporting the allocations
+ * lua made without the GIL, then decrefs the objects it released.
+ *
+ * Must be called with the GIL.
+ */
+void pylua_unlock(LuaStateObject* sobj) {
+    if (--sobj->lockcount == 0) {
+        // allocations lua made without the GIL
+        Py_ssize_t lost = sobj->tracemalloc ? pylua_tracemalloc_flush(sobj->tracemalloc) : 0;
+        
+        PyObject** deferred = sobj->deferred;
+        Py_ssize_t count = sobj->ndeferred;
+        Py_ssize_t leaked = sobj->deferredlost;
+        
+        sobj->deferred = NULL;
+        sobj->ndeferred = 0;
+        sobj->deferredsize = 0;
+        sobj->deferredlost = 0;
+        
+        atomic_store_explicit(&sobj->lockowner, 0, memory_order_release);
+        PyThread_release_lock(sobj->lock);
+        
+        if (lost)
+            pylua_tracemalloc_warn(lost);
+        if (leaked)
+            pylua_deferred_warn(leaked);
+        
+        // those may run any code, including code using this state
+        for (Py_ssize_t i = 0; i < count; i++)
+            Py_DECREF(deferred[i]);
+        PyMem_RawFree(deferred);
+    }
+}
+
+/**
+ * Keeps a python object released by lua while the GIL is not held,
+ * until the lock is released.
+ *
+ * The lock must be held ; this does not need the GIL.
+ */
+void pylua_defer_decref(LuaStateObject* sobj, PyObject* obj) {
+    if (sobj->ndeferred == sobj->deferredsize) {
+        Py_ssize_t size = sobj->deferredsize ? sobj->deferredsize * 2 : 16;
+        PyObject** deferred = PyMem_RawRealloc(sobj->deferred, size * sizeof *deferred);
+        
+        // nothing better to do than leaking it, which is reported on unlock
+        if (!deferred) {
+            sobj->deferredlost++;
+            return;
+        }
+        
+        sobj->deferred = deferred;
+        sobj->deferredsize = size;
+    }
+    
+    sobj->deferred[sobj->ndeferred++] = obj;
+}
+
+/**
+ * Decrefs the deferred objects right away, when the lock can't be taken.
+ * Must be called with the GIL.
+ */
+void pylua_flush_deferred(LuaStateObject* sobj) {
+    for (Py_ssize_t i = 0; i < sobj->ndeferred; i++)
+        Py_DECREF(sobj->deferred[i]);
+    
+    PyMem_RawFree(sobj->deferred);
+    sobj->deferred = NULL;
+    sobj->ndeferred = 0;
+    sobj->deferredsize = 0;
+}
\ No newline at end of file
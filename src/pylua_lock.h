@@ -0,0 +1,16 @@
+#ifndef PYLUA_LOCK_H
+#define PYLUA_LOCK_H
+
+#include "pylua.h"
+#include "pylua_state.h"
+
+#include <pythread.h>
+
+int pylua_init_lock(LuaStateObject* sobj);
+void pylua_free_lock(LuaStateObject* sobj);
+void pylua_lock(LuaStateObject* sobj);
+void pylua_unlock(LuaStateObject* sobj);
+void pylua_defer_decref(LuaStateObject* sobj, PyObject* obj);
+void pylua_flush_deferred(LuaStateObject* sobj);
+
+#endif
\ No newline at end of file
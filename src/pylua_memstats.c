@@ -0,0 +1,167 @@
+#include "pylua_memstats.h"
+
+#include <string.h>
+
+/*
+    Lua tells the type of the objects it allocates (from 5.2), but not when freeing them:
+    in tracking mode, each block is prefixed with a header remembering it.
+    
+    Only the object itself has a type ; what it owns (table parts, stacks...) is "other".
+*/
+
+// Size of the header, which keeps blocks aligned
+#define PYLUA_MEM_HEADER 16
+
+// Tags of prototypes and upvalues, which lua.h does not define
+#if LUA_VERSION_NUM >= 504
+#   define PYLUA_TUPVAL 9
+#   define PYLUA_TPROTO 10
+#else
+#   define PYLUA_TPROTO 9
+#   define PYLUA_TUPVAL 10
+#endif
+
+static const char* pylua_mem_kinds[PYLUA_MEM_KINDS] = {
+    "string", "table", "function", "userdata", "thread", "proto", "upvalue", "other"
+};
+
+
+/**
+ * Creates the accounting for a state, allocating with `alloc`
+ * Returns NULL if there is not enough memory
+ */
+struct MemStats* pylua_memstats_new(pylua_Alloc alloc) {
+    struct MemStats* stats = (struct MemStats*)calloc(1, sizeof *stats);
+    if (stats)
+        stats->alloc = alloc;
+    return stats;
+}
+
+/**
+ * Returns the kind of a new block, given the tag lua passes instead of its old size
+ */
+static int pylua_mem_kind(size_t tag) {
+#if LUA_VERSION_NUM >= 502
+    // the variant bits are not needed
+    switch (tag & 0x0f) {
+        case LUA_TSTRING: return PYLUA_MEM_STRING;
+        case LUA_TTABLE: return PYLUA_MEM_TABLE;
+        case LUA_TFUNCTION: return PYLUA_MEM_FUNCTION;
+        case LUA_TUSERDATA: return PYLUA_MEM_USERDATA;
+        case LUA_TTHREAD: return PYLUA_MEM_THREAD;
+        case PYLUA_TPROTO: return PYLUA_MEM_PROTO;
+        case PYLUA_TUPVAL: return PYLUA_MEM_UPVALUE;
+    }
+#endif
+    return PYLUA_MEM_OTHER;
+}
+
+/**
+ * Same as pylua_alloc, keeping track of what is allocated ;
+ * the actual allocation is done by stats->alloc, with room for the header
+ */
+void* pylua_alloc_tracked(LuaStateObject* self, void* ptr, size_t osize, size_t nsize) {
+    struct MemStats* stats = self->memstats;
+    
+    unsigned char* block = NULL;
+    int kind;
+    
+    if (ptr) {
+        block = (unsigned char*)ptr - PYLUA_MEM_HEADER;
+        kind = block[0];
+    } else {
+        kind = pylua_mem_kind(osize);
+        osize = 0;
+    }
+    
+    if (nsize == 0) {
+        if (block) {
+            stats->alloc(self, block, osize + PYLUA_MEM_HEADER, 0);
+            stats->bytes[kind] -= osize;
+            stats->blocks[kind]--;
+        }
+        return NULL;
+    }
+    
+    if (nsize > SIZE_MAX - PYLUA_MEM_HEADER)
+        return NULL;
+    
+    block = (unsigned char*)stats->alloc(self, block, block ? osize + PYLUA_MEM_HEADER : 0, nsize + PYLUA_MEM_HEADER);
+    if (!block)
+        return NULL;
+    
+    if (!ptr) {
+        block[0] = (unsigned char)kind;
+        stats->blocks[kind]++;
+    }
+    stats->bytes[kind] += nsize - osize;
+    
+    int bucket = 0;
+    while (bucket < PYLUA_MEM_BUCKETS - 1 && nsize > ((size_t)16 << bucket))
+        bucket++;
+    stats->histogram[bucket]++;
+    
+    if (self->mem > stats->peak)
+        stats->peak = self->mem;
+    if (self->mem > stats->callpeak)
+        stats->callpeak = self->mem;
+    
+    return block + PYLUA_MEM_HEADER;
+}
+
+/**
+ * Returns the accounting of a state as a dict, and optionally restarts the peaks and the histogram
+ * The state lock must be held.
+ */
+PyObject* pylua_memstats_dict(LuaStateObject* self, int reset) {
+    struct MemStats* stats = self->memstats;
+    
+    PyObject* kinds = PyDict_New();
+    if (!kinds)
+        return NULL;
+    
+    for (int i = 0; i < PYLUA_MEM_KINDS; i++) {
+        PyObject* kind = Py_BuildValue("{s:n,s:n}", "bytes", (Py_ssize_t)stats->bytes[i], "blocks", (Py_ssize_t)stats->blocks[i]);
+        if (!kind || PyDict_SetItemString(kinds, pylua_mem_kinds[i], kind) < 0) {
+            Py_XDECREF(kind);
+            Py_DECREF(kinds);
+            return NULL;
+        }
+        Py_DECREF(kind);
+    }
+    
+    PyObject* histogram = PyDict_New();
+    if (!histogram) {
+        Py_DECREF(kinds);
+        return NULL;
+    }
+    
+    for (int i = 0; i < PYLUA_MEM_BUCKETS; i++) {
+        PyObject* key = PyLong_FromSize_t((size_t)16 << i);
+        PyObject* count = PyLong_FromSize_t(stats->histogram[i]);
+        if (!key || !count || PyDict_SetItem(histogram, key, count) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(count);
+            Py_DECREF(histogram);
+            Py_DECREF(kinds);
+            return NULL;
+        }
+        Py_DECREF(key);
+        Py_DECREF(count);
+    }
+    
+    PyObject* res = Py_BuildValue("{s:n,s:K,s:n,s:n,s:N,s:N}",
+        "used", (Py_ssize_t)self->mem,
+        "limit", (unsigned long long)self->limit,
+        "peak", (Py_ssize_t)stats->peak,
+        "call_peak", (Py_ssize_t)stats->callpeak,
+        "types", kinds,
+        "histogram", histogram);
+    
+    if (res && reset) {
+        stats->peak = self->mem;
+        stats->callpeak = self->mem;
+        memset(stats->histogram, 0, sizeof stats->histogram);
+    }
+    return res;
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#ifndef PYLUA_MEMSTATS_H
+#define PYLUA_MEMSTATS_H
+
+#include "pylua.h"
+#include "pylua_state.h"
+
+// Kinds of allocations told apart (see pylua_mem_kind)
+enum {
+    PYLUA_MEM_STRING,
+    PYLUA_MEM_TABLE,
+    PYLUA_MEM_FUNCTION,
+    PYLUA_MEM_USERDATA,
+    PYLUA_MEM_THREAD,
+    PYLUA_MEM_PROTO,
+    PYLUA_MEM_UPVALUE,
+    PYLUA_MEM_OTHER,
+    PYLUA_MEM_KINDS
+};
+
+// Histogram buckets, of sizes up to 16, 32, 64... bytes, the last one being everything larger
+#define PYLUA_MEM_BUCKETS 20
+
+// Heap accounting of a lua state, kept by pylua_alloc_tracked
+struct MemStats {
+    // The allocator doing the actual work
+    pylua_Alloc alloc;
+    
+    // Live bytes and blocks per kind
+    size_t bytes[PYLUA_MEM_KINDS];
+    size_t blocks[PYLUA_MEM_KINDS];
+    
+    // Allocations per size
+    size_t histogram[PYLUA_MEM_BUCKETS];
+    
+    // Highest usage, overall and during the last call from python
+    size_t peak;
+    size_t callpeak;
+};
+
+struct MemStats* pylua_memstats_new(pylua_Alloc alloc);
+void* pylua_alloc_tracked(LuaStateObject* self, void* ptr, size_t osize, size_t nsize);
+PyObject* pylua_memstats_dict(LuaStateObject* self, int reset);
+
+#endif
\ No newline at end of file
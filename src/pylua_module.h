@@ -0,0 +1,36 @@
+#ifndef PYLUA_MODULE_H
+#define PYLUA_MODULE_H
+
+#include "pylua.h"
+
+// Per-interpreter state of the module
+typedef struct {
+    // Exceptions
+    PyObject* LuaError;
+    PyObject* LuaCompileError;
+    PyObject* LuaRuntimeError;
+    PyObject* LuaFatalError;
+    
+    // Types
+    PyTypeObject* LuaStateType;
+    PyTypeObject* LuaObjectType;
+    PyTypeObject* LuaFunctionType;
+    PyTypeObject* LuaTableType;
+    PyTypeObject* LuaThreadType;
+    PyTypeObject* LuaUserDataType;
+    PyTypeObject* LuaAwaitableType;
+    PyTypeObject* LuaExecutorType;
+    PyTypeObject* LuaChannelType;
+    PyTypeObject* LuaChunkCacheType;
+    PyTypeObject* LuaStatePoolType;
+    
+    // concurrent.futures.Future, imported when first needed
+    PyObject* Future;
+    
+} PyLuaModuleState;
+
+extern PyModuleDef pylua_module;
+
+PyLuaModuleState* pylua_get_module_state(PyTypeObject* type);
+
+#endif
\ No newline at end of file
@@ -1,4 +1,6 @@
 #include "pylua_object.h"
+#include "pylua_cycles.h"
+#include "pylua_lock.h"
 #include "pylua_protect.h"
 
 /**
@@ -6,11 +8,13 @@
  * then return it.
  */
 Py_hash_t LuaObject_hash(LuaObject* self) {
-    PYLUA_CHECK(L, &self->sobj->info, -1);
+    PYLUA_ENTER(L, &self->sobj->info, -1);
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
     const void* ptr = lua_topointer(L, -1);
     lua_pop(L, 1);
+    
+    PYLUA_LEAVE(&self->sobj->info);
     return (Py_hash_t)ptr;
 }
 
@@ -28,7 +32,7 @@ PyObject* LuaObject_richcompare(LuaObject* self, PyObject* other, int op) {
     // We only work with Py_EQ and Py_NE
     if (op == Py_EQ || op == Py_NE) {
         int eq = Py_NE;
-        if (PyObject_TypeCheck(other, &LuaObjectType)) {
+        if (PyObject_TypeCheck(other, self->sobj->module->LuaObjectType)) {
             if (LuaObject_hash(self) == LuaObject_hash((LuaObject*)other)) {
                 // Both LuaObject with equal hashes ; it is equals.
                 eq = Py_EQ;
@@ -53,29 +57,61 @@ PyObject* LuaObject_richcompare(LuaObject* self, PyObject* other, int op) {
  * Handle the deallocation of LuaObject
  */
 static void LuaObject_dealloc(LuaObject* self) {
+    PyObject_GC_UnTrack(self);
+    
     // the unref (with protect)
+    pylua_lock(self->sobj);
     if (self->sobj->info.state) {
         //PYLUA_TRY(self->sobj,
             luaL_unref(self->sobj->info.state, LUA_REGISTRYINDEX, self->ref);
         //);
     }
+    pylua_unlink_object(self->sobj, self);
+    pylua_unlock(self->sobj);
     
     // decref the related stateobj
     Py_DECREF(self->sobj);
 
-    // free ourselves
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    // free ourselves (and release our heap type)
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+
+/**
+ * Implement tp_traverse for LuaObject
+ *
+ * During a cycle collection of its state, it also visits the python objects
+ * only its lua value can reach (see LuaState.collect_cycles).
+ * There is no tp_clear: its state is cleared instead.
+ */
+static int LuaObject_traverse(LuaObject* self, visitproc visit, void* arg) {
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->sobj);
+    
+    if (self->sobj->gcpass) {
+        for (struct PyRef* ref = self->sobj->pyrefs; ref; ref = ref->next) {
+            if (ref->owner == self)
+                Py_VISIT(ref->obj);
+        }
+    }
+    return 0;
 }
 
 
-PyTypeObject LuaObjectType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pylua.LuaObject",
-    .tp_doc = "Lua object",
-    .tp_basicsize = sizeof(LuaObject),
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = NULL,
-    .tp_dealloc = (destructor)LuaObject_dealloc,
-    .tp_richcompare = (richcmpfunc)LuaObject_richcompare,
-    .tp_hash = (hashfunc)LuaObject_hash
+static PyType_Slot LuaObjectSlots[] = {
+    {Py_tp_doc, "Lua object"},
+    {Py_tp_dealloc, LuaObject_dealloc},
+    {Py_tp_traverse, LuaObject_traverse},
+    {Py_tp_richcompare, LuaObject_richcompare},
+    {Py_tp_hash, LuaObject_hash},
+    {0, NULL}
+};
+
+PyType_Spec LuaObjectTypeSpec = {
+    .name = "pylua.LuaObject",
+    .basicsize = sizeof(LuaObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_HAVE_GC,
+    .slots = LuaObjectSlots
 };
\ No newline at end of file
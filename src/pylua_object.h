@@ -4,7 +4,7 @@
 #include "pylua.h"
 #include "pylua_state.h"
 
-typedef struct {
+typedef struct _LuaObject {
     PyObject_HEAD
 
     // The parent state
@@ -12,9 +12,13 @@ typedef struct {
 
     // Reference number
     int ref;
+    
+    // Siblings in the LuaObjects of the state
+    struct _LuaObject* prev;
+    struct _LuaObject* next;
 
 } LuaObject;
 
-PyTypeObject LuaObjectType;
+extern PyType_Spec LuaObjectTypeSpec;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,234 @@
+#include "pylua_pool.h"
+#include "pylua_state.h"
+
+/**
+ * Creates a state with the factory, and saves it as it is
+ * Returns NULL if a python exception occured
+ */
+static PyObject* pylua_pool_create(LuaStatePoolObject* self) {
+    PyObject* state = PyObject_CallNoArgs(self->factory);
+    if (!state)
+        return NULL;
+    
+    if (!PyObject_TypeCheck(state, self->module->LuaStateType)) {
+        PyErr_Format(PyExc_TypeError, "factory must return a LuaState, not %s", Py_TYPE(state)->tp_name);
+        Py_DECREF(state);
+        return NULL;
+    }
+    
+    if (pylua_state_checkpoint((LuaStateObject*)state) < 0) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    return state;
+}
+
+/**
+ * Checks if a state is one of the idle states.
+ * The list of states must be locked
+ */
+static int pylua_pool_idle(LuaStatePoolObject* self, PyObject* state) {
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(self->states); i++) {
+        if (PyList_GET_ITEM(self->states, i) == state)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Implement tp_new for our StatePool type,
+ * which creates the states right away
+ */
+static PyObject* LuaStatePool_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"factory", "size", NULL};
+    PyObject* factory;
+    Py_ssize_t size = 4;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|n", keywords, &factory, &size))
+        return NULL;
+    
+    if (!PyCallable_Check(factory)) {
+        PyErr_SetString(PyExc_TypeError, "factory must be callable");
+        return NULL;
+    }
+    
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "size must be positive");
+        return NULL;
+    }
+    
+    PyLuaModuleState* module = pylua_get_module_state(type);
+    if (!module)
+        return NULL;
+    
+    LuaStatePoolObject* self = (LuaStatePoolObject*)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    
+    self->module = module;
+    self->size = size;
+    Py_INCREF(factory);
+    self->factory = factory;
+    
+    self->states = PyList_New(0);
+    if (!self->states) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    
+    for (Py_ssize_t i = 0; i < size; i++) {
+        PyObject* state = pylua_pool_create(self);
+        if (!state || PyList_Append(self->states, state) < 0) {
+            Py_XDECREF(state);
+            Py_DECREF(self);
+            return NULL;
+        }
+        Py_DECREF(state);
+    }
+    
+    return (PyObject*)self;
+}
+
+/**
+ * Implements StatePool.acquire, which returns an idle state,
+ * or a new one if there is none left
+ */
+static PyObject* LuaStatePool_acquire(LuaStatePoolObject* self, PyObject* unused) {
+    PyObject* state = NULL;
+    
+    Py_BEGIN_CRITICAL_SECTION(self->states);
+    Py_ssize_t len = PyList_GET_SIZE(self->states);
+    if (len) {
+        state = PyList_GET_ITEM(self->states, len - 1);
+        Py_INCREF(state);
+        PyList_SetSlice(self->states, len - 1, len, NULL);
+    }
+    Py_END_CRITICAL_SECTION();
+    
+    if (state)
+        return state;
+    
+    return pylua_pool_create(self);
+}
+
+/**
+ * Implements StatePool.release, which resets a state to its checkpoint,
+ * and keeps it for later if the pool is not full.
+ * States that can't be reset are given up.
+ */
+static PyObject* LuaStatePool_release(LuaStatePoolObject* self, PyObject* args) {
+    PyObject* state;
+    
+    if (!PyArg_ParseTuple(args, "O!", self->module->LuaStateType, &state))
+        return NULL;
+    
+    // an idle state given twice would be handed out twice
+    int idle;
+    Py_BEGIN_CRITICAL_SECTION(self->states);
+    idle = pylua_pool_idle(self, state);
+    Py_END_CRITICAL_SECTION();
+    
+    if (idle) {
+        PyErr_SetString(PyExc_ValueError, "state is already in the pool");
+        return NULL;
+    }
+    
+    if (pylua_state_reset((LuaStateObject*)state) < 0)
+        return NULL;
+    
+    int err = 0;
+    
+    // checked again, it may have been given back while it was reset
+    Py_BEGIN_CRITICAL_SECTION(self->states);
+    idle = pylua_pool_idle(self, state);
+    if (!idle && PyList_GET_SIZE(self->states) < self->size)
+        err = PyList_Append(self->states, state);
+    Py_END_CRITICAL_SECTION();
+    
+    if (idle) {
+        PyErr_SetString(PyExc_ValueError, "state is already in the pool");
+        return NULL;
+    }
+    if (err < 0)
+        return NULL;
+    
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements `len` for a StatePool, which is the number of idle states
+ */
+static Py_ssize_t LuaStatePool_length(LuaStatePoolObject* self) {
+    return PyList_GET_SIZE(self->states);
+}
+
+/**
+ * Getter for StatePool.size
+ */
+static PyObject* LuaStatePool_get_size(LuaStatePoolObject* self, void* unused) {
+    return PyLong_FromSsize_t(self->size);
+}
+
+/**
+ * Implement tp_traverse for StatePool ;
+ * the factory may well reference the pool
+ */
+static int LuaStatePool_traverse(LuaStatePoolObject* self, visitproc visit, void* arg) {
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->factory);
+    Py_VISIT(self->states);
+    return 0;
+}
+
+/**
+ * Implement tp_clear for StatePool
+ */
+static int LuaStatePool_clear(LuaStatePoolObject* self) {
+    Py_CLEAR(self->factory);
+    Py_CLEAR(self->states);
+    return 0;
+}
+
+/**
+ * Handle deallocation of StatePool
+ */
+static void LuaStatePool_dealloc(LuaStatePoolObject* self) {
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->factory);
+    Py_XDECREF(self->states);
+    
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+
+static PyMethodDef LuaStatePool_methods[] = {
+    {"acquire", (PyCFunction)LuaStatePool_acquire, METH_NOARGS, "take a state from the pool"},
+    {"release", (PyCFunction)LuaStatePool_release, METH_VARARGS, "reset a state and give it back to the pool"},
+    {NULL}
+};
+
+static PyGetSetDef LuaStatePool_getset[] = {
+    {"size", (getter)LuaStatePool_get_size, NULL, "number of idle states kept by the pool", NULL},
+    {NULL}
+};
+
+static PyType_Slot LuaStatePoolSlots[] = {
+    {Py_tp_doc, "Pool of warmed up lua states, reset between uses"},
+    {Py_tp_new, LuaStatePool_new},
+    {Py_tp_dealloc, LuaStatePool_dealloc},
+    {Py_tp_traverse, LuaStatePool_traverse},
+    {Py_tp_clear, LuaStatePool_clear},
+    {Py_tp_methods, LuaStatePool_methods},
+    {Py_tp_getset, LuaStatePool_getset},
+    {Py_mp_length, LuaStatePool_length},
+    {0, NULL}
+};
+
+PyType_Spec LuaStatePoolTypeSpec = {
+    .name = "pylua.StatePool",
+    .basicsize = sizeof(LuaStatePoolObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .slots = LuaStatePoolSlots
+};
\ No newline at end of file
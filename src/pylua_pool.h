@@ -0,0 +1,23 @@
+#ifndef PYLUA_POOL_H
+#define PYLUA_POOL_H
+
+#include "pylua.h"
+#include "pylua_module.h"
+
+typedef struct {
+    PyObject_HEAD
+    
+    PyLuaModuleState* module;
+    
+    // Creates a warmed up LuaState
+    PyObject* factory;
+    
+    // Idle states, reset to their checkpoint
+    PyObject* states;
+    Py_ssize_t size;
+    
+} LuaStatePoolObject;
+
+extern PyType_Spec LuaStatePoolTypeSpec;
+
+#endif
\ No newline at end of file
@@ -0,0 +1,322 @@
+#include "pylua_profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#   include <windows.h>
+#else
+#   include <time.h>
+#endif
+
+
+/**
+ * Returns a monotonic clock, in nanoseconds. Does not need the GIL.
+ */
+long long pylua_clock_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (long long)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Allocates a profiler sampling every `instructions` instructions,
+ * or else every `interval` nanoseconds, keeping the last `capacity` samples.
+ * Returns NULL if out of memory.
+ */
+struct Profiler* pylua_profiler_new(long instructions, long long interval, size_t capacity) {
+    struct Profiler* prof = calloc(1, sizeof *prof);
+    if (!prof)
+        return NULL;
+    
+    prof->running = 1;
+    prof->instructions = instructions;
+    prof->interval = instructions ? 0 : interval;
+    prof->next = pylua_clock_ns() + prof->interval;
+    prof->capacity = capacity;
+    prof->stacks = malloc(capacity * PYLUA_PROFILER_DEPTH * sizeof *prof->stacks);
+    prof->depths = malloc(capacity);
+    
+    if (!prof->stacks || !prof->depths) {
+        pylua_profiler_free(prof);
+        return NULL;
+    }
+    return prof;
+}
+
+/**
+ * Frees a profiler
+ */
+void pylua_profiler_free(struct Profiler* prof) {
+    if (!prof)
+        return;
+    
+    pylua_frames_free(&prof->frames);
+    free(prof->stacks);
+    free(prof->depths);
+    free(prof);
+}
+
+/**
+ * Drops the samples taken so far (the functions seen are kept)
+ */
+void pylua_profiler_clear(struct Profiler* prof) {
+    prof->head = 0;
+    prof->nsamples = 0;
+    prof->overwritten = 0;
+    prof->lost = 0;
+}
+
+/**
+ * Hash of a function: its source and line, or its address
+ */
+static uint32_t pylua_frames_hash(const char* source, int line, const void* ptr) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = source; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    hash = (hash ^ (uint32_t)line) * 16777619u;
+    return (hash ^ (uint32_t)((uintptr_t)ptr >> 4)) * 16777619u;
+}
+
+/**
+ * Grows the index of the frames to `size` slots, a power of two
+ */
+static int pylua_frames_reindex(struct FrameTable* table, uint32_t size) {
+    uint32_t* index = calloc(size, sizeof *index);
+    if (!index)
+        return -1;
+    
+    for (uint32_t i = 0; i < table->nframes; i++) {
+        uint32_t j = table->frames[i].hash & (size - 1);
+        while (index[j])
+            j = (j + 1) & (size - 1);
+        index[j] = i + 1;
+    }
+    
+    free(table->index);
+    table->index = index;
+    table->indexcap = size;
+    return 0;
+}
+
+/**
+ * Returns the number of a function, adding it if it is new (with no name),
+ * or UINT32_MAX if out of memory. A new python callable is held by the table,
+ * so this needs the GIL for them.
+ */
+uint32_t pylua_frames_add(struct FrameTable* table, const char* source, int line, const void* ptr) {
+    uint32_t hash = pylua_frames_hash(source, line, ptr);
+    
+    if (table->indexcap) {
+        uint32_t j = hash & (table->indexcap - 1);
+        while (table->index[j]) {
+            struct ProfilerFrame* frame = &table->frames[table->index[j] - 1];
+            if (frame->hash == hash && frame->line == line && frame->ptr == ptr && strcmp(frame->source, source) == 0)
+                return table->index[j] - 1;
+            j = (j + 1) & (table->indexcap - 1);
+        }
+    }
+    
+    // kept at most half full
+    if ((table->nframes + 1) * 2 > table->indexcap) {
+        if (pylua_frames_reindex(table, table->indexcap ? table->indexcap * 2 : 64) < 0)
+            return UINT32_MAX;
+    }
+    
+    if (table->nframes == table->framecap) {
+        uint32_t cap = table->framecap ? table->framecap * 2 : 32;
+        struct ProfilerFrame* frames = realloc(table->frames, cap * sizeof *frames);
+        if (!frames)
+            return UINT32_MAX;
+        table->frames = frames;
+        table->framecap = cap;
+    }
+    
+    struct ProfilerFrame* frame = &table->frames[table->nframes];
+    frame->hash = hash;
+    frame->line = line;
+    frame->ptr = ptr;
+    frame->name[0] = '\0';
+    strncpy(frame->source, source, sizeof frame->source - 1);
+    frame->source[sizeof frame->source - 1] = '\0';
+    
+    if (line == PYLUA_FRAME_PYTHON)
+        Py_INCREF((PyObject*)ptr);
+    
+    uint32_t j = hash & (table->indexcap - 1);
+    while (table->index[j])
+        j = (j + 1) & (table->indexcap - 1);
+    table->index[j] = table->nframes + 1;
+    return table->nframes++;
+}
+
+/**
+ * Frees the functions of a table, releasing the python callables (with the GIL)
+ */
+void pylua_frames_free(struct FrameTable* table) {
+    for (uint32_t i = 0; i < table->nframes; i++) {
+        if (table->frames[i].line == PYLUA_FRAME_PYTHON)
+            Py_DECREF((PyObject*)table->frames[i].ptr);
+    }
+    
+    free(table->frames);
+    free(table->index);
+    table->frames = NULL;
+    table->index = NULL;
+    table->nframes = 0;
+    table->framecap = 0;
+    table->indexcap = 0;
+}
+
+/**
+ * Records the stack of `L` in the ring buffer
+ */
+static void pylua_profiler_sample(struct Profiler* prof, lua_State* L) {
+    uint32_t* stack = prof->stacks + prof->head * PYLUA_PROFILER_DEPTH;
+    lua_Debug ar;
+    int depth = 0;
+    
+    while (depth < PYLUA_PROFILER_DEPTH && lua_getstack(L, depth, &ar)) {
+        lua_getinfo(L, "S", &ar);
+        int line = ar.what[0] == 'C' ? PYLUA_FRAME_C : ar.linedefined;
+        uint32_t frame = pylua_frames_add(&prof->frames, ar.short_src, line, NULL);
+        if (frame == UINT32_MAX) {
+            prof->lost++;
+            return;
+        }
+        stack[depth++] = frame;
+    }
+    
+    if (!depth)
+        return;
+    
+    prof->depths[prof->head] = (unsigned char)depth;
+    prof->head = (prof->head + 1) % prof->capacity;
+    if (prof->nsamples < prof->capacity) {
+        prof->nsamples++;
+    } else {
+        prof->overwritten++;
+    }
+}
+
+/**
+ * Called by the builtin hook, every `hookcount` instructions.
+ * Takes a sample once the period has elapsed.
+ */
+void pylua_profiler_hook(struct Profiler* prof, lua_State* L) {
+    if (prof->instructions) {
+        prof->elapsed += prof->hookcount;
+        if (prof->elapsed < prof->instructions)
+            return;
+        prof->elapsed = 0;
+        
+    } else {
+        long long now = pylua_clock_ns();
+        if (now < prof->next)
+            return;
+        prof->next = now + prof->interval;
+    }
+    
+    pylua_profiler_sample(prof, L);
+}
+
+/**
+ * Hash of the stack of a sample
+ */
+static uint32_t pylua_profiler_stack_hash(struct Profiler* prof, size_t sample) {
+    const uint32_t* stack = prof->stacks + sample * PYLUA_PROFILER_DEPTH;
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < prof->depths[sample]; i++) {
+        hash = (hash ^ stack[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Writes the label of a function: its source and line, or [C]
+ */
+static int pylua_profiler_label(struct Buffer* out, struct ProfilerFrame* frame) {
+    if (frame->line == PYLUA_FRAME_C)
+        return pylua_buffer_write(out, "[C]", 3);
+    
+    // the separators of the format
+    for (const char* c = frame->source; *c; c++) {
+        if (pylua_buffer_putc(out, *c == ';' ? ',' : *c == '\n' ? ' ' : *c) < 0)
+            return -1;
+    }
+    
+    char line[16];
+    int len = snprintf(line, sizeof line, ":%d", frame->line);
+    return pylua_buffer_write(out, line, (size_t)len);
+}
+
+/**
+ * Writes the samples as collapsed stacks, one line per distinct stack:
+ * its functions from the outermost one, separated by ';', then its count.
+ * Returns -1 if out of memory.
+ */
+int pylua_profiler_collapse(struct Profiler* prof, struct Buffer* out) {
+    size_t n = prof->nsamples;
+    size_t cap = 16;
+    while (cap < n * 2)
+        cap *= 2;
+    
+    // distinct stacks (as their first sample, offset by one) and their counts
+    size_t* slots = calloc(cap, sizeof *slots);
+    size_t* counts = calloc(cap, sizeof *counts);
+    if (!slots || !counts) {
+        free(slots);
+        free(counts);
+        return -1;
+    }
+    
+    size_t first = (prof->head + prof->capacity - n) % prof->capacity;
+    for (size_t i = 0; i < n; i++) {
+        size_t sample = (first + i) % prof->capacity;
+        size_t size = prof->depths[sample] * sizeof *prof->stacks;
+        size_t j = pylua_profiler_stack_hash(prof, sample) & (cap - 1);
+        
+        while (slots[j]) {
+            size_t other = slots[j] - 1;
+            if (prof->depths[other] == prof->depths[sample]
+                    && memcmp(prof->stacks + other * PYLUA_PROFILER_DEPTH, prof->stacks + sample * PYLUA_PROFILER_DEPTH, size) == 0)
+                break;
+            j = (j + 1) & (cap - 1);
+        }
+        
+        if (!slots[j])
+            slots[j] = sample + 1;
+        counts[j]++;
+    }
+    
+    int err = 0;
+    for (size_t j = 0; j < cap && !err; j++) {
+        if (!slots[j])
+            continue;
+        
+        size_t sample = slots[j] - 1;
+        const uint32_t* stack = prof->stacks + sample * PYLUA_PROFILER_DEPTH;
+        for (int i = prof->depths[sample] - 1; i >= 0 && !err; i--) {
+            err = pylua_profiler_label(out, &prof->frames.frames[stack[i]]);
+            if (!err && i)
+                err = pylua_buffer_putc(out, ';');
+        }
+        
+        char count[32];
+        int len = snprintf(count, sizeof count, " %zu\n", counts[j]);
+        if (!err)
+            err = pylua_buffer_write(out, count, (size_t)len);
+    }
+    
+    free(slots);
+    free(counts);
+    return err < 0 ? -1 : 0;
+}
\ No newline at end of file
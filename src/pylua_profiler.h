@@ -0,0 +1,83 @@
+#ifndef PYLUA_PROFILER_H
+#define PYLUA_PROFILER_H
+
+#include "pylua.h"
+#include "pylua_buffer.h"
+
+#include <stdint.h>
+
+// Instructions between two looks at the clock, when sampling by time
+#define PYLUA_PROFILER_CHECK 1000
+
+// Frames kept per sample, from the innermost one
+#define PYLUA_PROFILER_DEPTH 64
+
+// Size of the names of functions, as the tracer knows them
+#define PYLUA_PROFILER_NAME 48
+
+// Kinds of functions, in place of a line for those not in lua
+#define PYLUA_FRAME_C (-1)
+#define PYLUA_FRAME_PYTHON (-2)
+
+// A function seen by a profiler: lua functions by their source and line,
+// C functions and python callables by their address, if known
+// (a python callable is then held by the frame)
+struct ProfilerFrame {
+    uint32_t hash;
+    int line;
+    const void* ptr;
+    char source[LUA_IDSIZE];
+    char name[PYLUA_PROFILER_NAME];
+};
+
+// Functions seen by a profiler, and their index by hash (offset by one)
+struct FrameTable {
+    struct ProfilerFrame* frames;
+    uint32_t nframes;
+    uint32_t framecap;
+    uint32_t* index;
+    uint32_t indexcap;
+};
+
+// Sampling profiler, run by the builtin hook without the GIL
+struct Profiler {
+    // Whether it samples, or is only kept for its samples
+    int running;
+    
+    // Sampling period, in instructions or in nanoseconds (one of them),
+    // and the count of the hook driving it
+    long instructions;
+    long long interval;
+    int hookcount;
+    
+    // Progress to the next sample
+    long elapsed;
+    long long next;
+    
+    // Functions seen so far
+    struct FrameTable frames;
+    
+    // Ring buffer of samples, as frame numbers
+    uint32_t* stacks;
+    unsigned char* depths;
+    size_t capacity;
+    size_t head;
+    size_t nsamples;
+    
+    // Samples overwritten by newer ones, and dropped for lack of memory
+    size_t overwritten;
+    size_t lost;
+};
+
+long long pylua_clock_ns(void);
+
+uint32_t pylua_frames_add(struct FrameTable* table, const char* source, int line, const void* ptr);
+void pylua_frames_free(struct FrameTable* table);
+
+struct Profiler* pylua_profiler_new(long instructions, long long interval, size_t capacity);
+void pylua_profiler_free(struct Profiler* prof);
+void pylua_profiler_clear(struct Profiler* prof);
+void pylua_profiler_hook(struct Profiler* prof, lua_State* L);
+int pylua_profiler_collapse(struct Profiler* prof, struct Buffer* out);
+
+#endif
\ No newline at end of file
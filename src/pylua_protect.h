@@ -3,6 +3,7 @@
 
 #include "pylua.h"
 #include "pylua_exceptions.h"
+#include "pylua_lock.h"
 #include "pylua_stateinfo.h"
 
 #include <setjmp.h>
@@ -30,6 +31,18 @@ struct PanicHandler* pylua_push_panichandler(struct LuaStateInfo* info);
 
 #define PYLUA_UNPROTECT(s) \
     pylua_pop_panichandler(s);
+
+// Same as PYLUA_PROTECT, but also releases the state lock
+// taken by PYLUA_ENTER if a panic happens
+
+#define PYLUA_PROTECT_LEAVE(s, r) \
+    do { \
+        if (setjmp(pylua_push_panichandler(s)->buf)) { \
+            pylua_pop_panichandler(s); \
+            pylua_unlock((s)->root); \
+            return r; \
+        } \
+    } while (0)
     
 /*
     NOTE: This only works if there's no protection ;
@@ -51,10 +64,29 @@ struct PanicHandler* pylua_push_panichandler(struct LuaStateInfo* info);
     do { \
         L = (s)->state; \
         if (!L) { \
-            PyErr_SetString(LuaFatalError, "lua state is dead"); \
+            PyErr_SetString((s)->root->module->LuaFatalError, "lua state is dead"); \
+            return r; \
+        } \
+    } while (0)
+        
+// Takes the state lock, then checks if the state is still alive.
+// Every entry point using the state must do this, and release
+// the lock with PYLUA_LEAVE before returning.
+
+#define PYLUA_ENTER(L, s, r) \
+    lua_State* L; \
+    do { \
+        pylua_lock((s)->root); \
+        L = (s)->state; \
+        if (!L) { \
+            pylua_unlock((s)->root); \
+            PyErr_SetString((s)->root->module->LuaFatalError, "lua state is dead"); \
             return r; \
         } \
     } while (0)
+
+#define PYLUA_LEAVE(s) \
+    pylua_unlock((s)->root);
         
 #define PYLUA_ERROR(s, m) \
     do { \
@@ -1,10 +1,16 @@
 #include "pylua_python.h"
+#include "pylua_channel.h"
+#include "pylua_collect.h"
+#include "pylua_cycles.h"
 #include "pylua_exceptions.h"
 #include "pylua_function.h"
+#include "pylua_hooks.h"
+#include "pylua_memstats.h"
 #include "pylua_object.h"
 #include "pylua_protect.h"
 #include "pylua_table.h"
 #include "pylua_thread.h"
+#include "pylua_tracer.h"
 #include "pylua_userdata.h"
 
 #include <sys/timeb.h>
@@ -123,29 +129,29 @@ int pylua_push_pyobj(lua_State* L, PyObject* obj) {
         return 0;
     }
 
+    LuaStateObject* root = pylua_get_root(L);
+    
+    // Is it a Channel? Any state can use it
+    if (PyObject_TypeCheck(obj, root->module->LuaChannelType))
+        return pylua_push_channel(L, ((LuaChannelObject*)obj)->chan);
+    
     // Is it a LuaObject?
-    if (PyObject_TypeCheck(obj, &LuaObjectType)) {
+    if (PyObject_TypeCheck(obj, root->module->LuaObjectType)) {
         LuaObject* lobj = (LuaObject*)obj;
 
-        // TODO: find a way to check if it's in the same state
-        
-        //if (lobj->sobj->info.state == L) {
+        if (lobj->sobj == root) {
             // It uses the same state, we can just push the ref
             lua_rawgeti(L, LUA_REGISTRYINDEX, lobj->ref);
             return 0;
 
-        /*} else {
-            // TODO: We do not use threads yet, but when we do,
-            // we must add some check to prevent using a LuaObject
-            // from a specific state to another state
-            
-            PyErr_SetString(LuaError, "cannot use a LuaObject from another LuaState");
+        } else {
+            PyErr_SetString(root->module->LuaError, "cannot use a LuaObject from another LuaState");
             return -1;
-        }*/
+        }
     }
 
     // Nope, we do not know what this is
-    PyErr_Format(LuaError, "cannot convert a %s to a lua object", Py_TYPE(obj)->tp_name);
+    PyErr_Format(root->module->LuaError, "cannot convert a %s to a lua object", Py_TYPE(obj)->tp_name);
     return -1;
 }
 
@@ -159,6 +165,7 @@ int pylua_push_pyobj(lua_State* L, PyObject* obj) {
 PyObject* pylua_get_as_pyobj(struct LuaStateInfo* info, int idx) {
     // Let's get the type
     lua_State* L = info->state;
+    PyLuaModuleState* module = info->root->module;
     int type = lua_type(L, idx);
 
     switch (type) {
@@ -203,18 +210,18 @@ PyObject* pylua_get_as_pyobj(struct LuaStateInfo* info, int idx) {
             int ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
             PyObject* obj = pylua_alloc_luaobject(
-                type == LUA_TTABLE          ?   &LuaTableType :
-                type == LUA_TFUNCTION       ?   &LuaFunctionType :
-                type == LUA_TLIGHTUSERDATA  ?   &LuaUserDataType :
-                type == LUA_TUSERDATA       ?   &LuaUserDataType :
-              /*type == LUA_TTHREAD         ?*/ &LuaThreadType,
+                type == LUA_TTABLE          ?   module->LuaTableType :
+                type == LUA_TFUNCTION       ?   module->LuaFunctionType :
+                type == LUA_TLIGHTUSERDATA  ?   module->LuaUserDataType :
+                type == LUA_TUSERDATA       ?   module->LuaUserDataType :
+              /*type == LUA_TTHREAD         ?*/ module->LuaThreadType,
 
                 info->root, ref);
 
             return obj;
 
         default:
-            PyErr_Format(LuaError, "cannot convert %s", lua_typename(L, type));
+            PyErr_Format(module->LuaError, "cannot convert %s", lua_typename(L, type));
             return NULL;
     }
 }
@@ -286,6 +293,72 @@ int pylua_push_tuple(lua_State* L, PyObject* obj, int startat) {
     return count;
 }
 
+/**
+ * Pushes a userdata owning a reference to a python object,
+ * released by lua once collected. `obj` may be NULL, for a placeholder
+ * filled later; only then is the GIL not needed.
+ *
+ * This may raise memory errors, so it must be called from protected code.
+ */
+void pylua_push_pyuserdata(lua_State* L, PyObject* obj) {
+    struct PyRef* userdata = lua_newuserdata(L, sizeof(struct PyRef));
+    userdata->obj = NULL;
+    userdata->prev = NULL;
+    userdata->next = NULL;
+    
+    // we want to add a gc handler, so let's create a metatable
+    lua_newtable(L);
+    lua_pushcclosure(L, &pylua_gc, 0);
+    lua_setfield(L, -2, "__gc");
+    //lua_pushcclosure(L, &pylua_tostring, 0);
+    //lua_setfield(L, -2, "__tostring");
+    lua_setmetatable(L, -2);
+    
+    // only once lua can release it
+    Py_XINCREF(obj);
+    userdata->obj = obj;
+    pylua_link_pyref(pylua_get_root(L), userdata);
+}
+
+/**
+ * Pushes a C closure calling a python callable, which is kept as an upvalue
+ *
+ * This may raise memory errors, so it must be called from protected code.
+ */
+void pylua_push_pycallable(lua_State* L, PyObject* func) {
+    pylua_push_pyuserdata(L, func);
+    lua_pushcclosure(L, &pylua_call_python, 1);
+}
+
+/**
+ * Returns the python object owned by a userdata made by pylua_push_pyuserdata,
+ * or NULL if it is anything else
+ */
+PyObject* pylua_to_pyuserdata(lua_State* L, int idx) {
+    if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx))
+        return NULL;
+    
+    lua_getfield(L, -1, "__gc");
+    int ours = lua_tocfunction(L, -1) == &pylua_gc;
+    lua_pop(L, 2);
+    
+    return ours ? *(PyObject**)lua_touserdata(L, idx) : NULL;
+}
+
+/**
+ * Returns the python callable of a function made by pylua_push_pycallable,
+ * or NULL if it is anything else
+ */
+PyObject* pylua_to_pycallable(lua_State* L, int idx) {
+    if (lua_tocfunction(L, idx) != &pylua_call_python)
+        return NULL;
+    
+    lua_getupvalue(L, idx, 1);
+    PyObject* res = pylua_to_pyuserdata(L, -1);
+    lua_pop(L, 1);
+    return res;
+}
+
 /**
  * Allocate a LuaObject with the specified type,
  * lua state and ref
@@ -295,13 +368,101 @@ PyObject* pylua_alloc_luaobject(PyTypeObject* type, LuaStateObject* sobj, int re
     obj->sobj = sobj;
     obj->ref = ref;
     Py_INCREF(obj->sobj);
+    pylua_link_object(sobj, obj);
     return (PyObject*)obj;
 }
 
 
+/**
+ * Keeps track of the call depth, must be paired with pylua_leave_call.
+ * It may run a collection, so the GIL must be released, under a panic handler.
+ */
+void pylua_enter_call(struct LuaStateInfo* info) {
+    // set the startat time if needed
+    if (info->depth++ == 0) {
+        ftime(&info->startat);
+        info->root->ncalls++;
+        
+        // the thread is charged for what its code allocates during the call:
+        // frees are credited to the running code, whoever allocated the block,
+        // so usage carried over from other calls would only drift
+        info->budget.used = 0;
+        info->budget.outer = info->root->budget;
+        info->root->budget = &info->budget;
+        
+        // between calls is the time to collect, past the soft memory limit,
+        // without stalling python
+        pylua_collect_pending(info->root->info.state, info->root);
+        
+        // the high-water mark is per call from python
+        if (info->root->memstats)
+            info->root->memstats->callpeak = info->root->mem;
+    }
+}
+
+/**
+ * Pairs with pylua_enter_call
+ */
+void pylua_leave_call(struct LuaStateInfo* info) {
+    if (--info->depth == 0) {
+        info->root->budget = info->budget.outer;
+        info->root->ncalls--;
+        
+        // a suspended thread is not done, and a panic closed the state
+        struct Tracer* tr = info->root->tracer;
+        if (tr && info->state && lua_status(info->state) != LUA_YIELD)
+            pylua_tracer_leave(tr, info->state);
+        
+        // the batched hook gets what is left, the error of the call is kept
+        // (without the GIL, as in executor workers, it is given later)
+        if (info->root->hookbatch && info->root->hookbatch->count && pylua_current_thread()) {
+            PyObject *exc_type, *exc_value, *exc_tb;
+            PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+            pylua_flush_hook(info->root);
+            PyErr_Restore(exc_type, exc_value, exc_tb);
+        }
+    }
+}
+
+
+/**
+ * Runs lua_pcall on the state of `info` with the GIL released, and under
+ * a panic handler, like pylua_call does: hooks, finalizers and python
+ * callbacks may take the GIL back. The GIL and the state lock must be held.
+ *
+ * Returns the status of lua_pcall, or -1 if lua panicked: the state
+ * is then closed, and a python exception is set.
+ */
+int pylua_pcall_released(struct LuaStateInfo* info, int nargs, int nresults) {
+    lua_State* L = info->state;
+    int err = 0;
+    
+    PyThreadState* outer = info->thstate;
+    info->thstate = PyEval_SaveThread();
+    
+    struct PanicHandler* panic = pylua_push_panichandler(info);
+    int fatal = setjmp(panic->buf);
+    if (!fatal) {
+        err = lua_pcall(L, nargs, nresults, 0);
+    }
+    
+    pylua_pop_panichandler(info);
+    
+    // a lua error raised while code held the GIL back (memory errors
+    // in the python sections of images) comes back with it
+    if (!pylua_current_thread())
+        PyEval_RestoreThread(info->thstate);
+    info->thstate = outer;
+    
+    return fatal ? -1 : err;
+}
+
 /**
  * Internal function for running lua code from python
  * Used by LuaFunction_call and LuaThread_call_function
+ *
+ * The state lock must be held. This may be nested
+ * (lua -> python -> lua), from a python callback.
  */
 PyObject* pylua_call(struct LuaStateInfo* info, int funcref, PyObject* args, int startat) {
     int err;
@@ -310,19 +471,26 @@ PyObject* pylua_call(struct LuaStateInfo* info, int funcref, PyObject* args, int
     PYLUA_PROTECT(info, NULL);
     
     int top = lua_gettop(L);
+    if (!lua_checkstack(L, (int)(PyTuple_GET_SIZE(args) - startat) + 1)) {
+        PyErr_SetString(info->root->module->LuaError, "too many arguments");
+        PYLUA_UNPROTECT(info);
+        return NULL;
+    }
+    
     lua_rawgeti(L, LUA_REGISTRYINDEX, funcref); // push the function
 
     int argc = pylua_push_tuple(L, args, startat);
     if (argc < 0) { // error occured?
+        lua_settop(L, top);
         PYLUA_UNPROTECT(info);
         return NULL;
     }
     
-    // set the startat time if needed
-    if (info->depth++ == 0)
-        ftime(&info->startat);
-    
     PYLUA_UNPROTECT(info);
+    
+    // the outer level (if any) gave the GIL back to its callback,
+    // so this one is ours to save and restore
+    PyThreadState* outer = info->thstate;
     info->thstate = PyEval_SaveThread();
     
     // we need another kind of protection for this,
@@ -332,6 +500,7 @@ PyObject* pylua_call(struct LuaStateInfo* info, int funcref, PyObject* args, int
     int fatal = setjmp(panic->buf);
     if (!fatal) {
         // if no error occured yet
+        pylua_enter_call(info);
         err = lua_pcall(L, argc, LUA_MULTRET, 0);
     }
     
@@ -339,10 +508,10 @@ PyObject* pylua_call(struct LuaStateInfo* info, int funcref, PyObject* args, int
     
     // restore the thread
     PyEval_RestoreThread(info->thstate);
-    info->thstate = NULL;
+    info->thstate = outer;
     
     // now we're good 
-    info->depth--;
+    pylua_leave_call(info);
     
     // we can stop here if a fatal error happened
     if (fatal)
@@ -355,7 +524,7 @@ PyObject* pylua_call(struct LuaStateInfo* info, int funcref, PyObject* args, int
     if (err) {
         if (!PyErr_Occurred()) {
             PyObject* err = pylua_get_as_unicode(L, -1);
-            PyErr_SetObject(LuaRuntimeError, err);
+            PyErr_SetObject(info->root->module->LuaRuntimeError, err);
             Py_DECREF(err);
         }
         // remove the error from the stack
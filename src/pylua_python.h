@@ -20,7 +20,16 @@ PyObject* pylua_get_as_pyobj(struct LuaStateInfo* info, int idx);
 PyObject* pylua_to_tuple(struct LuaStateInfo* info, int argc);
 int pylua_push_tuple(lua_State* L, PyObject* obj, int startat);
 
+void pylua_push_pyuserdata(lua_State* L, PyObject* obj);
+void pylua_push_pycallable(lua_State* L, PyObject* func);
+PyObject* pylua_to_pyuserdata(lua_State* L, int idx);
+PyObject* pylua_to_pycallable(lua_State* L, int idx);
+
 PyObject* pylua_alloc_luaobject(PyTypeObject* type, LuaStateObject* sobj, int ref);
+
+void pylua_enter_call(struct LuaStateInfo* info);
+void pylua_leave_call(struct LuaStateInfo* info);
 PyObject* pylua_call(struct LuaStateInfo* info, int funcref, PyObject* args, int startat);
+int pylua_pcall_released(struct LuaStateInfo* info, int nargs, int nresults);
 
 #endif
\ No newline at end of file
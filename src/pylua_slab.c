@@ -0,0 +1,139 @@
+#include "pylua_slab.h"
+#include "pylua_hooks.h"
+
+#include <string.h>
+
+// Pages start with this header, padded so that blocks stay aligned
+struct SlabPage {
+    struct SlabPage* next;
+    char pad[PYLUA_SLAB_STEP - sizeof(struct SlabPage*)];
+};
+
+
+/**
+ * Creates an empty slab
+ * Returns NULL if there is not enough memory
+ */
+struct Slab* pylua_slab_new(void) {
+    return (struct Slab*)calloc(1, sizeof(struct Slab));
+}
+
+/**
+ * Frees a slab and all its pages at once ;
+ * the lua state using it must be closed
+ */
+void pylua_slab_free(struct Slab* slab) {
+    if (!slab)
+        return;
+    
+    struct SlabPage* page = slab->pages;
+    while (page) {
+        struct SlabPage* next = page->next;
+        free(page);
+        page = next;
+    }
+    free(slab);
+}
+
+/**
+ * Returns a block of the size class `cls` (that is, of (cls + 1) * PYLUA_SLAB_STEP bytes)
+ */
+static void* pylua_slab_get(struct Slab* slab, size_t cls) {
+    void* block = slab->free[cls];
+    if (block) {
+        slab->free[cls] = *(void**)block;
+        return block;
+    }
+    
+    size_t size = (cls + 1) * PYLUA_SLAB_STEP;
+    if (slab->left < size) {
+        // the rest of the page is lost, which is at most PYLUA_SLAB_MAX bytes
+        struct SlabPage* page = (struct SlabPage*)malloc(PYLUA_SLAB_PAGE);
+        if (!page)
+            return NULL;
+        
+        page->next = slab->pages;
+        slab->pages = page;
+        slab->npages++;
+        slab->cur = (char*)page + sizeof *page;
+        slab->left = PYLUA_SLAB_PAGE - sizeof *page;
+    }
+    
+    block = slab->cur;
+    slab->cur += size;
+    slab->left -= size;
+    return block;
+}
+
+/**
+ * Gives a block back to its size class
+ */
+static void pylua_slab_put(struct Slab* slab, size_t cls, void* block) {
+    *(void**)block = slab->free[cls];
+    slab->free[cls] = block;
+}
+
+/**
+ * Same as pylua_alloc, with small blocks served by the slab of the state.
+ * The accounting uses the sizes asked by lua, not the rounded ones.
+ */
+void* pylua_alloc_slab(LuaStateObject* self, void* ptr, size_t osize, size_t nsize) {
+    struct Slab* slab = self->slab;
+    
+    // see pylua_alloc
+    if (ptr == NULL)
+        osize = 0;
+    
+    // blocks of up to PYLUA_SLAB_MAX bytes always come from the slab,
+    // so their size is enough to tell where they come from
+    size_t ocls = (osize - 1) / PYLUA_SLAB_STEP;
+    size_t ncls = (nsize - 1) / PYLUA_SLAB_STEP;
+    
+    if (nsize == 0) {
+        if (osize > PYLUA_SLAB_MAX)
+            free(ptr);
+        else if (ptr)
+            pylua_slab_put(slab, ocls, ptr);
+        
+        pylua_account(self, osize, 0);
+        return NULL;
+    }
+    
+    if (!pylua_can_alloc(self, osize, nsize))
+        return NULL;
+    
+    void* res;
+    if (ptr && osize <= PYLUA_SLAB_MAX && nsize <= PYLUA_SLAB_MAX && ocls == ncls) {
+        // still fits in its block
+        res = ptr;
+        
+    } else if (nsize <= PYLUA_SLAB_MAX) {
+        res = pylua_slab_get(slab, ncls);
+        if (!res)
+            return NULL;
+        
+        if (ptr) {
+            memcpy(res, ptr, osize < nsize ? osize : nsize);
+            if (osize > PYLUA_SLAB_MAX)
+                free(ptr);
+            else
+                pylua_slab_put(slab, ocls, ptr);
+        }
+        
+    } else if (ptr && osize <= PYLUA_SLAB_MAX) {
+        res = malloc(nsize);
+        if (!res)
+            return NULL;
+        
+        memcpy(res, ptr, osize);
+        pylua_slab_put(slab, ocls, ptr);
+        
+    } else {
+        res = realloc(ptr, nsize);
+        if (!res)
+            return NULL;
+    }
+    
+    pylua_account(self, osize, nsize);
+    return res;
+}
\ No newline at end of file
@@ -0,0 +1,33 @@
+#ifndef PYLUA_SLAB_H
+#define PYLUA_SLAB_H
+
+#include "pylua.h"
+#include "pylua_state.h"
+
+// Allocations up to this size are served by size classes, every PYLUA_SLAB_STEP bytes
+#define PYLUA_SLAB_STEP 16
+#define PYLUA_SLAB_MAX 256
+#define PYLUA_SLAB_CLASSES (PYLUA_SLAB_MAX / PYLUA_SLAB_STEP)
+
+// Size of the pages blocks are carved from
+#define PYLUA_SLAB_PAGE (64 * 1024)
+
+struct SlabPage;
+
+// Size-class allocator of a lua state: small blocks are carved from large pages,
+// recycled through a free list per class, and the pages are only freed with the slab
+struct Slab {
+    void* free[PYLUA_SLAB_CLASSES];
+    
+    // Every page, and what is left of the current one
+    struct SlabPage* pages;
+    char* cur;
+    size_t left;
+    size_t npages;
+};
+
+struct Slab* pylua_slab_new(void);
+void pylua_slab_free(struct Slab* slab);
+void* pylua_alloc_slab(LuaStateObject* self, void* ptr, size_t osize, size_t nsize);
+
+#endif
\ No newline at end of file
@@ -1,25 +1,73 @@
 #include "pylua_state.h"
+#include "pylua_checkpoint.h"
+#include "pylua_chunk.h"
+#include "pylua_collect.h"
+#include "pylua_cycles.h"
+#include "pylua_codec.h"
+#include "pylua_coverage.h"
 #include "pylua_exceptions.h"
 #include "pylua_hooks.h"
+#include "pylua_image.h"
+#include "pylua_json.h"
+#include "pylua_lib.h"
+#include "pylua_lock.h"
+#include "pylua_memstats.h"
+#include "pylua_profiler.h"
 #include "pylua_protect.h"
 #include "pylua_python.h"
+#include "pylua_slab.h"
+#include "pylua_tracemalloc.h"
+#include "pylua_tracer.h"
+
+#include <marshal.h>
 
 /**
  * Implement tp_new for our LuaState type
  * which just allocs our type with default NULL values
  */
 static PyObject* LuaState_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    PyLuaModuleState* module = pylua_get_module_state(type);
+    if (!module)
+        return NULL;
+    
     LuaStateObject* self = (LuaStateObject*)type->tp_alloc(type, 0);
     if (self != NULL) {
+        self->module = module;
         self->mem = 0;
         self->limit = 0;
+        self->softlimit = SIZE_MAX;
+        self->gcpending = 0;
+        self->budget = NULL;
+        self->ncalls = 0;
+        self->slab = NULL;
+        self->memstats = NULL;
+        self->tracemalloc = NULL;
         self->hook = NULL;
+        self->hookbatch = NULL;
+        self->hookmask = 0;
+        self->hookcount = 0;
+        self->hookelapsed = 0;
+        self->hookstep = 0;
+        self->profiler = NULL;
+        self->tracer = NULL;
+        self->coverage = NULL;
+        self->cache = NULL;
+        self->pyrefs = NULL;
+        self->objects = NULL;
+        self->gcpass = 0;
         
         self->info.state = NULL;
         self->info.panic = NULL;
         self->info.depth = 0;
         self->info.thstate = NULL;
-        self->info.root = NULL;
+        self->info.async = 0;
+        self->info.awaiting = NULL;
+        self->info.root = self;
+        
+        if (pylua_init_lock(self) < 0) {
+            Py_DECREF(self);
+            return NULL;
+        }
     }
     return (PyObject*)self;
 }
@@ -30,22 +78,77 @@ static PyObject* LuaState_new(PyTypeObject* type, PyObject* args, PyObject* kwds
  * Create a lua_State, setup panic handlers, etc.
  */
 static int LuaState_init(LuaStateObject* self, PyObject* args, PyObject* kwds) {
-    static char* keywords[] = {"openlibs", NULL};
+    static char* keywords[] = {"openlibs", "cache", "slab", "track_mem", "tracemalloc", NULL};
     int openlibs = 1; // init the libs by default
+    PyObject* cache = Py_None;
+    int slab = 0;
+    int track = 0;
+    int traced = 0;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", keywords, &openlibs)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pOppp", keywords, &openlibs, &cache, &slab, &track, &traced)) {
+        return -1;
+    }
+    
+    if (cache != Py_None && !PyObject_TypeCheck(cache, self->module->LuaChunkCacheType)) {
+        PyErr_SetString(PyExc_TypeError, "cache must be a ChunkCache");
         return -1;
     }
+    
+    // compiled chunk cache (none by default)
+    Py_CLEAR(self->cache);
+    if (cache != Py_None) {
+        Py_INCREF(cache);
+        self->cache = cache;
+    }
 
     // memory info
     self->mem = 0;
     self->limit = SIZE_MAX;
+    self->softlimit = SIZE_MAX;
+    self->gcpending = 0;
+    self->budget = NULL;
+    self->ncalls = 0;
     
     // debug hook (none)
     self->hook = NULL;
+    self->hookbatch = NULL;
+    self->hookmask = 0;
+    self->hookcount = 0;
+    self->hookelapsed = 0;
+    self->hookstep = 0;
 
-    // create the state
-    lua_State* L = lua_newstate((lua_Alloc)&pylua_alloc, self);
+    // create the state, with the size-class allocator if asked
+    pylua_Alloc alloc = &pylua_alloc;
+    if (slab) {
+        self->slab = pylua_slab_new();
+        if (!self->slab) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        alloc = &pylua_alloc_slab;
+    }
+    
+    // and with heap accounting on top of it
+    if (track) {
+        self->memstats = pylua_memstats_new(alloc);
+        if (!self->memstats) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        alloc = &pylua_alloc_tracked;
+    }
+    
+    // and reported to tracemalloc, as lua sees it
+    if (traced) {
+        self->tracemalloc = pylua_tracemalloc_new(alloc);
+        if (!self->tracemalloc) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        alloc = &pylua_alloc_traced;
+    }
+    
+    lua_State* L = lua_newstate((lua_Alloc)alloc, self);
     
     // initialize the state info
     pylua_set_stateinfo(L, &self->info);
@@ -55,8 +158,10 @@ static int LuaState_init(LuaStateObject* self, PyObject* args, PyObject* kwds) {
     lua_atpanic(L, &pylua_panic);
 
     // open the libs
-    if (openlibs)
+    if (openlibs) {
         luaL_openlibs(L);
+        pylua_open_lib(L);
+    }
 
     return 0;
 }
@@ -76,24 +181,72 @@ static PyObject* LuaState_load_file(LuaStateObject* self, PyObject* args) {
     
 #if LUA_VERSION_NUM <= 501
     if (mode) {
-        PyErr_SetObject(LuaError, LUA_VERSION " does not support mode arg");
+        PyErr_SetString(self->module->LuaError, LUA_VERSION " does not support mode arg");
         return NULL;
     }
 #endif
 
-    PYLUA_CHECK(L, &self->info, NULL);
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    // source files go through the chunk cache, if any
+    LuaChunkCacheObject* cache = (LuaChunkCacheObject*)self->cache;
+    int cached = 0;
+    int err = 0;
+    
+    if (cache) {
+        struct Buffer buf;
+        pylua_buffer_init(&buf);
+        
+        // if it can't be read, lua will report it
+        size_t skip = 0;
+        if (pylua_read_file(filename, &buf) == 0)
+            skip = pylua_skip_header(buf.data, buf.size);
+        
+        if (buf.data && pylua_chunk_cacheable(buf.data + skip, buf.size - skip, mode)) {
+            PyObject* name = PyBytes_FromFormat("@%s", filename);
+            PyObject* key = name ? pylua_chunk_key(cache, buf.data, buf.size, PyBytes_AS_STRING(name)) : NULL;
+            cached = key ? pylua_chunk_load(cache, L, key, PyBytes_AS_STRING(name)) : -1;
+            
+            // a miss compiles what was hashed, as the file may have changed since
+            if (!cached) {
+#if LUA_VERSION_NUM >= 502
+                err = luaL_loadbufferx(L, buf.data + skip, buf.size - skip, PyBytes_AS_STRING(name), mode);
+#else
+                err = luaL_loadbuffer(L, buf.data + skip, buf.size - skip, PyBytes_AS_STRING(name));
+#endif
+                cached = 1;
+                if (!err && pylua_chunk_store(cache, L, key) < 0) {
+                    lua_pop(L, 1);
+                    cached = -1;
+                }
+            }
+            
+            Py_XDECREF(key);
+            Py_XDECREF(name);
+        }
+        
+        pylua_buffer_free(&buf);
+        if (cached < 0) {
+            PYLUA_LEAVE(&self->info);
+            return NULL;
+        }
+    }
 
     // attempt to compile
+    if (!cached) {
 #if LUA_VERSION_NUM >= 502
-    int err = luaL_loadfilex(L, filename, mode);
+        err = luaL_loadfilex(L, filename, mode);
 #else
-    int err = luaL_loadfile(L, filename);
+        err = luaL_loadfile(L, filename);
 #endif
+    }
+    
     if (err) {
         PyObject* err = pylua_get_as_unicode(L, -1);
-        PyErr_SetObject(LuaCompileError, err);
+        PyErr_SetObject(self->module->LuaCompileError, err);
         Py_DECREF(err);
         lua_pop(L, 1);
+        PYLUA_LEAVE(&self->info);
         return NULL;
     }
 
@@ -102,6 +255,7 @@ static PyObject* LuaState_load_file(LuaStateObject* self, PyObject* args) {
     lua_pop(L, 1);
 
     // error handling for pylua_get_as_pyobj is useless
+    PYLUA_LEAVE(&self->info);
     return res;
 }
 
@@ -123,7 +277,7 @@ static PyObject* LuaState_load_string(LuaStateObject* self, PyObject* args) {
     
 #if LUA_VERSION_NUM <= 501
     if (mode) {
-        PyErr_SetObject(LuaError, LUA_VERSION " does not support mode arg");
+        PyErr_SetString(self->module->LuaError, LUA_VERSION " does not support mode arg");
         return NULL;
     }
 #endif
@@ -132,19 +286,291 @@ static PyObject* LuaState_load_string(LuaStateObject* self, PyObject* args) {
     if (!name)
         name = script;
     
-    PYLUA_CHECK(L, &self->info, NULL);
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    // source code goes through the chunk cache, if any
+    LuaChunkCacheObject* cache = (LuaChunkCacheObject*)self->cache;
+    PyObject* key = NULL;
+    int cached = 0;
+    
+    if (cache && pylua_chunk_cacheable(script, len, mode)) {
+        key = pylua_chunk_key(cache, script, len, name);
+        cached = key ? pylua_chunk_load(cache, L, key, name) : -1;
+        if (cached < 0) {
+            Py_XDECREF(key);
+            PYLUA_LEAVE(&self->info);
+            return NULL;
+        }
+    }
+
+    // attempt to compile
+    int err = 0;
+    if (!cached) {
+#if LUA_VERSION_NUM >= 502
+        err = luaL_loadbufferx(L, script, len, name, mode);
+#else
+        err = luaL_loadbuffer(L, script, len, name);
+#endif
+        if (!err && key && pylua_chunk_store(cache, L, key) < 0) {
+            Py_DECREF(key);
+            lua_pop(L, 1);
+            PYLUA_LEAVE(&self->info);
+            return NULL;
+        }
+    }
+    Py_XDECREF(key);
+    
+    if (err) {
+        PyObject* err = pylua_get_as_unicode(L, -1);
+        PyErr_SetObject(self->module->LuaCompileError, err);
+        Py_DECREF(err);
+        lua_pop(L, 1);
+        PYLUA_LEAVE(&self->info);
+        return NULL;
+    }
+
+    // get it as a luafunction
+    PyObject* res = pylua_get_as_pyobj(&self->info, -1);
+    lua_pop(L, 1);
+
+    PYLUA_LEAVE(&self->info);
+    return res;
+}
+
+// Size of the chunks read from file objects
+#define PYLUA_STREAM_CHUNK 65536
+
+// State of pylua_stream_read
+struct StreamReader {
+    // Bound read method or iterator, or neither for a single buffer
+    PyObject* read;
+    PyObject* iter;
+    
+    // Chunk being read by lua, which must stay alive until the next one
+    PyObject* chunk;
+    Py_buffer view;
+    int viewing;
+    int done;
+};
+
+/**
+ * Releases the chunk being read by lua
+ */
+static void pylua_stream_release(struct StreamReader* r) {
+    if (r->viewing) {
+        PyBuffer_Release(&r->view);
+        r->viewing = 0;
+    }
+    Py_CLEAR(r->chunk);
+}
+
+/**
+ * lua_Reader pulling chunks from a python object.
+ * If a python exception occurs, it stops there: the caller must check for it.
+ */
+static const char* pylua_stream_read(lua_State* L, void* ud, size_t* size) {
+    struct StreamReader* r = (struct StreamReader*)ud;
+    *size = 0;
+    
+    if (r->done)
+        return NULL;
+    
+    // a buffer is given to lua as a whole
+    if (!r->read && !r->iter) {
+        r->done = 1;
+        *size = (size_t)r->view.len;
+        return (const char*)r->view.buf;
+    }
+    
+    pylua_stream_release(r);
+    
+    for (;;) {
+        PyObject* chunk = r->read
+            ? PyObject_CallFunction(r->read, "n", (Py_ssize_t)PYLUA_STREAM_CHUNK)
+            : PyIter_Next(r->iter);
+        
+        if (!chunk) {
+            r->done = 1;
+            return NULL;
+        }
+        r->chunk = chunk;
+        
+        // text files give str, which lua gets as UTF-8
+        const char* data = NULL;
+        Py_ssize_t len = 0;
+        if (PyUnicode_Check(chunk)) {
+            data = PyUnicode_AsUTF8AndSize(chunk, &len);
+            
+        } else if (PyObject_GetBuffer(chunk, &r->view, PyBUF_SIMPLE) == 0) {
+            r->viewing = 1;
+            data = (const char*)r->view.buf;
+            len = r->view.len;
+        }
+        
+        if (!data) {
+            r->done = 1;
+            return NULL;
+        }
+        
+        if (len > 0) {
+            *size = (size_t)len;
+            return data;
+        }
+        
+        // an empty read means the end of the file,
+        // but an iterator may give empty chunks
+        if (r->read) {
+            r->done = 1;
+            return NULL;
+        }
+        pylua_stream_release(r);
+    }
+}
 
+/**
+ * Implements LuaState.load_stream, which compiles a script read from
+ * a file object, an iterator of chunks, or a buffer (such as a mmap, which is not copied)
+ * to a callable LuaFunction, without having it all in memory at once.
+ *
+ * The chunk name defaults to the name of the file, if any.
+ */
+static PyObject* LuaState_load_stream(LuaStateObject* self, PyObject* args) {
+    PyObject* source;
+    const char* name = NULL;
+    const char* mode = NULL; // defaults to "bt"
+    
+    if (!PyArg_ParseTuple(args, "O|zz", &source, &name, &mode)) {
+        return NULL;
+    }
+    
+#if LUA_VERSION_NUM <= 501
+    if (mode) {
+        PyErr_SetString(self->module->LuaError, LUA_VERSION " does not support mode arg");
+        return NULL;
+    }
+#endif
+    
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    struct StreamReader r = {NULL, NULL, NULL, {0}, 0, 0};
+    
+    // mmaps have a read method too, but they don't need it
+    if (PyObject_CheckBuffer(source)) {
+        if (PyObject_GetBuffer(source, &r.view, PyBUF_SIMPLE) < 0) {
+            PYLUA_LEAVE(&self->info);
+            return NULL;
+        }
+        r.viewing = 1;
+        
+    } else if (PyObject_HasAttrString(source, "read")) {
+        if (!(r.read = PyObject_GetAttrString(source, "read"))) {
+            PYLUA_LEAVE(&self->info);
+            return NULL;
+        }
+        
+    } else if (!(r.iter = PyObject_GetIter(source))) {
+        PYLUA_LEAVE(&self->info);
+        return NULL;
+    }
+    
+    // file objects have a name, else keep it short
+    PyObject* fname = NULL;
+    if (!name && r.read) {
+        PyObject* attr = PyObject_GetAttrString(source, "name");
+        if (attr && PyUnicode_Check(attr))
+            fname = PyUnicode_FromFormat("@%U", attr);
+        
+        Py_XDECREF(attr);
+        PyErr_Clear();
+        
+        if (fname && !(name = PyUnicode_AsUTF8(fname)))
+            PyErr_Clear();
+    }
+    if (!name)
+        name = "=(stream)";
+    
     // attempt to compile
 #if LUA_VERSION_NUM >= 502
-    int err = luaL_loadbufferx(L, script, len, name, mode);
+    int err = lua_load(L, &pylua_stream_read, &r, name, mode);
 #else
-    int err = luaL_loadbuffer(L, script, len, name);
+    int err = lua_load(L, &pylua_stream_read, &r, name);
 #endif
+    
+    pylua_stream_release(&r);
+    Py_XDECREF(r.read);
+    Py_XDECREF(r.iter);
+    Py_XDECREF(fname);
+    
+    // the source failed first
+    if (PyErr_Occurred()) {
+        lua_pop(L, 1);
+        PYLUA_LEAVE(&self->info);
+        return NULL;
+    }
+    
+    if (err) {
+        PyObject* err = pylua_get_as_unicode(L, -1);
+        PyErr_SetObject(self->module->LuaCompileError, err);
+        Py_DECREF(err);
+        lua_pop(L, 1);
+        PYLUA_LEAVE(&self->info);
+        return NULL;
+    }
+
+    // get it as a luafunction
+    PyObject* res = pylua_get_as_pyobj(&self->info, -1);
+    lua_pop(L, 1);
+
+    PYLUA_LEAVE(&self->info);
+    return res;
+}
+
+/**
+ * Implements LuaState.load_bytecode, which loads a binary chunk
+ * (from LuaFunction.dump, or luac) to a callable LuaFunction.
+ *
+ * Unlike load_string and load_file, this only accepts bytecode.
+ * Any buffer can be given (bytes, mmap...), it is not copied.
+ * Bytecode is not verified by lua: it must come from a trusted source.
+ */
+static PyObject* LuaState_load_bytecode(LuaStateObject* self, PyObject* args) {
+    Py_buffer view;
+    const char* name = NULL;
+    
+    if (!PyArg_ParseTuple(args, "y*|z", &view, &name)) {
+        return NULL;
+    }
+    
+    if (!name)
+        name = "=(bytecode)";
+    
+    // give a clear error before lua does
+    const char* msg = pylua_check_bytecode((const char*)view.buf, (size_t)view.len);
+    if (msg) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(self->module->LuaCompileError, msg);
+        return NULL;
+    }
+    
+    // same as PYLUA_ENTER, but the buffer must be released
+    pylua_lock(self);
+    lua_State* L = self->info.state;
+    if (!L) {
+        pylua_unlock(self);
+        PyBuffer_Release(&view);
+        PyErr_SetString(self->module->LuaFatalError, "lua state is dead");
+        return NULL;
+    }
+    
+    int err = pylua_load_binary(L, (const char*)view.buf, (size_t)view.len, name);
+    PyBuffer_Release(&view);
+    
     if (err) {
         PyObject* err = pylua_get_as_unicode(L, -1);
-        PyErr_SetObject(LuaCompileError, err);
+        PyErr_SetObject(self->module->LuaCompileError, err);
         Py_DECREF(err);
         lua_pop(L, 1);
+        PYLUA_LEAVE(&self->info);
         return NULL;
     }
 
@@ -152,6 +578,190 @@ static PyObject* LuaState_load_string(LuaStateObject* self, PyObject* args) {
     PyObject* res = pylua_get_as_pyobj(&self->info, -1);
     lua_pop(L, 1);
 
+    PYLUA_LEAVE(&self->info);
+    return res;
+}
+
+/**
+ * Implements LuaState.pack, which encodes a value (and the tables it contains)
+ * to msgpack, like pylua.pack does in lua.
+ *
+ * With refs, shared tables and cycles are kept, as references.
+ */
+static PyObject* LuaState_pack(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"value", "refs", NULL};
+    PyObject* value;
+    int refs = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|p", keywords, &value, &refs)) {
+        return NULL;
+    }
+    
+    PYLUA_ENTER(L, &self->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->info, NULL);
+    
+    struct Buffer buf;
+    pylua_buffer_init(&buf);
+    
+    lua_pushcfunction(L, &pylua_pack_buffer);
+    if (pylua_push_pyobj(L, value) < 0) {
+        lua_pop(L, 1);
+        PYLUA_UNPROTECT(&self->info);
+        PYLUA_LEAVE(&self->info);
+        return NULL;
+    }
+    lua_pushboolean(L, refs);
+    lua_pushlightuserdata(L, &buf);
+    
+    PyObject* res = NULL;
+    int err = pylua_pcall_released(&self->info, 3, 0);
+    if (err > 0) {
+        if (!PyErr_Occurred()) {
+            PyObject* msg = pylua_get_as_unicode(L, -1);
+            PyErr_SetObject(self->module->LuaError, msg);
+            Py_XDECREF(msg);
+        }
+        lua_pop(L, 1);
+        
+    } else if (!err) {
+        res = PyBytes_FromStringAndSize(buf.data, (Py_ssize_t)buf.size);
+    }
+    
+    pylua_buffer_free(&buf);
+    PYLUA_UNPROTECT(&self->info);
+    PYLUA_LEAVE(&self->info);
+    return res;
+}
+
+/**
+ * Implements LuaState.unpack, which decodes msgpack (from pack, or anything else
+ * without ext types) to a lua value.
+ * Any buffer can be given, it is not copied.
+ */
+static PyObject* LuaState_unpack(LuaStateObject* self, PyObject* args) {
+    Py_buffer view;
+    
+    if (!PyArg_ParseTuple(args, "y*", &view)) {
+        return NULL;
+    }
+    
+    // same as PYLUA_ENTER, but the buffer must be released
+    pylua_lock(self);
+    lua_State* L = self->info.state;
+    if (!L) {
+        pylua_unlock(self);
+        PyBuffer_Release(&view);
+        PyErr_SetString(self->module->LuaFatalError, "lua state is dead");
+        return NULL;
+    }
+    
+    // same as PYLUA_PROTECT_LEAVE, releasing the buffer as well
+    if (setjmp(pylua_push_panichandler(&self->info)->buf)) {
+        pylua_pop_panichandler(&self->info);
+        pylua_unlock(self);
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    
+    PyObject* res = NULL;
+    int err = -1;
+    
+    if (lua_checkstack(L, 3)) {
+        lua_pushcfunction(L, &pylua_unpack_buffer);
+        lua_pushlightuserdata(L, view.buf);
+        lua_pushinteger(L, (lua_Integer)view.len);
+        err = pylua_pcall_released(&self->info, 2, 1);
+        
+    } else {
+        PyErr_SetString(self->module->LuaError, "stack overflow");
+    }
+    
+    if (err > 0) {
+        if (!PyErr_Occurred()) {
+            PyObject* msg = pylua_get_as_unicode(L, -1);
+            PyErr_SetObject(self->module->LuaError, msg);
+            Py_XDECREF(msg);
+        }
+        lua_pop(L, 1);
+        
+    } else if (!err) {
+        res = pylua_get_as_pyobj(&self->info, -1);
+        lua_pop(L, 1);
+    }
+    
+    PYLUA_UNPROTECT(&self->info);
+    PyBuffer_Release(&view);
+    PYLUA_LEAVE(&self->info);
+    return res;
+}
+
+/**
+ * Implements LuaState.decode_json, which parses JSON straight to lua values.
+ * Any buffer can be given, it is not copied.
+ *
+ * JSON null is nil, or `null` if it is not None.
+ * With mark_arrays, arrays get a metatable so that empty ones are encoded back as arrays.
+ */
+static PyObject* LuaState_decode_json(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"buffer", "null", "mark_arrays", NULL};
+    Py_buffer view;
+    PyObject* null = Py_None;
+    int arrays = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|Op", keywords, &view, &null, &arrays)) {
+        return NULL;
+    }
+    
+    // same as PYLUA_ENTER, but the buffer must be released
+    pylua_lock(self);
+    lua_State* L = self->info.state;
+    if (!L) {
+        pylua_unlock(self);
+        PyBuffer_Release(&view);
+        PyErr_SetString(self->module->LuaFatalError, "lua state is dead");
+        return NULL;
+    }
+    
+    // same as PYLUA_PROTECT_LEAVE, releasing the buffer as well
+    if (setjmp(pylua_push_panichandler(&self->info)->buf)) {
+        pylua_pop_panichandler(&self->info);
+        pylua_unlock(self);
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    
+    PyObject* res = NULL;
+    
+    lua_pushcfunction(L, &pylua_json_decode_buffer);
+    lua_pushlightuserdata(L, view.buf);
+    lua_pushinteger(L, (lua_Integer)view.len);
+    lua_pushboolean(L, arrays);
+    
+    if (null != Py_None && pylua_push_pyobj(L, null) < 0) {
+        lua_pop(L, 4);
+        PYLUA_UNPROTECT(&self->info);
+        PyBuffer_Release(&view);
+        PYLUA_LEAVE(&self->info);
+        return NULL;
+    }
+    
+    int err = pylua_pcall_released(&self->info, null != Py_None ? 4 : 3, 1);
+    if (err > 0) {
+        if (!PyErr_Occurred()) {
+            PyObject* msg = pylua_get_as_unicode(L, -1);
+            PyErr_SetObject(self->module->LuaError, msg);
+            Py_XDECREF(msg);
+        }
+        lua_pop(L, 1);
+        
+    } else if (!err) {
+        res = pylua_get_as_pyobj(&self->info, -1);
+        lua_pop(L, 1);
+    }
+    
+    PYLUA_UNPROTECT(&self->info);
+    PyBuffer_Release(&view);
+    PYLUA_LEAVE(&self->info);
     return res;
 }
 
@@ -159,7 +769,7 @@ static PyObject* LuaState_load_string(LuaStateObject* self, PyObject* args) {
  * Implements LuaState.get_globals, which returns the global table
  */
 static PyObject* LuaState_get_globals(LuaStateObject *self, void *unused) {
-    PYLUA_CHECK(L, &self->info, NULL);
+    PYLUA_ENTER(L, &self->info, NULL);
 
 #if LUA_VERSION_NUM >= 502
     lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
@@ -169,6 +779,7 @@ static PyObject* LuaState_get_globals(LuaStateObject *self, void *unused) {
     PyObject* globals = pylua_get_as_pyobj(&self->info, -1);
     lua_pop(L, 1);
 
+    PYLUA_LEAVE(&self->info);
     return globals;
 }
 
@@ -176,8 +787,8 @@ static PyObject* LuaState_get_globals(LuaStateObject *self, void *unused) {
  * Implements LuaState.new_table, which returns a new thread
  */
 static PyObject* LuaState_new_thread(LuaStateObject* self, PyObject* args) {
-    PYLUA_CHECK(L, &self->info, NULL);
-    PYLUA_PROTECT(&self->info, NULL);
+    PYLUA_ENTER(L, &self->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->info, NULL);
 
     lua_State* thread = lua_newthread(L);
     PyObject* res = pylua_get_as_pyobj(&self->info, -1);
@@ -187,6 +798,7 @@ static PyObject* LuaState_new_thread(LuaStateObject* self, PyObject* args) {
     info->root = self;
     
     PYLUA_UNPROTECT(&self->info);
+    PYLUA_LEAVE(&self->info);
     return res;
 }
 
@@ -198,10 +810,10 @@ static PyObject* LuaState_new_table(LuaStateObject* self, PyObject* args) {
     //    return NULL;
     //}
 
-    PYLUA_CHECK(L, &self->info, NULL);
+    PYLUA_ENTER(L, &self->info, NULL);
 
     // protect from memory allocation errors
-    PYLUA_PROTECT(&self->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->info, NULL);
 
     lua_newtable(L);
     PyObject* res = pylua_get_as_pyobj(&self->info, -1);
@@ -209,6 +821,7 @@ static PyObject* LuaState_new_table(LuaStateObject* self, PyObject* args) {
 
     // error handling for pylua_get_as_pyobj is useless
     PYLUA_UNPROTECT(&self->info);
+    PYLUA_LEAVE(&self->info);
     return res;
 }
 
@@ -222,24 +835,16 @@ static PyObject* LuaState_new_userdata(LuaStateObject* self, PyObject* args) {
         return NULL;
     }
     
-    PYLUA_CHECK(L, &self->info, NULL);
-    PYLUA_PROTECT(&self->info, NULL);
-    
-    Py_INCREF(obj);
-    PyObject** userdata = lua_newuserdata(L, sizeof(PyObject*));
-    *userdata = obj;
+    PYLUA_ENTER(L, &self->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->info, NULL);
     
-    lua_newtable(L);
-    lua_pushcclosure(L, &pylua_gc, 0);
-    lua_setfield(L, -2, "__gc");
-    //lua_pushcclosure(L, &pylua_tostring, 0);
-    //lua_setfield(L, -2, "__tostring");
-    lua_setmetatable(L, -2);
+    pylua_push_pyuserdata(L, obj);
     
     PyObject* res = pylua_get_as_pyobj(&self->info, -1);
     lua_pop(L, 1);
     
     PYLUA_UNPROTECT(&self->info);
+    PYLUA_LEAVE(&self->info);
     return res;
 }
 
@@ -254,31 +859,16 @@ static PyObject* LuaState_new_function(LuaStateObject* self, PyObject* args) {
         return NULL;
     }
 
-    PYLUA_CHECK(L, &self->info, NULL);
+    PYLUA_ENTER(L, &self->info, NULL);
 
     // protect from memory allocation errors
-    PYLUA_PROTECT(&self->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->info, NULL);
 
     // We can't check the type of our function: it could be an instance,
     // a callable class, or just a regular function ; the user can do whatever he wants
 
-    // Let's push our function as an upvalue
-    Py_INCREF(func);
-    PyObject** userdata = lua_newuserdata(L, sizeof(PyObject*));
-    *userdata = func;
-
-    // we want to add a gc handler, so let's create a metatable
-    lua_newtable(L);
-    //lua_pushlightuserdata(L, func);
-    //lua_pushvalue(L, -2); // let's use the same one instead
-    lua_pushcclosure(L, &pylua_gc, 0);
-    lua_setfield(L, -2, "__gc");
-
-    // we got our lightuserdata followed by our table
-    lua_setmetatable(L, -2);
-
-    // push our new C closure
-    lua_pushcclosure(L, &pylua_call_python, 1);
+    // push our new C closure, with our function as an upvalue
+    pylua_push_pycallable(L, func);
 
     // Then we get it as a LuaTable
     PyObject* res = pylua_get_as_pyobj(&self->info, -1);
@@ -286,56 +876,735 @@ static PyObject* LuaState_new_function(LuaStateObject* self, PyObject* args) {
 
     // Error handling for get_as_pyobj is useless
     PYLUA_UNPROTECT(&self->info);
+    PYLUA_LEAVE(&self->info);
     return res;
 }
 
 /**
  * Implements LuaState.set_hook, which binds a Lua debug hook
- * to a python callable
+ * to a python callable, run along with the time limit, the profiler,
+ * the tracer and the coverage (see pylua_hook_builtin). With a `batch` size, the hook is called with
+ * a list of (event, line, source, name) tuples every `batch` events,
+ * and with the remaining ones when the call from python returns.
+ * Events which don't fit in a full batch that can't be given yet
+ * are dropped, with a RuntimeWarning on the next delivery.
  */
-static PyObject* LuaState_set_hook(LuaStateObject* self, PyObject* args) {
+static PyObject* LuaState_set_hook(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"hook", "mask", "count", "batch", NULL};
     PyObject* hook;
     int mask = 0;
     int count = 0;
+    int batch = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iii", kwlist, &hook, &mask, &count, &batch))
+        return NULL;
     
-    if (!PyArg_ParseTuple(args, "O|ii", &hook, &mask, &count))
+    if (batch < 0 || count < 0) {
+        PyErr_SetString(PyExc_ValueError, "count and batch must not be negative");
         return NULL;
+    }
+    
+    struct HookBatch* events = NULL;
+    if (hook != Py_None && batch > 0) {
+        events = pylua_hookbatch_new(batch);
+        if (!events)
+            return PyErr_NoMemory();
+    }
+    
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    // the events of the old hook are its own
+    pylua_flush_hook(self);
+    pylua_hookbatch_free(self->hookbatch);
+    self->hookbatch = events;
     
+    PyObject* old = self->hook;
     if (hook == Py_None) {
-        Py_XDECREF(self->hook);
         self->hook = NULL;
-        lua_sethook(self->info.state, NULL, 0, 0);
+        self->hookmask = 0;
+        self->hookcount = 0;
         
     } else {
         Py_INCREF(hook);
-        Py_XDECREF(self->hook);
         self->hook = hook;
-        lua_sethook(self->info.state, &pylua_hook_python, mask, count); 
+        self->hookmask = mask & (LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE | LUA_MASKCOUNT);
+        self->hookcount = count;
     }
     
+    self->hookelapsed = 0;
+    pylua_set_builtin_hook(self);
+    
+    PYLUA_LEAVE(&self->info);
+    
+    // the old hook may run any code on release
+    Py_XDECREF(old);
     Py_RETURN_NONE;
 }
 
 /**
- * Implements LuaState.close(), which closes the lua state
- * Returns True if the state was closed, False otherwise.
+ * Implements LuaState.start_profiler, which samples the lua stack from
+ * the builtin hook, without the GIL: every interval_instructions instructions,
+ * or else every interval_us microseconds. The last max_samples are kept,
+ * and the ones of a previous run are dropped.
  */
-static PyObject* LuaState_close(LuaStateObject* self, void* unused) {
-    if (self->info.state) {
-        lua_close(self->info.state);
-        self->info.state = NULL;
-        Py_RETURN_TRUE;
+static PyObject* LuaState_start_profiler(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"interval_instructions", "interval_us", "max_samples", NULL};
+    long instructions = 0;
+    long long interval = 1000;
+    Py_ssize_t capacity = 10000;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|lLn", keywords, &instructions, &interval, &capacity))
+        return NULL;
+    
+    if (instructions < 0 || instructions > INT_MAX || interval <= 0 || interval > LLONG_MAX / 1000 || capacity <= 0) {
+        PyErr_SetString(PyExc_ValueError, "invalid profiler interval or size");
+        return NULL;
     }
     
-    Py_RETURN_FALSE;
-}
-
+    // the sampled stacks are allocated as one block
+    if ((size_t)capacity > SIZE_MAX / (PYLUA_PROFILER_DEPTH * sizeof(uint32_t)))
+        return PyErr_NoMemory();
+    
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    struct Profiler* prof = pylua_profiler_new(instructions, interval * 1000, (size_t)capacity);
+    if (!prof) {
+        PYLUA_LEAVE(&self->info);
+        return PyErr_NoMemory();
+    }
+    
+    pylua_profiler_free(self->profiler);
+    self->profiler = prof;
+    pylua_set_builtin_hook(self);
+    
+    PYLUA_LEAVE(&self->info);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements LuaState.stop_profiler, which stops sampling ;
+ * the samples are kept for collapsed_stacks
+ */
+static PyObject* LuaState_stop_profiler(LuaStateObject* self, PyObject* unused) {
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    if (self->profiler) {
+        self->profiler->running = 0;
+        pylua_set_builtin_hook(self);
+    }
+    
+    PYLUA_LEAVE(&self->info);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements LuaState.collapsed_stacks, which returns the samples of the profiler
+ * as collapsed stacks (one "outer;...;inner count" line per stack), as read
+ * by flamegraph tools. Functions are named by their source and line.
+ * The samples are dropped if `clear` is set.
+ */
+static PyObject* LuaState_collapsed_stacks(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"clear", NULL};
+    int clear = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", keywords, &clear))
+        return NULL;
+    
+    struct Buffer out;
+    pylua_buffer_init(&out);
+    
+    pylua_lock(self);
+    int err = 0;
+    if (self->profiler) {
+        err = pylua_profiler_collapse(self->profiler, &out);
+        if (!err && clear)
+            pylua_profiler_clear(self->profiler);
+    }
+    pylua_unlock(self);
+    
+    if (err) {
+        pylua_buffer_free(&out);
+        return PyErr_NoMemory();
+    }
+    
+    PyObject* res = PyUnicode_DecodeUTF8(out.data ? out.data : "", (Py_ssize_t)out.size, "replace");
+    pylua_buffer_free(&out);
+    return res;
+}
+
+/**
+ * Implements LuaState.start_tracer, which counts the calls and times
+ * every function, from the builtin hook on calls and returns.
+ * The stats of a previous run are dropped.
+ */
+static PyObject* LuaState_start_tracer(LuaStateObject* self, PyObject* unused) {
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    struct Tracer* tr = pylua_tracer_new();
+    if (!tr) {
+        PYLUA_LEAVE(&self->info);
+        return PyErr_NoMemory();
+    }
+    
+    pylua_tracer_free(self->tracer);
+    self->tracer = tr;
+    pylua_set_builtin_hook(self);
+    
+    PYLUA_LEAVE(&self->info);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements LuaState.stop_tracer, which stops tracing ;
+ * the stats are kept for tracer_stats
+ */
+static PyObject* LuaState_stop_tracer(LuaStateObject* self, PyObject* unused) {
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    if (self->tracer) {
+        self->tracer->running = 0;
+        pylua_set_builtin_hook(self);
+    }
+    
+    PYLUA_LEAVE(&self->info);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Returns the stats of the tracer, as pstats has them (see pylua_tracer_stats),
+ * dropping them if `clear` is set
+ */
+static PyObject* pylua_state_tracer_stats(LuaStateObject* self, int clear) {
+    pylua_lock(self);
+    
+    PyObject* stats;
+    if (self->tracer) {
+        stats = pylua_tracer_stats(self->tracer);
+        if (stats && clear)
+            pylua_tracer_clear(self->tracer);
+    } else {
+        stats = PyDict_New();
+    }
+    
+    pylua_unlock(self);
+    return stats;
+}
+
+/**
+ * Implements LuaState.tracer_stats, which returns the stats of the tracer
+ * as a dict, in the format of pstats.Stats.stats
+ */
+static PyObject* LuaState_tracer_stats(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"clear", NULL};
+    int clear = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", keywords, &clear))
+        return NULL;
+    
+    return pylua_state_tracer_stats(self, clear);
+}
+
+/**
+ * Implements LuaState.dump_stats, which writes the stats of the tracer to a file,
+ * to be loaded by pstats.Stats (as cProfile.Profile.dump_stats does)
+ */
+static PyObject* LuaState_dump_stats(LuaStateObject* self, PyObject* args) {
+    PyObject* filename;
+    
+    if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &filename))
+        return NULL;
+    
+    PyObject* stats = pylua_state_tracer_stats(self, 0);
+    PyObject* data = stats ? PyMarshal_WriteObjectToString(stats, Py_MARSHAL_VERSION) : NULL;
+    Py_XDECREF(stats);
+    if (!data) {
+        Py_DECREF(filename);
+        return NULL;
+    }
+    
+    FILE* file = fopen(PyBytes_AS_STRING(filename), "wb");
+    int err = !file || fwrite(PyBytes_AS_STRING(data), 1, (size_t)PyBytes_GET_SIZE(data), file) != (size_t)PyBytes_GET_SIZE(data);
+    if (file && fclose(file) != 0)
+        err = 1;
+    
+    if (err)
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+    
+    Py_DECREF(data);
+    Py_DECREF(filename);
+    if (err)
+        return NULL;
+    
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements LuaState.start_coverage, which collects the lines run from
+ * the builtin hook. With `functions`, the lines of the functions called
+ * are also collected on calls, so that coverage_lcov can tell the lines
+ * not run. The data of a previous run is dropped.
+ */
+static PyObject* LuaState_start_coverage(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"functions", NULL};
+    int functions = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", keywords, &functions))
+        return NULL;
+    
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    struct Coverage* cov = pylua_coverage_new(functions);
+    if (!cov) {
+        PYLUA_LEAVE(&self->info);
+        return PyErr_NoMemory();
+    }
+    
+    pylua_coverage_free(self->coverage);
+    self->coverage = cov;
+    pylua_set_builtin_hook(self);
+    
+    PYLUA_LEAVE(&self->info);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements LuaState.stop_coverage, which stops collecting, and returns
+ * the lines run as a dict of sets by chunk. The data is kept for coverage_lcov.
+ */
+static PyObject* LuaState_stop_coverage(LuaStateObject* self, PyObject* unused) {
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    PyObject* res;
+    if (self->coverage) {
+        self->coverage->running = 0;
+        pylua_set_builtin_hook(self);
+        res = pylua_coverage_lines(self->coverage);
+    } else {
+        res = PyDict_New();
+    }
+    
+    PYLUA_LEAVE(&self->info);
+    return res;
+}
+
+/**
+ * Implements LuaState.coverage_lcov, which returns the coverage as an lcov tracefile
+ */
+static PyObject* LuaState_coverage_lcov(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"test_name", NULL};
+    const char* test = "";
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|s", keywords, &test))
+        return NULL;
+    
+    struct Buffer out;
+    pylua_buffer_init(&out);
+    
+    pylua_lock(self);
+    int err = self->coverage ? pylua_coverage_lcov(self->coverage, test, &out) : 0;
+    pylua_unlock(self);
+    
+    if (err) {
+        pylua_buffer_free(&out);
+        return PyErr_NoMemory();
+    }
+    
+    PyObject* res = PyUnicode_DecodeUTF8(out.data ? out.data : "", (Py_ssize_t)out.size, "replace");
+    pylua_buffer_free(&out);
+    return res;
+}
+
+/**
+ * Runs a C function on a state (given `ud` as a light userdata), as a protected call:
+ * running out of memory raises a LuaError, but the state stays usable.
+ * Python exceptions raised from the function take precedence over its lua error.
+ * It runs with the GIL released, and is refused while any thread runs lua code.
+ * Returns -1 if a python exception occured
+ */
+static int pylua_state_protected(LuaStateObject* self, lua_CFunction func, void* ud) {
+    PYLUA_ENTER(L, &self->info, -1);
+    
+    // it would pull the rug from under the running code, in any thread
+    if (self->ncalls) {
+        PYLUA_LEAVE(&self->info);
+        PyErr_SetString(self->module->LuaError, "cannot do that while lua code is running");
+        return -1;
+    }
+    
+    PYLUA_PROTECT_LEAVE(&self->info, -1);
+    
+    // finalizers may run python callbacks
+    lua_pushcfunction(L, func);
+    lua_pushlightuserdata(L, ud);
+    int err = pylua_pcall_released(&self->info, 1, 0);
+    
+    if (err > 0) {
+        if (!PyErr_Occurred()) {
+            PyObject* msg = pylua_get_as_unicode(L, -1);
+            PyErr_SetObject(self->module->LuaError, msg);
+            Py_XDECREF(msg);
+        }
+        lua_pop(L, 1);
+    }
+    
+    PYLUA_UNPROTECT(&self->info);
+    PYLUA_LEAVE(&self->info);
+    return err ? -1 : 0;
+}
+
+/**
+ * Saves the globals, the registry and the loaded packages of a state
+ * Returns -1 if a python exception occured
+ */
+int pylua_state_checkpoint(LuaStateObject* self) {
+    return pylua_state_protected(self, &pylua_checkpoint, NULL);
+}
+
+/**
+ * Restores a state to its last checkpoint
+ * Returns -1 if a python exception occured
+ */
+int pylua_state_reset(LuaStateObject* self) {
+    return pylua_state_protected(self, &pylua_reset, NULL);
+}
+
+/**
+ * Implements LuaState.checkpoint(), which saves the tables of the state
+ * (globals, registry, loaded packages, metatables) so that reset() can restore them
+ */
+static PyObject* LuaState_checkpoint(LuaStateObject* self, PyObject* unused) {
+    if (pylua_state_checkpoint(self) < 0)
+        return NULL;
+    
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements LuaState.reset(), which restores the state to its last checkpoint,
+ * reusing its memory instead of creating a new state
+ */
+static PyObject* LuaState_reset(LuaStateObject* self, PyObject* unused) {
+    if (pylua_state_reset(self) < 0)
+        return NULL;
+    
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements LuaState.save_image, which returns an image of the state
+ * (globals, loaded packages and everything they reach) for load_image.
+ *
+ * Python-backed functions and userdata are given to `persist`, which must return bytes.
+ * `permanents` maps names to values which are saved by name,
+ * along with the C functions and userdata of the loaded packages.
+ */
+static PyObject* LuaState_save_image(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"persist", "permanents", NULL};
+    PyObject* persist = Py_None;
+    PyObject* permanents = Py_None;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", keywords, &persist, &permanents)) {
+        return NULL;
+    }
+    
+    if ((persist != Py_None && !PyCallable_Check(persist)) || (permanents != Py_None && !PyDict_Check(permanents))) {
+        PyErr_SetString(PyExc_TypeError, "persist must be callable, and permanents a dict");
+        return NULL;
+    }
+    
+    struct Image img;
+    memset(&img, 0, sizeof img);
+    img.hook = persist != Py_None ? persist : NULL;
+    img.permanents = permanents != Py_None ? permanents : NULL;
+    pylua_buffer_init(&img.buf);
+    
+    if (pylua_state_protected(self, &pylua_save_image, &img) < 0) {
+        pylua_buffer_free(&img.buf);
+        return NULL;
+    }
+    
+    PyObject* res = PyBytes_FromStringAndSize(img.buf.data, (Py_ssize_t)img.buf.size);
+    pylua_buffer_free(&img.buf);
+    return res;
+}
+
+/**
+ * Implements LuaState.load_image, which replaces the globals and loaded packages
+ * of the state with those from an image made by save_image.
+ *
+ * The state must have the same libraries and permanents as the saved one.
+ * Python-backed values are given to `unpersist` as bytes, and replaced by what it returns.
+ * If it fails, the state is left half loaded and should be closed.
+ */
+static PyObject* LuaState_load_image(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"image", "unpersist", "permanents", NULL};
+    Py_buffer view;
+    PyObject* unpersist = Py_None;
+    PyObject* permanents = Py_None;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|OO", keywords, &view, &unpersist, &permanents)) {
+        return NULL;
+    }
+    
+    if ((unpersist != Py_None && !PyCallable_Check(unpersist)) || (permanents != Py_None && !PyDict_Check(permanents))) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_TypeError, "unpersist must be callable, and permanents a dict");
+        return NULL;
+    }
+    
+    struct Image img;
+    memset(&img, 0, sizeof img);
+    img.hook = unpersist != Py_None ? unpersist : NULL;
+    img.permanents = permanents != Py_None ? permanents : NULL;
+    img.data = (const char*)view.buf;
+    img.size = (size_t)view.len;
+    
+    int err = pylua_state_protected(self, &pylua_load_image, &img);
+    PyBuffer_Release(&view);
+    
+    if (err < 0)
+        return NULL;
+    
+    Py_RETURN_NONE;
+}
+
+/**
+ * Implements LuaState.close(), which closes the lua state
+ * Returns True if the state was closed, False otherwise.
+ */
+static PyObject* LuaState_close(LuaStateObject* self, void* unused) {
+    pylua_lock(self);
+    
+    if (self->info.state) {
+        lua_close(self->info.state);
+        self->info.state = NULL;
+        
+        // everything lua allocated goes at once
+        pylua_slab_free(self->slab);
+        self->slab = NULL;
+        pylua_unlock(self);
+        Py_RETURN_TRUE;
+    }
+    
+    pylua_unlock(self);
+    Py_RETURN_FALSE;
+}
+
 /**
  * Getter for LuaState.mem_usage
  * Returns the current memory usage
  */
 static PyObject* LuaState_get_mem_usage(LuaStateObject* self, void* unused) {
-    return PyLong_FromSize_t(self->mem);
+    pylua_lock(self);
+    size_t mem = self->mem;
+    pylua_unlock(self);
+    
+    return PyLong_FromSize_t(mem);
+}
+
+/**
+ * Implements LuaState.mem_stats, which returns the heap accounting of the state:
+ * live bytes and blocks per type, an allocation size histogram, the peak usage,
+ * and the peak usage during the last call from python.
+ *
+ * Without track_mem, only the usage and the limit are known.
+ */
+static PyObject* LuaState_mem_stats(LuaStateObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"reset", NULL};
+    int reset = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", keywords, &reset)) {
+        return NULL;
+    }
+    
+    pylua_lock(self);
+    PyObject* res;
+    if (self->memstats) {
+        res = pylua_memstats_dict(self, reset);
+    } else {
+        res = Py_BuildValue("{s:n,s:K}", "used", (Py_ssize_t)self->mem, "limit", (unsigned long long)self->limit);
+    }
+    pylua_unlock(self);
+    
+    return res;
+}
+
+/**
+ * Runs a struct GcCall with the GIL released, as finalizers may run
+ * python callbacks ; returns like pylua_pcall_released
+ */
+static int pylua_state_gc(LuaStateObject* self, struct GcCall* call) {
+    lua_State* L = self->info.state;
+    lua_pushcfunction(L, &pylua_collect_call);
+    lua_pushlightuserdata(L, call);
+    return pylua_pcall_released(&self->info, 1, 0);
+}
+
+/**
+ * Implements LuaState.gc, which drives the garbage collector,
+ * with the same options as collectgarbage:
+ *
+ *   collect, stop, restart -> None
+ *   count -> bytes in use
+ *   step [size] -> True if a cycle finished
+ *   isrunning -> bool
+ *   setpause / setstepmul value -> previous value
+ *   incremental [pause, stepmul, stepsize] -> previous mode
+ *   generational [minormul, majormul] -> previous mode
+ */
+static PyObject* LuaState_gc(LuaStateObject* self, PyObject* args) {
+    const char* op = "collect";
+    struct GcCall call = {0, {0, 0, 0}, 0};
+    
+    if (!PyArg_ParseTuple(args, "|siii", &op, &call.args[0], &call.args[1], &call.args[2])) {
+        return NULL;
+    }
+    
+    int mode = 0;
+    if (strcmp(op, "collect") == 0) {
+        call.what = LUA_GCCOLLECT;
+    } else if (strcmp(op, "stop") == 0) {
+        call.what = LUA_GCSTOP;
+    } else if (strcmp(op, "restart") == 0) {
+        call.what = LUA_GCRESTART;
+    } else if (strcmp(op, "count") == 0) {
+        call.what = LUA_GCCOUNT;
+    } else if (strcmp(op, "step") == 0) {
+        call.what = LUA_GCSTEP;
+    } else if (strcmp(op, "setpause") == 0) {
+        call.what = LUA_GCSETPAUSE;
+    } else if (strcmp(op, "setstepmul") == 0) {
+        call.what = LUA_GCSETSTEPMUL;
+#if LUA_VERSION_NUM >= 502
+    } else if (strcmp(op, "isrunning") == 0) {
+        call.what = LUA_GCISRUNNING;
+#endif
+#if LUA_VERSION_NUM == 502 || LUA_VERSION_NUM >= 504
+    } else if (strcmp(op, "incremental") == 0) {
+        call.what = LUA_GCINC;
+        mode = 1;
+    } else if (strcmp(op, "generational") == 0) {
+        call.what = LUA_GCGEN;
+        mode = 1;
+#else
+    } else if (strcmp(op, "incremental") == 0) {
+        // the only mode, set its parameters
+        call.what = LUA_GCSETPAUSE;
+        mode = 2;
+#endif
+    } else {
+        PyErr_Format(PyExc_ValueError, "invalid gc option '%s' for this lua version", op);
+        return NULL;
+    }
+    
+    PYLUA_ENTER(L, &self->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->info, NULL);
+    
+    int err = 0;
+    if (mode == 2) {
+        // the stepsize is ignored
+        int stepmul = call.args[1];
+        if (call.args[0])
+            err = pylua_state_gc(self, &call);
+        if (!err && stepmul) {
+            call.what = LUA_GCSETSTEPMUL;
+            call.args[0] = stepmul;
+            err = pylua_state_gc(self, &call);
+        }
+        
+    } else {
+        err = pylua_state_gc(self, &call);
+    }
+    
+    if (err) {
+        if (err > 0) {
+            if (!PyErr_Occurred()) {
+                PyObject* msg = pylua_get_as_unicode(L, -1);
+                PyErr_SetObject(self->module->LuaError, msg);
+                Py_XDECREF(msg);
+            }
+            lua_pop(L, 1);
+        }
+        PYLUA_UNPROTECT(&self->info);
+        PYLUA_LEAVE(&self->info);
+        return NULL;
+    }
+    
+    // lua_gc returns KiB, and the rest of the bytes separately
+    if (call.what == LUA_GCCOUNT) {
+        call.what = LUA_GCCOUNTB;
+        pylua_collect_protected(L, &call);
+        size_t count = (size_t)call.res;
+        
+        call.what = LUA_GCCOUNT;
+        pylua_collect_protected(L, &call);
+        count += (size_t)call.res * 1024;
+        
+        PYLUA_UNPROTECT(&self->info);
+        PYLUA_LEAVE(&self->info);
+        return PyLong_FromSize_t(count);
+    }
+    
+    PYLUA_UNPROTECT(&self->info);
+    PYLUA_LEAVE(&self->info);
+    
+    if (mode) {
+#if LUA_VERSION_NUM >= 504
+        return PyUnicode_FromString(call.res == LUA_GCGEN ? "generational" : "incremental");
+#else
+        // the previous mode is not known
+        return PyUnicode_FromString("incremental");
+#endif
+    }
+    
+    switch (call.what) {
+        case LUA_GCSTEP:
+#if LUA_VERSION_NUM >= 502
+        case LUA_GCISRUNNING:
+#endif
+            return PyBool_FromLong(call.res);
+        
+        case LUA_GCSETPAUSE:
+        case LUA_GCSETSTEPMUL:
+            return PyLong_FromLong(call.res);
+        
+        default:
+            Py_RETURN_NONE;
+    }
+}
+
+/**
+ * Getter for LuaState.soft_mem_limit
+ * Returns the soft memory limit, 0 if there is none
+ */
+static PyObject* LuaState_get_soft_mem_limit(LuaStateObject* self, void* unused) {
+    pylua_lock(self);
+    size_t limit = self->softlimit;
+    pylua_unlock(self);
+    
+    return PyLong_FromSize_t(limit == SIZE_MAX ? 0 : limit);
+}
+
+/**
+ * Setter for LuaState.soft_mem_limit
+ * Sets the soft memory limit (0 for none). Crossing it only schedules a full
+ * collection: it runs before the next call from python, or at the next tick
+ * of the builtin count hook if one is installed, never within the allocation.
+ *
+ * Past the hard limit, lua 5.2 and later run an emergency collection before
+ * failing an allocation ; lua 5.1 has none, and fails right away.
+ */
+static int LuaState_set_soft_mem_limit(LuaStateObject* self, PyObject* value, void* unused) {
+    size_t limit = PyLong_AsSize_t(value);
+    if (limit == (size_t)-1 && PyErr_Occurred()) {
+        return -1;
+    }
+
+    pylua_lock(self);
+    self->softlimit = limit ? limit : SIZE_MAX;
+    self->gcpending = self->mem > self->softlimit;
+    pylua_unlock(self);
+    return 0;
 }
 
 /**
@@ -343,7 +1612,11 @@ static PyObject* LuaState_get_mem_usage(LuaStateObject* self, void* unused) {
  * Returns the memory limit
  */
 static PyObject* LuaState_get_mem_limit(LuaStateObject* self, void* unused) {
-    return PyLong_FromSize_t(self->limit);
+    pylua_lock(self);
+    size_t limit = self->limit;
+    pylua_unlock(self);
+    
+    return PyLong_FromSize_t(limit);
 }
 
 /**
@@ -356,10 +1629,23 @@ static int LuaState_set_mem_limit(LuaStateObject* self, PyObject* value, void* u
         return -1;
     }
 
+    pylua_lock(self);
     self->limit = limit;
+    pylua_unlock(self);
     return 0;
 }
 
+/**
+ * Getter for LuaState.tracemalloc_domain
+ * Returns the tracemalloc domain lua allocations are reported to, or None
+ */
+static PyObject* LuaState_get_tracemalloc_domain(LuaStateObject* self, void* unused) {
+    if (!self->tracemalloc)
+        Py_RETURN_NONE;
+    
+    return PyLong_FromUnsignedLong(self->tracemalloc->domain);
+}
+
 /**
  * Getter for LuaState.time_limit
  * Returns the execution time limit
@@ -378,28 +1664,180 @@ static int LuaState_set_time_limit(LuaStateObject* self, PyObject* value, void*
         return -1;
     }
     
-    if (self->hook) {
-        PyErr_SetString(PyExc_Exception, "cannot set time limit when a debug hook is set");
+    PYLUA_ENTER(L, &self->info, -1);
+    
+    self->info.timelimit = limit;
+    pylua_set_builtin_hook(self);
+    
+    PYLUA_LEAVE(&self->info);
+    return 0;
+}
+
+/**
+ * Getter for LuaState.chunk_cache
+ * Returns the compiled chunk cache, or None
+ */
+static PyObject* LuaState_get_chunk_cache(LuaStateObject* self, void* unused) {
+    pylua_lock(self);
+    PyObject* cache = self->cache ? self->cache : Py_None;
+    Py_INCREF(cache);
+    pylua_unlock(self);
+    
+    return cache;
+}
+
+/**
+ * Setter for LuaState.chunk_cache
+ * Sets the compiled chunk cache used by load_string and load_file
+ */
+static int LuaState_set_chunk_cache(LuaStateObject* self, PyObject* value, void* unused) {
+    if (value && value != Py_None && !PyObject_TypeCheck(value, self->module->LuaChunkCacheType)) {
+        PyErr_SetString(PyExc_TypeError, "cache must be a ChunkCache");
         return -1;
     }
+    
+    if (value == Py_None)
+        value = NULL;
+    Py_XINCREF(value);
+    
+    pylua_lock(self);
+    PyObject* old = self->cache;
+    self->cache = value;
+    pylua_unlock(self);
+    
+    Py_XDECREF(old);
+    return 0;
+}
+
+/**
+ * Implements LuaState.collect_cycles, which finds the reference cycles
+ * going through lua and python, and lets the python collector break them.
+ * Returns the number of unreachable objects found by the python collector.
+ *
+ * Lua is walked first, to find the python objects that a single LuaObject
+ * can reach (see pylua_cycles_mark) ; those are visited by that LuaObject
+ * instead of the state while python collects. Lua must not be running.
+ */
+static PyObject* LuaState_collect_cycles(LuaStateObject* self, PyObject* unused) {
+    PYLUA_ENTER(L, &self->info, NULL);
+    
+    int running = 1;
+#if LUA_VERSION_NUM >= 502
+    running = lua_gc(L, LUA_GCISRUNNING, 0);
+#endif
+    
+    int err = pylua_state_protected(self, &pylua_cycles_mark, self);
+    Py_ssize_t collected = 0;
+    if (!err) {
+        self->gcpass = 1;
+        collected = PyGC_Collect();
+        self->gcpass = 0;
+    }
+    pylua_cycles_reset(self);
+    
+    // python may have closed the state while collecting
+    L = self->info.state;
+    if (L) {
+        if (running)
+            lua_gc(L, LUA_GCRESTART, 0);
+        
+        // what python let go of can go now
+        struct GcCall call = {LUA_GCCOLLECT, {0, 0, 0}, 0};
+        if (!err) {
+            // errors of finalizers are dropped, but a panic closed the state
+            int gcerr = pylua_state_gc(self, &call);
+            if (gcerr > 0) {
+                PyErr_Clear();
+                lua_pop(L, 1);
+            } else if (gcerr < 0)
+                err = -1;
+        }
+    }
+    
+    PYLUA_LEAVE(&self->info);
+    if (err)
+        return NULL;
+    
+    return PyLong_FromSsize_t(collected);
+}
 
-    self->info.timelimit = limit;
-    if (limit == 0) {
-        lua_sethook(self->info.state, NULL, 0, 0); 
-    } else {
-        lua_sethook(self->info.state, &pylua_hook_builtin, LUA_MASKCOUNT, limit * 250); 
+/**
+ * Implement tp_traverse for LuaState
+ *
+ * It visits the python objects held by lua, but only while no other thread
+ * can change them: that is, while the lock is free, or during collect_cycles.
+ */
+static int LuaState_traverse(LuaStateObject* self, visitproc visit, void* arg) {
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->hook);
+    Py_VISIT(self->cache);
+    
+    if (atomic_load_explicit(&self->lockowner, memory_order_acquire) && !self->gcpass)
+        return 0;
+    
+    for (Py_ssize_t i = 0; i < self->ndeferred; i++) {
+        Py_VISIT(self->deferred[i]);
+    }
+    
+    // the ones owned by a LuaObject are visited by it
+    for (struct PyRef* ref = self->pyrefs; ref; ref = ref->next) {
+        if (!ref->owner || ref->owner == self)
+            Py_VISIT(ref->obj);
     }
     return 0;
 }
 
+/**
+ * Implement tp_clear for LuaState
+ *
+ * Breaks a cycle by closing the lua state, unless it is in use.
+ */
+static int LuaState_clear(LuaStateObject* self) {
+    if (atomic_load_explicit(&self->lockowner, memory_order_acquire))
+        return 0;
+    
+    pylua_lock(self);
+    if (self->info.state) {
+        lua_close(self->info.state);
+        self->info.state = NULL;
+        
+        pylua_slab_free(self->slab);
+        self->slab = NULL;
+    }
+    pylua_unlock(self);
+    
+    Py_CLEAR(self->hook);
+    Py_CLEAR(self->cache);
+    
+    pylua_hookbatch_free(self->hookbatch);
+    self->hookbatch = NULL;
+    return 0;
+}
+
 /**
  * Handle deallocation of LuaState
  */
 static void LuaState_dealloc(LuaStateObject* self) {
+    PyObject_GC_UnTrack(self);
+    
     if (self->info.state) {
         lua_close(self->info.state);
         self->info.state = NULL;
     }
+    pylua_slab_free(self->slab);
+    self->slab = NULL;
+    free(self->memstats);
+    self->memstats = NULL;
+    pylua_tracemalloc_free(self->tracemalloc);
+    self->tracemalloc = NULL;
+    pylua_profiler_free(self->profiler);
+    self->profiler = NULL;
+    pylua_tracer_free(self->tracer);
+    self->tracer = NULL;
+    pylua_coverage_free(self->coverage);
+    self->coverage = NULL;
+    pylua_hookbatch_free(self->hookbatch);
+    self->hookbatch = NULL;
     
     // TODO: move that to lua gc
     if (self->info.panic) {
@@ -412,8 +1850,15 @@ static void LuaState_dealloc(LuaStateObject* self) {
         //PYLUA_DEBUG_2("panic handler is clean");
     }
     
-    // delete ourselves
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    // lua may have released python objects while closing
+    pylua_flush_deferred(self);
+    pylua_free_lock(self);
+    Py_CLEAR(self->cache);
+    
+    // delete ourselves (and release our heap type)
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free((PyObject *) self);
+    Py_DECREF(type);
 }
 
 
@@ -421,11 +1866,33 @@ static PyMethodDef LuaState_methods[] = {
     {"get_globals", (PyCFunction)LuaState_get_globals, METH_NOARGS, "return the global table"},
     {"load_string", (PyCFunction)LuaState_load_string, METH_VARARGS, "compile a string to a LuaFunction"},
     {"load_file", (PyCFunction)LuaState_load_file, METH_VARARGS, "compile a file to a LuaFunction"},
+    {"load_stream", (PyCFunction)LuaState_load_stream, METH_VARARGS, "compile a file object or an iterator to a LuaFunction"},
+    {"load_bytecode", (PyCFunction)LuaState_load_bytecode, METH_VARARGS, "load a binary chunk to a LuaFunction"},
     {"new_thread", (PyCFunction)LuaState_new_thread, METH_VARARGS, "create a new state for threading"},
     {"new_table", (PyCFunction)LuaState_new_table, METH_NOARGS, "create a new table"},
     {"new_userdata", (PyCFunction)LuaState_new_userdata, METH_VARARGS, "create a new userdata"},
     {"new_function", (PyCFunction)LuaState_new_function, METH_VARARGS, "create a LuaFunction bound to a Python callable"},
-    {"set_hook", (PyCFunction)LuaState_set_hook, METH_VARARGS, "set a lua debug hook"},
+    {"set_hook", (PyCFunction)LuaState_set_hook, METH_VARARGS | METH_KEYWORDS, "set a lua debug hook"},
+    {"start_profiler", (PyCFunction)LuaState_start_profiler, METH_VARARGS | METH_KEYWORDS, "start sampling the lua stack"},
+    {"stop_profiler", (PyCFunction)LuaState_stop_profiler, METH_NOARGS, "stop sampling the lua stack"},
+    {"collapsed_stacks", (PyCFunction)LuaState_collapsed_stacks, METH_VARARGS | METH_KEYWORDS, "return the profiler samples as collapsed stacks"},
+    {"start_tracer", (PyCFunction)LuaState_start_tracer, METH_NOARGS, "start timing every lua call"},
+    {"stop_tracer", (PyCFunction)LuaState_stop_tracer, METH_NOARGS, "stop timing lua calls"},
+    {"tracer_stats", (PyCFunction)LuaState_tracer_stats, METH_VARARGS | METH_KEYWORDS, "return the tracer stats, in the format of pstats"},
+    {"dump_stats", (PyCFunction)LuaState_dump_stats, METH_VARARGS, "write the tracer stats to a file, for pstats"},
+    {"start_coverage", (PyCFunction)LuaState_start_coverage, METH_VARARGS | METH_KEYWORDS, "start collecting the lines run"},
+    {"stop_coverage", (PyCFunction)LuaState_stop_coverage, METH_NOARGS, "stop collecting the lines run, and return them"},
+    {"coverage_lcov", (PyCFunction)LuaState_coverage_lcov, METH_VARARGS | METH_KEYWORDS, "return the coverage as an lcov tracefile"},
+    {"checkpoint", (PyCFunction)LuaState_checkpoint, METH_NOARGS, "save the state, to be restored by reset"},
+    {"reset", (PyCFunction)LuaState_reset, METH_NOARGS, "restore the state to its last checkpoint"},
+    {"pack", (PyCFunction)LuaState_pack, METH_VARARGS | METH_KEYWORDS, "encode a value to msgpack"},
+    {"unpack", (PyCFunction)LuaState_unpack, METH_VARARGS, "decode msgpack to a value"},
+    {"gc", (PyCFunction)LuaState_gc, METH_VARARGS, "drive the garbage collector"},
+    {"collect_cycles", (PyCFunction)LuaState_collect_cycles, METH_NOARGS, "collect the reference cycles between lua and python"},
+    {"mem_stats", (PyCFunction)LuaState_mem_stats, METH_VARARGS | METH_KEYWORDS, "return the heap accounting of the state"},
+    {"decode_json", (PyCFunction)LuaState_decode_json, METH_VARARGS | METH_KEYWORDS, "decode json to lua values"},
+    {"save_image", (PyCFunction)LuaState_save_image, METH_VARARGS | METH_KEYWORDS, "save the state to an image"},
+    {"load_image", (PyCFunction)LuaState_load_image, METH_VARARGS | METH_KEYWORDS, "load an image made by save_image"},
     {"close", (PyCFunction)LuaState_close, METH_NOARGS, "close the lua state"},
     {NULL}
 };
@@ -433,21 +1900,29 @@ static PyMethodDef LuaState_methods[] = {
 static PyGetSetDef LuaState_getset[] = {
     {"mem_usage", (getter)LuaState_get_mem_usage, NULL, "current memory usage", NULL},
     {"mem_limit", (getter)LuaState_get_mem_limit, (setter)LuaState_set_mem_limit, "current memory limit", NULL},
+    {"soft_mem_limit", (getter)LuaState_get_soft_mem_limit, (setter)LuaState_set_soft_mem_limit, "soft memory limit, past which a full collection is scheduled for the next call", NULL},
     {"time_limit", (getter)LuaState_get_time_limit, (setter)LuaState_set_time_limit, "current memory limit", NULL},
+    {"tracemalloc_domain", (getter)LuaState_get_tracemalloc_domain, NULL, "tracemalloc domain of lua allocations", NULL},
+    {"chunk_cache", (getter)LuaState_get_chunk_cache, (setter)LuaState_set_chunk_cache, "compiled chunk cache", NULL},
     //{"globals", (getter)LuaState_get_globals, NULL, "globals", NULL},
     {NULL}
 };
 
-PyTypeObject LuaStateType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pylua.LuaState",
-    //.tp_doc = "",
-    .tp_basicsize = sizeof(LuaStateObject),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = LuaState_new,
-    .tp_init = (initproc)LuaState_init,
-    .tp_dealloc = (destructor)LuaState_dealloc,
-    .tp_methods = LuaState_methods,
-    .tp_getset = LuaState_getset
+static PyType_Slot LuaStateSlots[] = {
+    {Py_tp_new, LuaState_new},
+    {Py_tp_init, LuaState_init},
+    {Py_tp_dealloc, LuaState_dealloc},
+    {Py_tp_traverse, LuaState_traverse},
+    {Py_tp_clear, LuaState_clear},
+    {Py_tp_methods, LuaState_methods},
+    {Py_tp_getset, LuaState_getset},
+    {0, NULL}
+};
+
+PyType_Spec LuaStateTypeSpec = {
+    .name = "pylua.LuaState",
+    .basicsize = sizeof(LuaStateObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .slots = LuaStateSlots
 };
\ No newline at end of file
@@ -2,23 +2,97 @@
 #define PYLUA_STATE_H
 
 #include "pylua.h"
+#include "pylua_module.h"
 #include "pylua_stateinfo.h"
 
+#include <pythread.h>
+#include <stdatomic.h>
+
 typedef struct _LuaStateObject {
     PyObject_HEAD
     
     // Lua state info
     struct LuaStateInfo info;
+    
+    // Module state of the interpreter owning this state
+    PyLuaModuleState* module;
 
     // Memory usage and limit
     size_t mem;
     size_t limit;
     
-    // Debug hook
+    // Budget of the code running, charged along with the ones enclosing it
+    struct MemBudget* budget;
+    
+    // Lua threads (the state included) running a call from python
+    int ncalls;
+    
+    // Usage past which a full collection is run before the next call,
+    // and whether it is due (see pylua_collect_pending)
+    size_t softlimit;
+    int gcpending;
+    
+    // Size-class allocator (a struct Slab), or NULL if lua uses malloc
+    struct Slab* slab;
+    
+    // Heap accounting (a struct MemStats), or NULL if not tracking
+    struct MemStats* memstats;
+    
+    // Tracemalloc reporting (a struct TraceMalloc), or NULL if not reporting
+    struct TraceMalloc* tracemalloc;
+    
+    // Debug hook, and its pending events if it takes them in batches
     PyObject* hook;
+    struct HookBatch* hookbatch;
+    
+    // Events and count interval asked by the debug hook, instructions
+    // run since it was last called, and the count interval of the
+    // builtin hook dispatching to it (see pylua_set_builtin_hook)
+    int hookmask;
+    int hookcount;
+    int hookelapsed;
+    int hookstep;
+    
+    // Sampling profiler (a struct Profiler), or NULL if not profiling
+    struct Profiler* profiler;
+    
+    // Call profiler (a struct Tracer), or NULL if not tracing
+    struct Tracer* tracer;
+    
+    // Line coverage (a struct Coverage), or NULL if not collecting
+    struct Coverage* coverage;
+    
+    // Compiled chunk cache (a ChunkCache), or NULL
+    PyObject* cache;
+    
+    // Python objects held by lua userdata (a list of struct PyRef),
+    // LuaObjects of this state, and whether a cycle collection is running
+    struct PyRef* pyrefs;
+    struct _LuaObject* objects;
+    int gcpass;
+    
+    // Lock shared by the lua state and its threads,
+    // with its owner thread (also read without the lock) and recursion count
+    PyThread_type_lock lock;
+    atomic_ulong lockowner;
+    int lockcount;
+    
+    // Python objects released by lua while the GIL was not held,
+    // to decref once the lock is released (see pylua_gc),
+    // and how many were leaked for lack of memory
+    PyObject** deferred;
+    Py_ssize_t ndeferred;
+    Py_ssize_t deferredsize;
+    Py_ssize_t deferredlost;
 
 } LuaStateObject;
 
-PyTypeObject LuaStateType;
+// Allocators of lua states, given the state object as their userdata
+typedef void* (*pylua_Alloc)(LuaStateObject* self, void* ptr, size_t osize, size_t nsize);
+
+extern PyType_Spec LuaStateTypeSpec;
+
+int pylua_state_checkpoint(LuaStateObject* self);
+int pylua_state_reset(LuaStateObject* self);
 
 #endif
\ No newline at end of file
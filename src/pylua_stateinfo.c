@@ -21,7 +21,12 @@ void pylua_init_stateinfo(struct LuaStateInfo* info, lua_State* L) {
     info->startat.time = 0;
     info->timelimit = 0;
     info->depth = 0;
+    info->budget.used = 0;
+    info->budget.limit = SIZE_MAX;
+    info->budget.outer = NULL;
     info->thstate = NULL;
+    info->async = 0;
+    info->awaiting = NULL;
 }
 
 /**
@@ -45,4 +50,24 @@ struct LuaStateInfo* pylua_alloc_stateinfo(lua_State* L) {
     
     pylua_init_stateinfo(info, L);
     return info;
+}
+
+/**
+ * Removes the struct LuaStateInfo* allocated for a thread,
+ * so it can be garbage collected along with the thread
+ */
+void pylua_free_stateinfo(lua_State* L, lua_State* thread) {
+    lua_pushlightuserdata(L, thread); // key
+    lua_pushnil(L); // value
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Returns the root state object of a lua_State (or any of its threads),
+ * which is given to lua along with our alloc function
+ */
+struct _LuaStateObject* pylua_get_root(lua_State* L) {
+    void* ud;
+    lua_getallocf(L, &ud);
+    return (struct _LuaStateObject*)ud;
 }
\ No newline at end of file
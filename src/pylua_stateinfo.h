@@ -7,6 +7,16 @@
 struct PanicHandler;
 struct _LuaStateObject;
 
+// Memory attributed to a tenant of a state (a lua thread, or a call),
+// that is the net growth of the heap while its code runs
+struct MemBudget {
+    size_t used;
+    size_t limit;
+    
+    // The enclosing budget, also charged
+    struct MemBudget* outer;
+};
+
 struct LuaStateInfo {
     // Associated lua state
     lua_State* state;
@@ -21,9 +31,18 @@ struct LuaStateInfo {
     // Call depth
     int depth;
     
+    // Memory used by the code running in this thread
+    struct MemBudget budget;
+    
     // Thread state
     PyThreadState* thstate;
     
+    // Set if python callbacks may yield awaitables (see call_async)
+    int async;
+    
+    // Awaitable yielded by a python callback, waiting to be picked up
+    PyObject* awaiting;
+    
     // The root state object
     struct _LuaStateObject* root;
 };
@@ -32,5 +51,7 @@ struct LuaStateInfo* pylua_get_stateinfo(lua_State* L, lua_State* thread);
 void pylua_init_stateinfo(struct LuaStateInfo* info, lua_State* L);
 void pylua_set_stateinfo(lua_State* L, struct LuaStateInfo* info);
 struct LuaStateInfo* pylua_alloc_stateinfo(lua_State* L);
+void pylua_free_stateinfo(lua_State* L, lua_State* thread);
+struct _LuaStateObject* pylua_get_root(lua_State* L);
 
 #endif
\ No newline at end of file
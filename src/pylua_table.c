@@ -1,4 +1,6 @@
 #include "pylua_table.h"
+#include "pylua_buffer.h"
+#include "pylua_json.h"
 #include "pylua_protect.h"
 #include "pylua_python.h"
 
@@ -6,7 +8,7 @@
  * Implements `len` for a LuaTable
  */
 static Py_ssize_t LuaTable_length(LuaObject* self) {
-    PYLUA_CHECK(L, &self->sobj->info, -1);
+    PYLUA_ENTER(L, &self->sobj->info, -1);
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
 #if LUA_VERSION_NUM >= 502
@@ -15,6 +17,8 @@ static Py_ssize_t LuaTable_length(LuaObject* self) {
     size_t length = lua_objlen(L, -1);
 #endif
     lua_pop(L, 1);
+    
+    PYLUA_LEAVE(&self->sobj->info);
     return length;
 }
 
@@ -22,14 +26,15 @@ static Py_ssize_t LuaTable_length(LuaObject* self) {
  * Implements `getattr` AND `getitem` for a LuaTable
  */
 static PyObject* LuaTable_getattr(LuaObject* self, PyObject* attr) {
-    PYLUA_CHECK(L, &self->sobj->info, NULL);
-    PYLUA_PROTECT(&self->sobj->info, NULL);
+    PYLUA_ENTER(L, &self->sobj->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->sobj->info, NULL);
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
 
     if (pylua_push_pyobj(L, attr)) {
         lua_pop(L, 1);
         PYLUA_UNPROTECT(&self->sobj->info);
+        PYLUA_LEAVE(&self->sobj->info);
         return NULL;
     }
 
@@ -39,6 +44,7 @@ static PyObject* LuaTable_getattr(LuaObject* self, PyObject* attr) {
 
     // error handling for pylua_get_as_pyobj is useless
     PYLUA_UNPROTECT(&self->sobj->info);
+    PYLUA_LEAVE(&self->sobj->info);
     return val;
 }
 
@@ -47,40 +53,120 @@ static PyObject* LuaTable_getattr(LuaObject* self, PyObject* attr) {
  * Implements `setattr` AND `setitem` for a LuaTable
  */
 static int LuaTable_setattr(LuaObject* self, PyObject* attr, PyObject* value) {
-    PYLUA_CHECK(L, &self->sobj->info, -1);
-    PYLUA_PROTECT(&self->sobj->info, -1);
+    PYLUA_ENTER(L, &self->sobj->info, -1);
+    PYLUA_PROTECT_LEAVE(&self->sobj->info, -1);
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
     if (pylua_push_pyobj(L, attr)) {
         lua_pop(L, 1);
         PYLUA_UNPROTECT(&self->sobj->info);
+        PYLUA_LEAVE(&self->sobj->info);
         return -1;
     }
     if (pylua_push_pyobj(L, value)) {
         lua_pop(L, 2);
         PYLUA_UNPROTECT(&self->sobj->info);
+        PYLUA_LEAVE(&self->sobj->info);
         return -1;
     }
     lua_rawset(L, -3);
     lua_pop(L, 1);
 
     PYLUA_UNPROTECT(&self->sobj->info);
+    PYLUA_LEAVE(&self->sobj->info);
     return 0;
 }
 
+/**
+ * Implements LuaTable.encode_json, which encodes the table (and what it contains) to JSON
+ *
+ * Sequences are arrays, and other tables are objects. Empty tables are objects,
+ * unless empty_array is set or they were decoded as arrays with mark_arrays.
+ * Values equal to `null` (if it is not None) are encoded as null.
+ */
+static PyObject* LuaTable_encode_json(LuaObject* self, PyObject* args, PyObject* kwds) {
+    static char* keywords[] = {"empty_array", "null", NULL};
+    int empty = 0;
+    PyObject* null = Py_None;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pO", keywords, &empty, &null)) {
+        return NULL;
+    }
+    
+    PYLUA_ENTER(L, &self->sobj->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->sobj->info, NULL);
+    
+    struct Buffer buf;
+    pylua_buffer_init(&buf);
+    
+    lua_pushcfunction(L, &pylua_json_encode_buffer);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
+    lua_pushlightuserdata(L, &buf);
+    lua_pushboolean(L, empty);
+    
+    if (null != Py_None && pylua_push_pyobj(L, null) < 0) {
+        lua_pop(L, 4);
+        PYLUA_UNPROTECT(&self->sobj->info);
+        PYLUA_LEAVE(&self->sobj->info);
+        return NULL;
+    }
+    
+    PyObject* res = NULL;
+    int err = pylua_pcall_released(&self->sobj->info, null != Py_None ? 4 : 3, 0);
+    if (err > 0) {
+        if (!PyErr_Occurred()) {
+            PyObject* msg = pylua_get_as_unicode(L, -1);
+            PyErr_SetObject(self->sobj->module->LuaError, msg);
+            Py_XDECREF(msg);
+        }
+        lua_pop(L, 1);
+        
+    } else if (!err) {
+        res = PyUnicode_DecodeUTF8(buf.data, (Py_ssize_t)buf.size, NULL);
+    }
+    
+    pylua_buffer_free(&buf);
+    PYLUA_UNPROTECT(&self->sobj->info);
+    PYLUA_LEAVE(&self->sobj->info);
+    return res;
+}
+
+
+static PyMethodDef LuaTable_methods[] = {
+    {"encode_json", (PyCFunction)LuaTable_encode_json, METH_VARARGS | METH_KEYWORDS, "encode the table to json"},
+    {NULL}
+};
+
+/**
+ * Implements `getattr` for a LuaTable: methods come first,
+ * then lua fields (fields of the same name are still available with [])
+ */
+static PyObject* LuaTable_getattro(LuaObject* self, PyObject* attr) {
+    if (PyUnicode_Check(attr)) {
+        for (PyMethodDef* def = LuaTable_methods; def->ml_name; def++) {
+            if (PyUnicode_CompareWithASCIIString(attr, def->ml_name) == 0)
+                return PyObject_GenericGetAttr((PyObject*)self, attr);
+        }
+    }
+    
+    return LuaTable_getattr(self, attr);
+}
+
 
-static PyMappingMethods LuaTableMappingMethods = {
-    .mp_length = (lenfunc)LuaTable_length,
-    .mp_subscript = (binaryfunc)LuaTable_getattr,
-    .mp_ass_subscript = (objobjargproc)LuaTable_setattr
+static PyType_Slot LuaTableSlots[] = {
+    {Py_tp_doc, "Lua table"},
+    {Py_tp_getattro, LuaTable_getattro},
+    {Py_tp_methods, LuaTable_methods},
+    {Py_tp_setattro, LuaTable_setattr},
+    {Py_mp_length, LuaTable_length},
+    {Py_mp_subscript, LuaTable_getattr},
+    {Py_mp_ass_subscript, LuaTable_setattr},
+    {0, NULL}
 };
 
-PyTypeObject LuaTableType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pylua.LuaTable",
-    .tp_doc = "Lua table",
-    .tp_base = &LuaObjectType,
-    .tp_getattro = (getattrofunc)LuaTable_getattr,
-    .tp_setattro = (setattrofunc)LuaTable_setattr,
-    .tp_as_mapping = &LuaTableMappingMethods
+PyType_Spec LuaTableTypeSpec = {
+    .name = "pylua.LuaTable",
+    .basicsize = sizeof(LuaObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = LuaTableSlots
 };
\ No newline at end of file
@@ -4,6 +4,6 @@
 #include "pylua.h"
 #include "pylua_object.h"
 
-PyTypeObject LuaTableType;
+extern PyType_Spec LuaTableTypeSpec;
 
 #endif
\ No newline at end of file
@@ -5,72 +5,154 @@
 #include "pylua_stateinfo.h"
 
 static PyObject* LuaThread_call(LuaObject* self, PyObject* args) {
-    if (!args || PyTuple_GET_SIZE(args) < 0) {
+    if (!args || PyTuple_GET_SIZE(args) < 1) {
         PyErr_SetString(PyExc_TypeError, "function takes at least 1 argument (0 given)");
         return NULL;
     }
     
     LuaObject* func = (LuaObject*)PyTuple_GET_ITEM(args, 0);
-    if (!PyObject_TypeCheck(func, &LuaObjectType)) {
+    if (!PyObject_TypeCheck(func, self->sobj->module->LuaObjectType)) {
         PyErr_SetString(PyExc_TypeError, "argument 1 must be pylua.LuaObject");
         return NULL;
     }
     
-    if (self->sobj->info.thstate) {
-        PyErr_SetString(LuaFatalError, "not thread safe");
-        return NULL;
-    }
-    
-    PYLUA_CHECK(L, &self->sobj->info, NULL);
-    PYLUA_PROTECT(&self->sobj->info, NULL);
+    PYLUA_ENTER(L, &self->sobj->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->sobj->info, NULL);
     
     // first we need to get our thread object
     lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
     lua_State* thread = lua_tothread(L, -1);
-    lua_pop(L, -1);
+    lua_pop(L, 1);
     
     // we need our info object
     struct LuaStateInfo* info = pylua_get_stateinfo(L, thread);
     
     PYLUA_UNPROTECT(&self->sobj->info);
     
-    if (info->thstate) {
-        PyErr_SetString(LuaFatalError, "not thread safe");
-        return NULL;
-    }
-    return pylua_call(info, func->ref, args, 1);
+    PyObject* res = pylua_call(info, func->ref, args, 1);
+    
+    PYLUA_LEAVE(&self->sobj->info);
+    return res;
 }
 
 
 static PyObject* LuaThread_get_state(LuaObject* self, PyObject* args) {
-    PYLUA_CHECK(L, &self->sobj->info, NULL);
-    PYLUA_PROTECT(&self->sobj->info, NULL);
+    PYLUA_ENTER(L, &self->sobj->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->sobj->info, NULL);
     
     // first we need to get our thread object
     lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
     lua_State* thread = lua_tothread(L, -1);
-    lua_pop(L, -1);
+    lua_pop(L, 1);
     
     // we need our info object
     struct LuaStateInfo* info = pylua_get_stateinfo(L, thread);
     PYLUA_UNPROTECT(&self->sobj->info);
+    PYLUA_LEAVE(&self->sobj->info);
     
     // there it is
     Py_INCREF(info->root);
     return (PyObject*)info->root;
 }
 
+/**
+ * Returns the info of a LuaThread, or NULL if it was not made by pylua
+ * The state lock must be held.
+ */
+static struct LuaStateInfo* LuaThread_get_info(LuaObject* self, lua_State* L) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
+    lua_State* thread = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    
+    struct LuaStateInfo* info = pylua_get_stateinfo(L, thread);
+    if (!info)
+        PyErr_SetString(self->sobj->module->LuaError, "thread was not made by pylua");
+    return info;
+}
+
+/**
+ * Getter for LuaThread.mem_usage
+ * Returns the memory charged to the code run by the thread,
+ * during its current or last call
+ */
+static PyObject* LuaThread_get_mem_usage(LuaObject* self, void* unused) {
+    PYLUA_ENTER(L, &self->sobj->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->sobj->info, NULL);
+    
+    struct LuaStateInfo* info = LuaThread_get_info(self, L);
+    size_t used = info ? info->budget.used : 0;
+    
+    PYLUA_UNPROTECT(&self->sobj->info);
+    PYLUA_LEAVE(&self->sobj->info);
+    
+    return info ? PyLong_FromSize_t(used) : NULL;
+}
+
+/**
+ * Getter for LuaThread.mem_budget
+ * Returns the memory budget of the thread, 0 if there is none
+ */
+static PyObject* LuaThread_get_mem_budget(LuaObject* self, void* unused) {
+    PYLUA_ENTER(L, &self->sobj->info, NULL);
+    PYLUA_PROTECT_LEAVE(&self->sobj->info, NULL);
+    
+    struct LuaStateInfo* info = LuaThread_get_info(self, L);
+    size_t limit = info ? info->budget.limit : 0;
+    
+    PYLUA_UNPROTECT(&self->sobj->info);
+    PYLUA_LEAVE(&self->sobj->info);
+    
+    if (!info)
+        return NULL;
+    return PyLong_FromSize_t(limit == SIZE_MAX ? 0 : limit);
+}
+
+/**
+ * Setter for LuaThread.mem_budget
+ * Sets the memory budget of each call of the thread (0 for none): past it,
+ * allocations of its code fail as if the state was out of memory
+ */
+static int LuaThread_set_mem_budget(LuaObject* self, PyObject* value, void* unused) {
+    size_t limit = PyLong_AsSize_t(value);
+    if (limit == (size_t)-1 && PyErr_Occurred()) {
+        return -1;
+    }
+    
+    PYLUA_ENTER(L, &self->sobj->info, -1);
+    PYLUA_PROTECT_LEAVE(&self->sobj->info, -1);
+    
+    struct LuaStateInfo* info = LuaThread_get_info(self, L);
+    if (info)
+        info->budget.limit = limit ? limit : SIZE_MAX;
+    
+    PYLUA_UNPROTECT(&self->sobj->info);
+    PYLUA_LEAVE(&self->sobj->info);
+    return info ? 0 : -1;
+}
+
 
 static PyMethodDef LuaThread_methods[] = {
     {"call", (PyCFunction)LuaThread_call, METH_VARARGS, "call a lua function using the thread"},
     {"get_state", (PyCFunction)LuaThread_get_state, METH_NOARGS, "get the state from a thread"},
     {NULL}
 };
+
+static PyGetSetDef LuaThread_getset[] = {
+    {"mem_usage", (getter)LuaThread_get_mem_usage, NULL, "memory charged to the thread", NULL},
+    {"mem_budget", (getter)LuaThread_get_mem_budget, (setter)LuaThread_set_mem_budget, "memory budget of the thread", NULL},
+    {NULL}
+};
     
-PyTypeObject LuaThreadType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pylua.LuaThread",
-    .tp_doc = "Lua thread",
-    .tp_base = &LuaObjectType,
-    .tp_methods = LuaThread_methods
+static PyType_Slot LuaThreadSlots[] = {
+    {Py_tp_doc, "Lua thread"},
+    {Py_tp_methods, LuaThread_methods},
+    {Py_tp_getset, LuaThread_getset},
+    {0, NULL}
+};
+
+PyType_Spec LuaThreadTypeSpec = {
+    .name = "pylua.LuaThread",
+    .basicsize = sizeof(LuaObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = LuaThreadSlots
 };
\ No newline at end of file
@@ -4,6 +4,6 @@
 #include "pylua.h"
 #include "pylua_object.h"
 
-PyTypeObject LuaThreadType;
+extern PyType_Spec LuaThreadTypeSpec;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,276 @@
+#include "pylua_tracemalloc.h"
+#include "pylua_hooks.h"
+
+#include <stdatomic.h>
+
+/*
+    Lua allocations are reported to tracemalloc, in a domain per state,
+    so that memory profilers see the lua heap.
+    
+    Lua code runs without the GIL, which tracemalloc needs:
+    the events are then kept (in order) until the GIL is held again.
+    A free or a resize of a block allocated meanwhile is merged with
+    its allocation, so the queue is bounded by the blocks alive
+    before and after, rather than growing with every allocation.
+*/
+
+// Next domain to give, shared by every interpreter
+static atomic_uint pylua_next_domain = PYLUA_TRACEMALLOC_DOMAIN;
+
+
+/**
+ * Creates the reporting for a state, allocating with `alloc`
+ * Returns NULL if there is not enough memory. Must be called with the GIL.
+ */
+struct TraceMalloc* pylua_tracemalloc_new(pylua_Alloc alloc) {
+    struct TraceMalloc* trace = (struct TraceMalloc*)PyMem_RawCalloc(1, sizeof *trace);
+    if (trace) {
+        trace->alloc = alloc;
+        trace->domain = atomic_fetch_add(&pylua_next_domain, 1);
+    }
+    return trace;
+}
+
+/**
+ * Reports the pending events, then frees the reporting
+ * Must be called with the GIL, once the lua state is closed.
+ */
+void pylua_tracemalloc_free(struct TraceMalloc* trace) {
+    if (!trace)
+        return;
+    
+    pylua_tracemalloc_flush(trace);
+    PyMem_RawFree(trace->events);
+    PyMem_RawFree(trace->slots);
+    PyMem_RawFree(trace);
+}
+
+/**
+ * Reports an event
+ */
+static void pylua_tracemalloc_report(struct TraceMalloc* trace, uintptr_t ptr, size_t size) {
+    if (size)
+        PyTraceMalloc_Track(trace->domain, ptr, size);
+    else
+        PyTraceMalloc_Untrack(trace->domain, ptr);
+}
+
+/**
+ * Returns the slot of the pending allocation at `ptr`, or -1
+ */
+static Py_ssize_t pylua_tracemalloc_find(struct TraceMalloc* trace, uintptr_t ptr) {
+    if (!trace->nslots)
+        return -1;
+    
+    size_t mask = (size_t)trace->nslots - 1;
+    for (size_t i = (size_t)(ptr >> 4) * 0x9E3779B97F4A7C15ull & mask;; i = (i + 1) & mask) {
+        Py_ssize_t idx = trace->slots[i];
+        if (!idx)
+            return -1;
+        if (trace->events[idx - 1].ptr == ptr)
+            return (Py_ssize_t)i;
+    }
+}
+
+/**
+ * Adds the event at `idx` to the pending allocations ; there must be room
+ */
+static void pylua_tracemalloc_insert(struct TraceMalloc* trace, Py_ssize_t idx) {
+    size_t mask = (size_t)trace->nslots - 1;
+    size_t i = (size_t)(trace->events[idx].ptr >> 4) * 0x9E3779B97F4A7C15ull & mask;
+    while (trace->slots[i])
+        i = (i + 1) & mask;
+    trace->slots[i] = idx + 1;
+}
+
+/**
+ * Removes the pending allocation in `slot`, moving back the ones after it
+ */
+static void pylua_tracemalloc_remove(struct TraceMalloc* trace, Py_ssize_t slot) {
+    size_t mask = (size_t)trace->nslots - 1;
+    size_t hole = (size_t)slot;
+    
+    for (size_t i = (hole + 1) & mask; trace->slots[i]; i = (i + 1) & mask) {
+        size_t home = (size_t)(trace->events[trace->slots[i] - 1].ptr >> 4) * 0x9E3779B97F4A7C15ull & mask;
+        
+        // it can fill the hole if its home is not between the hole and itself
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            trace->slots[hole] = trace->slots[i];
+            hole = i;
+        }
+    }
+    trace->slots[hole] = 0;
+}
+
+/**
+ * Drops the cancelled events, and indexes the pending allocations again
+ */
+static void pylua_tracemalloc_compact(struct TraceMalloc* trace) {
+    Py_ssize_t n = 0;
+    for (Py_ssize_t i = 0; i < trace->nevents; i++) {
+        if (trace->events[i].ptr)
+            trace->events[n++] = trace->events[i];
+    }
+    trace->nevents = n;
+    trace->ncancelled = 0;
+    
+    memset(trace->slots, 0, (size_t)trace->nslots * sizeof *trace->slots);
+    for (Py_ssize_t i = 0; i < n; i++) {
+        if (trace->events[i].size)
+            pylua_tracemalloc_insert(trace, i);
+    }
+}
+
+/**
+ * Makes room for one more event, compacting or growing the queue
+ * Returns -1 if there is not enough memory.
+ */
+static int pylua_tracemalloc_reserve(struct TraceMalloc* trace) {
+    if (trace->nevents < trace->size)
+        return 0;
+    
+    // growing is only worth it if most events are alive
+    if (trace->ncancelled > trace->size / 4) {
+        pylua_tracemalloc_compact(trace);
+        return 0;
+    }
+    
+    Py_ssize_t size = trace->size ? trace->size * 2 : 256;
+    struct TraceEvent* events = PyMem_RawRealloc(trace->events, size * sizeof *events);
+    if (!events)
+        return -1;
+    trace->events = events;
+    
+    // at most half full
+    Py_ssize_t* slots = PyMem_RawCalloc((size_t)size * 2, sizeof *slots);
+    if (!slots)
+        return -1;
+    
+    PyMem_RawFree(trace->slots);
+    trace->slots = slots;
+    trace->nslots = size * 2;
+    trace->size = size;
+    
+    pylua_tracemalloc_compact(trace);
+    return 0;
+}
+
+/**
+ * Reports the events which happened without the GIL, and returns the count
+ * of the ones lost meanwhile (see pylua_tracemalloc_warn)
+ * Must be called with the GIL and the state lock.
+ */
+Py_ssize_t pylua_tracemalloc_flush(struct TraceMalloc* trace) {
+    for (Py_ssize_t i = 0; i < trace->nevents; i++) {
+        struct TraceEvent* evt = &trace->events[i];
+        if (!evt->ptr)
+            continue;
+        
+        pylua_tracemalloc_report(trace, evt->ptr, evt->size);
+        
+        Py_ssize_t slot = evt->size ? pylua_tracemalloc_find(trace, evt->ptr) : -1;
+        if (slot >= 0)
+            pylua_tracemalloc_remove(trace, slot);
+    }
+    
+    trace->nevents = 0;
+    trace->ncancelled = 0;
+    
+    Py_ssize_t lost = trace->lost;
+    trace->lost = 0;
+    return lost;
+}
+
+/**
+ * Warns that events were lost ; as it may run python code,
+ * it must be called with the GIL, once the state lock is released
+ */
+void pylua_tracemalloc_warn(Py_ssize_t lost) {
+    PyObject *exc_type, *exc_value, *exc_tb;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    
+    if (PyErr_WarnFormat(PyExc_RuntimeWarning, 1, "%zd lua allocation events could not be reported to tracemalloc", lost) < 0)
+        PyErr_WriteUnraisable(NULL);
+    
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+/**
+ * Queues an event, merging it with a pending allocation at the same address
+ */
+static void pylua_tracemalloc_queue(struct TraceMalloc* trace, uintptr_t ptr, size_t size, int fresh) {
+    Py_ssize_t slot = fresh ? -1 : pylua_tracemalloc_find(trace, ptr);
+    if (slot >= 0) {
+        struct TraceEvent* evt = &trace->events[trace->slots[slot] - 1];
+        
+        if (size) {
+            // resized again
+            evt->size = size;
+            return;
+        }
+        
+        // freed: never reported if it was allocated meanwhile
+        if (evt->fresh) {
+            evt->ptr = 0;
+            trace->ncancelled++;
+        } else {
+            evt->size = 0;
+        }
+        pylua_tracemalloc_remove(trace, slot);
+        return;
+    }
+    
+    if (pylua_tracemalloc_reserve(trace) < 0) {
+        trace->lost++;
+        return;
+    }
+    
+    Py_ssize_t idx = trace->nevents++;
+    trace->events[idx].ptr = ptr;
+    trace->events[idx].size = size;
+    trace->events[idx].fresh = fresh;
+    
+    if (size)
+        pylua_tracemalloc_insert(trace, idx);
+}
+
+/**
+ * Reports an event now if we hold the GIL, later otherwise
+ */
+static void pylua_tracemalloc_event(struct TraceMalloc* trace, void* ptr, size_t size, int fresh) {
+    if (pylua_current_thread()) {
+        // after the ones before it, which may be about the same address
+        if (trace->nevents)
+            trace->lost += pylua_tracemalloc_flush(trace);
+        
+        pylua_tracemalloc_report(trace, (uintptr_t)ptr, size);
+        return;
+    }
+    
+    pylua_tracemalloc_queue(trace, (uintptr_t)ptr, size, fresh);
+}
+
+/**
+ * Same as pylua_alloc, reporting to tracemalloc ;
+ * the actual allocation is done by trace->alloc
+ */
+void* pylua_alloc_traced(LuaStateObject* self, void* ptr, size_t osize, size_t nsize) {
+    struct TraceMalloc* trace = self->tracemalloc;
+    
+    void* res = trace->alloc(self, ptr, osize, nsize);
+    
+    if (nsize == 0) {
+        if (ptr)
+            pylua_tracemalloc_event(trace, ptr, 0, 0);
+        return res;
+    }
+    
+    if (!res)
+        return NULL;
+    
+    if (ptr && ptr != res)
+        pylua_tracemalloc_event(trace, ptr, 0, 0);
+    pylua_tracemalloc_event(trace, res, nsize, ptr != res);
+    
+    return res;
+}
\ No newline at end of file
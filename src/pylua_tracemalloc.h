@@ -0,0 +1,47 @@
+#ifndef PYLUA_TRACEMALLOC_H
+#define PYLUA_TRACEMALLOC_H
+
+#include "pylua.h"
+#include "pylua_state.h"
+
+// Domains of the states, which get one each
+#define PYLUA_TRACEMALLOC_DOMAIN 0x4c756100
+
+// An allocation to report to tracemalloc, or a free if size is 0.
+// Fresh allocations were not tracked before, and ptr is 0 once they are cancelled.
+struct TraceEvent {
+    uintptr_t ptr;
+    size_t size;
+    int fresh;
+};
+
+// Reporting of a lua state to tracemalloc, done by pylua_alloc_traced
+struct TraceMalloc {
+    // The allocator doing the actual work
+    pylua_Alloc alloc;
+    
+    // Tracemalloc domain of the state
+    unsigned int domain;
+    
+    // Events which happened without the GIL, reported once it is held
+    struct TraceEvent* events;
+    Py_ssize_t nevents;
+    Py_ssize_t size;
+    Py_ssize_t ncancelled;
+    
+    // Pending allocations by address (index + 1 of their event, 0 if empty),
+    // so that a free or resize coalesces with them
+    Py_ssize_t* slots;
+    Py_ssize_t nslots;
+    
+    // Events lost for lack of memory, warned about on the next flush
+    Py_ssize_t lost;
+};
+
+struct TraceMalloc* pylua_tracemalloc_new(pylua_Alloc alloc);
+void pylua_tracemalloc_free(struct TraceMalloc* trace);
+Py_ssize_t pylua_tracemalloc_flush(struct TraceMalloc* trace);
+void pylua_tracemalloc_warn(Py_ssize_t lost);
+void* pylua_alloc_traced(LuaStateObject* self, void* ptr, size_t osize, size_t nsize);
+
+#endif
\ No newline at end of file
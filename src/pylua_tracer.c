@@ -0,0 +1,563 @@
+#include "pylua_tracer.h"
+#include "pylua_hooks.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Allocates a call profiler, or returns NULL if out of memory
+ */
+struct Tracer* pylua_tracer_new(void) {
+    struct Tracer* tr = calloc(1, sizeof *tr);
+    if (!tr)
+        return NULL;
+    
+    tr->running = 1;
+    tr->last = pylua_clock_ns();
+    return tr;
+}
+
+/**
+ * Frees a call profiler (with the GIL, as it may hold python callables)
+ */
+void pylua_tracer_free(struct Tracer* tr) {
+    if (!tr)
+        return;
+    
+    for (size_t i = 0; i < tr->stackcap; i++) {
+        free(tr->stacks[i].entries);
+    }
+    
+    pylua_frames_free(&tr->frames);
+    free(tr->stats);
+    free(tr->edges);
+    free(tr->stacks);
+    free(tr);
+}
+
+/**
+ * Drops the stats gathered so far ; the running calls are still counted
+ * once they return
+ */
+void pylua_tracer_clear(struct Tracer* tr) {
+    for (uint32_t i = 0; i < tr->statscap; i++) {
+        unsigned int active = tr->stats[i].active;
+        memset(&tr->stats[i], 0, sizeof tr->stats[i]);
+        tr->stats[i].active = active;
+    }
+    
+    for (size_t i = 0; i < tr->edgecap; i++) {
+        tr->edges[i].callee = UINT32_MAX;
+    }
+    tr->nedges = 0;
+    tr->lost = 0;
+}
+
+/**
+ * Makes room for the stats of every function seen
+ */
+static int pylua_tracer_grow_stats(struct Tracer* tr) {
+    if (tr->frames.nframes <= tr->statscap)
+        return 0;
+    
+    uint32_t cap = tr->frames.framecap;
+    struct TracerStats* stats = realloc(tr->stats, cap * sizeof *stats);
+    if (!stats)
+        return -1;
+    
+    memset(stats + tr->statscap, 0, (cap - tr->statscap) * sizeof *stats);
+    tr->stats = stats;
+    tr->statscap = cap;
+    return 0;
+}
+
+/**
+ * Returns the stats of the calls from a caller to a callee, adding them
+ * if they are new, or NULL if out of memory
+ */
+static struct TracerEdge* pylua_tracer_edge(struct Tracer* tr, uint32_t caller, uint32_t callee) {
+    // kept at most half full
+    if ((tr->nedges + 1) * 2 > tr->edgecap) {
+        size_t cap = tr->edgecap ? tr->edgecap * 2 : 256;
+        struct TracerEdge* edges = calloc(cap, sizeof *edges);
+        if (!edges)
+            return NULL;
+        
+        for (size_t i = 0; i < cap; i++) {
+            edges[i].callee = UINT32_MAX;
+        }
+        
+        for (size_t i = 0; i < tr->edgecap; i++) {
+            struct TracerEdge* edge = &tr->edges[i];
+            if (edge->callee == UINT32_MAX)
+                continue;
+            
+            size_t j = (edge->caller * 2654435761u ^ edge->callee) & (cap - 1);
+            while (edges[j].callee != UINT32_MAX)
+                j = (j + 1) & (cap - 1);
+            edges[j] = *edge;
+        }
+        
+        free(tr->edges);
+        tr->edges = edges;
+        tr->edgecap = cap;
+    }
+    
+    size_t j = (caller * 2654435761u ^ callee) & (tr->edgecap - 1);
+    while (tr->edges[j].callee != UINT32_MAX) {
+        if (tr->edges[j].caller == caller && tr->edges[j].callee == callee)
+            return &tr->edges[j];
+        j = (j + 1) & (tr->edgecap - 1);
+    }
+    
+    tr->edges[j].caller = caller;
+    tr->edges[j].callee = callee;
+    tr->nedges++;
+    return &tr->edges[j];
+}
+
+/**
+ * Returns the stack of a lua thread, or NULL if there is none
+ */
+static struct TracerStack* pylua_tracer_find(struct Tracer* tr, lua_State* L) {
+    if (!tr->stackcap)
+        return NULL;
+    
+    size_t j = ((uintptr_t)L >> 4) & (tr->stackcap - 1);
+    while (tr->stacks[j].thread) {
+        if (tr->stacks[j].thread == L)
+            return &tr->stacks[j];
+        j = (j + 1) & (tr->stackcap - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Returns the stack of a lua thread, adding it if it is new,
+ * or NULL if out of memory
+ */
+static struct TracerStack* pylua_tracer_stack(struct Tracer* tr, lua_State* L) {
+    struct TracerStack* stack = pylua_tracer_find(tr, L);
+    if (stack)
+        return stack;
+    
+    // kept at most half full
+    if ((tr->nstacks + 1) * 2 > tr->stackcap) {
+        size_t cap = tr->stackcap ? tr->stackcap * 2 : 16;
+        struct TracerStack* stacks = calloc(cap, sizeof *stacks);
+        if (!stacks)
+            return NULL;
+        
+        for (size_t i = 0; i < tr->stackcap; i++) {
+            if (!tr->stacks[i].thread)
+                continue;
+            
+            size_t j = ((uintptr_t)tr->stacks[i].thread >> 4) & (cap - 1);
+            while (stacks[j].thread)
+                j = (j + 1) & (cap - 1);
+            stacks[j] = tr->stacks[i];
+        }
+        
+        free(tr->stacks);
+        tr->stacks = stacks;
+        tr->stackcap = cap;
+    }
+    
+    size_t j = ((uintptr_t)L >> 4) & (tr->stackcap - 1);
+    while (tr->stacks[j].thread)
+        j = (j + 1) & (tr->stackcap - 1);
+    
+    tr->stacks[j].thread = L;
+    tr->nstacks++;
+    return &tr->stacks[j];
+}
+
+/**
+ * Whether a function already runs in a stack
+ * (a thread left by a coroutine that never returns is checked alone)
+ */
+static int pylua_tracer_recursive(struct Tracer* tr, struct TracerStack* stack, uint32_t frame) {
+    if (!tr->stats[frame].active)
+        return 0;
+    
+    for (int i = 0; i < stack->size; i++) {
+        if (stack->entries[i].frame == frame)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Adds a call to stats
+ */
+static void pylua_tracer_add(struct TracerStats* stats, struct TracerEntry* entry, int recursive) {
+    stats->calls++;
+    stats->own += entry->own;
+    
+    // the outermost call has the time of the inner ones
+    if (!recursive) {
+        stats->primitive++;
+        stats->total += entry->own + entry->sub;
+    }
+}
+
+/**
+ * Records the return of the call on the top of a stack
+ */
+static void pylua_tracer_return(struct Tracer* tr, struct TracerStack* stack) {
+    struct TracerEntry* entry = &stack->entries[--stack->size];
+    struct TracerStats* stats = &tr->stats[entry->frame];
+    
+    stats->active--;
+    int recursive = pylua_tracer_recursive(tr, stack, entry->frame);
+    pylua_tracer_add(stats, entry, recursive);
+    
+    if (stack->size) {
+        struct TracerEntry* parent = &stack->entries[stack->size - 1];
+        parent->sub += entry->own + entry->sub;
+        
+        struct TracerEdge* edge = pylua_tracer_edge(tr, parent->frame, entry->frame);
+        if (edge) {
+            pylua_tracer_add(&edge->stats, entry, recursive);
+        } else {
+            tr->lost++;
+        }
+    }
+}
+
+/**
+ * Records a call, on the top of a stack
+ */
+static void pylua_tracer_call(struct Tracer* tr, struct TracerStack* stack, lua_State* L, lua_Debug* ar) {
+    lua_getinfo(L, "S", ar);
+    
+    const void* ptr = NULL;
+    int line = ar->linedefined;
+    if (ar->what[0] == 'C') {
+        // told apart by their address
+        lua_getinfo(L, "f", ar);
+        ptr = (const void*)(uintptr_t)lua_tocfunction(L, -1);
+        lua_pop(L, 1);
+        line = PYLUA_FRAME_C;
+    }
+    
+    uint32_t frame = pylua_frames_add(&tr->frames, ar->short_src, line, ptr);
+    if (frame == UINT32_MAX || pylua_tracer_grow_stats(tr) < 0) {
+        tr->lost++;
+        return;
+    }
+    
+    if (stack->size == stack->capacity) {
+        int cap = stack->capacity ? stack->capacity * 2 : 32;
+        struct TracerEntry* entries = realloc(stack->entries, cap * sizeof *entries);
+        if (!entries) {
+            tr->lost++;
+            return;
+        }
+        stack->entries = entries;
+        stack->capacity = cap;
+    }
+    
+    // named once, by the first call seen
+    struct ProfilerFrame* info = &tr->frames.frames[frame];
+    if (!info->name[0]) {
+        lua_getinfo(L, "n", ar);
+        const char* name = ar->name ? ar->name : ar->what[0] == 'm' ? "<main>" : "<anonymous>";
+        snprintf(info->name, sizeof info->name, "%s", name);
+    }
+    
+    struct TracerEntry* entry = &stack->entries[stack->size++];
+    entry->frame = frame;
+    entry->ci = (intptr_t)ar->i_ci;
+    entry->own = 0;
+    entry->sub = 0;
+    tr->stats[frame].active++;
+}
+
+/**
+ * Pops the calls of a stack down to the one running at `ci`, included,
+ * if there is one. Calls left by an error are above it.
+ */
+static void pylua_tracer_unwind(struct Tracer* tr, struct TracerStack* stack, intptr_t ci) {
+    for (int i = stack->size - 1; i >= 0; i--) {
+        if (stack->entries[i].ci == ci) {
+            while (stack->size > i)
+                pylua_tracer_return(tr, stack);
+            return;
+        }
+    }
+}
+
+/**
+ * Gives the time since the last event to the call running then,
+ * and returns the stack of `L` (NULL if out of memory)
+ */
+static struct TracerStack* pylua_tracer_tick(struct Tracer* tr, lua_State* L) {
+    long long now = pylua_clock_ns();
+    
+    struct TracerStack* current = tr->current == L ? NULL : pylua_tracer_find(tr, tr->current);
+    struct TracerStack* stack = pylua_tracer_stack(tr, L);
+    if (!current)
+        current = stack;
+    
+    if (current && current->size)
+        current->entries[current->size - 1].own += now - tr->last;
+    tr->current = L;
+    tr->last = now;
+    
+    if (!stack)
+        tr->lost++;
+    return stack;
+}
+
+/**
+ * Called by the builtin hook on calls and returns
+ *
+ * Returns are matched to their call by the (private) call info of lua,
+ * as errors leave calls without a return event.
+ */
+void pylua_tracer_hook(struct Tracer* tr, lua_State* L, lua_Debug* ar) {
+    struct TracerStack* stack = pylua_tracer_tick(tr, L);
+    if (!stack)
+        return;
+    
+    intptr_t ci = (intptr_t)ar->i_ci;
+    switch (ar->event) {
+        case LUA_HOOKCALL:
+            pylua_tracer_call(tr, stack, L, ar);
+            break;
+        
+#if LUA_VERSION_NUM >= 502
+        case LUA_HOOKTAILCALL:
+            // it takes the place of its caller, which returns
+            pylua_tracer_unwind(tr, stack, ci);
+            pylua_tracer_call(tr, stack, L, ar);
+            break;
+#else
+        case LUA_HOOKTAILRET:
+            if (stack->size)
+                pylua_tracer_return(tr, stack);
+            break;
+#endif
+        
+        case LUA_HOOKRET:
+            pylua_tracer_unwind(tr, stack, ci);
+            break;
+    }
+}
+
+/**
+ * Pops every call of a lua thread, once it is done running
+ * (those left by an error at the top level never return)
+ */
+void pylua_tracer_leave(struct Tracer* tr, lua_State* L) {
+    struct TracerStack* stack = pylua_tracer_find(tr, L);
+    if (!stack || !stack->size)
+        return;
+    
+    pylua_tracer_tick(tr, L);
+    while (stack->size)
+        pylua_tracer_return(tr, stack);
+}
+
+/**
+ * Tells the python callable run by pylua_call_python, so that the call
+ * is its own instead of the one of pylua_call_python. Needs the GIL.
+ */
+void pylua_tracer_python(struct Tracer* tr, lua_State* L, PyObject* func) {
+    struct TracerStack* stack = pylua_tracer_find(tr, L);
+    if (!stack || !stack->size)
+        return;
+    
+    struct TracerEntry* entry = &stack->entries[stack->size - 1];
+    struct ProfilerFrame* info = &tr->frames.frames[entry->frame];
+    if (info->line != PYLUA_FRAME_C || info->ptr != (const void*)(uintptr_t)&pylua_call_python)
+        return;
+    
+    uint32_t frame = pylua_frames_add(&tr->frames, "", PYLUA_FRAME_PYTHON, func);
+    if (frame == UINT32_MAX || pylua_tracer_grow_stats(tr) < 0) {
+        tr->lost++;
+        return;
+    }
+    
+    tr->stats[entry->frame].active--;
+    tr->stats[frame].active++;
+    entry->frame = frame;
+}
+
+/**
+ * Returns the pstats key of a function: its file, line and name
+ */
+static PyObject* pylua_tracer_label(struct ProfilerFrame* frame) {
+    if (frame->line >= 0)
+        return Py_BuildValue("(sis)", frame->source, frame->line, frame->name);
+    
+    if (frame->line == PYLUA_FRAME_C)
+        return Py_BuildValue("(siN)", "~", 0, PyUnicode_FromFormat("<lua C function %s>", frame->name));
+    
+    // same as cProfile, for python functions
+    PyObject* func = (PyObject*)frame->ptr;
+    PyObject* code = PyObject_GetAttrString(func, "__code__");
+    if (code && PyCode_Check(code)) {
+        PyCodeObject* co = (PyCodeObject*)code;
+        PyObject* res = Py_BuildValue("(OiO)", co->co_filename, co->co_firstlineno, co->co_name);
+        Py_DECREF(code);
+        return res;
+    }
+    
+    Py_XDECREF(code);
+    PyErr_Clear();
+    return Py_BuildValue("(siN)", "~", 0, PyUnicode_FromFormat("<%s>", Py_TYPE(func)->tp_name));
+}
+
+/**
+ * Adds stats to a list of [cc, nc, tt, ct] (or [nc, cc, tt, ct] for callers),
+ * making it if it is NULL. Returns a new reference, or NULL on failure.
+ */
+static PyObject* pylua_tracer_merge(PyObject* list, struct TracerStats* stats, int callers) {
+    unsigned long long first = callers ? stats->calls : stats->primitive;
+    unsigned long long second = callers ? stats->primitive : stats->calls;
+    double own = (double)stats->own / 1e9;
+    double total = (double)stats->total / 1e9;
+    
+    if (!list)
+        return Py_BuildValue("[KKdd]", first, second, own, total);
+    
+    PyObject* add = Py_BuildValue("[KKdd]", first, second, own, total);
+    if (!add) {
+        Py_DECREF(list);
+        return NULL;
+    }
+    
+    for (Py_ssize_t i = 0; i < 4; i++) {
+        PyObject* sum = PyNumber_Add(PyList_GET_ITEM(list, i), PyList_GET_ITEM(add, i));
+        if (!sum || PyList_SetItem(list, i, sum) < 0) {
+            Py_DECREF(add);
+            Py_DECREF(list);
+            return NULL;
+        }
+    }
+    
+    Py_DECREF(add);
+    return list;
+}
+
+/**
+ * Returns the stats as pstats has them:
+ * {(file, line, name): (cc, nc, tt, ct, {caller: (nc, cc, tt, ct)})}
+ * where cc are the primitive calls, nc all calls, tt the time spent in
+ * the function alone and ct the time spent in it and its callees, in seconds.
+ * Functions with the same key are merged.
+ */
+PyObject* pylua_tracer_stats(struct Tracer* tr) {
+    uint32_t n = tr->frames.nframes;
+    PyObject* labels = PyList_New(n);
+    PyObject* stats = PyDict_New();
+    PyObject* callers = PyDict_New();
+    if (!labels || !stats || !callers)
+        goto error;
+    
+    for (uint32_t i = 0; i < n; i++) {
+        PyObject* label = pylua_tracer_label(&tr->frames.frames[i]);
+        if (!label)
+            goto error;
+        PyList_SET_ITEM(labels, i, label);
+    }
+    
+    // stats as lists for now, and callers by callee
+    for (uint32_t i = 0; i < n && i < tr->statscap; i++) {
+        if (!tr->stats[i].calls)
+            continue;
+        
+        PyObject* label = PyList_GET_ITEM(labels, i);
+        PyObject* list = PyDict_GetItemWithError(stats, label);
+        if (!list && PyErr_Occurred())
+            goto error;
+        
+        Py_XINCREF(list);
+        list = pylua_tracer_merge(list, &tr->stats[i], 0);
+        int err = list ? PyDict_SetItem(stats, label, list) : -1;
+        Py_XDECREF(list);
+        if (err < 0)
+            goto error;
+    }
+    
+    for (size_t i = 0; i < tr->edgecap; i++) {
+        struct TracerEdge* edge = &tr->edges[i];
+        if (edge->callee == UINT32_MAX || !edge->stats.calls)
+            continue;
+        
+        PyObject* callee = PyList_GET_ITEM(labels, edge->callee);
+        PyObject* caller = PyList_GET_ITEM(labels, edge->caller);
+        PyObject* dict = PyDict_GetItemWithError(callers, callee);
+        if (!dict) {
+            if (PyErr_Occurred() || !(dict = PyDict_New()))
+                goto error;
+            int err = PyDict_SetItem(callers, callee, dict);
+            Py_DECREF(dict);
+            if (err < 0)
+                goto error;
+        }
+        
+        PyObject* list = PyDict_GetItemWithError(dict, caller);
+        if (!list && PyErr_Occurred())
+            goto error;
+        
+        Py_XINCREF(list);
+        list = pylua_tracer_merge(list, &edge->stats, 1);
+        int err = list ? PyDict_SetItem(dict, caller, list) : -1;
+        Py_XDECREF(list);
+        if (err < 0)
+            goto error;
+    }
+    
+    // then as tuples
+    PyObject* label;
+    PyObject* list;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(stats, &pos, &label, &list)) {
+        PyObject* dict = PyDict_GetItemWithError(callers, label);
+        if (!dict && PyErr_Occurred())
+            goto error;
+        
+        PyObject* from = PyDict_New();
+        if (!from)
+            goto error;
+        
+        PyObject* caller;
+        PyObject* counts;
+        Py_ssize_t cpos = 0;
+        while (dict && PyDict_Next(dict, &cpos, &caller, &counts)) {
+            PyObject* tuple = PyList_AsTuple(counts);
+            if (!tuple || PyDict_SetItem(from, caller, tuple) < 0) {
+                Py_XDECREF(tuple);
+                Py_DECREF(from);
+                goto error;
+            }
+            Py_DECREF(tuple);
+        }
+        
+        PyObject* tuple = Py_BuildValue("(OOOON)",
+            PyList_GET_ITEM(list, 0), PyList_GET_ITEM(list, 1),
+            PyList_GET_ITEM(list, 2), PyList_GET_ITEM(list, 3), from);
+        
+        // replacing a value keeps the iteration valid
+        if (!tuple || PyDict_SetItem(stats, label, tuple) < 0) {
+            Py_XDECREF(tuple);
+            goto error;
+        }
+        Py_DECREF(tuple);
+    }
+    
+    Py_DECREF(labels);
+    Py_DECREF(callers);
+    return stats;
+    
+error:
+    Py_XDECREF(labels);
+    Py_XDECREF(stats);
+    Py_XDECREF(callers);
+    return NULL;
+}
\ No newline at end of file
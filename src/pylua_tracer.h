@@ -0,0 +1,78 @@
+#ifndef PYLUA_TRACER_H
+#define PYLUA_TRACER_H
+
+#include "pylua.h"
+#include "pylua_profiler.h"
+
+// Calls and times (in nanoseconds) of a function, or of a caller to a callee,
+// the primitive ones being those that are not recursive
+struct TracerStats {
+    unsigned long long calls;
+    unsigned long long primitive;
+    long long own;
+    long long total;
+    
+    // Running calls of the function (unused for callers)
+    unsigned int active;
+};
+
+// Stats of the calls from a caller to a callee
+struct TracerEdge {
+    uint32_t caller;
+    uint32_t callee;
+    struct TracerStats stats;
+};
+
+// A running call, with the time spent in it and in its callees so far
+struct TracerEntry {
+    uint32_t frame;
+    intptr_t ci;
+    long long own;
+    long long sub;
+};
+
+// The calls running in a lua thread
+struct TracerStack {
+    lua_State* thread;
+    struct TracerEntry* entries;
+    int size;
+    int capacity;
+};
+
+// Call profiler, run by the builtin hook on calls and returns without the GIL
+struct Tracer {
+    // Whether it traces, or is only kept for its stats
+    int running;
+    
+    // Functions seen so far, and their stats
+    struct FrameTable frames;
+    struct TracerStats* stats;
+    uint32_t statscap;
+    
+    // Stats per caller and callee, by hash (empty slots have no callee)
+    struct TracerEdge* edges;
+    size_t nedges;
+    size_t edgecap;
+    
+    // Stacks per lua thread, by hash (empty slots have no thread)
+    struct TracerStack* stacks;
+    size_t nstacks;
+    size_t stackcap;
+    
+    // Thread of the last event, and its time
+    lua_State* current;
+    long long last;
+    
+    // Events dropped for lack of memory
+    size_t lost;
+};
+
+struct Tracer* pylua_tracer_new(void);
+void pylua_tracer_free(struct Tracer* tr);
+void pylua_tracer_clear(struct Tracer* tr);
+void pylua_tracer_hook(struct Tracer* tr, lua_State* L, lua_Debug* ar);
+void pylua_tracer_leave(struct Tracer* tr, lua_State* L);
+void pylua_tracer_python(struct Tracer* tr, lua_State* L, PyObject* func);
+PyObject* pylua_tracer_stats(struct Tracer* tr);
+
+#endif
\ No newline at end of file
@@ -1,9 +1,14 @@
 #include "pylua_userdata.h"
 #include "pylua_object.h"
 
-PyTypeObject LuaUserDataType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pylua.LuaUserData",
-    .tp_doc = "Lua userdata",
-    .tp_base = &LuaObjectType
+static PyType_Slot LuaUserDataSlots[] = {
+    {Py_tp_doc, "Lua userdata"},
+    {0, NULL}
+};
+
+PyType_Spec LuaUserDataTypeSpec = {
+    .name = "pylua.LuaUserData",
+    .basicsize = sizeof(LuaObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = LuaUserDataSlots
 };
\ No newline at end of file
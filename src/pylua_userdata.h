@@ -3,6 +3,6 @@
 
 #include "pylua.h"
 
-PyTypeObject LuaUserDataType;
+extern PyType_Spec LuaUserDataTypeSpec;
 
 #endif
\ No newline at end of file